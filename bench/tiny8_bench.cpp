@@ -0,0 +1,2711 @@
+﻿// MIT License
+// 
+// Copyright(c) 2023, Pantelis Lekakis
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <tiny8.h>
+#include <tiny8_jit.h>
+#include <tiny8_batch.h>
+#include <tiny8_lockstep.h>
+#include <tiny8_env.h>
+#include <tiny8_pack.h>
+#include <tiny8_fork.h>
+#include <tiny8_explore.h>
+#include <tiny8_blit.h>
+#include <tiny8_atlas.h>
+#include <tiny8_frames.h>
+#include <tiny8_audio.h>
+#include <tiny8_timing.h>
+#include <tiny8_movie.h>
+#include <tiny8_diff.h>
+#include <tiny8_pool.h>
+#include <tiny8_async.h>
+#include <tiny8_stream.h>
+#include <tiny8_savestate.h>
+#include <tiny8_capture.h>
+#include <tiny8_checkpoint.h>
+#include <tiny8_cycles.h>
+#include <tiny8_analysis.h>
+#include <tiny8_aot.h>
+#include <tiny8_coverage.h>
+#include <tiny8_sampler.h>
+#include <tiny8_constexpr.h>
+#include <tiny8_debug.h>
+#include <tiny8_gdb.h>
+#include <tiny8_input.h>
+#include <tiny8_perf.h>
+#include <tiny8_metrics_server.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Counting global allocator for --check-allocations and --footprint: every allocation made while armed is counted.
+atomic<bool>		g_countAllocations = false;
+atomic<uint64_t>	g_allocations = 0;
+atomic<uint64_t>	g_allocatedBytes = 0;
+
+void count_allocation(size_t size)
+{
+	if (g_countAllocations.load(memory_order_relaxed))
+	{
+		g_allocations.fetch_add(1, memory_order_relaxed);
+		g_allocatedBytes.fetch_add(size, memory_order_relaxed);
+	}
+}
+
+void* counted_alloc(size_t size)
+{
+	count_allocation(size);
+	void* const p = malloc(size > 0 ? size : 1);
+	if (p == nullptr)
+		throw bad_alloc();
+	return p;
+}
+
+void* counted_aligned_alloc(size_t size, align_val_t alignment)
+{
+	count_allocation(size);
+	size_t const align = static_cast<size_t>(alignment);
+#if defined(_WIN32)
+	void* const p = _aligned_malloc(size > 0 ? size : 1, align);
+#else
+	void* const p = aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) & ~(align - 1));
+#endif
+	if (p == nullptr)
+		throw bad_alloc();
+	return p;
+}
+
+void aligned_free(void* p)
+{
+#if defined(_WIN32)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+void* operator new(size_t size) { return counted_alloc(size); }
+void* operator new[](size_t size) { return counted_alloc(size); }
+void* operator new(size_t size, align_val_t alignment) { return counted_aligned_alloc(size, alignment); }
+void* operator new[](size_t size, align_val_t alignment) { return counted_aligned_alloc(size, alignment); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, align_val_t) noexcept { aligned_free(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { aligned_free(p); }
+
+// A memory write applied after loading a rom, before running it.
+struct memory_poke
+{
+	uint16_t		m_address;
+	uint8_t			m_value;
+};
+
+// Pokes applied to well known roms so they run a steady workload without any input.
+// The Timendus test suite reads the test to run from 0x1ff; the keypad test (5) polls keys and redraws forever.
+struct rom_preset
+{
+	char const*		m_name;
+	memory_poke		m_poke;
+};
+
+constexpr rom_preset c_presets[] =
+{
+	{ "chip8-test-suite.ch8", { 0x1ff, 5 } },
+};
+
+// Screens of the test suite that every backend has to reproduce: the test picked through 0x1ff, run without input under a mode (also
+// given to the suite as its platform through 0x1fe) for c_conformanceFrames frames of c_conformanceCyclesPerFrame instructions, and
+// the display_hash() it ends on.
+struct golden_screen
+{
+	uint8_t			m_test;
+	tiny8::flags	m_flags;
+	uint64_t		m_hash;
+};
+
+constexpr char const	c_conformanceRom[] = "chip8-test-suite.ch8";
+constexpr uint32_t		c_conformanceFrames = 2000;
+constexpr uint32_t		c_conformanceCyclesPerFrame = 30;
+
+constexpr golden_screen c_goldens[] =
+{
+	{ 1, tiny8::chip8_original, 0x1db5a61a26972043ull },
+	{ 2, tiny8::chip8_original, 0x85e0bbd0caa57381ull },
+	{ 3, tiny8::chip8_original, 0x48a16f0d051bbfdcull },
+	{ 4, tiny8::chip8_original, 0x8b0fd38f9c3fce46ull },
+	{ 5, tiny8::chip8_original, 0xc22b50ea5e1c9738ull },
+	{ 1, tiny8::chip8_schip, 0x1db5a61a26972043ull },
+	{ 2, tiny8::chip8_schip, 0x85e0bbd0caa57381ull },
+	{ 3, tiny8::chip8_schip, 0x48a16f0d051bbfdcull },
+	{ 4, tiny8::chip8_schip, 0xda31f919fbae649aull },
+	{ 5, tiny8::chip8_schip, 0x684b3be9b1999ddfull },
+	{ 1, tiny8::chip8_xochip, 0x1db5a61a26972043ull },
+	{ 2, tiny8::chip8_xochip, 0x85e0bbd0caa57381ull },
+	{ 3, tiny8::chip8_xochip, 0x48a16f0d051bbfdcull },
+	{ 4, tiny8::chip8_xochip, 0x0c8386f33992fadeull },
+	{ 5, tiny8::chip8_xochip, 0xdf6cc6899b8a545eull },
+};
+
+// Command line settings.
+struct bench_settings
+{
+	uint64_t			m_cycles = 10'000'000;						// Instructions to run per rom, mode and dispatch backend.
+	uint32_t			m_cyclesPerFrame = tiny8::c_defaultCyclesPerFrame;
+	size_t				m_instances = 0;							// Also run this many instances at once on a tiny8::batch.
+	size_t				m_migrate = 0;								// Also balance and migrate this many instances of uneven cost.
+	size_t				m_priority = 0;								// Also run this many background instances next to interactive ones.
+	bool				m_metrics = false;							// Also run a batch recording metrics, and scrape them over HTTP.
+	size_t				m_threads = 0;								// Batch workers, 0 for one per hardware thread.
+	size_t				m_env = 0;									// Also step this many instances of the rom on a tiny8::vec_env.
+	size_t				m_sharedCache = 0;							// Also run this many instances from private and from shared decode caches.
+	size_t				m_monitors = 0;								// Also read snapshots of the running rom from this many threads.
+	size_t				m_inputTaps = 0;							// Also run while another thread taps keys this many times through a tiny8::input_port.
+	uint16_t			m_tiers = 0;								// Also run with blocks compiled after this many entries (decoded after an eighth).
+	size_t				m_lanes = 0;								// Also run this many lanes of the rom on a tiny8::lockstep.
+	size_t				m_forks = 0;								// Also branch this many tiny8::cow_state forks off the rom.
+	size_t				m_explore = 0;								// Also explore this many states of the rom with a tiny8::explorer.
+	size_t				m_pool = 0;									// Also recycle this many tiny8::instance_pool instances over short runs.
+	size_t				m_resets = 0;								// Also time restarting the rom this many times.
+	size_t				m_coroutines = 0;							// Also run this many instances from coroutines on a tiny8::run_queue.
+	size_t				m_saveStates = 0;							// Also time saving and loading this many serialized states.
+	size_t				m_checkpoints = 0;							// Also run this many frames checkpointing after each one.
+	size_t				m_capture = 0;								// Also run this many frames capturing them to a GIF.
+	size_t				m_machineFrames = 0;						// Also run this many frames as COSMAC VIP machine cycles.
+	size_t				m_determinism = 0;							// Also check a batch of this many instances ends the same on any worker count.
+	vector<string>		m_roms;										// .ch8 files, or .t8pk packs standing for every rom they hold.
+	bool				m_micro = false;							// Also run the synthetic roms of c_microRoms.
+	bool				m_perf = false;								// Also count hardware events per emulated instruction.
+	bool				m_profile = false;							// Also print the profiling counters (needs TINY8_PROFILE).
+	bool				m_blit = false;								// Also time expanding the rom's screen to 32-bit pixels.
+	bool				m_spriteCache = false;						// Also run the rom and a sprite loop with and without the sprite cache.
+	size_t				m_atlas = 0;								// Also keep the screens of this many instances in a tiny8::blit_atlas.
+	bool				m_stream = false;							// Also measure the display delta stream of the rom.
+	bool				m_analyze = false;							// Also analyse the rom's control flow and prewarm a decode cache with it.
+	bool				m_disassemble = false;						// Also print the rom's disassembly.
+	bool				m_debug = false;							// Also time running under a tiny8::debugger.
+	string				m_sampleProfile;							// Also sample the rom's call stacks into this folded stacks file.
+	bool				m_coverage = false;							// Also report the instructions and quirks each rom uses (and store them in written packs).
+	bool				m_powerSaver = false;						// Also run frame by frame, sleeping through the quiet ones.
+	size_t				m_footprint = 0;							// Also create this many full and compact instances and measure them.
+	bool				m_timing = false;							// Also time the phases of every frame a frontend would run.
+	uint32_t			m_turbo = 0;								// Also fast-forward at this many frames per presented frame.
+	bool				m_checkAllocations = false;					// Check that running never allocates instead of benchmarking.
+	string				m_writePack;								// Pack the roms into this file instead of benchmarking them.
+	string				m_translate;								// Translate the first rom to C++ into this file instead.
+	uint16_t			m_gdbPort = 0;								// Serve the first rom to a gdb client on this port instead.
+	string				m_recordMovie;								// Record a scripted session of the first rom into this file instead.
+	string				m_replayMovie;								// Replay this movie on every backend instead.
+	bool				m_conformance = false;						// Check the test suite screens against the goldens instead.
+	uint32_t			m_diffBlock = 0;							// Compare every backend against families in blocks this long instead.
+	vector<memory_poke>	m_pokes;									// Replaces the presets when given.
+};
+
+struct rom_image
+{
+	string				m_name;
+	vector<uint8_t>		m_data;
+	vector<memory_poke>	m_pokes;
+};
+
+struct bench_result
+{
+	uint64_t			m_cycles = 0;
+	double				m_seconds = 0.0;
+	tiny8::perf_sample	m_perf = {};	// With --perf, where the counters are available.
+};
+
+// The hardware counters of the main thread, opened on first use.
+tiny8::perf_counters& bench_counters()
+{
+	static tiny8::perf_counters counters;
+	return counters;
+}
+
+// Read a rom file, making sure it fits in the interpreter memory.
+bool load_rom(filesystem::path const& path, rom_image& rom)
+{
+	ifstream file(path, fstream::in | fstream::binary);
+	if (!file.is_open())
+		return false;
+
+	rom.m_name = path.filename().string();
+	rom.m_data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+	return rom.m_data.size() <= tiny8::c_maxRomSize;
+}
+
+// Synthetic roms stressing one hot path each, looping forever without input; --micro runs them like any other rom.
+struct micro_rom
+{
+	char const*						m_name;
+	std::initializer_list<uint16_t>	m_words;	// Instructions (and sprite data) from 0x200, big endian like the rom.
+};
+
+constexpr micro_rom c_microRoms[] =
+{
+	// 7xnn and 8xy4 on four registers.
+	{ "micro:arith", {
+		0x6001, 0x6103,	0x7005, 0x8014, 0x7103, 0x8104, 0x7207, 0x8204,	// 200: V0 = 1, V1 = 3, then adds
+		0x8314, 0x1204 } },												// 210: V3 += V1, loop at 204
+	// 2nnn/00EE recursing 12 deep and back.
+	{ "micro:calls", {
+		0x6000, 0x220a, 0x1200, 0x0000, 0x0000,							// 200: V0 = 0, call 20A, again
+		0x7001, 0x300c, 0x220a, 0x00ee } },								// 20A: V0 += 1, recurse until V0 == 12
+	// Dxyn of an 8x8 sprite at random positions, some clipped at the edges.
+	{ "micro:draws", {
+		0xa20a, 0xc03f, 0xc11f, 0xd018, 0x1202,							// 200: I = sprite, V0/V1 random, draw, loop at 202
+		0xff81, 0xbda5, 0xa5bd, 0x81ff } },								// 20A: sprite
+	// 00E0, three clears for every glyph drawn.
+	{ "micro:clears", {
+		0x00e0, 0xc03f, 0xc11f, 0xd015, 0x00e0, 0x00e0, 0x1200 } },	// 200: clear, draw glyph 0 at random, clear twice
+	// Fx33, Fx55 and Fx65 through all sixteen registers.
+	{ "micro:memory", {
+		0xa300, 0xf033, 0xff55, 0xff65, 0x7001, 0x1200 } },			// 200: I = 300, BCD of V0, store and load V0-VF
+	// SUPER-CHIP scrolls of a high resolution screen (faults, skipped, in original mode).
+	{ "micro:scroll", {
+		0x00ff, 0xa214, 0xc07f, 0xc13f, 0xd018, 0x00c4, 0x00fb, 0x00fc,	// 200: hires, I = sprite, draw at random, scroll
+		0x1204, 0x0000,													// 210: loop at 204
+		0xff81, 0xbda5, 0xa5bd, 0x81ff } },								// 214: sprite
+};
+
+vector<rom_image> micro_roms()
+{
+	vector<rom_image> roms;
+	for (micro_rom const& micro : c_microRoms)
+	{
+		rom_image rom;
+		rom.m_name = micro.m_name;
+		for (uint16_t const word : micro.m_words)
+		{
+			rom.m_data.push_back(static_cast<uint8_t>(word >> 8));
+			rom.m_data.push_back(static_cast<uint8_t>(word));
+		}
+		roms.push_back(move(rom));
+	}
+	return roms;
+}
+
+// Read every rom in a pack.
+bool load_pack(filesystem::path const& path, vector<rom_image>& roms)
+{
+	tiny8::rom_pack pack;
+	if (!pack.open(path.string().c_str()))
+		return false;
+
+	for (size_t i = 0; i < pack.size(); ++i)
+	{
+		tiny8::pack_rom const entry = pack.at(i);
+		roms.push_back({ string(entry.m_name), vector<uint8_t>(entry.m_data.begin(), entry.m_data.end()), {} });
+	}
+	return true;
+}
+
+// Write the rom's pokes into an interpreter's memory.
+template<class Interpreter>
+void apply_pokes(Interpreter& interpreter, rom_image const& rom)
+{
+	tiny8::memory* const memory = interpreter.get_memory();
+	for (auto const& poke : rom.m_pokes)
+		memory->m_data[poke.m_address & (tiny8::c_maxMemory - 1)] = poke.m_value;
+}
+
+// Copy the rom and its pokes into an interpreter's memory.
+template<class Interpreter>
+void install_rom(Interpreter& interpreter, rom_image const& rom)
+{
+	interpreter.load_rom(rom.m_data);
+	apply_pokes(interpreter, rom);
+}
+
+// Run a rom for check_quirks() with its pokes written first and no keys pressed, up to ten minutes of frames.
+tiny8::quirk_report check_rom_quirks(rom_image const& rom, bench_settings const& settings, tiny8::coverage_recorder& recorder)
+{
+	uint32_t const frames = static_cast<uint32_t>(std::clamp<uint64_t>(settings.m_cycles / settings.m_cyclesPerFrame, 1, 36'000));
+	return tiny8::check_quirks(rom.m_data, tiny8::flags::none, frames, recorder, settings.m_cyclesPerFrame,
+		[](void* user_data, tiny8::interpreter& interpreter, uint32_t frame)
+		{
+			if (frame == 0)
+				apply_pokes(interpreter, *static_cast<rom_image const*>(user_data));
+		}, const_cast<rom_image*>(&rom));
+}
+
+// Pack the roms into a single file, with the flags they don't depend on when checking coverage.
+bool write_pack(string const& path, vector<rom_image> const& roms, bench_settings const& settings)
+{
+	tiny8::pack_builder builder;
+	tiny8::coverage_recorder recorder;
+	for (auto const& rom : roms)
+	{
+		tiny8::flags const free = settings.m_coverage ? check_rom_quirks(rom, settings, recorder).m_free : tiny8::flags::none;
+		if (!builder.add(rom.m_name, rom.m_data, tiny8::flags::none, 0, free))
+			printf("Skipping %s: already in the pack.\n", rom.m_name.c_str());
+	}
+
+	vector<uint8_t> const bytes = builder.build();
+	ofstream file(path, fstream::out | fstream::binary);
+	file.write(reinterpret_cast<char const*>(bytes.data()), bytes.size());
+	if (!file)
+		return false;
+
+	printf("Packed %zu roms into %s (%zu bytes)\n", builder.size(), path.c_str(), bytes.size());
+	return true;
+}
+
+// Copy the rom in and run the requested number of instructions headless, a frame at a time with emulated timers.
+template<class Interpreter>
+bench_result run(Interpreter& interpreter, rom_image const& rom, bench_settings const& settings)
+{
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	uint64_t const frames = settings.m_cycles / settings.m_cyclesPerFrame;
+
+	if (settings.m_perf)
+		bench_counters().start();
+	auto const start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < frames; ++i)
+		interpreter.run_frame(keys);
+	auto const end = chrono::steady_clock::now();
+
+	bench_result result;
+	if (settings.m_perf)
+		result.m_perf = bench_counters().stop();
+	result.m_cycles = interpreter.get_cycles();
+	result.m_seconds = chrono::duration<double>(end - start).count();
+	return result;
+}
+
+void print_result(char const* mode, char const* dispatch, bench_result const& result)
+{
+	double const mips = result.m_cycles / result.m_seconds / 1e6;
+	double const ns = result.m_seconds * 1e9 / result.m_cycles;
+	printf("  %-10s %-10s %12llu instructions %10.2f ms %10.2f MIPS %8.2f ns/instruction\n", mode, dispatch, (unsigned long long)result.m_cycles, result.m_seconds * 1e3, mips, ns);
+
+	// Hardware events per emulated instruction, and host instructions per cycle.
+	tiny8::perf_sample const& perf = result.m_perf;
+	if (result.m_cycles == 0 || !perf.valid(tiny8::perf_event::instructions))
+		return;
+	printf("  %-10s %-10s", "", "per instr");
+	for (size_t i = 0; i < size_t(tiny8::perf_event::count); ++i)
+	{
+		if (perf.m_valid[i])
+			printf(" %10.3f %s", double(perf.m_values[i]) / result.m_cycles, tiny8::c_perfEventNames[i]);
+	}
+	if (perf.valid(tiny8::perf_event::cycles) && perf[tiny8::perf_event::cycles] > 0)
+		printf("  %.2f IPC", double(perf[tiny8::perf_event::instructions]) / perf[tiny8::perf_event::cycles]);
+	printf("\n");
+}
+
+// Run a rom in all dispatch backends for a given mode.
+template<tiny8::flags F>
+void bench_mode(char const* mode, rom_image const& rom, bench_settings const& settings)
+{
+	{
+		tiny8::interpreter interpreter(F, tiny8::dispatch_mode::families);
+		print_result(mode, "families", run(interpreter, rom, settings));
+	}
+	{
+		tiny8::interpreter interpreter(F, tiny8::dispatch_mode::table);
+		print_result(mode, "table", run(interpreter, rom, settings));
+	}
+	{
+		tiny8::basic_interpreter<F> interpreter;
+		print_result(mode, "static", run(interpreter, rom, settings));
+	}
+	{
+		tiny8::basic_interpreter<F> interpreter;
+		interpreter.set_threaded_dispatch(true);
+		print_result(mode, "threaded", run(interpreter, rom, settings));
+	}
+	{
+		tiny8::basic_interpreter<F> interpreter;
+		interpreter.set_decode_cache(true);
+		print_result(mode, "cached", run(interpreter, rom, settings));
+	}
+	if (tiny8::c_jitSupported)
+	{
+		tiny8::block_jit jit;
+		tiny8::basic_interpreter<F> interpreter;
+		jit.attach(interpreter);
+		print_result(mode, "jit", run(interpreter, rom, settings));
+	}
+}
+
+// Run many instances of a rom on a batch; the instruction budget is split across them.
+void print_batch(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::basic_batch<tiny8::basic_interpreter<tiny8::chip8_original>> batch(settings.m_instances, settings.m_threads);
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		install_rom(batch[i], rom);
+		batch[i].set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+	}
+
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / batch.size());
+
+	auto const start = chrono::steady_clock::now();
+	batch.run_frames(frames);
+	auto const end = chrono::steady_clock::now();
+
+	bench_result result;
+	for (size_t i = 0; i < batch.size(); ++i)
+		result.m_cycles += batch[i].get_cycles();
+	result.m_seconds = chrono::duration<double>(end - start).count();
+
+	char label[32];
+	snprintf(label, sizeof(label), "%zux%zu", batch.size(), batch.worker_count());
+	print_result("batch", label, result);
+}
+
+// Run a batch of instances of uneven cost (the first quarter runs eight times the instructions per frame) split between the workers
+// by count, then balanced by cost, then moved one by one to a second batch halfway through, which must end on the same states.
+void print_migrate(rom_image const& rom, bench_settings const& settings)
+{
+	using Batch = tiny8::basic_batch<tiny8::basic_interpreter<tiny8::chip8_original>>;
+	uint64_t const frames = std::max<uint64_t>(2, settings.m_cycles / settings.m_cyclesPerFrame / settings.m_migrate);
+
+	auto const setup = [&](Batch& batch)
+	{
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			install_rom(batch[i], rom);
+			batch[i].set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame * (i < batch.size() / 4 ? 8 : 1));
+		}
+	};
+	auto const report = [&](char const* label, Batch& batch, double seconds)
+	{
+		bench_result result;
+		for (size_t i = 0; i < batch.size(); ++i)
+			result.m_cycles += batch[i].get_cycles();
+		result.m_seconds = seconds;
+		print_result("migrate", label, result);
+	};
+
+	uint64_t reference = 0;
+	for (bool const balanced : { false, true })
+	{
+		Batch batch(settings.m_migrate, settings.m_threads);
+		setup(batch);
+		batch.set_balancing(balanced);
+
+		auto const start = chrono::steady_clock::now();
+		batch.run_frames(frames);
+		report(balanced ? "by cost" : "by count", batch, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+		reference = batch.digest();
+	}
+
+	Batch from(settings.m_migrate, settings.m_threads), to(settings.m_migrate, settings.m_threads);
+	setup(from);
+	setup(to);
+	from.set_balancing(true);
+	to.set_balancing(true);
+	from.run_frames(frames / 2);
+
+	tiny8::state_serializer serializer;
+	vector<uint8_t> buffer(tiny8::state_serializer::c_maxStateSize);
+	size_t moved = 0;
+	auto const start = chrono::steady_clock::now();
+	for (size_t i = 0; i < from.size(); ++i)
+		moved += from.migrate(i, to, i, serializer, buffer);
+	double const migrate_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	to.run_frames(frames - frames / 2);
+
+	uint64_t const hash = to.digest();
+	printf("  %-10s %zu of %zu instances moved, %.2f us each, %s\n", "", moved, from.size(), migrate_seconds * 1e6 / from.size(),
+		moved == from.size() && hash == reference ? "same states" : "MISMATCH");
+}
+
+// Run a batch of instances of uneven cost, with keys changing every frame, on one worker, then on more split by count, by cost and by
+// priority: every run must end with the same digest.
+void print_determinism(rom_image const& rom, bench_settings const& settings)
+{
+	using Batch = tiny8::basic_batch<tiny8::basic_interpreter<tiny8::chip8_original>>;
+	uint64_t const frames = std::max<uint64_t>(60, settings.m_cycles / settings.m_cyclesPerFrame / settings.m_determinism);
+
+	struct run
+	{
+		char const*	m_label;
+		size_t		m_threads;
+		bool		m_balancing;
+		bool		m_priorities;
+	};
+	size_t const hardware = std::max(4u, std::thread::hardware_concurrency());
+	run const runs[] = { { "1 worker", 1, false, false }, { "by count", hardware, false, false }, { "by cost", hardware, true, false },
+		{ "priority", hardware, false, true } };
+
+	// Keys from the instance and the frame only, set between frames.
+	Batch::frame_callback const press = [](void*, Batch& batch, uint64_t frame)
+	{
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			for (size_t key = 0; key < tiny8::c_maxKeys; ++key)
+				batch.keys(i)[key] = static_cast<uint8_t>(tiny8::random_state(i * 131 + frame / 8 + key) % 5 == 0);
+		}
+	};
+
+	uint64_t reference = 0;
+	for (run const& r : runs)
+	{
+		Batch batch(settings.m_determinism, r.m_threads);
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			install_rom(batch[i], rom);
+			batch[i].set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame * (i % 4 == 0 ? 8 : 1));
+			if (r.m_priorities && i % 2 == 0)
+				batch.set_priority(i, tiny8::batch_priority::interactive);
+		}
+		batch.set_balancing(r.m_balancing);
+		batch.set_frame_callback(press);
+		batch.run_frames(frames);
+
+		uint64_t const digest = batch.digest();
+		if (&r == runs)
+			reference = digest;
+		printf("  %-10s %-8s %2zu workers, digest %016llx %s\n", "batch", r.m_label, batch.worker_count(), (unsigned long long)digest,
+			digest == reference ? "same" : "MISMATCH");
+	}
+}
+
+// A second of frames of a batch with two interactive instances and many background ones, all competing equally and then with
+// priorities and a 16.6ms frame budget: the slowest frame, and how many background frames ran per frame.
+void print_priority(rom_image const& rom, bench_settings const& settings)
+{
+	constexpr size_t c_interactive = 2;
+	constexpr uint64_t c_frames = 60;
+
+	for (bool const prioritized : { false, true })
+	{
+		tiny8::basic_batch<tiny8::basic_interpreter<tiny8::chip8_original>> batch(c_interactive + settings.m_priority, settings.m_threads);
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			install_rom(batch[i], rom);
+			batch[i].set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		}
+		if (prioritized)
+		{
+			for (size_t i = 0; i < c_interactive; ++i)
+				batch.set_priority(i, tiny8::batch_priority::interactive);
+			batch.set_frame_budget(chrono::microseconds(16600));
+		}
+
+		double slowest = 0.0;
+		uint64_t background = 0;
+		for (uint64_t frame = 0; frame < c_frames; ++frame)
+		{
+			auto const start = chrono::steady_clock::now();
+			batch.run_frames(1);
+			slowest = std::max(slowest, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+			background += prioritized ? batch.background_run() : settings.m_priority;
+		}
+
+		bool interactive = true;
+		for (size_t i = 0; i < c_interactive; ++i)
+			interactive &= batch[i].get_cycles() == batch[0].get_cycles();
+		printf("  %-10s %-11s %zu+%zu instances, slowest frame %6.2f ms, %8.1f background frames per frame, interactive %s\n", "priority",
+			prioritized ? "prioritized" : "equal", c_interactive, settings.m_priority, slowest * 1000.0, double(background) / c_frames,
+			interactive ? "every frame" : "MISSED");
+	}
+}
+
+// Run a batch of instances with decode caches without metrics and then recording them, and an instance compiling its blocks,
+// then scrape the metrics once from a metrics_server on a free loopback port and check the text carries what was recorded.
+void print_metrics(rom_image const& rom, bench_settings const& settings)
+{
+	using Batch = tiny8::basic_batch<tiny8::basic_interpreter<tiny8::chip8_original>>;
+	size_t const count = std::max<size_t>(settings.m_instances, 4);
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / count);
+
+	tiny8::metrics metrics;
+	for (bool const recording : { false, true })
+	{
+		Batch batch(count, settings.m_threads);
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			install_rom(batch[i], rom);
+			batch[i].set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+			batch[i].set_decode_cache(true);
+		}
+		if (recording)
+			batch.set_metrics(&metrics);
+
+		auto const start = chrono::steady_clock::now();
+		batch.run_frames(frames);
+		bench_result result;
+		result.m_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		for (size_t i = 0; i < batch.size(); ++i)
+			result.m_cycles += batch[i].get_cycles();
+		print_result("metrics", recording ? "recording" : "off", result);
+	}
+
+	if (tiny8::c_jitSupported)
+	{
+		tiny8::block_jit jit;
+		tiny8::basic_interpreter<tiny8::chip8_original> interpreter;
+		install_rom(interpreter, rom);
+		jit.attach(interpreter);
+		for (int frame = 0; frame < 60; ++frame)
+			interpreter.run_frame(settings.m_cyclesPerFrame);
+		metrics.record_compiles(jit.compiled_blocks(), jit.compile_nanoseconds());
+	}
+
+	tiny8::metrics_snapshot const totals = metrics.snapshot();
+	string response;
+	tiny8::metrics_server server(metrics, 0);
+	tiny8::net::socket_handle const client = server.is_listening() ? tiny8::net::connect_tcp("127.0.0.1", server.port()) : tiny8::net::c_invalidSocket;
+	if (client != tiny8::net::c_invalidSocket)
+	{
+		char const request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+		tiny8::net::send_all(client, request, sizeof(request) - 1);
+		char buffer[1024];
+		for (int received; (received = static_cast<int>(recv(client, buffer, sizeof(buffer), 0))) > 0; )
+			response.append(buffer, static_cast<size_t>(received));
+		tiny8::net::close_socket(client);
+	}
+
+	char expected[64];
+	snprintf(expected, sizeof(expected), "tiny8_instructions_total %llu\n", (unsigned long long)totals.m_instructions);
+	printf("  %-10s %llu frames, %.1f%% decode cache hits, %llu host frames, %llu blocks compiled in %.1f us, scraped %zu bytes over http, %s\n", "",
+		(unsigned long long)totals.m_frames, totals.cache_hit_rate() * 100.0, (unsigned long long)totals.m_hostFrames,
+		(unsigned long long)totals.m_compiledBlocks, totals.m_compileNanoseconds / 1e3, response.size(),
+		response.find(expected) != string::npos ? "ok" : "MISMATCH");
+}
+
+// Run a batch of the rom with a decode cache per instance, then with one warmed up on the first instance and shared by all of
+// them (and with that one compiled, where the jit is supported): same final states, heap per instance and speed.
+void print_shared_cache(rom_image const& rom, bench_settings const& settings)
+{
+	using Interpreter = tiny8::basic_interpreter<tiny8::chip8_original>;
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / settings.m_sharedCache);
+
+	uint64_t reference = 0;
+	auto const measure = [&](char const* label, bool shared, bool compile)
+	{
+		tiny8::block_jit jit;
+		tiny8::basic_batch<Interpreter> batch(settings.m_sharedCache, settings.m_threads);
+
+		g_allocatedBytes = 0;
+		g_countAllocations = true;
+		auto const start = chrono::steady_clock::now();
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			install_rom(batch[i], rom);
+			batch[i].set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+			if (!shared)
+				batch[i].set_decode_cache(true);
+		}
+
+		size_t sharing = 0;
+		if (shared)
+		{
+			// Ten seconds of the rom, for the code it patches at startup to be the same as the others will have, then the blocks the
+			// control flow analysis finds; the leader restarts (keeping the shared blocks) to run the same frames as the others.
+			Interpreter& leader = batch[0];
+			if (compile)
+				jit.attach(leader);
+			else
+				leader.set_decode_cache(true);
+			for (int frame = 0; frame < 600; ++frame)
+				leader.run_frame(settings.m_cyclesPerFrame);
+			tiny8::analysis analysis;
+			if (analysis.analyze(leader, rom.m_data))
+				analysis.prewarm(leader);
+			sharing = batch.share_decode_cache(0);
+			leader.reset();
+			apply_pokes(leader, rom);
+		}
+
+		batch.run_frames(frames);
+		auto const end = chrono::steady_clock::now();
+		g_countAllocations = false;
+
+		uint64_t hash = 0;
+		size_t still_shared = 0;
+		bench_result result;
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			hash ^= batch[i].state_hash() + i;
+			still_shared += batch[i].is_decode_cache_shared();
+			result.m_cycles += batch[i].get_cycles();
+		}
+		result.m_seconds = chrono::duration<double>(end - start).count();
+		bool const ok = reference == 0 || hash == reference;
+		reference = hash;
+
+		printf("  shared cache: %-8s %zu instances, %zu sharing (%zu at the end), %.1f KB heap/instance, %.2f MIPS, %s\n", label, batch.size(),
+			sharing, still_shared, static_cast<double>(g_allocatedBytes) / batch.size() / 1024.0, result.m_cycles / result.m_seconds / 1e6, ok ? "ok" : "MISMATCH");
+	};
+
+	measure("private", false, false);
+	measure("shared", true, false);
+	if (tiny8::c_jitSupported)
+		measure("jit", true, true);
+}
+
+// Run the rom polling a tiny8::input_port every 64 instructions while another thread taps keys through it as fast as it takes
+// them: every press and release must reach the interpreter, in order, and the run keeps its speed.
+void print_input_port(rom_image const& rom, bench_settings const& settings)
+{
+	constexpr uint32_t c_interval = 64;
+
+	struct tap_counter
+	{
+		tiny8::input_port	m_port;
+		uint16_t			m_keys = 0;
+		uint64_t			m_changes = 0;
+		bool				m_inOrder = true;	// Every change is one key going the way the producer sent it next.
+
+		static uint16_t poll(void* user_data)
+		{
+			tap_counter& self = *static_cast<tap_counter*>(user_data);
+			uint16_t const keys = self.m_port.sample();
+			if (keys != self.m_keys)
+			{
+				uint16_t const expected = (self.m_changes & 1) == 0 ? static_cast<uint16_t>(1 << (self.m_changes / 2 % tiny8::c_maxKeys)) : 0;
+				self.m_inOrder &= keys == expected;
+				self.m_keys = keys;
+				self.m_changes++;
+			}
+			return keys;
+		}
+	};
+
+	tap_counter counter;
+	tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+	interpreter.set_decode_cache(true);
+	interpreter.set_input_poll(&tap_counter::poll, &counter, c_interval);
+
+	std::atomic<bool> done = false;
+	auto const start = chrono::steady_clock::now();
+	std::thread producer([&]()
+	{
+		for (size_t tap = 0; tap < settings.m_inputTaps; ++tap)
+		{
+			uint8_t const key = static_cast<uint8_t>(tap % tiny8::c_maxKeys);
+			while (!counter.m_port.push(key, true))
+				std::this_thread::yield();
+			while (!counter.m_port.push(key, false))
+				std::this_thread::yield();
+		}
+		done = true;
+	});
+
+	// Runs until the last release has been taken, then as long again without the producer.
+	while (!done || counter.m_changes < 2 * settings.m_inputTaps)
+		interpreter.run_cycles(c_interval * 16);
+	producer.join();
+	auto const end = chrono::steady_clock::now();
+
+	bench_result tapped;
+	tapped.m_cycles = interpreter.get_cycles();
+	tapped.m_seconds = chrono::duration<double>(end - start).count();
+
+	interpreter.set_input_poll(nullptr);
+	interpreter.reset();
+	apply_pokes(interpreter, rom);
+	auto const quiet_start = chrono::steady_clock::now();
+	interpreter.run_cycles(static_cast<uint32_t>(tapped.m_cycles));
+	auto const quiet_end = chrono::steady_clock::now();
+
+	printf("  input port %zu taps, %llu changes seen %s, %.2f MIPS tapped, %.2f MIPS without the port\n", settings.m_inputTaps,
+		(unsigned long long)counter.m_changes, counter.m_changes == 2 * settings.m_inputTaps && counter.m_inOrder ? "in order" : "MISMATCH",
+		tapped.m_cycles / tapped.m_seconds / 1e6, tapped.m_cycles / chrono::duration<double>(quiet_end - quiet_start).count() / 1e6);
+}
+
+// Run the rom a frame at a time, publishing a snapshot to a tiny8::state_monitor after each, while threads read every new snapshot
+// as soon as it's out: every snapshot read must match the state of the frame it was published at. Frames are timed with and
+// without the readers, which only slow the emulation thread down through the cache lines they share.
+void print_monitor(rom_image const& rom, bench_settings const& settings)
+{
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame);
+	auto const fingerprint = [](tiny8::registers const& registers, tiny8::display const& display, uint64_t cycles)
+	{
+		return tiny8::xxhash64(display.m_planes, sizeof(display.m_planes), tiny8::xxhash64(&registers, sizeof(registers), cycles));
+	};
+
+	auto const run = [&](size_t readers, uint64_t& reads, uint64_t& torn)
+	{
+		tiny8::state_monitor monitor;
+		vector<std::atomic<uint64_t>> published(frames + 1);
+		std::atomic<bool> done = false;
+		std::atomic<uint64_t> total_reads = 0;
+		std::atomic<uint64_t> total_torn = 0;
+
+		vector<std::thread> threads;
+		for (size_t i = 0; i < readers; ++i)
+		{
+			threads.emplace_back([&]()
+			{
+				tiny8::observed_state state;
+				uint64_t count = 0, mismatches = 0, seen = 0;
+				while (!done.load(std::memory_order_relaxed))
+				{
+					uint64_t const version = monitor.version();
+					if (version == seen || !monitor.read(state))
+						continue;
+					seen = version;
+					uint64_t const frame = state.m_cycles / settings.m_cyclesPerFrame;
+					mismatches += fingerprint(state.m_registers, state.m_display, state.m_cycles) != published[frame].load(std::memory_order_relaxed);
+					++count;
+				}
+				total_reads += count;
+				total_torn += mismatches;
+			});
+		}
+
+		tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(interpreter, rom);
+		interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		interpreter.set_decode_cache(true);
+
+		auto const start = chrono::steady_clock::now();
+		for (uint64_t frame = 0; frame < frames; ++frame)
+		{
+			interpreter.run_frame();
+			published[interpreter.get_cycles() / settings.m_cyclesPerFrame].store(fingerprint(*interpreter.get_registers(), *interpreter.get_display(), interpreter.get_cycles()), std::memory_order_relaxed);
+			monitor.publish(interpreter);
+		}
+		auto const end = chrono::steady_clock::now();
+
+		done = true;
+		for (std::thread& thread : threads)
+			thread.join();
+		reads = total_reads;
+		torn = total_torn;
+		return chrono::duration<double, micro>(end - start).count() / frames;
+	};
+
+	uint64_t reads = 0, torn = 0;
+	double const quiet = run(0, reads, torn);
+	double const watched = run(settings.m_monitors, reads, torn);
+	printf("  monitor %zu readers, %llu snapshots read, %s, %.2f us per frame watched, %.2f us unwatched\n", settings.m_monitors,
+		(unsigned long long)reads, torn == 0 ? "all consistent" : "TORN", watched, quiet);
+}
+
+// Run the rom, then a loop drawing a font glyph and erasing it one column further each time, with and without the sprite cache
+// (schip flags, so draws don't wait for the vertical blank), checking both end in the same state.
+void print_sprite_cache(rom_image const& rom, bench_settings const& settings)
+{
+	static constexpr uint8_t c_spriteLoop[] =
+	{
+		0x60, 0x00,		// 200: V0 = 0 (x)
+		0x61, 0x08,		// 202: V1 = 8 (y)
+		0x62, 0x00,		// 204: V2 = 0 (glyph)
+		0xf2, 0x29,		// 206: I = glyph V2
+		0xd0, 0x15,		// 208: draw
+		0xd0, 0x15,		// 20A: erase
+		0x70, 0x01,		// 20C: V0 += 1
+		0x63, 0x38,		// 20E: V3 = 56
+		0x83, 0x05,		// 210: V3 -= V0
+		0x3f, 0x01,		// 212: skip if V0 <= 56
+		0x60, 0x00,		// 214: V0 = 0
+		0x72, 0x01,		// 216: V2 += 1
+		0x63, 0x0f,		// 218: V3 = 15
+		0x82, 0x32,		// 21A: V2 &= V3
+		0x12, 0x06,		// 21C: jump 206
+	};
+
+	rom_image const loop = { "sprite loop", vector<uint8_t>(std::begin(c_spriteLoop), std::end(c_spriteLoop)), {} };
+
+	for (rom_image const* image : { &rom, &loop })
+	{
+		uint64_t reference = 0;
+		for (bool const cached : { false, true })
+		{
+			tiny8::interpreter interpreter(tiny8::chip8_schip, tiny8::dispatch_mode::table);
+			install_rom(interpreter, *image);
+			interpreter.set_decode_cache(true);
+			interpreter.set_sprite_cache(cached);
+
+			auto const start = chrono::steady_clock::now();
+			interpreter.run_cycles(static_cast<uint32_t>(std::min<uint64_t>(settings.m_cycles, UINT32_MAX)));
+			auto const end = chrono::steady_clock::now();
+
+			bench_result result;
+			result.m_cycles = interpreter.get_cycles();
+			result.m_seconds = chrono::duration<double>(end - start).count();
+			uint64_t const hash = interpreter.state_hash();
+			bool const ok = reference == 0 || hash == reference;
+			reference = hash;
+
+			char label[32];
+			snprintf(label, sizeof(label), "sprites %s", cached ? "on" : "off");
+			print_result(image == &loop ? "loop" : "rom", label, result);
+			if (!ok)
+				printf("  %-10s MISMATCH\n", "");
+		}
+	}
+}
+
+// Run the rom on the jit (decoded only where it isn't supported) with every block decoded and compiled the first time it runs,
+// then promoted through the tiers: the first 10 frames, the whole run, what each tier ran and the final states.
+void print_tiers(rom_image const& rom, bench_settings const& settings)
+{
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	uint64_t reference = 0;
+	for (tiny8::tier_thresholds const thresholds : { tiny8::tier_thresholds{}, tiny8::tier_thresholds{ std::max<uint16_t>(1, settings.m_tiers / 8), settings.m_tiers } })
+	{
+		tiny8::block_jit jit;
+		tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(interpreter, rom);
+		interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		jit.attach(interpreter);
+		interpreter.set_tier_thresholds(thresholds);
+
+		auto const start = chrono::steady_clock::now();
+		for (int frame = 0; frame < 10; ++frame)
+			interpreter.run_frame(keys);
+		auto const warm = chrono::steady_clock::now();
+		interpreter.run_cycles(static_cast<uint32_t>(std::min<uint64_t>(settings.m_cycles, UINT32_MAX)));
+		auto const end = chrono::steady_clock::now();
+
+		bench_result result;
+		result.m_cycles = interpreter.get_cycles();
+		result.m_seconds = chrono::duration<double>(end - start).count();
+		uint64_t const hash = interpreter.state_hash();
+		bool const ok = reference == 0 || hash == reference;
+		reference = hash;
+
+		tiny8::tier_counts const counts = interpreter.get_tier_counts();
+		printf("  tiers %5u/%-5u first 10 frames %8.2f us, %.2f MIPS, instructions %llu/%llu/%llu, %llu blocks decoded, %llu compiled, %s\n",
+			thresholds.m_decode, thresholds.m_compile, chrono::duration<double, micro>(warm - start).count(), result.m_cycles / result.m_seconds / 1e6,
+			(unsigned long long)counts.m_instructions[size_t(tiny8::tier::interpreted)], (unsigned long long)counts.m_instructions[size_t(tiny8::tier::decoded)],
+			(unsigned long long)counts.m_instructions[size_t(tiny8::tier::native)], (unsigned long long)counts.m_promotions[size_t(tiny8::tier::decoded)],
+			(unsigned long long)counts.m_promotions[size_t(tiny8::tier::native)], ok ? "ok" : "MISMATCH");
+	}
+}
+
+// Step a vec_env with pseudo-random actions, four frames a step and 10 second episodes, twice: both passes must see the same
+// observations and episode ends.
+void print_env(rom_image const& rom, bench_settings const& settings)
+{
+	constexpr uint32_t c_frameSkip = 4;
+	uint64_t const steps = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / c_frameSkip / settings.m_env);
+
+	auto const pass = [&](uint64_t& ended, double& seconds)
+	{
+		tiny8::basic_vec_env<tiny8::basic_interpreter<tiny8::chip8_original>> env(settings.m_env, rom.m_data, tiny8::observation_format::bytes, 1, settings.m_threads);
+		env.set_cycles_per_frame(settings.m_cyclesPerFrame);
+		env.set_episode_limit(600);
+
+		vector<uint8_t> observations(env.size() * env.observation_size());
+		vector<uint16_t> actions(env.size());
+		vector<float> rewards(env.size());
+		vector<uint8_t> done(env.size());
+		env.reset(observations.data());
+
+		uint64_t hash = 0, random = 0x9e3779b97f4a7c15ull;
+		ended = 0;
+		auto const start = chrono::steady_clock::now();
+		for (uint64_t step = 0; step < steps; ++step)
+		{
+			for (uint16_t& action : actions)
+			{
+				random ^= random << 13, random ^= random >> 7, random ^= random << 17;
+				action = static_cast<uint16_t>(1u << (random & 15)) & static_cast<uint16_t>(random >> 16);
+			}
+			env.step(actions, c_frameSkip, observations.data(), rewards.data(), done.data());
+			hash = tiny8::xxhash64(observations.data(), observations.size(), hash);
+			ended += std::count(done.begin(), done.end(), uint8_t(1));
+		}
+		seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		return hash;
+	};
+
+	uint64_t ended = 0, ended_again = 0;
+	double seconds = 0.0, seconds_again = 0.0;
+	bool const ok = pass(ended, seconds) == pass(ended_again, seconds_again) && ended == ended_again;
+	printf("  env: %zu instances, %llu steps of %u frames, %llu episodes ended, %.0f steps/s (%.0f instance frames/s), %s\n", settings.m_env,
+		(unsigned long long)steps, c_frameSkip, (unsigned long long)ended, steps * settings.m_env / seconds,
+		steps * settings.m_env * c_frameSkip / seconds, ok ? "deterministic" : "MISMATCH");
+}
+
+// Run many lanes of a rom in lockstep; the instruction budget is split across them.
+void print_lockstep(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::basic_lockstep<tiny8::basic_interpreter<tiny8::chip8_original>> lockstep(settings.m_lanes);
+	for (size_t i = 0; i < lockstep.size(); ++i)
+		install_rom(lockstep.lane(i), rom);
+
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / lockstep.size());
+
+	auto const start = chrono::steady_clock::now();
+	lockstep.run_frames(frames, settings.m_cyclesPerFrame);
+	auto const end = chrono::steady_clock::now();
+
+	bench_result result;
+	result.m_cycles = lockstep.get_grouped_instructions() + lockstep.get_scalar_instructions();
+	result.m_seconds = chrono::duration<double>(end - start).count();
+
+	char label[32];
+	snprintf(label, sizeof(label), "%zu lanes", lockstep.size());
+	print_result("lockstep", label, result);
+	printf("  %-10s %.1f%% of instructions ran grouped\n", "", 100.0 * lockstep.get_grouped_instructions() / result.m_cycles);
+}
+
+// Branch forks off a common state, each pressing a different key, and run them a frame at a time through one interpreter.
+void print_forks(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::basic_interpreter<tiny8::chip8_original> interpreter;
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+	tiny8::cow_state root;
+	root.capture(interpreter);
+	vector<tiny8::cow_state> forks(settings.m_forks, root);
+
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / forks.size());
+
+	bench_result result;
+	auto const start = chrono::steady_clock::now();
+	for (uint64_t frame = 0; frame < frames; ++frame)
+	{
+		for (size_t i = 0; i < forks.size(); ++i)
+		{
+			uint8_t keys[tiny8::c_maxKeys] = { 0 };
+			keys[i % tiny8::c_maxKeys] = 1;
+
+			forks[i].restore(interpreter);
+			uint64_t const before = interpreter.get_cycles();
+			interpreter.run_frame(keys);
+			result.m_cycles += interpreter.get_cycles() - before;
+			forks[i].capture(interpreter);
+		}
+	}
+	auto const end = chrono::steady_clock::now();
+	result.m_seconds = chrono::duration<double>(end - start).count();
+
+	size_t owned = 0, shared = 0;
+	for (auto const& fork : forks)
+	{
+		owned += fork.owned_bytes();
+		shared += fork.shared_pages(root);
+	}
+
+	char label[32];
+	snprintf(label, sizeof(label), "%zu forks", forks.size());
+	print_result("fork", label, result);
+	printf("  %-10s %zu bytes owned and %.1f of %zu pages shared with the root per fork\n", "", owned / forks.size(), double(shared) / forks.size(), tiny8::cow_state::c_pageCount);
+}
+
+// Explore the rom breadth-first from its first frame, every key held for 4 frames from every state, until there are at least
+// m_explore states; then replay the path to the last state from the root and check it ends in the same machine.
+void print_explore(rom_image const& rom, bench_settings const& settings)
+{
+	constexpr size_t c_width = 64;
+	auto const fingerprint = [](tiny8::interpreter& interpreter)
+	{
+		uint64_t const h = tiny8::xxhash64(interpreter.get_memory()->m_data, tiny8::c_maxMemory, interpreter.display_hash());
+		return tiny8::xxhash64(interpreter.get_registers(), sizeof(tiny8::registers), h);
+	};
+
+	tiny8::interpreter root(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(root, rom);
+	root.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+	root.run_frame();
+
+	tiny8::explorer explorer(c_width, settings.m_threads, tiny8::chip8_original, tiny8::dispatch_mode::table);
+	explorer.set_cycles_per_frame(settings.m_cyclesPerFrame);
+	explorer.start(root);
+
+	auto const start = chrono::steady_clock::now();
+	size_t const states = explorer.explore(settings.m_explore);
+	auto const end = chrono::steady_clock::now();
+	double const seconds = chrono::duration<double>(end - start).count();
+
+	tiny8::interpreter restored(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	explorer.restore(states - 1, restored);
+	uint8_t keys[tiny8::c_maxKeys];
+	for (uint16_t const mask : explorer.path(states - 1))
+	{
+		for (uint32_t key = 0; key < tiny8::c_maxKeys; ++key)
+			keys[key] = (mask >> key) & 1;
+		for (int frame = 0; frame < 4; ++frame)
+			root.run_frame(keys);
+	}
+	bool const replayed = fingerprint(root) == fingerprint(restored);
+
+	printf("  %-10s %zu states to depth %u in %.3f s (%.0f states/s), %llu duplicates, %llu faults, %zu frontier\n", "explore", states,
+		explorer.get_state(states - 1).m_depth, seconds, states / seconds, (unsigned long long)explorer.duplicate_count(),
+		(unsigned long long)explorer.fault_count(), explorer.frontier_size());
+	printf("  %-10s %zu distinct pages, %.0f bytes per state against %zu for a machine_state, replay %s\n", "", explorer.page_count(),
+		double(explorer.bytes()) / states, sizeof(tiny8::machine_state), replayed ? "ok" : "MISMATCH");
+}
+
+// Short runs of a second each, alternating between the three modes, on instances acquired from a pool and released right after.
+// The instruction budget is split across the runs; heap allocations made once every mode has been seen are counted too.
+void print_pool(rom_image const& rom, bench_settings const& settings)
+{
+	constexpr tiny8::flags c_modes[] = { tiny8::chip8_original, tiny8::chip8_schip, tiny8::chip8_xochip };
+	constexpr uint64_t c_framesPerRun = 60;
+
+	auto const setup = chrono::steady_clock::now();
+	tiny8::basic_instance_pool<tiny8::interpreter> pool(settings.m_pool, tiny8::none, tiny8::dispatch_mode::table);
+	double const setupSeconds = chrono::duration<double>(chrono::steady_clock::now() - setup).count();
+	if (pool.capacity() == 0)
+	{
+		printf("  %-10s the arena couldn't be mapped\n", "pool");
+		return;
+	}
+
+	vector<tiny8::interpreter*> running(pool.capacity());
+	for (tiny8::flags const mode : c_modes)
+		pool.release(pool.acquire(rom.m_data, mode));
+
+	uint64_t const runs = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / c_framesPerRun);
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+
+	bench_result result;
+	uint64_t completed = 0;
+	g_allocations = 0;
+	g_countAllocations = true;
+	auto const start = chrono::steady_clock::now();
+	for (uint64_t run = 0; run < runs; run += running.size())
+	{
+		for (size_t i = 0; i < running.size(); ++i)
+		{
+			running[i] = pool.acquire(rom.m_data, c_modes[(run + i) % std::size(c_modes)]);
+			running[i]->set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		}
+
+		for (tiny8::interpreter* instance : running)
+		{
+			for (uint64_t frame = 0; frame < c_framesPerRun; ++frame)
+				instance->run_frame(keys);
+			result.m_cycles += instance->get_cycles();
+			completed++;
+			pool.release(instance);
+		}
+	}
+	auto const end = chrono::steady_clock::now();
+	g_countAllocations = false;
+	result.m_seconds = chrono::duration<double>(end - start).count();
+
+	char label[32];
+	snprintf(label, sizeof(label), "%zu instances", pool.capacity());
+	print_result("pool", label, result);
+	printf("  %-10s %.0f runs per second, %llu allocations, %s, set up in %.3f ms\n", "", completed / result.m_seconds, (unsigned long long)g_allocations.load(),
+		pool.has_huge_pages() ? "huge pages" : "regular pages", setupSeconds * 1000.0);
+}
+
+// Restart a rom that ran for a frame over and over, by constructing a new interpreter each time and with reset(), which keeps
+// the one already set up. Only the restarts are timed.
+void print_resets(rom_image const& rom, bench_settings const& settings)
+{
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	auto const time = [&](char const* label, auto&& restart)
+	{
+		double seconds = 0.0;
+		uint64_t cycles = 0;
+		for (size_t i = 0; i < settings.m_resets; ++i)
+		{
+			auto const start = chrono::steady_clock::now();
+			tiny8::interpreter& interpreter = restart();
+			auto const end = chrono::steady_clock::now();
+			seconds += chrono::duration<double>(end - start).count();
+
+			interpreter.run_frame(keys);
+			cycles += interpreter.get_cycles();
+		}
+		printf("  %-10s %-18s %10.2f ns/restart (%zu restarts, %llu instructions)\n", "reset", label, seconds * 1e9 / settings.m_resets,
+			settings.m_resets, (unsigned long long)cycles);
+	};
+
+	unique_ptr<tiny8::interpreter> constructed;
+	time("construct", [&]() -> tiny8::interpreter&
+	{
+		constructed = make_unique<tiny8::interpreter>(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(*constructed, rom);
+		return *constructed;
+	});
+
+	tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(interpreter, rom);
+	time("reset()", [&]() -> tiny8::interpreter&
+	{
+		interpreter.reset();
+		apply_pokes(interpreter, rom);
+		return interpreter;
+	});
+
+	interpreter.set_decode_cache(true);
+	time("reset() cached", [&]() -> tiny8::interpreter&
+	{
+		interpreter.reset();
+		apply_pokes(interpreter, rom);
+		return interpreter;
+	});
+}
+
+// Serialize the state after every frame, uncompressed and with LZ4, and restore each one into an interpreter constructed with
+// other flags.
+void print_save_states(rom_image const& rom, bench_settings const& settings)
+{
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	vector<uint8_t> buffer(tiny8::state_serializer::c_maxStateSize);
+
+	for (tiny8::state_compression const compression : { tiny8::state_compression::none, tiny8::state_compression::lz4 })
+	{
+		tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		tiny8::interpreter restored;
+		install_rom(interpreter, rom);
+		interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		tiny8::state_serializer serializer(compression);
+
+		double save_seconds = 0.0, load_seconds = 0.0;
+		uint64_t bytes = 0;
+		bool matches = true;
+		g_allocations = 0;
+		g_countAllocations = true;
+		for (size_t i = 0; i < settings.m_saveStates; ++i)
+		{
+			interpreter.run_frame(keys);
+
+			auto const start = chrono::steady_clock::now();
+			size_t const size = serializer.save(interpreter, buffer);
+			auto const saved = chrono::steady_clock::now();
+			bool const loaded = serializer.load(restored, std::span<uint8_t const>(buffer.data(), size));
+			auto const end = chrono::steady_clock::now();
+
+			save_seconds += chrono::duration<double>(saved - start).count();
+			load_seconds += chrono::duration<double>(end - saved).count();
+			bytes += size;
+			matches &= loaded && restored.get_flags() == interpreter.get_flags() && restored.state_hash() == interpreter.state_hash();
+		}
+		g_countAllocations = false;
+
+		printf("  %-10s %-5s %8.0f bytes/state, %8.2f ns/save, %8.2f ns/load, %.0f MB/s saved, %llu allocations, restored %s\n", "savestate",
+			compression == tiny8::state_compression::lz4 ? "lz4" : "none", double(bytes) / settings.m_saveStates, save_seconds * 1e9 / settings.m_saveStates,
+			load_seconds * 1e9 / settings.m_saveStates, bytes / save_seconds / 1e6, (unsigned long long)g_allocations.load(), matches ? "ok" : "MISMATCH");
+	}
+}
+
+// Run frames checkpointing after each one to a temporary file, serialized and written on the frame loop's thread and then through
+// a checkpoint_writer, against the same frames without checkpoints. The last checkpoint written is restored and compared.
+void print_checkpoints(rom_image const& rom, bench_settings const& settings)
+{
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	enum class mode { none, sync, async };
+
+	for (mode const m : { mode::none, mode::sync, mode::async })
+	{
+		FILE* const file = tmpfile();
+		if (file == nullptr)
+		{
+			printf("  %-10s couldn't create a temporary file\n", "checkpoint");
+			return;
+		}
+
+		tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(interpreter, rom);
+		interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+		tiny8::state_serializer serializer;
+		vector<uint8_t> buffer(tiny8::state_serializer::c_maxStateSize);
+		uint64_t bytes = 0, dropped = 0, last = 0;
+		double seconds = 0.0;
+		{
+			tiny8::checkpoint_writer writer(file);
+			auto const start = chrono::steady_clock::now();
+			for (size_t frame = 0; frame < settings.m_checkpoints; ++frame)
+			{
+				interpreter.run_frame(keys);
+				if (m == mode::sync)
+				{
+					size_t const size = serializer.save(interpreter, buffer);
+					uint8_t header[12];
+					for (size_t i = 0; i < 8; ++i)
+						header[i] = static_cast<uint8_t>(uint64_t(frame) >> (8 * i));
+					for (size_t i = 0; i < 4; ++i)
+						header[8 + i] = static_cast<uint8_t>(size >> (8 * i));
+					fwrite(header, 1, sizeof(header), file);
+					fwrite(buffer.data(), 1, size, file);
+					bytes += sizeof(header) + size;
+				}
+				else if (m == mode::async)
+					writer.submit(interpreter, frame);
+			}
+			seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			writer.flush();
+			if (m == mode::async)
+			{
+				bytes = writer.bytes_written();
+				dropped = writer.dropped_count();
+			}
+		}
+		if (m == mode::none)
+		{
+			printf("  %-10s %-5s %8.2f us/frame\n", "checkpoint", "none", seconds * 1e6 / settings.m_checkpoints);
+			fclose(file);
+			continue;
+		}
+
+		// The last record in the file is the last checkpoint submitted, unless it was dropped.
+		rewind(file);
+		uint64_t id = 0;
+		size_t size = 0, restored_size = 0;
+		while ((size = tiny8::checkpoint_writer::read_checkpoint(file, id, buffer)) > 0)
+		{
+			last = id;
+			restored_size = size;
+		}
+		fclose(file);
+
+		tiny8::interpreter restored;
+		bool const loaded = restored_size > 0 && serializer.load(restored, std::span<uint8_t const>(buffer.data(), restored_size));
+		bool const matches = loaded && (last + 1 < settings.m_checkpoints || restored.state_hash() == interpreter.state_hash());
+		printf("  %-10s %-5s %8.2f us/frame, %8.0f bytes/checkpoint, %llu dropped, last restored %s\n", "checkpoint", m == mode::sync ? "sync" : "async",
+			seconds * 1e6 / settings.m_checkpoints, double(bytes) / std::max<uint64_t>(1, settings.m_checkpoints - dropped), (unsigned long long)dropped,
+			matches ? "ok" : "MISMATCH");
+	}
+}
+
+// Run frames capturing each one to a GIF in a temporary file, against the same frames without capturing. Frames run unthrottled,
+// far faster than the writer encodes, so many are dropped; at 60Hz none would be.
+void print_capture(rom_image const& rom, bench_settings const& settings)
+{
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+
+	for (bool const capture : { false, true })
+	{
+		FILE* const file = tmpfile();
+		if (file == nullptr)
+		{
+			printf("  %-10s couldn't create a temporary file\n", "capture");
+			return;
+		}
+
+		tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(interpreter, rom);
+		interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+		double seconds = 0.0;
+		uint64_t dropped = 0;
+		{
+			tiny8::gif_capture gif(file);
+			auto const start = chrono::steady_clock::now();
+			for (size_t frame = 0; frame < settings.m_capture; ++frame)
+			{
+				interpreter.run_frame(keys);
+				if (capture)
+					gif.capture(*interpreter.get_display());
+			}
+			seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			dropped = gif.dropped_count();
+		}
+		fseek(file, 0, SEEK_END);
+		long const bytes = ftell(file);
+		fclose(file);
+
+		if (!capture)
+		{
+			printf("  %-10s %-5s %8.2f us/frame\n", "capture", "off", seconds * 1e6 / settings.m_capture);
+			continue;
+		}
+		printf("  %-10s %-5s %8.2f us/frame, %ld bytes of GIF, %llu frames dropped\n", "capture", "gif", seconds * 1e6 / settings.m_capture,
+			bytes, (unsigned long long)dropped);
+	}
+}
+
+// Run frames as COSMAC VIP machine cycles, which run as many instructions as fit the frame's time, against frames of a fixed
+// instruction count.
+void print_machine_frames(rom_image const& rom, bench_settings const& settings)
+{
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+
+	tiny8::interpreter counted(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(counted, rom);
+	auto start = chrono::steady_clock::now();
+	for (size_t frame = 0; frame < settings.m_machineFrames; ++frame)
+		counted.run_frame(keys, settings.m_cyclesPerFrame);
+	double const counted_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	tiny8::interpreter timed(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(timed, rom);
+	uint32_t carry = 0, least = ~0u, most = 0;
+	start = chrono::steady_clock::now();
+	for (size_t frame = 0; frame < settings.m_machineFrames; ++frame)
+	{
+		uint32_t const instructions = tiny8::run_machine_frame(timed, tiny8::c_cosmacVipCosts, keys, carry);
+		least = std::min(least, instructions);
+		most = std::max(most, instructions);
+	}
+	double const timed_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	printf("  %-10s %-5s %8.2f us/frame, %u instructions/frame\n", "machine", "count", counted_seconds * 1e6 / settings.m_machineFrames, settings.m_cyclesPerFrame);
+	printf("  %-10s %-5s %8.2f us/frame, %u to %u instructions/frame (%.1f on average)\n", "machine", "vip", timed_seconds * 1e6 / settings.m_machineFrames,
+		least, most, double(timed.get_cycles()) / settings.m_machineFrames);
+}
+
+// Coroutine that starts right away and frees itself when it returns.
+struct detached_task
+{
+	struct promise_type
+	{
+		detached_task get_return_object() { return {}; }
+		suspend_never initial_suspend() noexcept { return {}; }
+		suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { abort(); }
+	};
+};
+
+detached_task run_instance(tiny8::interpreter& interpreter, uint64_t frames, tiny8::run_queue& queue)
+{
+	while (frames > 0)
+	{
+		tiny8::slice_result const slice = co_await tiny8::co_run(interpreter, ~0u, queue.scheduler());
+		frames -= slice.m_end == tiny8::slice_end::frame;
+	}
+}
+
+// Run many instances of a rom a frame at a time from coroutines, all multiplexed on the calling thread; the instruction budget
+// is split across them.
+void print_coroutines(rom_image const& rom, bench_settings const& settings)
+{
+	vector<unique_ptr<tiny8::interpreter>> instances;
+	for (size_t i = 0; i < settings.m_coroutines; ++i)
+	{
+		instances.push_back(make_unique<tiny8::interpreter>(tiny8::chip8_original, tiny8::dispatch_mode::table));
+		install_rom(*instances.back(), rom);
+		instances.back()->set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+	}
+
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / instances.size());
+
+	tiny8::run_queue queue;
+	auto const start = chrono::steady_clock::now();
+	for (auto& instance : instances)
+		run_instance(*instance, frames, queue);
+	queue.run();
+	auto const end = chrono::steady_clock::now();
+
+	bench_result result;
+	for (auto const& instance : instances)
+		result.m_cycles += instance->get_cycles();
+	result.m_seconds = chrono::duration<double>(end - start).count();
+
+	char label[32];
+	snprintf(label, sizeof(label), "%zu tasks", instances.size());
+	print_result("coroutine", label, result);
+}
+
+// Translate a rom to C++ ahead of time: every block the analysis reaches, plus the ones running cycles instructions of it decodes.
+bool translate_rom(string const& path, rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+	tiny8::analysis analysis;
+	if (!analysis.analyze(interpreter, rom.m_data))
+		return false;
+
+	tiny8::aot_translator translator;
+	translator.attach(interpreter);
+	analysis.prewarm(interpreter);
+
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	for (uint64_t frame = 0; frame < settings.m_cycles / settings.m_cyclesPerFrame; ++frame)
+		interpreter.run_frame(keys);
+
+	FILE* const file = fopen(path.c_str(), "w");
+	if (file == nullptr)
+		return false;
+	translator.write(interpreter, rom.m_data, "tiny8_aot_program", "tiny8::interpreter", file);
+	bool const written = fclose(file) == 0;
+
+	printf("Translated %zu blocks of %s into %s\n", translator.block_count(), rom.m_name.c_str(), path.c_str());
+	return written;
+}
+
+// Run the rom on a batch at 60 frames per second, serving its first instance to a gdb client (target remote :port) until one has
+// connected and detached again. The other instances keep running whatever the client does.
+bool serve_gdb(uint16_t port, rom_image const& rom, bench_settings const& settings)
+{
+	using instance = tiny8::basic_interpreter<tiny8::chip8_original>;
+	tiny8::basic_batch<instance> batch(std::max<size_t>(settings.m_instances, 4), settings.m_threads);
+	for (size_t i = 0; i < batch.size(); ++i)
+		install_rom(batch[i], rom);
+	batch.set_cycles_per_frame(settings.m_cyclesPerFrame);
+
+	tiny8::basic_gdb_server<instance> server(batch[0], port);
+	if (!server.is_listening())
+		return false;
+	server.attach(batch, 0);
+	printf("Serving %s (instance 0 of %zu) on 127.0.0.1:%u\n", rom.m_name.c_str(), batch.size(), unsigned(port));
+
+	bool served = false;
+	auto next = chrono::steady_clock::now();
+	while (!served || server.is_connected())
+	{
+		served |= server.is_connected();
+		batch.run_frames(1);
+		next += chrono::microseconds(16'667);
+		this_thread::sleep_until(next);
+	}
+	batch.set_instance_runner(0, nullptr);
+
+	printf("Client detached after %llu frames: instance 0 ran %llu instructions, instance 1 ran %llu\n", (unsigned long long)batch.get_frame(),
+		(unsigned long long)batch[0].get_cycles(), (unsigned long long)batch[1].get_cycles());
+	return true;
+}
+
+// Record cycles / cycles per frame frames of a rom with scripted input: a random key held for a while, then nothing, and so on.
+// Pokes aren't part of a movie, so none are applied.
+bool record_movie(string const& path, rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::interpreter interpreter(tiny8::chip8_original);
+	tiny8::movie_recorder recorder;
+	if (!recorder.start(interpreter, rom.m_data, 1, settings.m_cyclesPerFrame))
+		return false;
+
+	uint8_t keys[tiny8::c_maxKeys] = { 0 };
+	uint32_t script = 0x1234567;
+	uint64_t const frames = settings.m_cycles / settings.m_cyclesPerFrame;
+	for (uint64_t frame = 0, next_change = 0; frame < frames; ++frame)
+	{
+		if (frame == next_change)
+		{
+			script = script * 1664525u + 1013904223u;
+			memset(keys, 0, sizeof(keys));
+			if (script & 0x10000)
+				keys[(script >> 20) % tiny8::c_maxKeys] = 1;
+			next_change += 4 + (script >> 28) * 4;
+		}
+		recorder.run_frame(interpreter, keys);
+	}
+
+	vector<uint8_t> const bytes = recorder.get_movie().save();
+	ofstream file(path, fstream::out | fstream::binary);
+	file.write(reinterpret_cast<char const*>(bytes.data()), bytes.size());
+	if (!file)
+		return false;
+
+	printf("Recorded %llu frames of %s into %s (%zu runs, %zu bytes)\n", (unsigned long long)frames, rom.m_name.c_str(), path.c_str(),
+		recorder.get_movie().m_runs.size(), bytes.size());
+	return true;
+}
+
+// Replay a movie on every dispatch backend against the rom it was recorded with, checking its framebuffer hashes.
+bool replay_movie(string const& path, vector<rom_image> const& roms)
+{
+	ifstream file(path, fstream::in | fstream::binary);
+	vector<uint8_t> const bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	tiny8::movie movie;
+	if (!movie.load(bytes))
+	{
+		printf("%s is not a valid movie.\n", path.c_str());
+		return false;
+	}
+
+	auto const rom = find_if(roms.begin(), roms.end(), [&](rom_image const& r) { return tiny8::rom_hash(r.m_data) == movie.m_header.m_romHash; });
+	if (rom == roms.end())
+	{
+		printf("None of the roms given is the one %s was recorded with.\n", path.c_str());
+		return false;
+	}
+
+	printf("%s: %u frames of %s\n", path.c_str(), movie.m_header.m_frameCount, rom->m_name.c_str());
+	tiny8::flags const flags = static_cast<tiny8::flags>(movie.m_header.m_flags);
+
+	bool ok = true;
+	auto replay = [&](char const* dispatch, auto& interpreter)
+	{
+		auto const start = chrono::steady_clock::now();
+		tiny8::replay_result const result = tiny8::replay_movie(interpreter, movie, rom->m_data);
+		auto const end = chrono::steady_clock::now();
+
+		print_result("replay", dispatch, { interpreter.get_cycles(), chrono::duration<double>(end - start).count() });
+		if (result.m_status == tiny8::replay_status::diverged)
+			printf("  %-10s diverged by frame %u, %u checkpoints matched\n", "", result.m_divergedFrame, result.m_checkpoints);
+		else if (result.m_status != tiny8::replay_status::ok)
+			printf("  %-10s can't be replayed: %s\n", "", result.m_status == tiny8::replay_status::flags_mismatch ? "flags mismatch" : "interpreter not fresh");
+		ok &= result.m_status == tiny8::replay_status::ok;
+	};
+
+	{
+		tiny8::interpreter interpreter(flags, tiny8::dispatch_mode::families);
+		replay("families", interpreter);
+	}
+	{
+		tiny8::interpreter interpreter(flags, tiny8::dispatch_mode::table);
+		replay("table", interpreter);
+	}
+	{
+		tiny8::interpreter interpreter(flags, tiny8::dispatch_mode::table);
+		interpreter.set_threaded_dispatch(true);
+		replay("threaded", interpreter);
+	}
+	{
+		tiny8::interpreter interpreter(flags, tiny8::dispatch_mode::table);
+		interpreter.set_decode_cache(true);
+		replay("cached", interpreter);
+	}
+	if (tiny8::c_jitSupported)
+	{
+		tiny8::block_jit jit;
+		tiny8::interpreter interpreter(flags, tiny8::dispatch_mode::table);
+		jit.attach(interpreter);
+		replay("jit", interpreter);
+	}
+	return ok;
+}
+
+// Run one test of the suite and hash the screen it ends on.
+template<class Interpreter>
+uint64_t conformance_hash(Interpreter& interpreter, rom_image const& rom, uint8_t platform, uint8_t test)
+{
+	interpreter.load_rom(rom.m_data);
+	interpreter.get_memory()->m_data[0x1fe] = platform;
+	interpreter.get_memory()->m_data[0x1ff] = test;
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, c_conformanceCyclesPerFrame);
+
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	for (uint32_t i = 0; i < c_conformanceFrames; ++i)
+		interpreter.run_frame(keys);
+	return interpreter.display_hash();
+}
+
+// Check every golden screen of a mode on all dispatch backends, each test on a fresh interpreter.
+template<tiny8::flags F>
+bool conformance_mode(char const* mode, uint8_t platform, rom_image const& rom)
+{
+	bool ok = true;
+	auto const check = [&](char const* dispatch, auto&& with_interpreter)
+	{
+		uint32_t matched = 0, total = 0;
+		for (golden_screen const& golden : c_goldens)
+		{
+			if (golden.m_flags != F)
+				continue;
+
+			uint64_t hash = 0;
+			with_interpreter([&](auto& interpreter) { hash = conformance_hash(interpreter, rom, platform, golden.m_test); });
+			total++;
+			if (hash == golden.m_hash)
+				matched++;
+			else
+				printf("  %-10s %-10s test %u ends on display hash %016llx instead of %016llx\n", mode, dispatch, golden.m_test, (unsigned long long)hash, (unsigned long long)golden.m_hash);
+		}
+		printf("  %-10s %-10s %u/%u screens match\n", mode, dispatch, matched, total);
+		ok &= matched == total;
+	};
+
+	check("families", [](auto&& run) { tiny8::interpreter interpreter(F, tiny8::dispatch_mode::families); run(interpreter); });
+	check("table", [](auto&& run) { tiny8::interpreter interpreter(F, tiny8::dispatch_mode::table); run(interpreter); });
+	check("static", [](auto&& run) { tiny8::basic_interpreter<F> interpreter; run(interpreter); });
+	check("threaded", [](auto&& run) { tiny8::basic_interpreter<F> interpreter; interpreter.set_threaded_dispatch(true); run(interpreter); });
+	check("cached", [](auto&& run) { tiny8::basic_interpreter<F> interpreter; interpreter.set_decode_cache(true); run(interpreter); });
+	if (tiny8::c_jitSupported)
+		check("jit", [](auto&& run) { tiny8::block_jit jit; tiny8::basic_interpreter<F> interpreter; jit.attach(interpreter); run(interpreter); });
+	return ok;
+}
+
+// Check the test suite against the goldens in every mode. Needs the exact rom they were taken from.
+bool check_conformance(vector<rom_image> const& roms)
+{
+	auto const rom = find_if(roms.begin(), roms.end(), [](rom_image const& r) { return r.m_name == c_conformanceRom; });
+	if (rom == roms.end())
+	{
+		printf("Conformance needs %s.\n", c_conformanceRom);
+		return false;
+	}
+
+	printf("%s conformance (%u frames of %u instructions per screen)\n", rom->m_name.c_str(), c_conformanceFrames, c_conformanceCyclesPerFrame);
+	bool ok = conformance_mode<tiny8::chip8_original>("original", 1, *rom);
+	ok &= conformance_mode<tiny8::chip8_schip>("schip", 2, *rom);
+	ok &= conformance_mode<tiny8::chip8_xochip>("xochip", 3, *rom);
+	return ok;
+}
+
+// Run every other backend side by side with the families reference and report the first instruction they disagree on.
+template<tiny8::flags F>
+bool diff_mode(char const* mode, rom_image const& rom, bench_settings const& settings)
+{
+	bool ok = true;
+	auto const check = [&](char const* dispatch, auto&& with_candidate)
+	{
+		tiny8::interpreter reference(F, tiny8::dispatch_mode::families);
+		install_rom(reference, rom);
+		reference.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+		with_candidate([&](auto& candidate)
+		{
+			install_rom(candidate, rom);
+			candidate.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+			tiny8::differential diff(reference, candidate, settings.m_diffBlock);
+			uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+			printf("  %-10s %-10s ", mode, dispatch);
+			if (diff.run(settings.m_cycles, keys))
+				printf("%llu instructions match families\n", (unsigned long long)diff.compared());
+			else
+			{
+				diff.get_divergence().print(stdout);
+				ok = false;
+			}
+		});
+	};
+
+	check("table", [](auto&& run) { tiny8::interpreter interpreter(F, tiny8::dispatch_mode::table); run(interpreter); });
+	check("static", [](auto&& run) { tiny8::basic_interpreter<F> interpreter; run(interpreter); });
+	check("threaded", [](auto&& run) { tiny8::basic_interpreter<F> interpreter; interpreter.set_threaded_dispatch(true); run(interpreter); });
+	check("cached", [](auto&& run) { tiny8::basic_interpreter<F> interpreter; interpreter.set_decode_cache(true); run(interpreter); });
+	if (tiny8::c_jitSupported)
+		check("jit", [](auto&& run) { tiny8::block_jit jit; tiny8::basic_interpreter<F> interpreter; jit.attach(interpreter); run(interpreter); });
+	return ok;
+}
+
+// Run a rom with profiling enabled and print where it spends its instructions.
+void print_profile(rom_image const& rom, bench_settings const& settings)
+{
+#if defined(TINY8_PROFILE)
+	tiny8::basic_interpreter<tiny8::chip8_original> interpreter;
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+	interpreter.set_tier_thresholds({ 2, 0 });
+	interpreter.set_profiling(true);
+
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	uint64_t const frames = settings.m_cycles / settings.m_cyclesPerFrame;
+	for (uint64_t i = 0; i < frames; ++i)
+		interpreter.run_frame(keys);
+
+	printf("  profile: ");
+	interpreter.get_profile()->dump(stdout);
+#else
+	(void)rom;
+	(void)settings;
+	printf("  profile: not compiled in, configure with -DTINY8_PROFILE=ON\n");
+#endif
+}
+
+// Expand the screen a rom draws in its first second to 32-bit pixels, as a frontend would to present it, and compare the
+// blit kernel against a per-pixel loop.
+void print_blit(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::basic_interpreter<tiny8::chip8_xochip> interpreter;
+	install_rom(interpreter, rom);
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	for (int frame = 0; frame < 60; ++frame)
+		interpreter.run_frame(keys, settings.m_cyclesPerFrame);
+
+	tiny8::display const& display = *interpreter.get_display();
+	tiny8::blit_palette const palette = tiny8::make_palette(0xff000000, 0xffffffff);
+	size_t const width = display.width();
+	size_t const height = display.height();
+
+	constexpr uint32_t c_scale = 10;
+	vector<uint32_t> pixels(tiny8::c_hiresDisplaySize * c_scale * c_scale);
+	vector<uint8_t> bytes(tiny8::c_hiresDisplaySize);
+	display.unpack(bytes.data());
+
+	auto const time = [&](char const* label, auto&& body)
+	{
+		constexpr int c_iterations = 2000;
+		auto const start = chrono::steady_clock::now();
+		for (int i = 0; i < c_iterations; ++i)
+			body();
+		auto const end = chrono::steady_clock::now();
+		printf("  %-10s %-18s %10.2f us/frame (%zux%zu)\n", "blit", label, chrono::duration<double, micro>(end - start).count() / c_iterations, width, height);
+	};
+
+	time("per pixel", [&]()
+	{
+		for (size_t y = 0; y < height; ++y)
+		{
+			for (size_t x = 0; x < width; ++x)
+				pixels[y * width + x] = palette.m_colors[display.pixel(x, y)];
+		}
+	});
+	time("packed", [&]() { tiny8::blit(display, pixels.data(), width * sizeof(uint32_t), palette); });
+	time("packed x10", [&]() { tiny8::blit(display, pixels.data(), width * c_scale * sizeof(uint32_t), palette, c_scale); });
+	time("bytes", [&]() { tiny8::blit(bytes.data(), width, height, pixels.data(), width * sizeof(uint32_t), palette); });
+}
+
+// Run instances of the rom with different seeds and keep their screens in one tiny8::blit_atlas, timing the dirty row updates
+// against redrawing every tile each frame, and check the atlas ends up matching a full redraw.
+void print_atlas(rom_image const& rom, bench_settings const& settings)
+{
+	using interpreter_type = tiny8::basic_interpreter<tiny8::chip8_xochip>;
+	vector<unique_ptr<interpreter_type>> instances;
+	for (size_t i = 0; i < settings.m_atlas; ++i)
+	{
+		instances.push_back(make_unique<interpreter_type>());
+		install_rom(*instances.back(), rom);
+		instances.back()->set_seed(i);
+	}
+
+	tiny8::blit_palette const palette = tiny8::make_palette(0xff000000, 0xffffffff);
+	tiny8::blit_atlas atlas(instances.size(), palette);
+	vector<uint32_t> full(atlas.width() * atlas.height());
+
+	constexpr int c_frames = 600;
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	chrono::steady_clock::duration dirty_time{}, full_time{};
+	uint64_t span_rows = 0;
+	for (int frame = 0; frame < c_frames; ++frame)
+	{
+		for (auto& instance : instances)
+			instance->run_frame(keys, settings.m_cyclesPerFrame);
+
+		auto const start = chrono::steady_clock::now();
+		for (size_t i = 0; i < instances.size(); ++i)
+			atlas.update(i, *instances[i]->get_display());
+		span_rows += atlas.take_dirty_span().m_count;
+		auto const middle = chrono::steady_clock::now();
+
+		for (size_t i = 0; i < instances.size(); ++i)
+		{
+			tiny8::display const& display = *instances[i]->get_display();
+			uint32_t const scale = static_cast<uint32_t>(tiny8::blit_atlas::c_tileWidth / display.width());
+			tiny8::blit(display, full.data() + atlas.tile_y(i) * atlas.width() + atlas.tile_x(i), atlas.pitch(), palette, scale);
+		}
+		full_time += chrono::steady_clock::now() - middle;
+		dirty_time += middle - start;
+	}
+
+	// Only the tiles are compared, the cells of the last grid row past the last instance are never drawn.
+	bool same = true;
+	for (size_t i = 0; i < instances.size(); ++i)
+	{
+		for (size_t y = 0; y < tiny8::blit_atlas::c_tileHeight; ++y)
+		{
+			size_t const offset = (atlas.tile_y(i) + y) * atlas.width() + atlas.tile_x(i);
+			same &= memcmp(atlas.pixels() + offset, full.data() + offset, tiny8::blit_atlas::c_tileWidth * sizeof(uint32_t)) == 0;
+		}
+	}
+
+	printf("  %-10s %zu tiles in %zux%zu: dirty rows %8.2f us/frame, every tile %8.2f us/frame, %.1f of %zu rows uploaded per frame, %s\n", "atlas",
+		instances.size(), atlas.width(), atlas.height(), chrono::duration<double, micro>(dirty_time).count() / c_frames,
+		chrono::duration<double, micro>(full_time).count() / c_frames, double(span_rows) / c_frames, atlas.height(), same ? "ok" : "MISMATCH");
+}
+
+// Analyse the rom, round trip the analysis through its saved form and time prewarming a decode cache with it against decoding
+// blocks on first use.
+void print_analysis(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(interpreter, rom);
+
+	tiny8::analysis analysis;
+	auto const start = chrono::steady_clock::now();
+	bool const analyzed = analysis.analyze(interpreter, rom.m_data);
+	auto const analyze_end = chrono::steady_clock::now();
+	if (!analyzed)
+	{
+		printf("  %-10s the rom doesn't fit in memory\n", "analysis");
+		return;
+	}
+
+	size_t code = 0;
+	for (uint32_t i = 0; i < rom.m_data.size(); ++i)
+		code += analysis.is_code(tiny8::c_romStartAddress + i);
+
+	tiny8::analysis loaded;
+	bool const round_trip = loaded.load(analysis.save()) && loaded.matches(interpreter, rom.m_data) && loaded.save() == analysis.save();
+	printf("  %-10s %zu blocks, %zu code bytes, %zu data bytes, analysed in %.1f us, saved as %zu bytes, reloaded %s\n", "analysis",
+		analysis.blocks().size(), code, rom.m_data.size() - code, chrono::duration<double, micro>(analyze_end - start).count(),
+		analysis.save().size(), round_trip ? "ok" : "MISMATCH");
+
+	if (settings.m_disassemble)
+		analysis.print(interpreter, rom.m_data, stdout);
+
+	// The first frames of a cold decode cache against one prewarmed from the analysis.
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	for (bool const prewarm : { false, true })
+	{
+		tiny8::interpreter instance(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(instance, rom);
+		instance.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		instance.set_decode_cache(true);
+
+		auto const prewarm_start = chrono::steady_clock::now();
+		if (prewarm)
+			loaded.prewarm(instance);
+		auto const run_start = chrono::steady_clock::now();
+		for (int frame = 0; frame < 10; ++frame)
+			instance.run_frame(keys);
+		auto const end = chrono::steady_clock::now();
+
+		printf("  %-10s %-10s prewarm %8.2f us, first 10 frames %8.2f us\n", "", prewarm ? "prewarmed" : "cold",
+			chrono::duration<double, micro>(run_start - prewarm_start).count(), chrono::duration<double, micro>(end - run_start).count());
+	}
+}
+
+// Run the rom under a debugger with nothing set, with a breakpoint on a hot address continued from every time, and a step at a
+// time, checking each ends in the same state as a plain run.
+void print_debugger(rom_image const& rom, bench_settings const& settings)
+{
+	uint32_t const cycles = static_cast<uint32_t>(std::min<uint64_t>(settings.m_cycles, 10'000'000));
+	auto const make = [&]()
+	{
+		auto interpreter = make_unique<tiny8::interpreter>(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(*interpreter, rom);
+		interpreter->set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		interpreter->set_decode_cache(true);
+		return interpreter;
+	};
+
+	auto const run = [&](char const* name, uint32_t count, auto&& body)
+	{
+		auto reference = make();
+		reference->run_cycles(count);
+		auto interpreter = make();
+
+		auto const start = chrono::steady_clock::now();
+		uint64_t const stops = body(*interpreter, count);
+		auto const end = chrono::steady_clock::now();
+		double const seconds = chrono::duration<double>(end - start).count();
+		printf("  %-10s %-10s %8.2f MIPS, %10llu stops, %s\n", "debugger", name, count / seconds / 1e6, (unsigned long long)stops,
+			interpreter->state_hash() == reference->state_hash() ? "ok" : "MISMATCH");
+	};
+
+	// The address the program is at a little into the run, likely in its main loop.
+	auto probe = make();
+	probe->run_cycles(1000);
+	uint16_t const hot = probe->get_registers()->m_pc;
+
+	run("plain", cycles, [](tiny8::interpreter& interpreter, uint32_t count)
+	{
+		interpreter.run_cycles(count);
+		return uint64_t(0);
+	});
+	run("unset", cycles, [](tiny8::interpreter& interpreter, uint32_t count)
+	{
+		tiny8::debugger debugger(interpreter);
+		return uint64_t(debugger.run(count).m_reason != tiny8::stop_reason::budget);
+	});
+	run("breakpoint", cycles, [hot](tiny8::interpreter& interpreter, uint32_t count)
+	{
+		tiny8::debugger debugger(interpreter);
+		debugger.set_breakpoint(hot);
+		uint64_t stops = 0;
+		for (uint32_t executed = 0; executed < count; ++stops)
+			executed += debugger.run(count - executed).m_cycles;
+		return stops - 1;
+	});
+	run("step", std::min(cycles, 1'000'000u), [](tiny8::interpreter& interpreter, uint32_t count)
+	{
+		tiny8::debugger debugger(interpreter);
+		for (uint32_t i = 0; i < count; ++i)
+			debugger.step();
+		return uint64_t(count);
+	});
+}
+
+// Encode the display after every frame into a delta stream, decode it on the other end, and report its size and encode time.
+// Space separated names of the legacy flags set.
+string flag_names(tiny8::flags f)
+{
+	static char const* const c_names[] = { "shift", "store_load", "jump_offset", "logical", "disp_sync", "draw" };
+	string names;
+	for (size_t bit = 0; bit < size(c_names); ++bit)
+	{
+		if ((f >> bit) & 1)
+			names += names.empty() ? c_names[bit] : string(" ") + c_names[bit];
+	}
+	return names.empty() ? "-" : names;
+}
+
+// Print the instructions the rom runs without input and the quirks it depends on, and the preset it can run on without them.
+void print_coverage(rom_image const& rom, bench_settings const& settings)
+{
+	auto recorder = make_unique<tiny8::coverage_recorder>();
+	tiny8::quirk_report const report = check_rom_quirks(rom, settings, *recorder);
+
+	tiny8::interpreter names(tiny8::flags::none, tiny8::dispatch_mode::table);
+	printf("  %-10s %zu opcodes:", "coverage", report.m_opcodes);
+	for (auto const& entry : recorder->instructions(names))
+		printf(" %.*s x%u", int(entry.m_name.size()), entry.m_name.data(), entry.m_opcodes);
+	printf("\n");
+
+	static tiny8::flags const c_presets[] = { tiny8::chip8_xochip, tiny8::chip8_schip, tiny8::chip8_original };
+	tiny8::flags const chosen = tiny8::choose_flags(tiny8::flags::none, report.m_free, c_presets);
+	printf("  %-10s reached %s, sensitive %s, %s\n", "quirks", flag_names(report.m_reached).c_str(), flag_names(report.m_sensitive).c_str(),
+		chosen == tiny8::chip8_xochip ? "runs as xochip" : chosen == tiny8::chip8_schip ? "runs as schip" : chosen == tiny8::chip8_original ? "runs as original" : "needs its own flags");
+}
+
+// Run the rom with and without a tiny8::sampling_profiler, collecting after every frame, and write its folded stacks (appended
+// to, so several roms share one file).
+void print_sample_profile(rom_image const& rom, bench_settings const& settings)
+{
+	auto const make = [&]()
+	{
+		auto interpreter = make_unique<tiny8::interpreter>(tiny8::chip8_original, tiny8::dispatch_mode::table);
+		install_rom(*interpreter, rom);
+		interpreter->set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+		interpreter->set_decode_cache(true);
+		return interpreter;
+	};
+
+	uint64_t const frames = std::max<uint64_t>(settings.m_cycles / settings.m_cyclesPerFrame, 1);
+	tiny8::sampling_profiler profiler;
+	auto const run = [&](bool sampled)
+	{
+		auto interpreter = make();
+		if (sampled)
+			profiler.attach(*interpreter);
+
+		auto const start = chrono::steady_clock::now();
+		for (uint64_t frame = 0; frame < frames; ++frame)
+		{
+			interpreter->run_frame();
+			if (sampled)
+				profiler.collect();
+		}
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	};
+
+	double const plain = run(false);
+	double const sampled = run(true);
+	printf("  %-10s %llu samples (%llu dropped), %.2f MIPS against %.2f unsampled, hottest:", "sampler", (unsigned long long)profiler.sample_count(),
+		(unsigned long long)profiler.dropped_count(), frames * settings.m_cyclesPerFrame / sampled / 1e6, frames * settings.m_cyclesPerFrame / plain / 1e6);
+	for (auto const& [pc, samples] : profiler.hottest(5))
+		printf(" %03X (%.1f%%)", pc, 100.0 * samples / profiler.sample_count());
+	printf("\n");
+
+	if (FILE* out = fopen(settings.m_sampleProfile.c_str(), "a"))
+	{
+		profiler.write_folded(out);
+		fclose(out);
+	}
+}
+
+// Run the rom frame by frame like a power saving host: sleep through the frames quiet_frames() reports (running them afterwards to
+// catch up) and check that nothing observable changed across them.
+void print_power_saver(rom_image const& rom, bench_settings const& settings)
+{
+	auto interpreter = make_unique<tiny8::interpreter>(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(*interpreter, rom);
+	interpreter->set_decode_cache(true);
+
+	auto const observable = [&]()
+	{
+		return tiny8::xxhash64(interpreter->get_memory()->m_data, sizeof(interpreter->get_memory()->m_data), interpreter->display_hash());
+	};
+
+	uint64_t const frames = std::max<uint64_t>(settings.m_cycles / settings.m_cyclesPerFrame, 1);
+	uint64_t quiet = 0, wakeups = 0, longest = 0, presents = 0;
+	uint32_t version = interpreter->get_display()->m_version;
+	bool ok = true;
+	auto const start = chrono::steady_clock::now();
+	for (uint64_t frame = 0; frame < frames; )
+	{
+		uint64_t const sleep = std::min<uint64_t>(interpreter->quiet_frames(), frames - frame);
+		if (sleep > 0)
+		{
+			uint64_t const before = observable();
+			for (uint64_t i = 0; i < sleep; ++i)
+				interpreter->run_frame(settings.m_cyclesPerFrame);
+			ok &= observable() == before;
+
+			quiet += sleep;
+			longest = std::max(longest, sleep);
+			frame += sleep;
+		}
+		else
+		{
+			interpreter->run_frame(settings.m_cyclesPerFrame);
+			++frame;
+		}
+
+		++wakeups;
+		presents += interpreter->get_display()->m_version != version;
+		version = interpreter->get_display()->m_version;
+	}
+	auto const end = chrono::steady_clock::now();
+
+	printf("  power saver: %llu of %llu frames quiet (%.1f%%), %llu wake-ups, longest sleep %llu frames, %llu presents, %.2f ms, %s\n",
+		(unsigned long long)quiet, (unsigned long long)frames, 100.0 * quiet / frames, (unsigned long long)wakeups, (unsigned long long)longest,
+		(unsigned long long)presents, chrono::duration<double, milli>(end - start).count(), ok ? "ok" : "CHANGED WHILE QUIET");
+}
+
+// Bytes per instance of full and footprint::compact interpreters: the object plus what constructing it, loading the rom and
+// running a frame allocates, over count instances (so structures shared between them count once). Compact instances share the
+// rom; both kinds are checked to end up in the same state.
+void print_footprint(rom_image const& rom, bench_settings const& settings)
+{
+	uint64_t reference = 0;
+	auto const measure = [&]<class Interpreter>(char const* label, std::type_identity<Interpreter>)
+	{
+		vector<unique_ptr<Interpreter>> instances(settings.m_footprint);
+		g_allocatedBytes = 0;
+		g_countAllocations = true;
+		for (auto& instance : instances)
+		{
+			instance = make_unique<Interpreter>(Interpreter::chip8_original);
+			install_rom(*instance, rom);
+			instance->run_frame(settings.m_cyclesPerFrame);
+		}
+		g_countAllocations = false;
+
+		Interpreter& last = *instances.back();
+		last.reset();
+		apply_pokes(last, rom);
+		for (int frame = 0; frame < 60; ++frame)
+			last.run_frame(settings.m_cyclesPerFrame);
+		uint64_t const hash = last.state_hash();
+		bool const ok = reference == 0 || hash == reference;
+		reference = hash;
+
+		printf("  footprint: %-8s %zu instances, %zu bytes/instance (%zu object, %.1f heap), %s\n", label, instances.size(),
+			static_cast<size_t>(g_allocatedBytes / instances.size()), sizeof(Interpreter), static_cast<double>(g_allocatedBytes) / instances.size() - sizeof(Interpreter),
+			ok ? "ok" : "MISMATCH");
+	};
+
+	measure("full", std::type_identity<tiny8::interpreter>());
+	measure("compact", std::type_identity<tiny8::compact_interpreter>());
+}
+
+// Run a rom frame by frame like a frontend, timing emulation, conversion to pixels and audio rendering of every frame.
+void print_timing(rom_image const& rom, bench_settings const& settings)
+{
+#if defined(TINY8_TIMING)
+	tiny8::basic_interpreter<tiny8::chip8_xochip> interpreter;
+	install_rom(interpreter, rom);
+
+	tiny8::frame_timings timings;
+	tiny8::audio_stream audio;
+	vector<int16_t> samples(audio.sample_rate() / 60 + 1);
+	vector<uint32_t> pixels(tiny8::c_hiresDisplaySize);
+	tiny8::blit_palette const palette = tiny8::make_palette(0xff000000, 0xffffffff);
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame);
+	for (uint64_t i = 0; i < frames; ++i)
+	{
+		{
+			tiny8::scoped_timer const timer(timings, tiny8::timing_phase::emulation);
+			interpreter.run_frame(settings.m_cyclesPerFrame);
+		}
+		{
+			tiny8::scoped_timer const timer(timings, tiny8::timing_phase::conversion);
+			tiny8::display& display = *interpreter.get_display();
+			tiny8::blit(display, pixels.data(), display.width() * sizeof(uint32_t), palette);
+			display.take_dirty_rows();
+		}
+		{
+			tiny8::scoped_timer const timer(timings, tiny8::timing_phase::audio);
+			audio.render_frame(interpreter);
+		}
+		audio.read(samples.data(), std::min(audio.queued(), samples.size()));
+	}
+
+	printf("  timing: %llu frames\n", (unsigned long long)frames);
+	timings.dump(stdout);
+#else
+	(void)rom;
+	(void)settings;
+	printf("  timing: not compiled in, configure with -DTINY8_TIMING=ON\n");
+#endif
+}
+
+// Fast-forward through a tiny8::turbo, checking every presented frame is the display the interpreter ended up with and the
+// machine matches one run frame by frame.
+void print_turbo(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::basic_interpreter<tiny8::chip8_original> interpreter, reference;
+	install_rom(interpreter, rom);
+	install_rom(reference, rom);
+
+	tiny8::turbo turbo(settings.m_turbo);
+	tiny8::frame_mailbox mailbox;
+	uint64_t const presents = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame / turbo.speed());
+	uint64_t published = 0;
+	bool ok = true;
+	auto const start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < presents; ++i)
+	{
+		if (turbo.run(interpreter, mailbox, settings.m_cyclesPerFrame) && mailbox.acquire())
+		{
+			ok &= memcmp(mailbox.front().m_planes, interpreter.get_display()->m_planes, sizeof(mailbox.front().m_planes)) == 0;
+			++published;
+		}
+	}
+	auto const end = chrono::steady_clock::now();
+
+	for (uint64_t frame = 0; frame < presents * turbo.speed(); ++frame)
+		reference.run_frame(settings.m_cyclesPerFrame);
+	ok &= interpreter.state_hash() == reference.state_hash();
+
+	double const ms = chrono::duration<double, milli>(end - start).count();
+	printf("  turbo: %ux, %llu presents (%llu published), %llu frames in %.2f ms, %.0f frames/s, %s\n", turbo.speed(),
+		(unsigned long long)presents, (unsigned long long)published, (unsigned long long)(presents * turbo.speed()), ms,
+		presents * turbo.speed() * 1000.0 / std::max(ms, 1e-3), ok ? "ok" : "MISMATCH");
+}
+
+void print_stream(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::basic_interpreter<tiny8::chip8_original> interpreter;
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+	tiny8::frame_encoder encoder;
+	tiny8::frame_decoder decoder;
+	uint8_t message[tiny8::c_maxStreamMessageSize];
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	uint64_t const frames = std::max<uint64_t>(1, settings.m_cycles / settings.m_cyclesPerFrame);
+
+	uint64_t bytes = 0, messages = 0;
+	bool decoded = true;
+	double seconds = 0.0;
+	for (uint64_t i = 0; i < frames; ++i)
+	{
+		interpreter.run_frame(keys);
+
+		auto const start = chrono::steady_clock::now();
+		size_t const size = encoder.encode(interpreter, message);
+		seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (size > 0)
+		{
+			decoded &= decoder.decode(std::span<uint8_t const>(message, size));
+			bytes += size;
+			messages++;
+		}
+	}
+
+	tiny8::display const& sent = *interpreter.get_display();
+	bool const matches = decoded && memcmp(sent.m_planes, decoder.get_display().m_planes, sizeof(sent.m_planes)) == 0;
+	printf("  %-10s %llu messages over %llu frames, %.1f bytes/frame, %.1f kbit/s at 60 fps, %.0f ns/frame, decoded %s\n", "stream",
+		(unsigned long long)messages, (unsigned long long)frames, double(bytes) / frames, bytes * 8.0 * 60.0 / frames / 1000.0, seconds * 1e9 / frames,
+		matches ? "ok" : "MISMATCH");
+}
+
+// Run a rom on an interpreter that is already set up and count the heap allocations made while it runs.
+template<class Interpreter>
+bool check_allocations(char const* mode, char const* dispatch, Interpreter& interpreter, rom_image const& rom, bench_settings const& settings)
+{
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+	uint8_t keys[tiny8::c_maxKeys] = { 0 };
+	uint64_t const frames = settings.m_cycles / settings.m_cyclesPerFrame;
+
+	g_allocations = 0;
+	g_countAllocations = true;
+	for (uint64_t i = 0; i < frames; ++i)
+	{
+		// Press and release a key now and then so input waits complete too.
+		keys[(i / 60) % tiny8::c_maxKeys] = (i % 60) < 30;
+		interpreter.run_frame(keys);
+		interpreter.advance(keys);
+		memset(keys, 0, sizeof(keys));
+	}
+	g_countAllocations = false;
+
+	uint64_t const allocations = g_allocations;
+	printf("  %-10s %-10s %12llu allocations\n", mode, dispatch, (unsigned long long)allocations);
+	return allocations == 0;
+}
+
+template<tiny8::flags F>
+bool check_mode(char const* mode, rom_image const& rom, bench_settings const& settings)
+{
+	bool ok = true;
+	{
+		tiny8::interpreter interpreter(F, tiny8::dispatch_mode::families);
+		ok &= check_allocations(mode, "families", interpreter, rom, settings);
+	}
+	{
+		tiny8::interpreter interpreter(F, tiny8::dispatch_mode::table);
+		ok &= check_allocations(mode, "table", interpreter, rom, settings);
+	}
+	{
+		tiny8::basic_interpreter<F> interpreter;
+		ok &= check_allocations(mode, "static", interpreter, rom, settings);
+	}
+	{
+		tiny8::basic_interpreter<F> interpreter;
+		interpreter.set_threaded_dispatch(true);
+		ok &= check_allocations(mode, "threaded", interpreter, rom, settings);
+	}
+	{
+		tiny8::basic_interpreter<F> interpreter;
+		interpreter.set_decode_cache(true);
+		ok &= check_allocations(mode, "cached", interpreter, rom, settings);
+	}
+	if (tiny8::c_jitSupported)
+	{
+		tiny8::block_jit jit;
+		tiny8::basic_interpreter<F> interpreter;
+		jit.attach(interpreter);
+		ok &= check_allocations(mode, "jit", interpreter, rom, settings);
+	}
+	return ok;
+}
+
+// Count executed instructions per opcode family (first nibble), stepping one instruction at a time outside of the timed runs.
+void print_family_counts(rom_image const& rom, bench_settings const& settings)
+{
+	tiny8::interpreter interpreter(tiny8::chip8_original, tiny8::dispatch_mode::table);
+	install_rom(interpreter, rom);
+	interpreter.set_timer_mode(tiny8::timer_mode::emulated, settings.m_cyclesPerFrame);
+
+	uint8_t const keys[tiny8::c_maxKeys] = { 0 };
+	uint64_t counts[16] = { 0 };
+	uint8_t pending_family = 0;
+	for (uint64_t i = 0; i < settings.m_cycles; ++i)
+	{
+		// While waiting for input the pending Fx0A executes again instead of the instruction at pc.
+		if (!interpreter.is_waiting_for_input())
+			pending_family = interpreter.get_memory()->m_data[interpreter.get_registers()->m_pc] >> 4;
+		counts[pending_family]++;
+
+		interpreter.run_cycles(1, keys);
+	}
+
+	printf("  opcode families:");
+	for (size_t family = 0; family < 16; ++family)
+	{
+		if (counts[family] > 0)
+			printf(" %Xxxx=%.1f%%", (unsigned)family, 100.0 * counts[family] / settings.m_cycles);
+	}
+	printf("\n");
+}
+
+void print_usage()
+{
+	printf("usage: tiny8_bench [--cycles N] [--cycles-per-frame N] [--instances N [--threads N]] [--migrate N] [--priority N] [--metrics] [--lanes N] [--env N] [--shared-cache N] [--tiers N] [--input-port N] [--monitor N] [--forks N] [--explore N] [--pool N] [--resets N] [--coroutines N] [--save-states N] [--checkpoints N] [--capture N] [--machine-frames N] [--determinism N] [--profile] [--blit] [--sprite-cache] [--atlas N] [--stream] [--analyze] [--disassemble] [--debug] [--coverage] [--sample-profile FILE] [--power-saver] [--turbo N] [--timing] [--footprint N] [--poke ADDRESS=VALUE ...] [--check-allocations] [--write-pack FILE] [--translate FILE] [--gdb PORT] [--record-movie FILE | --replay-movie FILE] [--conformance] [--diff BLOCK] [--micro] [--perf] [rom.ch8 | roms.t8pk ...]\n");
+	printf("Without roms, every .ch8 file in the roms directory is benchmarked.\n");
+}
+
+// Parse a whole argument as a number in [low, high], false if it isn't one or is out of range.
+template<class T>
+bool parse_number(char const* text, T& value, T low = 0, T high = numeric_limits<T>::max())
+{
+	char const* const end = text + strlen(text);
+	T parsed = 0;
+	auto const [ptr, error] = from_chars(text, end, parsed);
+	if (error != errc() || ptr != end || parsed < low || parsed > high)
+		return false;
+	value = parsed;
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	bench_settings settings;
+	for (int i = 1; i < argc; ++i)
+	{
+		string const arg = argv[i];
+		bool valid = true;
+		if (arg == "--cycles" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_cycles);
+		else if (arg == "--cycles-per-frame" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_cyclesPerFrame, 1u);
+		else if (arg == "--instances" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_instances);
+		else if (arg == "--threads" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_threads);
+		else if (arg == "--lanes" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_lanes);
+		else if (arg == "--env" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_env, size_t(1));
+		else if (arg == "--forks" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_forks);
+		else if (arg == "--explore" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_explore, size_t(2));
+		else if (arg == "--pool" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_pool);
+		else if (arg == "--resets" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_resets);
+		else if (arg == "--coroutines" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_coroutines);
+		else if (arg == "--migrate" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_migrate);
+		else if (arg == "--priority" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_priority);
+		else if (arg == "--metrics")
+			settings.m_metrics = true;
+		else if (arg == "--save-states" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_saveStates);
+		else if (arg == "--checkpoints" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_checkpoints);
+		else if (arg == "--capture" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_capture);
+		else if (arg == "--machine-frames" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_machineFrames);
+		else if (arg == "--determinism" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_determinism, size_t(1));
+		else if (arg == "--profile")
+			settings.m_profile = true;
+		else if (arg == "--blit")
+			settings.m_blit = true;
+		else if (arg == "--perf")
+			settings.m_perf = true;
+		else if (arg == "--micro")
+			settings.m_micro = true;
+		else if (arg == "--sprite-cache")
+			settings.m_spriteCache = true;
+		else if (arg == "--atlas" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_atlas);
+		else if (arg == "--stream")
+			settings.m_stream = true;
+		else if (arg == "--debug")
+			settings.m_debug = true;
+		else if (arg == "--coverage")
+			settings.m_coverage = true;
+		else if (arg == "--sample-profile" && i + 1 < argc)
+			settings.m_sampleProfile = argv[++i];
+		else if (arg == "--power-saver")
+			settings.m_powerSaver = true;
+		else if (arg == "--shared-cache" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_sharedCache, size_t(1));
+		else if (arg == "--monitor" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_monitors, size_t(1));
+		else if (arg == "--input-port" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_inputTaps, size_t(1));
+		else if (arg == "--tiers" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_tiers, uint16_t(1));
+		else if (arg == "--footprint" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_footprint, size_t(1));
+		else if (arg == "--timing")
+			settings.m_timing = true;
+		else if (arg == "--turbo" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_turbo);
+		else if (arg == "--analyze")
+			settings.m_analyze = true;
+		else if (arg == "--disassemble")
+			settings.m_analyze = settings.m_disassemble = true;
+		else if (arg == "--check-allocations")
+			settings.m_checkAllocations = true;
+		else if (arg == "--write-pack" && i + 1 < argc)
+			settings.m_writePack = argv[++i];
+		else if (arg == "--translate" && i + 1 < argc)
+			settings.m_translate = argv[++i];
+		else if (arg == "--gdb" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_gdbPort, uint16_t(1));
+		else if (arg == "--record-movie" && i + 1 < argc)
+			settings.m_recordMovie = argv[++i];
+		else if (arg == "--replay-movie" && i + 1 < argc)
+			settings.m_replayMovie = argv[++i];
+		else if (arg == "--diff" && i + 1 < argc)
+			valid = parse_number(argv[++i], settings.m_diffBlock, 1u);
+		else if (arg == "--conformance")
+			settings.m_conformance = true;
+		else if (arg == "--poke" && i + 1 < argc)
+		{
+			unsigned address = 0, value = 0;
+			if (sscanf(argv[++i], "%x=%x", &address, &value) != 2)
+			{
+				printf("--poke expects ADDRESS=VALUE in hex, e.g. 1ff=3\n");
+				return 1;
+			}
+			settings.m_pokes.push_back({ static_cast<uint16_t>(address), static_cast<uint8_t>(value) });
+		}
+		else if (arg == "--help")
+		{
+			print_usage();
+			return 0;
+		}
+		else
+			settings.m_roms.push_back(arg);
+
+		if (!valid)
+		{
+			printf("Invalid value for %s.\n", arg.c_str());
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (settings.m_roms.empty() && !settings.m_micro)
+	{
+		error_code ec;
+		for (auto const& entry : filesystem::directory_iterator("roms", ec))
+		{
+			if (entry.path().extension() == ".ch8")
+				settings.m_roms.push_back(entry.path().string());
+		}
+		sort(settings.m_roms.begin(), settings.m_roms.end());
+	}
+
+	if ((settings.m_roms.empty() && !settings.m_micro) || settings.m_cyclesPerFrame == 0)
+	{
+		printf("No roms to run (looked in ./roms).\n");
+		return 1;
+	}
+
+	vector<rom_image> roms;
+	for (auto const& path : settings.m_roms)
+	{
+		rom_image rom;
+		if (filesystem::path(path).extension() == ".t8pk")
+		{
+			if (!load_pack(path, roms))
+				printf("Skipping %s: not a valid rom pack.\n", path.c_str());
+		}
+		else if (load_rom(path, rom))
+			roms.push_back(move(rom));
+		else
+			printf("Skipping %s: can't be read or doesn't fit in memory.\n", path.c_str());
+	}
+	if (settings.m_micro)
+	{
+		for (rom_image& rom : micro_roms())
+			roms.push_back(move(rom));
+	}
+
+	if (settings.m_perf && !bench_counters().any_available())
+		printf("--perf: no hardware counters here (needs Linux perf_event with a PMU and perf_event_paranoid <= 2), timing only.\n");
+
+	if (!settings.m_writePack.empty())
+		return write_pack(settings.m_writePack, roms, settings) ? 0 : 1;
+
+	if (!settings.m_translate.empty())
+		return !roms.empty() && translate_rom(settings.m_translate, roms.front(), settings) ? 0 : 1;
+	if (settings.m_gdbPort != 0)
+		return !roms.empty() && serve_gdb(settings.m_gdbPort, roms.front(), settings) ? 0 : 1;
+
+	if (!settings.m_recordMovie.empty())
+		return !roms.empty() && record_movie(settings.m_recordMovie, roms.front(), settings) ? 0 : 1;
+
+	if (!settings.m_replayMovie.empty())
+		return replay_movie(settings.m_replayMovie, roms) ? 0 : 1;
+
+	if (settings.m_conformance)
+		return check_conformance(roms) ? 0 : 1;
+
+	bool ok = true;
+	for (auto& rom : roms)
+	{
+		rom.m_pokes = settings.m_pokes;
+		if (rom.m_pokes.empty())
+		{
+			for (auto const& preset : c_presets)
+			{
+				if (rom.m_name == preset.m_name)
+					rom.m_pokes.push_back(preset.m_poke);
+			}
+		}
+
+		printf("%s (%zu bytes)\n", rom.m_name.c_str(), rom.m_data.size());
+		if (settings.m_diffBlock > 0)
+		{
+			ok &= diff_mode<tiny8::chip8_original>("original", rom, settings);
+			ok &= diff_mode<tiny8::chip8_schip>("schip", rom, settings);
+			ok &= diff_mode<tiny8::chip8_xochip>("xochip", rom, settings);
+			continue;
+		}
+
+		if (settings.m_checkAllocations)
+		{
+			ok &= check_mode<tiny8::chip8_original>("original", rom, settings);
+			ok &= check_mode<tiny8::chip8_schip>("schip", rom, settings);
+			ok &= check_mode<tiny8::chip8_xochip>("xochip", rom, settings);
+			continue;
+		}
+
+		bench_mode<tiny8::chip8_original>("original", rom, settings);
+		bench_mode<tiny8::chip8_schip>("schip", rom, settings);
+		bench_mode<tiny8::chip8_xochip>("xochip", rom, settings);
+		if (settings.m_instances > 0)
+			print_batch(rom, settings);
+		if (settings.m_migrate > 0)
+			print_migrate(rom, settings);
+		if (settings.m_priority > 0)
+			print_priority(rom, settings);
+		if (settings.m_metrics)
+			print_metrics(rom, settings);
+		if (settings.m_env > 0)
+			print_env(rom, settings);
+		if (settings.m_lanes > 0)
+			print_lockstep(rom, settings);
+		if (settings.m_forks > 0)
+			print_forks(rom, settings);
+		if (settings.m_explore > 0)
+			print_explore(rom, settings);
+		if (settings.m_pool > 0)
+			print_pool(rom, settings);
+		if (settings.m_resets > 0)
+			print_resets(rom, settings);
+		if (settings.m_coroutines > 0)
+			print_coroutines(rom, settings);
+		if (settings.m_saveStates > 0)
+			print_save_states(rom, settings);
+		if (settings.m_checkpoints > 0)
+			print_checkpoints(rom, settings);
+		if (settings.m_capture > 0)
+			print_capture(rom, settings);
+		if (settings.m_machineFrames > 0)
+			print_machine_frames(rom, settings);
+		if (settings.m_determinism > 0)
+			print_determinism(rom, settings);
+		if (settings.m_profile)
+			print_profile(rom, settings);
+		if (settings.m_blit)
+			print_blit(rom, settings);
+		if (settings.m_atlas > 0)
+			print_atlas(rom, settings);
+		if (settings.m_stream)
+			print_stream(rom, settings);
+		if (settings.m_analyze)
+			print_analysis(rom, settings);
+		if (settings.m_debug)
+			print_debugger(rom, settings);
+		if (settings.m_coverage)
+			print_coverage(rom, settings);
+		if (!settings.m_sampleProfile.empty())
+			print_sample_profile(rom, settings);
+		if (settings.m_powerSaver)
+			print_power_saver(rom, settings);
+		if (settings.m_turbo > 0)
+			print_turbo(rom, settings);
+		if (settings.m_timing)
+			print_timing(rom, settings);
+		if (settings.m_footprint > 0)
+			print_footprint(rom, settings);
+		if (settings.m_sharedCache > 0)
+			print_shared_cache(rom, settings);
+		if (settings.m_tiers > 0)
+			print_tiers(rom, settings);
+		if (settings.m_spriteCache)
+			print_sprite_cache(rom, settings);
+		if (settings.m_inputTaps > 0)
+			print_input_port(rom, settings);
+		if (settings.m_monitors > 0)
+			print_monitor(rom, settings);
+		print_family_counts(rom, settings);
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,380 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <tiny8.h>
+#include <tiny8_farm.h>
+#include <tiny8_net.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define popen _popen
+#define pclose _pclose
+#endif
+
+using namespace std;
+
+// Regression farm driver: shards a pass over a rom pack and a replay set across worker processes, on this machine (--workers)
+// or on others connecting to it (--listen, --remote), and aggregates their results. Workers are this same program run with
+// --connect; the coordinator sends each one the pack, the movies and its shard over the socket, so they need no files.
+
+// Command line settings.
+struct farm_settings
+{
+	string				m_pack;
+	vector<string>		m_movies;
+	uint32_t			m_frames = 600;			// Frames each rom runs without input.
+	size_t				m_workers = 0;			// Local worker processes; with no workers at all the pass runs in process.
+	size_t				m_remote = 0;			// Workers expected to connect from other machines.
+	uint16_t			m_port = 0;				// Where remote workers connect.
+	uint32_t			m_connectTimeout = 60;	// Seconds for every worker to connect before the pass fails.
+	size_t				m_threads = 0;			// Batch workers per process, 0 to share the hardware threads between local workers.
+	string				m_connect;				// Host of a coordinator, to run as a worker...
+	uint16_t			m_connectPort = 0;		// ...and its port.
+	string				m_output;				// Write every unit's result to this file.
+};
+
+// Sent by the coordinator to each worker, followed by the pack and then every movie as its size (uint32_t) and bytes. The worker
+// answers with its result count (uint32_t) and results.
+struct job_header
+{
+	char		m_magic[4];
+	uint32_t	m_version;
+	uint32_t	m_shard;
+	uint32_t	m_shardCount;
+	uint32_t	m_frames;
+	uint32_t	m_movieCount;
+	uint64_t	m_packSize;
+};
+static_assert(sizeof(job_header) == 32, "the job layout must not depend on the compiler");
+
+constexpr char		c_jobMagic[4] = { 'T', '8', 'F', 'J' };
+constexpr uint32_t	c_jobVersion = 1;
+constexpr uint64_t	c_maxPackSize = 1ull << 30;		// Sizes a worker accepts before allocating for them, as they come from the network.
+constexpr uint32_t	c_maxMovieSize = 1u << 28;
+constexpr size_t	c_maxWorkers = 1024;			// Bound on --workers, --remote and --threads.
+
+char const* const	c_statusNames[] = { "ok", "rom_mismatch", "flags_mismatch", "not_fresh", "diverged" };
+
+vector<uint8_t> read_file(string const& path)
+{
+	ifstream file(path, fstream::in | fstream::binary);
+	return vector<uint8_t>((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+}
+
+// Parse a whole argument as a number in [low, high], false if it isn't one or is out of range.
+template<class T>
+bool parse_number(char const* text, T& value, T low = 0, T high = numeric_limits<T>::max())
+{
+	char const* const end = text + strlen(text);
+	T parsed = 0;
+	auto const [ptr, error] = from_chars(text, end, parsed);
+	if (error != errc() || ptr != end || parsed < low || parsed > high)
+		return false;
+	value = parsed;
+	return true;
+}
+
+// Split host:port, false without a host or a valid port.
+bool parse_endpoint(string const& text, string& host, uint16_t& port)
+{
+	size_t const colon = text.rfind(':');
+	if (colon == string::npos || colon == 0)
+		return false;
+	host = text.substr(0, colon);
+	return parse_number<uint16_t>(text.c_str() + colon + 1, port, 1);
+}
+
+size_t threads_per_process(farm_settings const& settings, size_t processes)
+{
+	if (settings.m_threads != 0)
+		return settings.m_threads;
+	return max<size_t>(1, thread::hardware_concurrency() / max<size_t>(1, processes));
+}
+
+// Receive a job, run its shard and send the results back.
+int run_worker(farm_settings const& settings)
+{
+	tiny8::net::startup startup;
+	tiny8::net::socket_handle const s = tiny8::net::connect_tcp(settings.m_connect.c_str(), settings.m_connectPort);
+	if (s == tiny8::net::c_invalidSocket)
+	{
+		printf("Can't connect to %s:%u\n", settings.m_connect.c_str(), unsigned(settings.m_connectPort));
+		return 1;
+	}
+
+	job_header header;
+	vector<uint8_t> pack_bytes;
+	vector<tiny8::movie> movies;
+	tiny8::rom_pack pack;
+	bool ok = tiny8::net::receive_all(s, &header, sizeof(header)) && memcmp(header.m_magic, c_jobMagic, sizeof(c_jobMagic)) == 0
+		&& header.m_version == c_jobVersion && header.m_shard < header.m_shardCount && header.m_packSize <= c_maxPackSize;
+	if (ok)
+	{
+		pack_bytes.resize(header.m_packSize);
+		ok = tiny8::net::receive_all(s, pack_bytes.data(), pack_bytes.size()) && pack.open(pack_bytes);
+	}
+	for (uint32_t i = 0; ok && i < header.m_movieCount; ++i)
+	{
+		uint32_t size = 0;
+		ok = tiny8::net::receive_all(s, &size, sizeof(size)) && size <= c_maxMovieSize;
+		vector<uint8_t> bytes(ok ? size : 0);
+		ok = ok && tiny8::net::receive_all(s, bytes.data(), bytes.size()) && movies.emplace_back().load(bytes);
+	}
+
+	if (ok)
+	{
+		vector<tiny8::farm_result> const results = tiny8::run_farm_shard(pack, movies, header.m_frames, header.m_shard, header.m_shardCount, settings.m_threads);
+		uint32_t const count = static_cast<uint32_t>(results.size());
+		ok = tiny8::net::send_all(s, &count, sizeof(count)) && tiny8::net::send_all(s, results.data(), results.size() * sizeof(tiny8::farm_result));
+	}
+
+	tiny8::net::close_socket(s);
+	return ok ? 0 : 1;
+}
+
+bool send_job(tiny8::net::socket_handle s, uint32_t shard, uint32_t shard_count, farm_settings const& settings, vector<uint8_t> const& pack_bytes,
+	vector<vector<uint8_t>> const& movie_bytes)
+{
+	job_header header = {};
+	memcpy(header.m_magic, c_jobMagic, sizeof(c_jobMagic));
+	header.m_version = c_jobVersion;
+	header.m_shard = shard;
+	header.m_shardCount = shard_count;
+	header.m_frames = settings.m_frames;
+	header.m_movieCount = static_cast<uint32_t>(movie_bytes.size());
+	header.m_packSize = pack_bytes.size();
+
+	bool ok = tiny8::net::send_all(s, &header, sizeof(header)) && tiny8::net::send_all(s, pack_bytes.data(), pack_bytes.size());
+	for (vector<uint8_t> const& bytes : movie_bytes)
+	{
+		uint32_t const size = static_cast<uint32_t>(bytes.size());
+		ok = ok && tiny8::net::send_all(s, &size, sizeof(size)) && tiny8::net::send_all(s, bytes.data(), bytes.size());
+	}
+	return ok;
+}
+
+// Receive a shard's results. Everything comes from the network and is used as an index, so each result must be for a unit of
+// this shard (i, i + n, i + 2n...), once, with that unit's movie and a known status.
+bool receive_results(tiny8::net::socket_handle s, size_t shard, size_t shards, vector<tiny8::farm_unit> const& units, vector<tiny8::farm_result>& results)
+{
+	uint32_t count = 0;
+	if (!tiny8::net::receive_all(s, &count, sizeof(count)) || count > (units.size() + shards - 1 - shard) / shards)
+		return false;
+
+	size_t const first = results.size();
+	results.resize(first + count);
+	if (!tiny8::net::receive_all(s, &results[first], count * sizeof(tiny8::farm_result)))
+		return false;
+
+	vector<bool> seen(units.size());
+	for (size_t i = first; i < results.size(); ++i)
+	{
+		tiny8::farm_result const& r = results[i];
+		if (r.m_unit >= units.size() || r.m_unit % shards != shard || seen[r.m_unit] || r.m_movie != units[r.m_unit].m_movie
+			|| r.m_status > static_cast<uint8_t>(tiny8::replay_status::diverged))
+			return false;
+		seen[r.m_unit] = true;
+	}
+	return true;
+}
+
+// Run the pass in process, or hand its shards to the workers and collect their results.
+bool run_shards(farm_settings const& settings, string const& self, tiny8::rom_pack const& pack, vector<uint8_t> const& pack_bytes,
+	vector<tiny8::movie> const& movies, vector<vector<uint8_t>> const& movie_bytes, vector<tiny8::farm_unit> const& units, vector<tiny8::farm_result>& results)
+{
+	size_t const shards = settings.m_workers + settings.m_remote;
+	if (shards == 0)
+	{
+		results = tiny8::run_farm_shard(pack, movies, settings.m_frames, 0, 1, threads_per_process(settings, 1));
+		return true;
+	}
+
+	tiny8::net::startup startup;
+	tiny8::net::socket_handle const listener = tiny8::net::listen_tcp(settings.m_remote > 0 ? settings.m_port : 0, settings.m_remote == 0);
+	if (listener == tiny8::net::c_invalidSocket)
+	{
+		printf("Can't listen on port %u\n", unsigned(settings.m_port));
+		return false;
+	}
+
+	if (settings.m_remote > 0)
+		printf("Waiting for %zu remote workers: tiny8_farm --connect <this host>:%u\n", settings.m_remote, unsigned(tiny8::net::local_port(listener)));
+
+	vector<FILE*> processes;
+	string const command = "\"" + self + "\" --connect 127.0.0.1:" + to_string(tiny8::net::local_port(listener)) + " --threads "
+		+ to_string(threads_per_process(settings, settings.m_workers));
+	for (size_t i = 0; i < settings.m_workers; ++i)
+		processes.push_back(popen(command.c_str(), "w"));
+
+	// Shards go out as workers connect, then the results are collected in the same order. A worker that failed to start or
+	// crashed never connects, so waiting is bounded.
+	auto const deadline = chrono::steady_clock::now() + chrono::seconds(settings.m_connectTimeout);
+	vector<tiny8::net::socket_handle> connections;
+	bool ok = true;
+	while (ok && connections.size() < shards)
+	{
+		if (chrono::steady_clock::now() >= deadline)
+		{
+			printf("Only %zu of %zu workers connected within %u s.\n", connections.size(), shards, unsigned(settings.m_connectTimeout));
+			ok = false;
+			break;
+		}
+		if (tiny8::net::poll_socket(listener, 100) <= 0)
+			continue;
+
+		tiny8::net::socket_handle const s = accept(listener, nullptr, nullptr);
+		if (s == tiny8::net::c_invalidSocket)
+			continue;
+
+		ok = send_job(s, static_cast<uint32_t>(connections.size()), static_cast<uint32_t>(shards), settings, pack_bytes, movie_bytes);
+		connections.push_back(s);
+	}
+
+	for (size_t shard = 0; shard < connections.size(); ++shard)
+	{
+		tiny8::net::socket_handle const s = connections[shard];
+		ok = ok && receive_results(s, shard, shards, units, results);
+		tiny8::net::close_socket(s);
+	}
+	tiny8::net::close_socket(listener);
+
+	for (FILE* const process : processes)
+	{
+		if (process == nullptr || pclose(process) != 0)
+			ok = false;
+	}
+
+	ranges::sort(results, [](tiny8::farm_result const& a, tiny8::farm_result const& b) { return a.m_unit < b.m_unit; });
+	return ok;
+}
+
+int run_coordinator(farm_settings const& settings, string const& self)
+{
+	vector<uint8_t> const pack_bytes = read_file(settings.m_pack);
+	tiny8::rom_pack pack;
+	if (pack_bytes.size() > c_maxPackSize || !pack.open(pack_bytes))
+	{
+		printf("%s is not a valid pack.\n", settings.m_pack.c_str());
+		return 1;
+	}
+
+	vector<tiny8::movie> movies(settings.m_movies.size());
+	vector<vector<uint8_t>> movie_bytes;
+	for (size_t i = 0; i < settings.m_movies.size(); ++i)
+	{
+		movie_bytes.push_back(read_file(settings.m_movies[i]));
+		if (movie_bytes.back().size() > c_maxMovieSize || !movies[i].load(movie_bytes.back()))
+		{
+			printf("%s is not a valid movie.\n", settings.m_movies[i].c_str());
+			return 1;
+		}
+	}
+
+	auto const start = chrono::steady_clock::now();
+	vector<tiny8::farm_result> results;
+	vector<tiny8::farm_unit> const units = tiny8::farm_units(pack, movies);
+	if (!run_shards(settings, self, pack, pack_bytes, movies, movie_bytes, units, results) || results.size() != units.size())
+	{
+		printf("A worker failed: %zu of %zu results received.\n", results.size(), units.size());
+		return 1;
+	}
+	double const seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	FILE* const output = settings.m_output.empty() ? nullptr : fopen(settings.m_output.c_str(), "w");
+	for (tiny8::farm_result const& r : results)
+	{
+		string const rom = units[r.m_unit].m_rom < pack.size() ? string(pack.at(units[r.m_unit].m_rom).m_name) : "(missing rom)";
+		string const movie = r.m_movie != tiny8::c_noMovie ? settings.m_movies[r.m_movie] : "-";
+		char line[512];
+		snprintf(line, sizeof(line), "%-24s %-24s %-12s %8u frames %12llu instructions display %016llx state %016llx%s\n", rom.c_str(), movie.c_str(),
+			c_statusNames[r.m_status], r.m_frames, (unsigned long long)r.m_cycles, (unsigned long long)r.m_displayHash, (unsigned long long)r.m_stateHash,
+			r.m_faulted ? " faulted" : "");
+		if (output != nullptr)
+			fputs(line, output);
+		if (tiny8::farm_failed(r))
+			printf("FAILED %s", line);
+	}
+	if (output != nullptr)
+		fclose(output);
+
+	tiny8::farm_summary const summary = tiny8::summarize(results);
+	printf("%llu units (%llu failed) in %zu shards, %.2f s, %.0f MIPS, digest %016llx\n", (unsigned long long)summary.m_units, (unsigned long long)summary.m_failed,
+		max<size_t>(1, settings.m_workers + settings.m_remote), seconds, summary.m_cycles / seconds / 1e6, (unsigned long long)summary.m_digest);
+#if defined(TINY8_PROFILE)
+	printf("profile: %llu draws, %llu clears, %llu key waits, %llu idle instructions skipped\n", (unsigned long long)summary.m_draws,
+		(unsigned long long)summary.m_clears, (unsigned long long)summary.m_waits, (unsigned long long)summary.m_idle);
+#endif
+	return summary.m_failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+	farm_settings settings;
+	for (int i = 1; i < argc; ++i)
+	{
+		string const arg = argv[i];
+		if (arg == "--pack" && i + 1 < argc)
+			settings.m_pack = argv[++i];
+		else if (arg == "--movie" && i + 1 < argc)
+			settings.m_movies.push_back(argv[++i]);
+		else if (arg == "--frames" && i + 1 < argc && parse_number(argv[i + 1], settings.m_frames))
+			++i;
+		else if (arg == "--workers" && i + 1 < argc && parse_number<size_t>(argv[i + 1], settings.m_workers, 0, c_maxWorkers))
+			++i;
+		else if (arg == "--listen" && i + 1 < argc && parse_number(argv[i + 1], settings.m_port))
+			++i;
+		else if (arg == "--remote" && i + 1 < argc && parse_number<size_t>(argv[i + 1], settings.m_remote, 0, c_maxWorkers))
+			++i;
+		else if (arg == "--threads" && i + 1 < argc && parse_number<size_t>(argv[i + 1], settings.m_threads, 0, c_maxWorkers))
+			++i;
+		else if (arg == "--connect" && i + 1 < argc && parse_endpoint(argv[i + 1], settings.m_connect, settings.m_connectPort))
+			++i;
+		else if (arg == "--connect-timeout" && i + 1 < argc && parse_number<uint32_t>(argv[i + 1], settings.m_connectTimeout, 1, 24 * 60 * 60))
+			++i;
+		else if (arg == "--output" && i + 1 < argc)
+			settings.m_output = argv[++i];
+		else
+		{
+			printf("usage: tiny8_farm --pack roms.t8pk [--movie FILE ...] [--frames N] [--workers N] [--listen PORT --remote N] [--connect-timeout SECONDS] [--threads N] [--output FILE]\n");
+			printf("       tiny8_farm --connect HOST:PORT [--threads N]\n");
+			return 1;
+		}
+	}
+
+	if (!settings.m_connect.empty())
+		return run_worker(settings);
+	if (settings.m_pack.empty())
+	{
+		printf("--pack is required.\n");
+		return 1;
+	}
+	return run_coordinator(settings, argv[0]);
+}
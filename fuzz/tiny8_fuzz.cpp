@@ -0,0 +1,250 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <tiny8.h>
+#include <tiny8_pool.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string_view>
+#include <vector>
+
+/*
+* Fuzzing harness for the input sequences a rom is played with, looking for faults (unimplemented opcodes, stack over and
+* underflows) and, optionally, soft-locks.
+*
+* The fuzzer's bytes are read three at a time: a 16-bit key mask (low byte first) held for 1 to 8 frames, up to c_maxFrames.
+* Each input runs on an instance from a pool, restarted in place with reset(), with emulated timers, so a run is a
+* deterministic function of its bytes and takes microseconds. The interpreter counts the edges between decode cache blocks
+* into a c_coverageMapSize map (set_coverage_map()), which is the coverage the fuzzer is fed:
+* - libFuzzer (TINY8_FUZZ_ENGINE=libfuzzer, clang): the map is in the __libfuzzer_extra_counters section it reads by itself.
+* - AFL++ (TINY8_FUZZ_ENGINE=standalone, built with afl-clang-fast): the map is added into AFL's own map after every run, the
+*   inputs come from __AFL_LOOP persistent mode.
+* - Standalone otherwise: runs the files given on the command line and prints the edges each reached, to replay crashes.
+*
+* Configured through the environment: TINY8_FUZZ_ROM (the rom, required), TINY8_FUZZ_FLAGS (chip8, schip or xochip, chip8 by
+* default), TINY8_FUZZ_CYCLES_PER_FRAME and TINY8_FUZZ_HANG_FRAMES: report a soft-lock when memory, the screen and the registers
+* don't change for that many frames in a row through a key change (off by default).
+*/
+namespace
+{
+	constexpr uint32_t	c_maxFrames = 240;
+	constexpr size_t	c_bytesPerStep = 3;
+
+#if defined(TINY8_FUZZ_LIBFUZZER)
+	__attribute__((used, section("__libfuzzer_extra_counters"))) uint8_t g_coverage[tiny8::c_coverageMapSize];
+#else
+	uint8_t g_coverage[tiny8::c_coverageMapSize];
+#endif
+
+	struct fuzz_setup
+	{
+		std::vector<uint8_t>	m_rom;
+		tiny8::flags			m_flags = tiny8::chip8_original;
+		uint32_t				m_cyclesPerFrame = tiny8::c_defaultCyclesPerFrame;
+		uint32_t				m_hangFrames = 0;
+		tiny8::instance_pool*	m_pool = nullptr;
+	};
+
+	fuzz_setup g_setup;
+
+	void fail(char const* what, char const* detail)
+	{
+		fprintf(stderr, "tiny8_fuzz: %s%s\n", what, detail);
+		abort();
+	}
+
+	void setup()
+	{
+		char const* const rom_path = getenv("TINY8_FUZZ_ROM");
+		if (rom_path == nullptr)
+			fail("set TINY8_FUZZ_ROM to the rom to fuzz", "");
+
+		std::ifstream file(rom_path, std::ios::binary);
+		g_setup.m_rom.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		if (!file.is_open() || g_setup.m_rom.empty())
+			fail("can't read ", rom_path);
+
+		if (char const* const flags = getenv("TINY8_FUZZ_FLAGS"))
+		{
+			std::string_view const name = flags;
+			if (name == "schip")
+				g_setup.m_flags = tiny8::chip8_schip;
+			else if (name == "xochip")
+				g_setup.m_flags = tiny8::chip8_xochip;
+			else if (name != "chip8")
+				fail("unknown TINY8_FUZZ_FLAGS ", flags);
+		}
+		if (char const* const cycles = getenv("TINY8_FUZZ_CYCLES_PER_FRAME"))
+			g_setup.m_cyclesPerFrame = static_cast<uint32_t>(std::max(1l, atol(cycles)));
+		if (char const* const frames = getenv("TINY8_FUZZ_HANG_FRAMES"))
+			g_setup.m_hangFrames = static_cast<uint32_t>(std::max(0l, atol(frames)));
+
+		// One instance: inputs run one at a time. Kept for the whole process, like libFuzzer keeps the harness.
+		static tiny8::instance_pool pool(1, g_setup.m_flags, tiny8::dispatch_mode::table);
+		g_setup.m_pool = &pool;
+	}
+
+	// What a rom that still reacts changes: memory, the screen and the registers, minus the program counter (a wait loop leaves it
+	// anywhere in the loop), the cycle count and the keys.
+	uint64_t machine_hash(tiny8::interpreter& interpreter)
+	{
+		tiny8::registers const& registers = *interpreter.get_registers();
+		uint64_t h = tiny8::xxhash64(registers.m_v, sizeof(registers.m_v), interpreter.display_hash());
+		h = tiny8::xxhash64(&registers.m_index, sizeof(registers.m_index), h);
+		h = tiny8::xxhash64(&registers.m_sp, sizeof(registers.m_sp), h);
+		return tiny8::xxhash64(interpreter.get_memory()->m_data, tiny8::c_maxMemory, h);
+	}
+
+	// Run one input. Returns the frames run; aborts on a fault or a soft-lock, which the fuzzer records as a crash.
+	uint32_t run_input(uint8_t const* data, size_t size)
+	{
+		tiny8::interpreter* const interpreter = g_setup.m_pool->acquire(g_setup.m_rom, g_setup.m_flags);
+		if (interpreter == nullptr)
+			fail("the rom doesn't fit in memory", "");
+
+		interpreter->set_timer_mode(tiny8::timer_mode::emulated, g_setup.m_cyclesPerFrame);
+		interpreter->set_coverage_map(g_coverage);
+
+		uint32_t frames = 0;
+		uint32_t unchanged = 0;
+		uint64_t previous_hash = 0;
+		uint16_t previous_keys = 0;
+		bool key_changed = false;
+		for (size_t offset = 0; offset + c_bytesPerStep <= size && frames < c_maxFrames; offset += c_bytesPerStep)
+		{
+			uint16_t const keys = static_cast<uint16_t>(data[offset] | (data[offset + 1] << 8));
+			uint32_t const hold = 1 + data[offset + 2] % 8;
+			key_changed |= keys != previous_keys;
+			previous_keys = keys;
+
+			uint8_t key_buffer[tiny8::c_maxKeys];
+			for (uint8_t key = 0; key < tiny8::c_maxKeys; ++key)
+				key_buffer[key] = (keys >> key) & 1;
+
+			for (uint32_t i = 0; i < hold && frames < c_maxFrames; ++i, ++frames)
+			{
+				interpreter->run_frame(key_buffer);
+				if (interpreter->has_fault())
+				{
+					tiny8::fault const& f = interpreter->get_fault();
+					char detail[64];
+					snprintf(detail, sizeof(detail), "trap %u at %03X (opcode %04X)", unsigned(f.m_trap), unsigned(f.m_pc), unsigned(f.m_opcode));
+					fail("fault: ", detail);
+				}
+
+				if (g_setup.m_hangFrames == 0)
+					continue;
+
+				uint64_t const hash = machine_hash(*interpreter);
+				unchanged = hash == previous_hash ? unchanged + 1 : 0;
+				previous_hash = hash;
+				if (unchanged == 0)
+					key_changed = false;
+				if (unchanged >= g_setup.m_hangFrames && key_changed)
+					fail("soft-lock: the machine stopped changing through a key change", "");
+			}
+		}
+
+		g_setup.m_pool->release(interpreter);
+		return frames;
+	}
+}
+
+#if defined(TINY8_FUZZ_LIBFUZZER)
+extern "C" int LLVMFuzzerInitialize(int*, char***)
+{
+	setup();
+	return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size)
+{
+	run_input(data, size);
+	return 0;
+}
+#else
+// AFL++'s coverage map, only there when built with its compilers.
+extern "C" __attribute__((weak)) uint8_t* __afl_area_ptr;
+extern "C" __attribute__((weak)) uint32_t __afl_map_size;
+
+namespace
+{
+	// Add the edges of the run into AFL's map, after the harness' own (which end well below its size in a build this small).
+	void feed_afl()
+	{
+		if (&__afl_area_ptr == nullptr || __afl_area_ptr == nullptr)
+			return;
+
+		uint32_t const map_size = &__afl_map_size != nullptr ? __afl_map_size : 0x10000;
+		uint32_t const base = map_size > 2 * tiny8::c_coverageMapSize ? map_size - tiny8::c_coverageMapSize : 0;
+		for (size_t i = 0; i < tiny8::c_coverageMapSize; ++i)
+			__afl_area_ptr[(base + i) % map_size] += g_coverage[i];
+	}
+
+	size_t edges_reached()
+	{
+		size_t edges = 0;
+		for (uint8_t const count : g_coverage)
+			edges += count != 0;
+		return edges;
+	}
+}
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+__AFL_FUZZ_INIT();
+#endif
+
+int main(int argc, char** argv)
+{
+	setup();
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+	uint8_t const* const data = __AFL_FUZZ_TESTCASE_BUF;
+	while (__AFL_LOOP(100000))
+	{
+		memset(g_coverage, 0, sizeof(g_coverage));
+		run_input(data, __AFL_FUZZ_TESTCASE_LEN);
+		feed_afl();
+	}
+#else
+	if (argc < 2)
+	{
+		printf("usage: TINY8_FUZZ_ROM=rom.ch8 tiny8_fuzz input ...\n");
+		return 1;
+	}
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::ifstream file(argv[i], std::ios::binary);
+		std::vector<uint8_t> const input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		memset(g_coverage, 0, sizeof(g_coverage));
+		uint32_t const frames = run_input(input.data(), input.size());
+		feed_afl();
+		printf("%s: %u frames, %zu edges\n", argv[i], frames, edges_reached());
+	}
+#endif
+	return 0;
+}
+#endif
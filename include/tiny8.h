@@ -21,12 +21,29 @@
 // SOFTWARE.
 #pragma once
 
-#include <iostream>
+#include <cstdio>
 #include <cstdlib>
-#include <unordered_map>
-#include <functional>
+#include <cstring>
+#include <cstddef>
+#include <array>
+#include <algorithm>
+#include <bit>
+#include <memory>
 #include <cassert>
+#include <type_traits>
+#include <span>
+#include <string_view>
+
+// TINY8_FREESTANDING: the core alone for microcontrollers, without the standard headers that need an operating system or a heap
+// (no <iostream>, <unordered_map>, <mutex> or <chrono>). Behaviour flags have to be known at compile time, so dispatch goes
+// through the constexpr table in read-only memory; the decode cache isn't available and the wall clock timers tick from a
+// host-provided source (set_tick_source()). Nothing is allocated and nothing throws.
+#if !defined(TINY8_FREESTANDING)
+#include <iostream>
+#include <unordered_map>
+#include <mutex>
 #include <chrono>
+#endif
 
 /*
 * A fully featured CHIP-8 interpreter covering instructions for:
@@ -34,20 +51,25 @@
 * - SChip
 * - XoChip
 * 
-* At the time of writing, the only thing that differentiates across versions is the instruction compatibility. Extended feature set is not yet implemented, but planned.
+* Versions differ in their behaviour flags (the quirks of shifts, loads and stores, jumps, logic ops and drawing) and in the
+* extended features, which are always available: SUPER-CHIP's 128x64 hires mode (00FE/00FF), big font (Fx30) and scrolling
+* (00Cn, 00FB/00FC, and XO-CHIP's 00Dn), XO-CHIP's two bitplanes (Fn01), audio pattern and pitch (F002, Fx3A), register ranges
+* (5xy2/5xy3) and, with a MemorySize of c_extendedMemory, its 64KB address space (F000 nnnn).
+*
+* Nothing is allocated once an interpreter is set up: advance(), run_cycles(), run_frame() and the decode cache and jit paths
+* never touch the heap (tiny8_bench --check-allocations verifies this), so they are safe to call from real-time threads.
 */
 namespace tiny8
 {
-	static void unimplemented(uint16_t opcode)
-	{
-		printf("Unimplemented instruction! Opcode: 0x%04x\n", opcode);
-		assert(false);
-	}
-
 	// Memory constants
-	constexpr size_t	c_maxMemory = 0x1000;
-	constexpr size_t	c_maxStack = 0x400;
+	constexpr size_t	c_maxMemory = 0x1000;			// Classic CHIP-8 address space.
+	constexpr size_t	c_extendedMemory = 0x10000;		// XO-CHIP address space, see basic_interpreter's MemorySize.
+	constexpr size_t	c_maxStack = 32;				// Stack entries stored, the deepest set_stack_depth() allows.
+	constexpr size_t	c_defaultStackDepth = 16;		// Nesting allowed by CHIP-8 and SUPER-CHIP interpreters.
+	constexpr size_t	c_extendedStackDepth = 32;		// Default for 64KB XO-CHIP instances.
 	constexpr uint16_t	c_romStartAddress = 0x200;
+	constexpr size_t	c_maxRomSize = c_maxMemory - c_romStartAddress;
+	constexpr size_t	c_maxExtendedRomSize = c_extendedMemory - c_romStartAddress;
 
 	// Font constants & data.
 	constexpr size_t	c_fontStartAddress = 0x0;
@@ -71,28 +93,193 @@ namespace tiny8
 		0xF0, 0x80, 0xF0, 0x80, 0x80  // F 
 	};
 
-	// Display constants
+	// The SCHIP/XO-CHIP big font (Fx30), 8x10 glyphs placed right after the small one.
+	constexpr size_t	c_bigFontStartAddress = c_fontStartAddress + sizeof(c_fontset);
+	constexpr uint8_t	c_bigFontset[160] =
+	{
+		0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+		0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+		0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+		0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+		0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+		0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+		0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+		0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+		0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+		0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+		0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+		0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+	};
+
+	// Glyph addresses by digit (the low nibble of vx), for Fx29 and Fx30.
+	constexpr auto c_glyphAddresses = [](size_t start, size_t glyph_size)
+	{
+		std::array<uint16_t, 16> addresses{};
+		for (size_t digit = 0; digit < addresses.size(); ++digit)
+			addresses[digit] = static_cast<uint16_t>(start + digit * glyph_size);
+		return addresses;
+	};
+	constexpr std::array<uint16_t, 16> c_fontAddresses = c_glyphAddresses(c_fontStartAddress, 5);
+	constexpr std::array<uint16_t, 16> c_bigFontAddresses = c_glyphAddresses(c_bigFontStartAddress, 10);
+
+	// Display constants. Low resolution is the classic CHIP-8 screen, high resolution the SCHIP/XO-CHIP one (00FF).
 	constexpr size_t	c_displayWidth = 64;
 	constexpr size_t	c_displayHeight = 32;
 	constexpr size_t	c_displaySize = c_displayWidth * c_displayHeight;
+	constexpr size_t	c_hiresDisplayWidth = 128;
+	constexpr size_t	c_hiresDisplayHeight = 64;
+	constexpr size_t	c_hiresDisplaySize = c_hiresDisplayWidth * c_hiresDisplayHeight;
+	constexpr size_t	c_displayPlanes = 2;		// XO-CHIP bitplanes, selected with Fn01.
 
 	// Input constants
 	constexpr size_t	c_maxKeys = 16;
 
-	// Anything memory related (including font data and stack).
-	struct memory
+	// Interpreters and their machine state are aligned to this, so their hot fields share one line and instances running on
+	// different threads never write to the same one.
+	constexpr size_t	c_cacheLineSize = 64;
+
+	// Audio constants
+	constexpr size_t	c_audioPatternSize = 16;		// XO-CHIP pattern buffer loaded by F002, played back one bit at a time.
+	constexpr uint8_t	c_defaultAudioPitch = 64;		// Fx3A value that plays the pattern at 4000 bits per second.
+
+	// Timing constants
+	constexpr uint32_t	c_defaultCyclesPerFrame = 12;	// Instructions per 60Hz frame used by run_frame() unless told otherwise (~700 instructions per second).
+
+	// Random number generation for Cxnn: every machine carries its own xorshift64* state, so there is no shared global generator
+	// between threads and a seed fully determines the sequence.
+	constexpr uint64_t random_state(uint64_t seed)
+	{
+		// splitmix64 spreads similar seeds apart; xorshift must never start from zero.
+		uint64_t z = seed + 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		z ^= z >> 31;
+		return z != 0 ? z : 1;
+	}
+
+	// Advance the generator and return the next 8 random bits.
+	inline uint8_t next_random(uint64_t& state)
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return static_cast<uint8_t>((state * 0x2545f4914f6cdd1dull) >> 56);
+	}
+
+	// XXH64 of a range of bytes, see basic_interpreter::display_hash() and state_hash(). Chaining calls through the seed hashes
+	// several ranges as one.
+	inline uint64_t xxhash64(void const* data, size_t size, uint64_t seed = 0)
+	{
+		constexpr uint64_t p1 = 0x9e3779b185ebca87ull, p2 = 0xc2b2ae3d27d4eb4full, p3 = 0x165667b19e3779f9ull, p4 = 0x85ebca77c2b2ae63ull, p5 = 0x27d4eb2f165667c5ull;
+		auto const round = [](uint64_t acc, uint64_t lane) { return std::rotl(acc + lane * p2, 31) * p1; };
+		auto const merge = [&](uint64_t acc, uint64_t v) { return (acc ^ round(0, v)) * p1 + p4; };
+		auto const read64 = [](uint8_t const* p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; };
+		auto const read32 = [](uint8_t const* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; };
+
+		uint8_t const* p = static_cast<uint8_t const*>(data);
+		uint8_t const* const end = p + size;
+
+		uint64_t h;
+		if (size >= 32)
+		{
+			uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+			for (; p + 32 <= end; p += 32)
+			{
+				v1 = round(v1, read64(p));
+				v2 = round(v2, read64(p + 8));
+				v3 = round(v3, read64(p + 16));
+				v4 = round(v4, read64(p + 24));
+			}
+			h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+			h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+		}
+		else
+			h = seed + p5;
+
+		h += size;
+		for (; p + 8 <= end; p += 8)
+			h = std::rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+		if (p + 4 <= end)
+		{
+			h = std::rotl(h ^ (read32(p) * p1), 23) * p2 + p3;
+			p += 4;
+		}
+		for (; p < end; ++p)
+			h = std::rotl(h ^ (*p * p5), 11) * p1;
+
+		h ^= h >> 33;
+		h *= p2;
+		h ^= h >> 29;
+		h *= p3;
+		return h ^ (h >> 32);
+	}
+
+	// Anything memory related (including font data and stack). Size is the address space, a power of two so addresses wrap with a mask.
+	template<size_t Size>
+	struct basic_memory
 	{
-		uint8_t			m_data[c_maxMemory];	// Main working memory of the CHIP-8.
+		static_assert(Size >= c_maxMemory && Size <= c_extendedMemory && (Size & (Size - 1)) == 0, "memory size must be a power of two between 4KB and 64KB");
+
+		uint8_t			m_data[Size];			// Main working memory of the CHIP-8.
 		uint16_t		m_stack[c_maxStack];	// Stack is intentionally placed outside working memory; I don't know of any programs that depend on it being part of the main memory.
 
-		uint8_t* const  m_rom = &m_data[c_romStartAddress];		// Where the rom data starts.
-		uint8_t* const  m_font = &m_data[c_fontStartAddress];	// Where the font data starts.
+		uint8_t* rom() { return &m_data[c_romStartAddress]; }				// Where the rom data starts.
+		uint8_t const* rom() const { return &m_data[c_romStartAddress]; }
+		uint8_t* font() { return &m_data[c_fontStartAddress]; }				// Where the font data starts.
+		uint8_t const* font() const { return &m_data[c_fontStartAddress]; }
 	};
 
-	// Display framebuffer.
+	using memory = basic_memory<c_maxMemory>;
+
+	// Display framebuffer. Pixels are bit packed, two 64-bit words per row with the leftmost pixel in the most significant bit of the
+	// first one, so a sprite row is drawn with a couple of shifts and XORs and scrolls move whole words. Low resolution only uses the
+	// first word of the first 32 rows; the first word of a high resolution row covers its left half.
 	struct display
 	{
-		uint8_t m_data[c_displaySize];
+		static_assert(c_displayWidth == 64 && c_hiresDisplayWidth == 128, "display rows are packed into one (low resolution) or two 64-bit words");
+		static_assert(c_hiresDisplayHeight <= 64, "dirty rows are tracked in a single 64-bit mask");
+
+		uint64_t m_planes[c_displayPlanes][c_hiresDisplayHeight][2];
+
+		// Change tracking, maintained by the clear, scroll and draw instructions so frontends only present (and upload) what changed.
+		uint32_t m_version = 0;		// Incremented whenever the framebuffer contents change.
+		uint64_t m_dirtyRows = 0;	// Bit y is set when row y changed since the last take_dirty_rows().
+
+		uint8_t	m_planeMask = 1;	// Planes affected by clear, scroll and draw (Fn01).
+		bool	m_hires = false;	// 128x64 instead of 64x32 (00FF/00FE).
+
+		size_t width() const { return m_hires ? c_hiresDisplayWidth : c_displayWidth; }
+		size_t height() const { return m_hires ? c_hiresDisplayHeight : c_displayHeight; }
+
+		// Get the rows changed since the last call and reset the mask.
+		uint64_t take_dirty_rows()
+		{
+			uint64_t const rows = m_dirtyRows;
+			m_dirtyRows = 0;
+			return rows;
+		}
+
+		// Byte-per-pixel view in the current resolution: bit p is set if the pixel is lit in plane p, so 0 is off and 1 is the classic lit colour.
+		uint8_t pixel(size_t x, size_t y) const
+		{
+			size_t const shift = 63 - (x & 63);
+			return static_cast<uint8_t>(((m_planes[0][y][x >> 6] >> shift) & 1) | (((m_planes[1][y][x >> 6] >> shift) & 1) << 1));
+		}
+		uint8_t operator[](size_t index) const { return pixel(index % width(), index / width()); }
+
+		// Expand the framebuffer into width() * height() bytes, one per pixel in row-major order.
+		void unpack(uint8_t* out) const
+		{
+			for (size_t y = 0; y < height(); ++y)
+			{
+				for (size_t x = 0; x < width(); ++x)
+					*out++ = pixel(x, y);
+			}
+		}
 	};
 
 	// Registers.
@@ -105,6 +292,161 @@ namespace tiny8
 		uint8_t			m_v[16];
 	};
 
+	// Register arithmetic, loads and stores, shared by the interpreter's handlers and constexpr_machine (tiny8_constexpr.h) so the
+	// semantics checked in static_asserts are the ones that run. Memory is reached through at(address), which returns a reference to
+	// the byte and wraps the address.
+	namespace semantics
+	{
+		template<bool Legacy>
+		constexpr void logical_or(registers& r, uint32_t x, uint32_t y)
+		{
+			r.m_v[x] = r.m_v[x] | r.m_v[y];
+			if constexpr (Legacy)
+				r.m_v[15] = 0;
+		}
+
+		template<bool Legacy>
+		constexpr void logical_and(registers& r, uint32_t x, uint32_t y)
+		{
+			r.m_v[x] = r.m_v[x] & r.m_v[y];
+			if constexpr (Legacy)
+				r.m_v[15] = 0;
+		}
+
+		template<bool Legacy>
+		constexpr void logical_xor(registers& r, uint32_t x, uint32_t y)
+		{
+			r.m_v[x] = r.m_v[x] ^ r.m_v[y];
+			if constexpr (Legacy)
+				r.m_v[15] = 0;
+		}
+
+		// A byte result and the flag vF gets, written in that order so vF as the destination ends up holding the flag.
+		struct flagged
+		{
+			uint8_t m_value;
+			uint8_t m_flag;
+		};
+
+		// a + b, flagging a carry.
+		constexpr flagged add_carry(uint8_t a, uint8_t b)
+		{
+#if defined(__GNUC__)
+			uint8_t sum;
+			bool const carry = __builtin_add_overflow(a, b, &sum);
+			return { sum, static_cast<uint8_t>(carry) };
+#else
+			uint8_t const sum = static_cast<uint8_t>(a + b);
+			return { sum, static_cast<uint8_t>(sum < a) };
+#endif
+		}
+
+		// a - b, flagging a > b (neither a borrow nor an equal pair).
+		constexpr flagged subtract_borrow(uint8_t a, uint8_t b)
+		{
+#if defined(__GNUC__)
+			uint8_t difference;
+			bool const borrow = __builtin_sub_overflow(a, b, &difference);
+			return { difference, static_cast<uint8_t>(!borrow && difference != 0) };
+#else
+			return { static_cast<uint8_t>(a - b), static_cast<uint8_t>(a > b) };
+#endif
+		}
+
+		// Decimal digits of every byte, hundreds first, for Fx33.
+		inline constexpr auto c_bcd = []
+		{
+			std::array<std::array<uint8_t, 3>, 256> table{};
+			for (uint32_t v = 0; v < 256; ++v)
+				table[v] = { static_cast<uint8_t>(v / 100), static_cast<uint8_t>(v / 10 % 10), static_cast<uint8_t>(v % 10) };
+			return table;
+		}();
+
+		constexpr void add(registers& r, uint32_t x, uint32_t y)
+		{
+			flagged const result = add_carry(r.m_v[x], r.m_v[y]);
+			r.m_v[x] = result.m_value;
+			r.m_v[15] = result.m_flag;
+		}
+
+		// 8xy5 and 8xy7: vx = va - vb, with vF set when va > vb.
+		constexpr void subtract(registers& r, uint32_t x, uint32_t a, uint32_t b)
+		{
+			flagged const result = subtract_borrow(r.m_v[a], r.m_v[b]);
+			r.m_v[x] = result.m_value;
+			r.m_v[15] = result.m_flag;
+		}
+
+		template<bool Legacy>
+		constexpr void shift_right(registers& r, uint32_t x, uint32_t y)
+		{
+			if constexpr (Legacy)
+				r.m_v[x] = r.m_v[y];
+
+			uint8_t const prev = r.m_v[x];
+			r.m_v[x] >>= 1;
+			r.m_v[15] = prev & 1;
+		}
+
+		template<bool Legacy>
+		constexpr void shift_left(registers& r, uint32_t x, uint32_t y)
+		{
+			if constexpr (Legacy)
+				r.m_v[x] = r.m_v[y];
+
+			uint8_t const prev = r.m_v[x];
+			r.m_v[x] <<= 1;
+			r.m_v[15] = (prev >> 7) & 1;
+		}
+
+		// Bnnn target.
+		template<bool Legacy>
+		constexpr uint16_t jump_offset(registers const& r, uint32_t nnn, uint32_t x)
+		{
+			return static_cast<uint16_t>(nnn + r.m_v[Legacy ? 0 : x]);
+		}
+
+		// Fx1E, flagging an index past the 12-bit address space. The flag is set first, so FF1E adds the flag.
+		constexpr void add_index(registers& r, uint32_t x)
+		{
+			r.m_v[15] = r.m_index + r.m_v[x] > 0xfff;
+			r.m_index += r.m_v[x];
+		}
+
+		// Fx29 and Fx30: point I at the small or big glyph of vx's low nibble.
+		constexpr void font_glyph(registers& r, uint32_t x) { r.m_index = c_fontAddresses[r.m_v[x] & 0xf]; }
+		constexpr void big_font_glyph(registers& r, uint32_t x) { r.m_index = c_bigFontAddresses[r.m_v[x] & 0xf]; }
+
+		// Fx33.
+		template<class At>
+		constexpr void store_bcd(registers const& r, uint32_t x, At&& at)
+		{
+			std::array<uint8_t, 3> const& digits = c_bcd[r.m_v[x]];
+			at(r.m_index + 0) = digits[0];
+			at(r.m_index + 1) = digits[1];
+			at(r.m_index + 2) = digits[2];
+		}
+
+		// Fx55 and Fx65; the original interpreter left I past the registers.
+		template<bool Legacy, class At>
+		constexpr void store_registers(registers& r, uint32_t x, At&& at)
+		{
+			for (uint32_t i = 0; i <= x; ++i)
+				at(r.m_index + i) = r.m_v[i];
+			if constexpr (Legacy)
+				r.m_index++;
+		}
+
+		template<bool Legacy, class At>
+		constexpr void load_registers(registers& r, uint32_t x, At&& at)
+		{
+			for (uint32_t i = 0; i <= x; ++i)
+				r.m_v[i] = at(r.m_index + i);
+			if constexpr (Legacy)
+				r.m_index++;
+		}
+	}
+
 	// Timers.
 	struct timers
 	{
@@ -112,13 +454,40 @@ namespace tiny8
 		uint8_t m_sound = 0;
 	};
 
-	// Input keys state.
+	// Sound output: the pattern buffer plays while the sound timer is non zero, see tiny8_audio.h.
+	struct audio
+	{
+		// A square wave until a rom loads its own pattern with F002.
+		uint8_t m_pattern[c_audioPatternSize] = { 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0 };
+		uint8_t m_pitch = c_defaultAudioPitch;
+	};
+
+	// Input keys state, bit k set while key k is held.
 	struct input
 	{
-		uint8_t m_key[c_maxKeys];
-		uint8_t m_prev_key[c_maxKeys];
+		uint16_t m_keys = 0;
+		uint16_t m_prevKeys = 0;	// Keys before the latest change, Fx0A completes on the difference.
+	};
+
+	// Pack a byte-per-key buffer (non zero is pressed) into an input mask.
+	inline uint16_t key_mask(uint8_t const key_buffer[c_maxKeys])
+	{
+		uint16_t mask = 0;
+		for (size_t i = 0; i < c_maxKeys; ++i)
+			mask |= static_cast<uint16_t>(key_buffer[i] != 0) << i;
+		return mask;
+	}
+
+	// A key press or release taking effect before the instruction executed at a given cycle count, see basic_interpreter::queue_input().
+	struct input_event
+	{
+		uint64_t	m_cycle;
+		uint8_t		m_key;
+		bool		m_pressed;
 	};
 
+	constexpr size_t	c_inputQueueSize = 64;
+
 	// Represents the current decoding state.
 	struct decode_state
 	{
@@ -130,331 +499,3090 @@ namespace tiny8
 		uint16_t  m_nnn;	// Used for memory access, 12 bit (second, third and fourth nibbles).
 	};
 
-	// Represents an instruction, along with a callback for execution. 
-	struct instruction
+	// Instructions the interpreter refuses to execute. See basic_interpreter::set_trap_callback().
+	enum class trap : uint8_t
 	{
-		std::function<void()>		m_body;
-		struct instruction_family*	m_family;
+		unimplemented,		// No instruction with this opcode in the current flags.
+		stack_overflow,		// A 2nnn with the stack already at its depth.
+		stack_underflow		// A 00EE with nothing to return to.
 	};
 
-	// Represents an instruction family, denoted by the first nibble of the opcode. A family can have one or more instructions based on certain opcode nibbles.
-	struct instruction_family
+	struct fault
 	{
-		std::unordered_map<uint8_t, instruction> m_instructions;
-		uint16_t	m_opcodeMask;
+		trap		m_trap;
+		uint16_t	m_pc;		// Address of the offending instruction.
+		uint16_t	m_opcode;
 	};
 
-	// The chip-8 interpreter.
-	class interpreter
+	// Called instead of executing the offending instruction; the registers already point past it.
+	using trap_callback = void(*)(void* user_data, fault const& f, registers const& regs);
+
+	// Trap callback printing the faults the way the interpreter used to print unimplemented instructions.
+	inline void trap_print(void*, fault const& f, registers const&)
 	{
-	public:
-		// Instruction compatibility and interpreter mode flags
-		// All the "legacy" ones refer to the original CHIP-8 implementation
-		// Relevant read on how those are assembled for each mode: https://games.gulrak.net/cadmium/chip8-opcode-table.html
-		enum flags : uint8_t
-		{
-			none = 0,
-			shift_legacy = 1 << 0,
-			store_load_legacy = 1 << 1,
-			jump_offset_legacy = 1 << 2,
-			logical_legacy = 1 << 3,
-			disp_sync_legacy = 1 << 4,
-			draw_legacy = 1 << 5,
-			all_legacy = shift_legacy | store_load_legacy | jump_offset_legacy | logical_legacy | disp_sync_legacy | draw_legacy,
-			// operation modes
-			chip8_original = all_legacy,
-			chip8_schip = draw_legacy,
-			chip8_xochip = store_load_legacy | jump_offset_legacy | shift_legacy
-		};
+		constexpr char const* c_messages[] = { "Unimplemented instruction!", "Stack overflow!", "Stack underflow!" };
+		printf("%s Opcode: 0x%04x, pc: 0x%04x\n", c_messages[static_cast<size_t>(f.m_trap)], f.m_opcode, f.m_pc);
+	}
 
-		// Constructor - initialise the chip-8 interpreter internal data.
-		interpreter(flags behaviour_flags = flags::none) : m_flags(behaviour_flags)
-		{
-			memset(m_memory.m_data, 0, sizeof(m_memory.m_data));
-			memset(m_memory.m_stack, 0, sizeof(m_memory.m_stack));
-			memcpy(m_memory.m_font, c_fontset, sizeof(c_fontset));
-
-			memset(m_display.m_data, 0, sizeof(m_display.m_data));
-
-			memset(m_registers.m_v, 0, sizeof(m_registers.m_v));
-
-			memset(m_input.m_key, 0, sizeof(m_input.m_key));
-			memset(m_input.m_prev_key, 0, sizeof(m_input.m_prev_key));
-
-			// setup instruction families and callbacks
-			// http://devernay.free.fr/hacks/chip8/C8TECH10.HTM
-			add_instruction(0x00, 0xe0, 0x00ff, [&]() { memset(m_display.m_data, 0, sizeof(m_display.m_data)); });
-			add_instruction(0x00, 0xee, 0x00ff, [&]() {	m_registers.m_pc = m_memory.m_stack[--m_registers.m_sp]; });
-			add_instruction(0x00, 0x00, 0x0000, [&]() { unimplemented(m_state.m_opcode); });
-			add_instruction(0x10, 0x00, 0x0000, [&]() { m_registers.m_pc = m_state.m_nnn; });
-			add_instruction(0x20, 0x00, 0x0000, [&]() { m_memory.m_stack[m_registers.m_sp++] = m_registers.m_pc; m_registers.m_pc = m_state.m_nnn; });
-			add_instruction(0x30, 0x00, 0x0000, [&]() { if (m_registers.m_v[m_state.m_x] == m_state.m_nn) m_registers.m_pc += 2; });
-			add_instruction(0x40, 0x00, 0x0000, [&]() { if (m_registers.m_v[m_state.m_x] != m_state.m_nn) m_registers.m_pc += 2; });
-			add_instruction(0x50, 0x00, 0x0000, [&]() { if (m_registers.m_v[m_state.m_x] == m_registers.m_v[m_state.m_y]) m_registers.m_pc += 2; });
-			add_instruction(0x60, 0x00, 0x0000, [&]() { m_registers.m_v[m_state.m_x] = m_state.m_nn; });
-			add_instruction(0x70, 0x00, 0x0000, [&]() { m_registers.m_v[m_state.m_x] += m_state.m_nn; });
-			add_instruction(0x80, 0x00, 0x000f, [&]() { m_registers.m_v[m_state.m_x] = m_registers.m_v[m_state.m_y]; });
-			add_instruction(0x80, 0x01, 0x000f, [&]() { m_registers.m_v[m_state.m_x] = m_registers.m_v[m_state.m_x] | m_registers.m_v[m_state.m_y]; if (m_flags & flags::logical_legacy) update_flag(0); });
-			add_instruction(0x80, 0x02, 0x000f, [&]() { m_registers.m_v[m_state.m_x] = m_registers.m_v[m_state.m_x] & m_registers.m_v[m_state.m_y]; if (m_flags & flags::logical_legacy) update_flag(0); });
-			add_instruction(0x80, 0x03, 0x000f, [&]() { m_registers.m_v[m_state.m_x] = m_registers.m_v[m_state.m_x] ^ m_registers.m_v[m_state.m_y]; if (m_flags & flags::logical_legacy) update_flag(0); });
-			add_instruction(0x80, 0x04, 0x000f, [&]() 
-				{
-					uint16_t const sum = m_registers.m_v[m_state.m_x] + m_registers.m_v[m_state.m_y];
-					m_registers.m_v[m_state.m_x] = sum & 0xff;
-					update_flag(sum > 255);
-				});
-			add_instruction(0x80, 0x05, 0x000f, [&]()
-				{
-					int16_t const sub = m_registers.m_v[m_state.m_x] - m_registers.m_v[m_state.m_y];
-					m_registers.m_v[m_state.m_x] = sub & 0xff;
-					update_flag(sub > 0);
-				});
-			add_instruction(0x80, 0x06, 0x000f, [&]()
-				{
-					if (m_flags & flags::shift_legacy)
-						m_registers.m_v[m_state.m_x] = m_registers.m_v[m_state.m_y];
+	// The complete state of a running machine: everything needed to resume execution exactly where it was left.
+	// Plain data with no pointers into itself, so saving or restoring a snapshot is a flat copy.
+	// The fields touched by every instruction come first and fill exactly one cache line; memory and the display follow on
+	// lines of their own.
+	template<size_t MemorySize>
+	struct alignas(c_cacheLineSize) basic_machine_state
+	{
+		registers		m_registers;
+		timers			m_timers;
+		input			m_input;
+		decode_state	m_state;						// Last decoded instruction, re-executed while waiting for input.
+		bool			m_isWaitingForInput = false;
+		bool			m_isWaitingForVblank = false;	// A draw with disp_sync_legacy idles until the next timer tick.
+		uint64_t		m_cycles = 0;					// Total instructions executed.
+		uint32_t		m_frameCycles = 0;				// Instructions executed in the current emulated frame.
+		uint64_t		m_random = random_state(0);		// Cxnn generator state, see set_seed().
 
-					uint8_t prev = m_registers.m_v[m_state.m_x];
-					m_registers.m_v[m_state.m_x] >>= 1;
-					update_flag(prev & 1);
-				});
-			add_instruction(0x80, 0x07, 0x000f, [&]()
-				{
-					int16_t const sub = m_registers.m_v[m_state.m_y] - m_registers.m_v[m_state.m_x];
-					m_registers.m_v[m_state.m_x] = sub & 0xff;
-					update_flag(sub > 0);
-				});
-			add_instruction(0x80, 0x0e, 0x000f, [&]()
-				{
-					if (m_flags & flags::shift_legacy)
-						m_registers.m_v[m_state.m_x] = m_registers.m_v[m_state.m_y];
+		alignas(c_cacheLineSize) basic_memory<MemorySize>	m_memory;
+		alignas(c_cacheLineSize) display	m_display;
+		audio			m_audio;
+	};
 
-					uint8_t prev = m_registers.m_v[m_state.m_x];
-					m_registers.m_v[m_state.m_x] <<= 1;
-					update_flag((prev >> 7) & 1);
-				});
+	using machine_state = basic_machine_state<c_maxMemory>;
+	using extended_machine_state = basic_machine_state<c_extendedMemory>;
+	static_assert(std::is_trivially_copyable_v<machine_state> && std::is_trivially_copyable_v<extended_machine_state>, "machine_state must be copyable with memcpy");
+	static_assert(offsetof(machine_state, m_memory) == c_cacheLineSize, "the hot fields of machine_state must fit in a single cache line");
 
-			add_instruction(0x90, 0x00, 0x000f, [&]() { if (m_registers.m_v[m_state.m_x] != m_registers.m_v[m_state.m_y]) m_registers.m_pc += 2; });
-			add_instruction(0xa0, 0x00, 0x0000, [&]() { m_registers.m_index = m_state.m_nnn; });
-			add_instruction(0xb0, 0x00, 0x0000, [&]() 
-				{
-					if (m_flags & flags::jump_offset_legacy)
-						m_registers.m_pc = m_state.m_nnn + m_registers.m_v[0];
-					else
-						m_registers.m_pc = m_state.m_nnn + m_registers.m_v[m_state.m_x];
-				});
-			add_instruction(0xc0, 0x00, 0x0000, [&]() { m_registers.m_v[m_state.m_x] = (std::rand() % 255) & m_state.m_nn; });
-			add_instruction(0xd0, 0x00, 0x0000, [&]()
-				{
-						auto const coordx = m_registers.m_v[m_state.m_x] & (c_displayWidth - 1);
-						auto const coordy = m_registers.m_v[m_state.m_y] & (c_displayHeight - 1);
-					
-						uint8_t any_invalidated = 0;
+#if defined(TINY8_TRACE)
+	// Tracing - only compiled in when TINY8_TRACE is defined, otherwise execute() carries no tracing code at all.
+	enum class trace_point : uint8_t
+	{
+		pre_execute,
+		post_execute
+	};
 
-						for (auto y = 0; y < m_state.m_n; ++y)
-						{
-							auto coordyy = (coordy + y);
-							if (((m_flags & flags::draw_legacy)) && coordyy > c_displayHeight)
-								continue;
-							else
-								coordyy &= (c_displayHeight - 1);
-						
-							// sprite as bit packed columns
-							auto const sprite = m_memory.m_data[m_registers.m_index + y];
-
-							// each sprite has a maximum of 8 columns
-							for (auto x = 0; x < 8; ++x)
-							{
-								auto coordxx = (coordx + x);
-								if (((m_flags & flags::draw_legacy)) && coordxx > c_displayWidth)
-									continue;
-								else
-									coordxx &= (c_displayWidth - 1);
-
-								// read next msb - this will be the sprite value for this column.
-								auto const sprite_volumn_value = (sprite & (1 << (7 - x))) != 0;
-
-								// extract the current value and xor it with the new, write result to display.
-								auto const display_data_index = coordyy * c_displayWidth + coordxx;
-								auto const previous_display_value = m_display.m_data[display_data_index];
-								auto const new_display_value = (uint8_t)previous_display_value ^ (uint8_t)sprite_volumn_value;
-								m_display.m_data[display_data_index] = new_display_value;
-
-								// If the new value is off but th e previous value was on, remember this so we set vf to 1 later on.
-								any_invalidated |= (previous_display_value && !new_display_value);
-							}
-						}
+	// Called around every executed instruction with the decoder state and the registers at that point.
+	using trace_callback = void(*)(void* user_data, trace_point point, decode_state const& state, registers const& regs);
 
-						update_flag(any_invalidated);
-				});
+	// Trace callback printing the same per-instruction lines the interpreter used to print unconditionally.
+	inline void trace_print(void*, trace_point point, decode_state const& state, registers const& regs)
+	{
+		printf("%s opcode: 0x%04x, pc: 0x%04x, sp: 0x%04x\n", point == trace_point::pre_execute ? "Pre-execute" : "Post-execute", state.m_opcode, regs.m_pc, regs.m_sp);
+	}
 
-			add_instruction(0xe0, 0x09e, 0x00ff, [&]() { if (m_input.m_key[m_registers.m_v[m_state.m_x]]) m_registers.m_pc += 2; });
-			add_instruction(0xe0, 0x0a1, 0x00ff, [&]() { if (!m_input.m_key[m_registers.m_v[m_state.m_x]]) m_registers.m_pc += 2; });		
+	// A single binary trace entry, recorded after an instruction has executed.
+	struct trace_record
+	{
+		uint16_t	m_opcode;
+		uint16_t	m_pc;
+		uint16_t	m_index;
+		uint16_t	m_sp;
+		uint8_t		m_v[16];
+	};
 
-			add_instruction(0xf0, 0x07, 0x00ff, [&]() { m_registers.m_v[m_state.m_x] = m_timers.m_delay; });
-			add_instruction(0xf0, 0x0a, 0x00ff, [&]()
-				{
-					bool keyPressed = false;
-					// Check if the key is depressed
-					for (uint8_t i=0; i<std::size(m_input.m_key); ++i)
-					{
-						if (m_input.m_key[i] ^ m_input.m_prev_key[i])
-						{
-							m_registers.m_v[m_state.m_x] = i;
-							if (m_input.m_key[i] == 0)
-							{
-								m_isWaitingForInput = false;
-								keyPressed = true;
-							}
-							break;
-						}
-					}
+	// Buffered binary trace sink: records are accumulated in memory and written out in large blocks, so tracing stays cheap enough to leave on in long runs.
+	// Pass trace_buffer::callback with the buffer as user data to set_trace_callback().
+	class trace_buffer
+	{
+	public:
+		trace_buffer(FILE* output, size_t capacity = 4096) : m_output(output), m_records(std::make_unique<trace_record[]>(capacity)), m_capacity(capacity) {}
+		~trace_buffer() { flush(); }
 
-					if (!keyPressed)
-						m_isWaitingForInput = true;
-				});
-			add_instruction(0xf0, 0x15, 0x00ff, [&]() { m_timers.m_delay = m_registers.m_v[m_state.m_x]; });
-			add_instruction(0xf0, 0x18, 0x00ff, [&]() { m_timers.m_sound = m_registers.m_v[m_state.m_x]; });
-			add_instruction(0xf0, 0x1e, 0x00ff, [&]() 
-				{ 
-					update_flag(m_registers.m_index + m_registers.m_v[m_state.m_x] > 0xfff);
-					m_registers.m_index += m_registers.m_v[m_state.m_x];
-				});
+		trace_buffer(trace_buffer const&) = delete;
+		trace_buffer& operator=(trace_buffer const&) = delete;
 
-			add_instruction(0xf0, 0x29, 0x00ff, [&]() { m_registers.m_index += m_memory.m_font[m_state.m_x]; });
-			add_instruction(0xf0, 0x33, 0x00ff, [&]()
-				{
-					uint8_t const v = m_registers.m_v[m_state.m_x];
-					m_memory.m_data[m_registers.m_index + 0] = (v % 1000) / 100;
-					m_memory.m_data[m_registers.m_index + 1] = (v % 100) / 10;
-					m_memory.m_data[m_registers.m_index + 2] = (v % 10);
-				});
+		// Write any pending records to the output.
+		void flush()
+		{
+			if (m_count > 0 && m_output != nullptr)
+				fwrite(m_records.get(), sizeof(trace_record), m_count, m_output);
+			m_count = 0;
+		}
+
+		static void callback(void* user_data, trace_point point, decode_state const& state, registers const& regs)
+		{
+			if (point != trace_point::post_execute)
+				return;
+
+			auto* const self = static_cast<trace_buffer*>(user_data);
+			if (self->m_count == self->m_capacity)
+				self->flush();
 
-			add_instruction(0xf0, 0x55, 0x00ff, [&]() { memcpy(&m_memory.m_data[m_registers.m_index], m_registers.m_v, sizeof(uint8_t) * (m_state.m_x + 1)); if (m_flags & flags::store_load_legacy) m_registers.m_index++; });
-			add_instruction(0xf0, 0x65, 0x00ff, [&]() { memcpy(m_registers.m_v, &m_memory.m_data[m_registers.m_index], sizeof(uint8_t) * (m_state.m_x + 1)); if (m_flags & flags::store_load_legacy) m_registers.m_index++; });
+			trace_record& record = self->m_records[self->m_count++];
+			record.m_opcode = state.m_opcode;
+			record.m_pc = regs.m_pc;
+			record.m_index = regs.m_index;
+			record.m_sp = regs.m_sp;
+			memcpy(record.m_v, regs.m_v, sizeof(record.m_v));
 		}
-		
-		void advance(uint8_t key_buffer[c_maxKeys])
-		{		
-			// Update key data and keep the previous key data around.
-			memcpy(m_input.m_prev_key, m_input.m_key, sizeof(uint8_t) * c_maxKeys);
-			memcpy(m_input.m_key, key_buffer, sizeof(uint8_t) * c_maxKeys);
 
-			// Fetch, decode, execute cycle
-			if (!m_isWaitingForInput)
-			{
-				fetch();
-				decode();
-			}
-			execute();
+	private:
+		FILE*							m_output;
+		std::unique_ptr<trace_record[]>	m_records;
+		size_t							m_capacity;
+		size_t							m_count = 0;
+	};
+#endif
 
-			// Timers update at 60Hz
-			auto const now = std::chrono::high_resolution_clock::now();
-			auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_frame_end).count();
-			if (elapsed_ms >= 16.66f)
-			{
-				if (m_timers.m_delay > 0)
-					m_timers.m_delay--;
+	// Instruction compatibility and interpreter mode flags
+	// All the "legacy" ones refer to the original CHIP-8 implementation
+	// Relevant read on how those are assembled for each mode: https://games.gulrak.net/cadmium/chip8-opcode-table.html
+	enum flags : uint8_t
+	{
+		none = 0,
+		shift_legacy = 1 << 0,
+		store_load_legacy = 1 << 1,
+		jump_offset_legacy = 1 << 2,
+		logical_legacy = 1 << 3,
+		disp_sync_legacy = 1 << 4,
+		draw_legacy = 1 << 5,
+		all_legacy = shift_legacy | store_load_legacy | jump_offset_legacy | logical_legacy | disp_sync_legacy | draw_legacy,
+		// operation modes
+		chip8_original = all_legacy,
+		chip8_schip = draw_legacy,
+		chip8_xochip = store_load_legacy | jump_offset_legacy | shift_legacy,
+		// not a behaviour: used as the basic_interpreter parameter when flags are only known at run time
+		runtime_flags = 1 << 7
+	};
 
-				if (m_timers.m_sound > 0)
-					m_timers.m_sound--;
+#if !defined(TINY8_FREESTANDING)
+	template<class Handler>
+	struct instruction_family;
 
-				m_frame_end = std::chrono::high_resolution_clock::now();
-			}
-		}
+	// Represents an instruction, along with a callback for execution. 
+	template<class Handler>
+	struct instruction
+	{
+		Handler						m_body;
+		instruction_family<Handler>*	m_family;
+	};
 
-		// Accessors
-		memory* const get_memory() { return &m_memory; }
-		display* const get_display() { return &m_display; }
-		registers* const get_registers() { return &m_registers; }
-		timers* const get_timers() { return &m_timers; }
-		input* const get_input() { return &m_input; }
+	// Represents an instruction family, denoted by the first nibble of the opcode. A family can have one or more instructions based on certain opcode nibbles.
+	template<class Handler>
+	struct instruction_family
+	{
+		std::unordered_map<uint8_t, instruction<Handler>> m_instructions;
+		uint16_t	m_opcodeMask;
+	};
+#endif
 
-	private:
-		using time_point = std::chrono::high_resolution_clock::time_point;
+	// Dispatch table constants.
+	// Every instruction is uniquely identified by its family (first nibble) and its low byte, so the table is indexed by those 12 bits.
+	constexpr size_t	c_dispatchTableSize = 0x1000;
 
-		memory			m_memory;
-		display			m_display;
-		registers		m_registers;
-		timers			m_timers;
-		input			m_input;
-		decode_state	m_state;
+	// Get the dispatch table index for a given opcode.
+	constexpr uint16_t dispatch_index(uint16_t opcode)
+	{
+		return ((opcode & 0xf000) >> 4) | (opcode & 0x00ff);
+	}
 
-		decode_state	m_previousState;
+	// How the decode cache runs a block, from cold to hot, see basic_interpreter::set_tier_thresholds().
+	enum class tier : uint8_t
+	{
+		interpreted,	// Fetched and decoded an instruction at a time through the regular path, nothing cached.
+		decoded,		// Pre-decoded instructions (and superinstructions) from the cache.
+		native,			// Translated by the block compiler.
+		count
+	};
 
-		time_point		m_frame_end;
-		bool			m_isWaitingForInput = false;
-		flags			m_flags;
+	// Counters of the control flow edges between decode cache blocks, see basic_interpreter::set_coverage_map().
+	constexpr size_t	c_coverageMapSize = 0x1000;
 
-		std::unordered_map<uint8_t, instruction_family> m_families;
-		instruction const* m_currentInstruction = nullptr;
-		
-		// Fetch the next opcode and update the decoder state.
-		void fetch()
-		{
-			uint16_t& pc = m_registers.m_pc;
+	// Entries to a block's address, since the decode cache was last dropped, promoting it to a tier. 0 promotes on the first entry.
+	struct tier_thresholds
+	{
+		uint16_t	m_decode = 0;
+		uint16_t	m_compile = 0;
+	};
 
-			m_previousState = m_state;
+	// What each tier of a decode cache ran since it was enabled.
+	struct tier_counts
+	{
+		uint64_t	m_instructions[size_t(tier::count)] = {};
+		uint64_t	m_promotions[size_t(tier::count)] = {};	// Blocks decoded, and compiled. None are promoted to interpreted.
+	};
 
-			m_state.m_opcode = (m_memory.m_data[pc] << 8) | m_memory.m_data[pc + 1];
-			m_state.m_x = static_cast<uint8_t>((m_state.m_opcode >> 8) & 0x000f);
-			m_state.m_y = static_cast<uint8_t>((m_state.m_opcode >> 4) & 0x000f);
-			m_state.m_n = static_cast<uint8_t>(m_state.m_opcode & 0x000f);
-			m_state.m_nn = static_cast<uint8_t>(m_state.m_opcode & 0x00ff);
-			m_state.m_nnn = static_cast<uint16_t>(m_state.m_opcode & 0x0fff);
-			
-			// Advance program counter. It's fine to do this here, as very few instructions modify the counter during execution.
-			pc += 2;
+#if defined(TINY8_PROFILE)
+	// Profiling - only compiled in when TINY8_PROFILE is defined, see basic_interpreter::set_profiling().
+	struct frame_counts
+	{
+		uint64_t	m_instructions = 0;
+		uint64_t	m_draws = 0;		// Dxyn.
+		uint64_t	m_clears = 0;		// 00E0.
+		uint64_t	m_waits = 0;		// Fx0A executions that kept waiting for a key.
+		uint64_t	m_idle = 0;			// Idle loop instructions fast-forwarded instead of executed (not in the opcode or address counts).
+	};
+
+	// Execution counts of a running interpreter. Opcodes are counted per dispatch table slot (see dispatch_index()) and every
+	// executed instruction counts a hit at its address. Frames end whenever the 60Hz timers tick.
+	template<size_t MemorySize>
+	struct basic_profile
+	{
+		uint64_t		m_opcodes[c_dispatchTableSize] = {};
+		uint64_t		m_pcHits[MemorySize] = {};
+		frame_counts	m_frame;			// The frame in progress.
+		frame_counts	m_lastFrame;		// The last completed frame.
+		frame_counts	m_peak;				// Highest count of each over the completed frames.
+		frame_counts	m_total;			// All completed frames.
+		uint64_t		m_frames = 0;
+		tier_counts		m_tiers;			// What each tier of the decode cache ran, see basic_interpreter::set_tier_thresholds().
+
+		void record(uint16_t opcode, uint32_t address)
+		{
+			m_opcodes[dispatch_index(opcode)]++;
+			m_pcHits[address]++;
+			m_frame.m_instructions++;
+			m_frame.m_draws += (opcode & 0xf000) == 0xd000;
+			m_frame.m_clears += opcode == 0x00e0;
 		}
 
-		// Get an instruction family for a given opcode and decode the instruction.
-		void decode()
+		void end_frame()
 		{
-			uint8_t const family_key = (m_state.m_opcode & 0xf000) >> 8;
-			auto const& family = m_families[family_key];
+			m_peak.m_instructions = std::max(m_peak.m_instructions, m_frame.m_instructions);
+			m_peak.m_draws = std::max(m_peak.m_draws, m_frame.m_draws);
+			m_peak.m_clears = std::max(m_peak.m_clears, m_frame.m_clears);
+			m_peak.m_waits = std::max(m_peak.m_waits, m_frame.m_waits);
+			m_peak.m_idle = std::max(m_peak.m_idle, m_frame.m_idle);
 
-			auto const instr_it = family.m_instructions.find(m_state.m_opcode & family.m_opcodeMask);
-			if (instr_it == family.m_instructions.end())
-			{
-				unimplemented(m_state.m_opcode);
-			}
+			m_total.m_instructions += m_frame.m_instructions;
+			m_total.m_draws += m_frame.m_draws;
+			m_total.m_clears += m_frame.m_clears;
+			m_total.m_waits += m_frame.m_waits;
+			m_total.m_idle += m_frame.m_idle;
 
-			m_currentInstruction = &instr_it->second;
+			m_lastFrame = m_frame;
+			m_frame = frame_counts();
+			m_frames++;
 		}
 
-		void execute()
+		// Print the frame averages and peaks, then the most executed opcode slots and instruction addresses.
+		// Slots are printed as the family nibble, an x and the low byte, e.g. Fx0A, Dx15.
+		void dump(FILE* output, size_t top = 10) const
 		{
-			assert(m_currentInstruction != nullptr);
-
-			printf("Pre-execute opcode: 0x%04x, pc: 0x%04x, sp: 0x%04x\n", m_state.m_opcode, m_registers.m_pc, m_registers.m_sp);
+			double const frames = static_cast<double>(std::max<uint64_t>(m_frames, 1));
+			fprintf(output, "%llu frames: per frame %.1f (peak %llu) instructions, %.2f (%llu) draws, %.2f (%llu) clears, %.1f (%llu) input waits, %.1f (%llu) idle skipped\n",
+				(unsigned long long)m_frames, m_total.m_instructions / frames, (unsigned long long)m_peak.m_instructions, m_total.m_draws / frames,
+				(unsigned long long)m_peak.m_draws, m_total.m_clears / frames, (unsigned long long)m_peak.m_clears, m_total.m_waits / frames, (unsigned long long)m_peak.m_waits,
+				m_total.m_idle / frames, (unsigned long long)m_peak.m_idle);
+			fprintf(output, "tiers: %llu interpreted, %llu decoded, %llu native instructions, %llu blocks decoded, %llu compiled\n",
+				(unsigned long long)m_tiers.m_instructions[size_t(tier::interpreted)], (unsigned long long)m_tiers.m_instructions[size_t(tier::decoded)],
+				(unsigned long long)m_tiers.m_instructions[size_t(tier::native)], (unsigned long long)m_tiers.m_promotions[size_t(tier::decoded)],
+				(unsigned long long)m_tiers.m_promotions[size_t(tier::native)]);
 
-			m_currentInstruction->m_body();
+			uint64_t total = 0;
+			for (uint64_t count : m_opcodes)
+				total += count;
+			if (total == 0)
+				return;
 
-			printf("Post-execute opcode: 0x%04x, pc: 0x%04x, sp: 0x%04x\n", m_state.m_opcode, m_registers.m_pc, m_registers.m_sp);			
+			fprintf(output, "hottest opcodes:");
+			for_top(m_opcodes, top, [&](size_t slot, uint64_t count) { fprintf(output, " %Xx%02X=%.1f%%", (unsigned)(slot >> 8), (unsigned)(slot & 0xff), 100.0 * count / total); });
+			fprintf(output, "\nhottest addresses:");
+			for_top(m_pcHits, top, [&](size_t address, uint64_t count) { fprintf(output, " %03zx=%.1f%%", address, 100.0 * count / total); });
+			fprintf(output, "\n");
 		}
 
-		// Add a new instruction and/or instruction family along with a callback to the instruction's body.
-		template<class T>
-		void add_instruction(uint8_t family_key, uint8_t instruction_key, uint16_t opcodeMask, T&& callback)
-		{				
-			if (!m_families.contains(family_key))
+	private:
+		// Visit the highest non zero counts in descending order, without sorting (or allocating) a copy.
+		template<size_t N, class Visit>
+		static void for_top(uint64_t const (&counts)[N], size_t top, Visit&& visit)
+		{
+			uint64_t below = ~0ull;
+			size_t below_index = 0;
+			for (size_t rank = 0; rank < top; ++rank)
 			{
-				instruction_family family = { .m_opcodeMask = opcodeMask };
-				m_families[family_key] = family;
-			}
+				size_t best = N;
+				for (size_t i = 0; i < N; ++i)
+				{
+					// Ties with the previous pick are taken in address order.
+					bool const after_previous = counts[i] < below || (counts[i] == below && i > below_index);
+					if (counts[i] != 0 && after_previous && (best == N || counts[i] > counts[best]))
+						best = i;
+				}
 
-			auto const it = m_families.find(family_key);
-			instruction const instr = { .m_body = callback, .m_family = &it->second };
+				if (best == N)
+					return;
 
-			it->second.m_instructions[instruction_key] = instr;
+				visit(best, counts[best]);
+				below = counts[best];
+				below_index = best;
+			}
 		}
+	};
+#endif
+
+	// What drives the 60Hz delay and sound timers.
+	enum class timer_mode : uint8_t
+	{
+		wall_clock,	// advance() ticks the timers every 16.66ms of host time.
+		emulated	// Timers tick every cycles-per-frame executed instructions, independently of host speed. Runs are reproducible and can go faster than real time.
+	};
+
+	// Why basic_interpreter::run_slice() returned.
+	enum class slice_end : uint8_t
+	{
+		budget,		// The whole budget ran.
+		frame		// An emulated frame completed and the timers just ticked (timer_mode::emulated only).
+	};
+
+	struct slice_result
+	{
+		uint32_t	m_cycles;	// Instructions run, executed or only counted.
+		slice_end	m_end;
+		bool		m_blocked;	// Waiting on Fx0A with no queued input event left to complete it: only a key change from the host can.
+	};
+
+	// Per-instance storage beyond the machine state. compact drops the copy of the rom kept for reset() (the caller keeps the rom
+	// alive instead, so many instances share one image) and shrinks the input queue, for sweeps running very many instances.
+	enum class footprint : uint8_t
+	{
+		full,
+		compact,
+	};
+
+	constexpr size_t	c_compactInputQueueSize = 8;
+
+
+	// How a decoded opcode is resolved to its instruction handler.
+	enum class dispatch_mode : uint8_t
+	{
+		families,	// Instruction family maps built once per flags combination and shared across all instances, looked up on every decode.
+		table		// Flat handler table built once per flags combination and shared across all instances; decode is a single indexed load.
+	};
+
+	// Constructs an interpreter in storage already known to be all zero bytes (a fresh anonymous mapping, calloc), see the
+	// basic_interpreter constructors taking it.
+	struct zeroed_storage_t { explicit zeroed_storage_t() = default; };
+	inline constexpr zeroed_storage_t zeroed_storage{};
+
+	// Threaded run loop flavour, see basic_interpreter::set_threaded_dispatch(). Defaults to guaranteed tail calls where Clang
+	// supports them, computed goto on other GCC compatible compilers and a switch everywhere else (MSVC).
+#define TINY8_THREADED_SWITCH		0
+#define TINY8_THREADED_GOTO			1
+#define TINY8_THREADED_TAIL_CALL	2
+
+#if defined(__clang__) && defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define TINY8_MUSTTAIL [[clang::musttail]]
+#endif
+#endif
+#if !defined(TINY8_MUSTTAIL)
+#define TINY8_MUSTTAIL
+#endif
+
+#if !defined(TINY8_THREADED_CORE)
+#if defined(__clang__) && defined(__has_cpp_attribute) && __has_cpp_attribute(clang::musttail) && defined(__x86_64__)
+#define TINY8_THREADED_CORE TINY8_THREADED_TAIL_CALL
+#elif defined(__GNUC__)
+#define TINY8_THREADED_CORE TINY8_THREADED_GOTO
+#else
+#define TINY8_THREADED_CORE TINY8_THREADED_SWITCH
+#endif
+#endif
+
+	// Every distinct instruction handler as (name, handler). The threaded run loops dispatch on the position in this list.
+#define TINY8_HANDLERS(X) \
+	X(unimplemented, op_unimplemented) \
+	X(00cn, op_00cn) X(00dn, op_00dn) X(00e0, op_00e0) X(00ee, op_00ee) X(00fb, op_00fb) X(00fc, op_00fc) X(00fe, op_00fe) X(00ff, op_00ff) \
+	X(1nnn, op_1nnn) X(2nnn, op_2nnn) X(3xnn, op_3xnn) X(4xnn, op_4xnn) X(5xy0, op_5xy0) X(5xy2, op_5xy2) X(5xy3, op_5xy3) \
+	X(6xnn, op_6xnn) X(7xnn, op_7xnn) X(8xy0, op_8xy0) X(8xy1, op_8xy1<false>) X(8xy1_legacy, op_8xy1<true>) \
+	X(8xy2, op_8xy2<false>) X(8xy2_legacy, op_8xy2<true>) X(8xy3, op_8xy3<false>) X(8xy3_legacy, op_8xy3<true>) \
+	X(8xy4, op_8xy4) X(8xy5, op_8xy5) X(8xy6, op_8xy6<false>) X(8xy6_legacy, op_8xy6<true>) X(8xy7, op_8xy7) \
+	X(8xye, op_8xye<false>) X(8xye_legacy, op_8xye<true>) X(9xy0, op_9xy0) X(annn, op_annn) \
+	X(bnnn, op_bnnn<false>) X(bnnn_legacy, op_bnnn<true>) X(cxnn, op_cxnn) X(dxyn, op_dxyn<false>) X(dxyn_legacy, op_dxyn<true>) \
+	X(ex9e, op_ex9e) X(exa1, op_exa1) X(f000, op_f000) X(fn01, op_fn01) X(f002, op_f002) X(fx07, op_fx07) X(fx0a, op_fx0a) X(fx15, op_fx15) X(fx18, op_fx18) X(fx1e, op_fx1e) \
+	X(fx29, op_fx29) X(fx30, op_fx30) X(fx33, op_fx33) X(fx3a, op_fx3a) X(fx55, op_fx55<false>) X(fx55_legacy, op_fx55<true>) X(fx65, op_fx65<false>) X(fx65_legacy, op_fx65<true>)
+
+	// Runs many interpreters in lockstep (tiny8_lockstep.h), needs access to their internals.
+	template<class Interpreter>
+	class basic_lockstep;
+
+	// The chip-8 interpreter.
+	// F selects the behaviour flags at compile time: the dispatch table is then a constexpr array and quirk variants are resolved by the compiler.
+	// With F = runtime_flags (see the interpreter alias below), flags are passed to the constructor instead.
+	// MemorySize is the address space: classic instances keep 4KB so the whole machine stays cache resident, XO-CHIP ones use 64KB.
+	// Every memory access wraps around it with a mask.
+	// Footprint selects what an instance keeps besides its machine state, see footprint.
+	template<flags F, size_t MemorySize = c_maxMemory, footprint Footprint = footprint::full>
+	class basic_interpreter : private basic_machine_state<MemorySize>
+	{
+	public:
+		using flags = tiny8::flags;
+		using enum tiny8::flags;
+
+		using memory = basic_memory<MemorySize>;
+		using machine_state = basic_machine_state<MemorySize>;
+
+		static constexpr size_t c_memorySize = MemorySize;
+		static constexpr size_t c_maxRomSize = MemorySize - c_romStartAddress;
+		static constexpr bool c_compact = Footprint == footprint::compact;
+		static constexpr size_t c_inputQueueSize = c_compact ? c_compactInputQueueSize : tiny8::c_inputQueueSize;
+
+		// Signature of an instruction body. Handlers are plain functions (no captures), so a single table of them can be shared by any number of interpreters.
+		using handler = void(*)(basic_interpreter&, decode_state const&);
+		using dispatch_table = std::array<handler, c_dispatchTableSize>;
+
+		// An instruction as kept in the decode cache.
+		struct decoded_instruction
+		{
+			decode_state	m_state;
+			handler			m_handler;
+		};
+
+		// Native code for a whole block of decoded instructions, see set_block_compiler().
+		using native_block = void(*)(basic_interpreter&);
+
+		// Hooks for translating decode cache blocks to native code (see tiny8_jit.h). The block starting at address is made of
+		// instructions[address], instructions[address + 2]... up to length instructions. m_compile returns nullptr for blocks it can't
+		// translate, which are then interpreted; m_reset is called whenever the cache is dropped.
+		struct block_compiler
+		{
+			native_block	(*m_compile)(void* user_data, basic_interpreter& self, decoded_instruction const* instructions, uint32_t address, uint32_t length) = nullptr;
+			void			(*m_reset)(void* user_data) = nullptr;
+			void*			m_userData = nullptr;
+		};
+
+		// A decode cache frozen for several interpreters to run from, see share_decode_cache().
+		struct shared_decode_cache;
+
+		// True when the behaviour flags are fixed at compile time.
+		static constexpr bool c_staticFlags = F != runtime_flags;
+
+#if defined(TINY8_FREESTANDING)
+		static_assert(c_staticFlags, "TINY8_FREESTANDING needs the behaviour flags at compile time, e.g. basic_interpreter<chip8_schip>");
+#else
+		// Constructor - initialise the chip-8 interpreter internal data.
+		basic_interpreter(flags behaviour_flags = flags::none, dispatch_mode mode = dispatch_mode::families) requires (!c_staticFlags) : m_flags(behaviour_flags)
+		{
+			initialise(false);
+			use_shared_dispatch(mode);
+		}
+
+		// Same as above in zeroed storage: memory, stack, display and registers are taken as found instead of cleared, so only the
+		// font and the small fields are written and the pages of a fresh mapping stay untouched until the instance runs.
+		basic_interpreter(zeroed_storage_t, flags behaviour_flags = flags::none, dispatch_mode mode = dispatch_mode::families) requires (!c_staticFlags) : m_flags(behaviour_flags)
+		{
+			initialise(true);
+			use_shared_dispatch(mode);
+		}
+#endif
+
+		// Constructor - flags are known at compile time, so dispatch always goes through the constexpr table.
+		basic_interpreter() requires (c_staticFlags) : m_flags(F)
+		{
+			initialise(false);
+			use_static_table();
+		}
+
+		// Same as above in zeroed storage.
+		explicit basic_interpreter(zeroed_storage_t) requires (c_staticFlags) : m_flags(F)
+		{
+			initialise(true);
+			use_static_table();
+		}
+
+		// Build the dispatch table for a given flags combination. Slots without an instruction trap as unimplemented.
+		static constexpr dispatch_table build_dispatch_table(flags f)
+		{
+			dispatch_table table;
+			table.fill(&op_unimplemented);
+
+			// Families keep the opcode mask of their first instruction, same as add_instruction().
+			uint16_t family_masks[16] = {};
+			bool family_seen[16] = {};
+			register_instructions(f, [&](uint8_t family_key, uint8_t instruction_key, uint16_t opcodeMask, handler body)
+				{
+					uint8_t const family = family_key >> 4;
+					if (!family_seen[family])
+					{
+						family_seen[family] = true;
+						family_masks[family] = opcodeMask;
+					}
+
+					// Masks only ever cover the low byte, so every low byte matching the key gets the handler.
+					for (uint16_t low = 0; low <= 0xff; ++low)
+					{
+						if ((low & family_masks[family]) == instruction_key)
+							table[(family << 8) | low] = body;
+					}
+				});
+
+			return table;
+		}
+		
+		// Execute a single instruction and update the timers (see timer_mode).
+		void advance(uint8_t key_buffer[c_maxKeys])
+		{		
+			// Blocked on Fx0A with the same keys: the instruction would only rescan them, so it's skipped but still counted.
+			uint16_t const keys = key_mask(key_buffer);
+			bool const blocked = keys == m_input.m_keys && fast_forward_input_wait(1);
+			if (blocked && m_timerMode == timer_mode::emulated)
+				return;
+
+			if (!blocked)
+			{
+				// Update key data and keep the previous key data around.
+				latch_input(keys);
+
+				if (m_timerMode == timer_mode::emulated)
+				{
+					run_emulated(1);
+					return;
+				}
+
+				// Fetch, decode, execute cycle
+				step();
+			}
+
+			// Timers update at 60Hz
+#if defined(TINY8_FREESTANDING)
+			if (m_tickSource == nullptr)
+				return;
+
+			uint32_t const now = m_tickSource(m_tickUserData);
+			if (now - m_lastTick >= 17)
+			{
+				tick_timers();
+				m_lastTick = now;
+			}
+#else
+			auto const now = std::chrono::high_resolution_clock::now();
+			auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_frame_end).count();
+			if (elapsed_ms >= 16.66f)
+			{
+				tick_timers();
+				m_frame_end = std::chrono::high_resolution_clock::now();
+			}
+#endif
+		}
+
+#if defined(TINY8_FREESTANDING)
+		// Milliseconds from any origin, free to wrap around, read by advance() to tick the timers in timer_mode::wall_clock (a
+		// SysTick counter, say). Without one they only tick in timer_mode::emulated.
+		using tick_source = uint32_t(*)(void* user_data);
+
+		void set_tick_source(tick_source source, void* user_data = nullptr)
+		{
+			m_tickSource = source;
+			m_tickUserData = user_data;
+			m_lastTick = source != nullptr ? source(user_data) : 0;
+		}
+#endif
+
+		// Execute a number of instructions in one go. Input is latched once for the whole batch and the clock is never read.
+		// With timer_mode::wall_clock the timers are left alone; with timer_mode::emulated they tick on every frame boundary crossed.
+		// Same result as calling advance() with the same keys that many times, minus the wall clock timer updates.
+		void run_cycles(uint32_t cycles, uint8_t const key_buffer[c_maxKeys])
+		{
+			if (cycles == 0)
+				return;
+
+			latch_input(key_mask(key_buffer));
+			run_latched(cycles);
+		}
+
+		// Same as above, holding the current keys and applying the queued input events at their cycles instead.
+		void run_cycles(uint32_t cycles) { run_latched(cycles); }
+
+		// Run up to budget instructions like run_cycles(), stopping early at the end of an emulated frame, so hosts multiplexing many
+		// instances get control back at natural points (see tiny8_async.h). When the slice ends blocked on Fx0A, the host may park
+		// the instance until its keys change: running it meanwhile only counts instructions and ticks timers.
+		slice_result run_slice(uint32_t budget)
+		{
+			uint32_t cycles = budget;
+			if (m_timerMode == timer_mode::emulated)
+				cycles = std::min(cycles, m_cyclesPerFrame - m_frameCycles);
+
+			run_latched(cycles);
+
+			bool const frame = m_timerMode == timer_mode::emulated && cycles > 0 && m_frameCycles == 0;
+			return { cycles, frame ? slice_end::frame : slice_end::budget, m_isWaitingForInput && m_inputCount == 0 };
+		}
+
+		// Execute one emulated 60Hz frame: cycles_per_frame instructions followed by a single timer tick.
+		// With timer_mode::emulated this instead runs up to the next frame boundary, using the rate given to set_timer_mode().
+		void run_frame(uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			if (m_timerMode == timer_mode::emulated)
+			{
+				run_cycles(m_cyclesPerFrame - m_frameCycles, key_buffer);
+				return;
+			}
+
+			run_cycles(cycles_per_frame, key_buffer);
+			tick_timers();
+		}
+
+		// Same as above, holding the current keys and applying the queued input events instead.
+		void run_frame(uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			if (m_timerMode == timer_mode::emulated)
+			{
+				run_latched(m_cyclesPerFrame - m_frameCycles);
+				return;
+			}
+
+			run_latched(cycles_per_frame);
+			tick_timers();
+		}
+
+		// For hosts running a run_frame() in pieces (see tiny8_debug.h): latch the keys as run_frame() does and return the number of
+		// instructions the frame runs, to execute with run_cycles() holding the keys. Call end_frame() once they have all run.
+		uint32_t begin_frame(uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			latch_input(key_mask(key_buffer));
+			return m_timerMode == timer_mode::emulated ? m_cyclesPerFrame - m_frameCycles : cycles_per_frame;
+		}
+
+		void end_frame()
+		{
+			if (m_timerMode != timer_mode::emulated)
+				tick_timers();
+		}
+
+		// Queue a key press or release to take effect right before the instruction executed at a given get_cycles() count, so
+		// batched runs see input at the exact instruction it happened on (scripted input, replays). Events must be queued in cycle
+		// order; ones already in the past apply before the next instruction. Returns false if the queue is full.
+		bool queue_input(uint64_t cycle, uint8_t key, bool pressed)
+		{
+			if (m_inputCount == c_inputQueueSize || key >= c_maxKeys)
+				return false;
+
+			assert(m_inputCount == 0 || m_inputQueue[(m_inputFirst + m_inputCount - 1) % c_inputQueueSize].m_cycle <= cycle);
+			m_inputQueue[(m_inputFirst + m_inputCount) % c_inputQueueSize] = { cycle, key, pressed };
+			m_inputCount++;
+			return true;
+		}
+
+		// Number of queued input events that haven't taken effect yet.
+		size_t pending_input() const { return m_inputCount; }
+
+		// Returns the key_mask() of the keys held right now.
+		using input_poll = uint16_t(*)(void* user_data);
+
+		// Poll the keys every interval instructions while running (and before the first one), for frontends whose input arrives
+		// while a whole frame runs in one go: a change is latched right away, like a queued event, so it takes effect within
+		// interval instructions of the poll seeing it instead of at the next frame. Runs polling live input aren't reproducible.
+		// nullptr stops polling; without a poll the run loops only pay a branch per span of held keys.
+		void set_input_poll(input_poll poll, void* user_data = nullptr, uint32_t interval = 1)
+		{
+			assert(interval > 0);
+			m_inputPoll = poll;
+			m_inputPollUserData = user_data;
+			m_inputPollInterval = interval;
+			m_nextInputPoll = m_cycles;
+		}
+
+		// Returns the number of instructions until the next sample, at least 1.
+		using sampler = uint32_t(*)(void* user_data, basic_interpreter& self);
+
+		// Call a sampler every so many instructions while running, starting after the first ones, and then as it asks (see
+		// tiny8_sampler.h). Runs stop at sample points like they do at queued input, so unlike set_profiling() nothing is counted per
+		// instruction and the threaded loop, the decode cache and native blocks keep running. nullptr stops sampling.
+		void set_sampler(sampler callback, void* user_data = nullptr, uint32_t first = 1)
+		{
+			assert(first > 0);
+			m_sampler = callback;
+			m_samplerUserData = user_data;
+			m_sampleInterval = first;
+			m_nextSample = m_cycles + first;
+		}
+
+		// Select what drives the timers. In timer_mode::emulated, cycles_per_frame instructions make up one 60Hz frame.
+		void set_timer_mode(timer_mode mode, uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			assert(cycles_per_frame > 0);
+
+			m_timerMode = mode;
+			m_cyclesPerFrame = cycles_per_frame;
+			m_frameCycles = 0;
+		}
+
+		timer_mode get_timer_mode() const { return m_timerMode; }
+		uint32_t get_cycles_per_frame() const { return m_cyclesPerFrame; }
+
+		// Copy a rom into memory at c_romStartAddress, keeping a copy of it for reset(). Returns false, leaving memory untouched, if it
+		// doesn't fit. A footprint::compact instance keeps the span instead: the rom must stay alive until another one is loaded.
+		bool load_rom(std::span<uint8_t const> rom)
+		{
+			if (rom.size() > c_maxRomSize)
+				return false;
+
+			if constexpr (c_compact)
+			{
+				m_romImage = rom;
+			}
+			else
+			{
+				if (rom.data() != m_romImage)
+					memcpy(m_romImage, rom.data(), rom.size());
+				m_romSize = static_cast<uint32_t>(rom.size());
+			}
+
+			memcpy(m_memory.rom(), rom.data(), rom.size());
+			invalidate_decode_cache();
+#if defined(TINY8_WRITE_TRACKING)
+			mark_written(c_romStartAddress, static_cast<uint32_t>(rom.size()));
+#endif
+			return true;
+		}
+
+		// Start over with a rom, in place: memory, display, registers, timers, input, audio, cycle counts and the random state go back
+		// to what the constructor leaves, while the configuration (dispatch, timer mode, stack depth, decode cache, callbacks) stays.
+		// Nothing is allocated. Returns false, with the machine reset and no rom loaded, if it doesn't fit.
+		bool reset(std::span<uint8_t const> rom)
+		{
+			reset_state();
+			return load_rom(rom);
+		}
+
+		// Same as above, switching to other behaviour flags. The dispatch structures of a flags combination are built (and
+		// allocated) the first time any instance uses it.
+#if !defined(TINY8_FREESTANDING)
+		bool reset(std::span<uint8_t const> rom, flags behaviour_flags) requires (!c_staticFlags)
+		{
+			switch_flags(behaviour_flags);
+			return reset(rom);
+		}
+#endif
+
+		// Restart the rom loaded last, from the copy load_rom() kept: the same as constructing a new interpreter and loading the rom
+		// again, minus building anything. Memory written through get_memory() afterwards (pokes) has to be written again.
+		void reset()
+		{
+			if constexpr (c_compact)
+				reset(m_romImage);
+			else
+				reset(std::span<uint8_t const>(m_romImage, m_romSize));
+		}
+
+#if !defined(TINY8_FREESTANDING)
+		void reset(flags behaviour_flags) requires (!c_staticFlags)
+		{
+			switch_flags(behaviour_flags);
+			reset();
+		}
+#endif
+
+		// Seed the Cxnn random number generator. Machines with the same seed draw the same numbers.
+		void set_seed(uint64_t seed) { m_random = random_state(seed); }
+
+		// Total number of instructions executed so far.
+		uint64_t get_cycles() const { return m_cycles; }
+
+		// True while an Fx0A is waiting for a key press and release; the next step executes it again.
+		bool is_waiting_for_input() const { return m_isWaitingForInput; }
+
+		// True after a draw with disp_sync_legacy, until the next timer tick: like the original interpreter waiting for the vertical
+		// blank, instructions up to the end of the frame are only counted. Run loops return as soon as a draw starts the wait, so a
+		// batch moves on to its next instance instead of burning the rest of the frame.
+		bool is_waiting_for_vblank() const { return m_isWaitingForVblank; }
+
+		// True while waiting on Fx0A when the given keys can't complete it: they match the latched ones and no press or release is
+		// left to be seen. advance(), run_cycles() and run_frame() then only count the instructions (and tick emulated timers)
+		// without executing anything, so the host can sleep or run other instances until a key changes.
+		bool is_blocked_on_input(uint8_t const key_buffer[c_maxKeys]) const
+		{
+			return m_isWaitingForInput && key_mask(key_buffer) == m_input.m_keys && m_input.m_keys == m_input.m_prevKeys;
+		}
+
+		// Returned by quiet_frames() when nothing observable happens again until a key changes.
+		static constexpr uint32_t c_quietUntilInput = ~0u;
+
+		// For power saving hosts, called between frames: how many 60Hz frames from here on can't change anything observable (screen,
+		// memory, sound) unless a key changes, 0 when that can't be told. Frames are quiet while blocked on Fx0A and while a delay timer
+		// busy-wait spins until the timer lets it out, never while a tone plays. The host can sleep that long, waking early on input,
+		// then catch up with run_frame(), which fast-forwards quiet frames, and present only when the display's m_version moved.
+		uint32_t quiet_frames() const
+		{
+			if (m_timers.m_sound > 0)
+				return 0;
+
+			if (m_isWaitingForInput)
+				return m_input.m_keys == m_input.m_prevKeys && m_inputCount == 0 ? c_quietUntilInput : 0;
+
+			return idle_loop_frames();
+		}
+
+		// Split an opcode into its fields. On little endian hosts the fields are built as one word and stored at once, rather than
+		// as five separate bytes and halves the compiler keeps apart.
+		static constexpr decode_state decode_opcode(uint16_t opcode)
+		{
+			if constexpr (std::endian::native == std::endian::little)
+			{
+				uint64_t const op = opcode;
+				return std::bit_cast<decode_state>(op | ((op & 0x0f00) << 8) | ((op & 0x00f0) << 20) | ((op & 0x000f) << 32) |
+					((op & 0x00ff) << 40) | ((op & 0x0fff) << 48));
+			}
+
+			decode_state s{};
+			s.m_opcode = opcode;
+			s.m_x = static_cast<uint8_t>((opcode >> 8) & 0x000f);
+			s.m_y = static_cast<uint8_t>((opcode >> 4) & 0x000f);
+			s.m_n = static_cast<uint8_t>(opcode & 0x000f);
+			s.m_nn = static_cast<uint8_t>(opcode & 0x00ff);
+			s.m_nnn = static_cast<uint16_t>(opcode & 0x0fff);
+			return s;
+		}
+
+		// Accessors
+		memory* const get_memory() { return &m_memory; }
+		display* const get_display() { return &m_display; }
+		registers* const get_registers() { return &m_registers; }
+		timers* const get_timers() { return &m_timers; }
+		audio* const get_audio() { return &m_audio; }
+		input* const get_input() { return &m_input; }
+
+		// 64-bit hash of the screen (both planes and the resolution), so runs are compared without diffing the framebuffer. It's kept
+		// until the next instruction that changes the display; bump m_version after writing pixels through get_display().
+		uint64_t display_hash() const
+		{
+			if (!m_displayHashValid || m_displayHashVersion != m_display.m_version)
+			{
+				m_displayHash = xxhash64(m_display.m_planes, sizeof(m_display.m_planes), m_display.m_hires);
+				m_displayHashVersion = m_display.m_version;
+				m_displayHashValid = true;
+			}
+			return m_displayHash;
+		}
+
+		// 64-bit hash of everything the machine goes on from: memory and stack, screen, registers, timers, sound, keys, cycle counts,
+		// random state and a pending Fx0A or vertical blank wait. Machines with the same hash run the same from there on given the same
+		// input. Fields are hashed one by one, so padding and the decoder scratch state never make equal machines differ.
+		uint64_t state_hash() const
+		{
+			uint64_t h = xxhash64(m_memory.m_data, sizeof(m_memory.m_data), display_hash());
+			h = xxhash64(m_memory.m_stack, sizeof(m_memory.m_stack), h);
+			h = xxhash64(&m_display.m_planeMask, sizeof(m_display.m_planeMask), h);
+
+			uint8_t fields[sizeof(registers) + sizeof(timers) + sizeof(audio) + sizeof(input) + 32];
+			uint8_t* out = fields;
+			auto const put = [&out](auto const& value) { memcpy(out, &value, sizeof(value)); out += sizeof(value); };
+			put(m_registers.m_index);
+			put(m_registers.m_sp);
+			put(m_registers.m_pc);
+			put(m_registers.m_v);
+			put(m_timers.m_delay);
+			put(m_timers.m_sound);
+			put(m_audio.m_pattern);
+			put(m_audio.m_pitch);
+			put(m_input.m_keys);
+			put(m_input.m_prevKeys);
+			put(m_cycles);
+			put(m_frameCycles);
+			put(m_random);
+			put(m_isWaitingForInput);
+			put(m_isWaitingForVblank);
+			return xxhash64(fields, static_cast<size_t>(out - fields), h);
+		}
+
+		// Snapshots: copy the whole machine state out of, or back into, the interpreter.
+		void save_state(machine_state& state) const { state = *this; }
+		void load_state(machine_state const& state)
+		{
+			static_cast<machine_state&>(*this) = state;
+			m_displayHashValid = false;
+
+			// Memory may differ completely from the one the cached blocks were decoded from.
+			invalidate_decode_cache();
+#if defined(TINY8_WRITE_TRACKING)
+			mark_written(0, static_cast<uint32_t>(MemorySize));
+#endif
+
+			// A pending Fx0A is executed again on the next step, so its handler has to be resolved from the restored opcode.
+			if (m_isWaitingForInput)
+				decode();
+		}
+
+		// Same as above, switching to the behaviour flags the state was saved with.
+#if !defined(TINY8_FREESTANDING)
+		void load_state(machine_state const& state, flags behaviour_flags) requires (!c_staticFlags)
+		{
+			switch_flags(behaviour_flags);
+			load_state(state);
+		}
+#endif
+
+		// Fast-forward delay timer busy-waits (Fx07, 3xnn/4xnn, jump back) up to the next timer tick instead of executing them.
+		// The skipped iterations would leave the machine in the exact same state, so this is on by default; tracing turns it off.
+		void set_idle_skipping(bool enabled) { m_idleSkipping = enabled; }
+
+		// Keep straight-line blocks of pre-decoded instructions around, keyed by address, so hot loops skip fetch and decode.
+		// Blocks are dropped whenever Fx33/Fx55 write over them. Call invalidate_decode_cache() after writing code through get_memory().
+		void set_decode_cache(bool enabled)
+		{
+#if defined(TINY8_FREESTANDING)
+			// Not without a heap: the cache takes several times the memory of the machine.
+			assert(!enabled);
+			(void)enabled;
+#else
+			if (!enabled)
+			{
+				m_decodeCache.reset();
+				leave_shared_cache();
+			}
+			else if (m_decodeCache == nullptr && m_sharedBlocks == nullptr)
+			{
+				leave_shared_cache();
+				m_decodeCache = std::make_unique<decode_cache>();
+			}
+#endif
+		}
+
+		// Keep the rows of recently drawn sprites shifted into place, keyed by address and bit offset, so drawing one again in the
+		// same column is a lookup and two XORs per row. Sprites are dropped whenever Fx33/Fx55 write over their data, and by
+		// invalidate_decode_cache(), to call after writing through get_memory().
+		void set_sprite_cache(bool enabled)
+		{
+#if defined(TINY8_FREESTANDING)
+			assert(!enabled);
+			(void)enabled;
+#else
+			if (!enabled)
+				m_spriteCache.reset();
+			else if (m_spriteCache == nullptr)
+			{
+				m_spriteCache = std::make_unique<sprite_cache>();
+				m_spriteCache->m_used = true;
+				m_spriteCache->clear();
+			}
+#endif
+		}
+
+		// Drop every cached block, they are decoded again the next time they execute. Shared blocks (see attach_decode_cache()) are
+		// checked against memory before they run again instead. Cached sprites are dropped too.
+		void invalidate_decode_cache()
+		{
+			if (m_spriteCache != nullptr)
+				m_spriteCache->clear();
+			if (m_sharedBlocks != nullptr)
+				m_sharedCheck = true;
+			if (m_decodeCache == nullptr)
+				return;
+
+			memset(m_decodeCache->m_blockLength, 0, sizeof(m_decodeCache->m_blockLength));
+			memset(m_decodeCache->m_code, 0, sizeof(m_decodeCache->m_code));
+			memset(m_decodeCache->m_native, 0, sizeof(m_decodeCache->m_native));
+			memset(m_decodeCache->m_entries, 0, sizeof(m_decodeCache->m_entries));
+
+			block_compiler const& compiler = m_decodeCache->m_compiler;
+			if (compiler.m_reset != nullptr)
+				compiler.m_reset(compiler.m_userData);
+		}
+
+		// Decode the blocks covering the straight-line code from start up to end ahead of time, as the decode cache would the first
+		// time it runs (see tiny8_analysis.h), and compile them with the block compiler if there is one. Does nothing without the
+		// decode cache.
+		void prewarm_decode_cache(uint32_t start, uint32_t end)
+		{
+			if (m_decodeCache == nullptr || m_sharedBlocks != nullptr)
+				return;
+
+			decode_cache& cache = *m_decodeCache;
+			for (uint32_t address = start; address < end && address + 1 < MemorySize; )
+			{
+				uint32_t length = cache.m_blockLength[address];
+				if (length == 0)
+					length = build_block(address);
+
+				if (cache.m_compiler.m_compile != nullptr && cache.m_native[address] == nullptr && !is_instrumented())
+					compile_block(address, length);
+
+				// Execution carries on after the last instruction, past both words of an F000 nnnn.
+				uint32_t const last = address + 2 * (length - 1);
+				address = last + (read_word(last) == 0xf000 ? 4 : 2);
+			}
+		}
+
+		// Translate whole blocks to native code before running them, enabling the decode cache if needed.
+		// Blocks only partially covered by the cycle budget are still interpreted, so instruction counts stay exact.
+		void set_block_compiler(block_compiler const& compiler)
+		{
+			leave_shared_cache();
+			set_decode_cache(true);
+			invalidate_decode_cache();
+			m_decodeCache->m_compiler = compiler;
+		}
+
+		// Run cold code through the regular path and only decode (and compile) the blocks entered often enough to pay for it,
+		// enabling the decode cache if needed. Short runs skip most of the decoding and compiling, long ones still end up running
+		// their hot loops decoded or native. The default, 0 and 0, decodes and compiles every block the first time it runs.
+		void set_tier_thresholds(tier_thresholds const& thresholds)
+		{
+			leave_shared_cache();
+			set_decode_cache(true);
+			m_decodeCache->m_thresholds = thresholds;
+			m_decodeCache->m_lastThreshold = std::max(thresholds.m_decode, thresholds.m_compile);
+		}
+
+		// Instructions run and blocks promoted by each tier, empty without the decode cache.
+		tier_counts get_tier_counts() const { return m_decodeCache != nullptr ? m_decodeCache->m_tierCounts : tier_counts{}; }
+
+		// Run instruction batches through a threaded loop: every handler is inlined and followed by its own fetch and dispatch instead
+		// of returning to a shared one, so the branch predictor sees one indirect jump per instruction kind (see TINY8_THREADED_CORE).
+		// Single steps, the decode cache and tracing keep using the regular loop.
+		void set_threaded_dispatch(bool enabled)
+		{
+			if (!enabled)
+				m_threadedIds = nullptr;
+			else if constexpr (c_staticFlags)
+			{
+				static constexpr threaded_ids s_ids = build_threaded_ids(F);
+				m_threadedIds = &s_ids;
+			}
+#if !defined(TINY8_FREESTANDING)
+			else
+				m_threadedIds = &shared_threaded_ids(m_flags);
+#endif
+		}
+
+		flags get_flags() const { return m_flags; }
+
+		// Make the decode cache start a block at an address (enabling the cache if needed), so a debugger running a block at a time
+		// gets control back right before the instruction there (see tiny8_debug.h). Only decoding looks at these: running costs the
+		// same with or without them.
+		void set_block_break(uint32_t address, bool enabled)
+		{
+			assert(address < MemorySize);
+			leave_shared_cache();
+			set_decode_cache(true);
+
+			decode_cache& cache = *m_decodeCache;
+			uint64_t const bit = 1ull << (address % 64);
+			if (((cache.m_breaks[address / 64] & bit) != 0) == enabled)
+				return;
+
+			cache.m_breaks[address / 64] ^= bit;
+			cache.m_breakCount += enabled ? 1 : -1;
+			invalidate_decode_cache();
+		}
+
+		// Instructions the decode cache runs in one go from the program counter, 1 without it, while waiting or at the end of memory.
+		uint32_t block_length_at_pc()
+		{
+			uint32_t const pc = m_registers.m_pc;
+			if (m_isWaitingForInput || m_isWaitingForVblank || pc + 1 >= MemorySize)
+				return 1;
+			if (m_sharedBlocks != nullptr && use_shared_cache())
+				return is_shared_block_stale(pc) ? 1 : std::max<uint32_t>(m_sharedBlocks->m_blockLength[pc], 1);
+			if (m_decodeCache == nullptr)
+				return 1;
+
+			uint32_t const length = m_decodeCache->m_blockLength[pc];
+			return length != 0 ? length : build_block(pc);
+		}
+
+#if !defined(TINY8_FREESTANDING)
+		// Freeze this interpreter's decode cache, with the native code of its compiled blocks, for any number of interpreters
+		// running the same rom with the same flags to run from, on any thread (see attach_decode_cache()). This interpreter runs
+		// from it too. A block compiler's code must outlive every interpreter using the cache.
+		std::shared_ptr<shared_decode_cache const> share_decode_cache()
+		{
+			assert(m_decodeCache != nullptr);
+
+			auto shared = std::make_shared<shared_decode_cache>();
+			shared->m_cache = std::move(m_decodeCache);
+			memcpy(shared->m_memory, m_memory.m_data, sizeof(m_memory.m_data));
+			std::span<uint8_t const> const rom = rom_image();
+			shared->m_romHash = xxhash64(rom.data(), rom.size(), 0);
+			shared->m_flags = m_flags;
+
+			attach_decode_cache(shared);
+			return shared;
+		}
+
+		// Run from a shared decode cache instead of this interpreter's own, which is dropped. Fails, leaving the interpreter alone,
+		// if the rom or the flags differ. Blocks missing from the cache are interpreted without being cached, and so are the blocks
+		// over code this instance holds differently than the interpreter sharing it did (patched or not yet patched), until it
+		// writes the same code back; the other instances aren't affected. Loading a different rom goes back to a private cache.
+		bool attach_decode_cache(std::shared_ptr<shared_decode_cache const> shared)
+		{
+			std::span<uint8_t const> const rom = rom_image();
+			if (shared->m_flags != m_flags || shared->m_romHash != xxhash64(rom.data(), rom.size(), 0))
+				return false;
+
+			m_decodeCache.reset();
+			if (m_sharedStale == nullptr)
+				m_sharedStale = std::make_unique<uint64_t[]>(MemorySize / 64);
+			m_sharedCache = std::move(shared);
+			m_sharedBlocks = m_sharedCache->m_cache.get();
+			m_sharedCheck = false;
+			mark_stale_shared_code();
+			return true;
+		}
+#endif
+
+		// Count every control flow edge into a decode cache block (enabling the cache if needed) in a map of c_coverageMapSize
+		// counters, AFL style: the previous block's address shifted right once, xored with the new one's. Counters wrap around.
+		// Costs a branch per block without a map; nullptr stops counting. The map must outlive its use.
+		void set_coverage_map(uint8_t* map)
+		{
+			if (map != nullptr)
+				set_decode_cache(true);
+			m_coverageMap = map;
+			m_previousBlock = 0;
+		}
+
+		// True while running from a shared decode cache.
+		bool is_decode_cache_shared() const { return m_sharedBlocks != nullptr; }
+
+		// Execute a single instruction as if it had just been fetched, the program counter pointing past it. Ahead-of-time translated
+		// blocks (tiny8_aot.h) run the instructions they don't translate through this.
+		void execute_opcode(uint16_t opcode) { execute(resolve(opcode), decode_opcode(opcode)); }
+
+		// Name of the instruction an opcode decodes to with these flags, as listed in TINY8_HANDLERS ("8xy6_legacy", "unimplemented").
+		std::string_view instruction_name(uint16_t opcode) const
+		{
+			handler const body = resolve(opcode);
+#define TINY8_HANDLER_NAME(name, handler_body) if (body == &handler_body) return #name;
+			TINY8_HANDLERS(TINY8_HANDLER_NAME)
+#undef TINY8_HANDLER_NAME
+			return "unimplemented";
+		}
+
+		// Calls nested deeper than this many levels overflow the stack; up to c_maxStack.
+		void set_stack_depth(size_t depth)
+		{
+			assert(depth > 0 && depth <= c_maxStack);
+			m_stackDepth = static_cast<uint16_t>(depth);
+		}
+
+		size_t get_stack_depth() const { return m_stackDepth; }
+
+		// Install a callback for unimplemented opcodes and stack overflows and underflows (nullptr only records them). Either way
+		// the offending instruction is skipped and the first fault is kept until clear_fault(), so a runner can check has_fault()
+		// after a batch of instructions and recycle the instance. Empty dispatch slots hold the trap handler, so valid opcodes
+		// pay nothing for it; the stack checks are a single compare in 2nnn and 00EE.
+		void set_trap_callback(trap_callback callback, void* user_data = nullptr)
+		{
+			m_trapCallback = callback;
+			m_trapUserData = user_data;
+		}
+
+		bool has_fault() const { return m_faulted; }
+		fault const& get_fault() const { return m_fault; }
+		void clear_fault() { m_faulted = false; }
+
+#if defined(TINY8_TRACE)
+		// Install a callback invoked before and after every instruction (nullptr disables tracing).
+		void set_trace_callback(trace_callback callback, void* user_data = nullptr)
+		{
+			m_traceCallback = callback;
+			m_traceUserData = user_data;
+		}
+
+		// The instruction fetched before the current one through the regular step path (not the threaded loop or the decode cache).
+		decode_state const& get_previous_state() const { return m_previousState; }
+#endif
+
+#if defined(TINY8_PROFILE)
+		using profile = basic_profile<MemorySize>;
+
+		// Count executions per opcode and address while enabled. Like tracing, profiling runs every instruction through the
+		// regular step path, so the threaded loop and native blocks are bypassed. Enabling starts from zero.
+		void set_profiling(bool enabled)
+		{
+			if (enabled)
+				m_profile = std::make_unique<profile>();
+			else
+				m_profile.reset();
+		}
+
+		// The counts gathered so far, nullptr while profiling is disabled.
+		profile const* get_profile() const { return m_profile.get(); }
+#endif
+
+#if defined(TINY8_WRITE_TRACKING)
+		// Memory write tracking - only compiled in when TINY8_WRITE_TRACKING is defined. Memory is split into c_writePageSize byte
+		// pages and every page written since construction or the last clear_written_pages() has its bit set: by Fx33, Fx55, 5xy2,
+		// load_rom() and load_state() (which marks everything). Call mark_written() after writing through get_memory().
+		static constexpr size_t c_writePageSize = 64;
+		static constexpr size_t c_writePageCount = MemorySize / c_writePageSize;
+
+		// One bit per page, page i in bit i % 64 of word i / 64.
+		using written_pages = std::array<uint64_t, (c_writePageCount + 63) / 64>;
+
+		written_pages const& get_written_pages() const { return m_writtenPages; }
+		bool is_page_written(size_t page) const { return (m_writtenPages[page / 64] >> (page % 64)) & 1; }
+		void clear_written_pages() { m_writtenPages.fill(0); }
+
+		// Mark the pages covering size bytes from address as written, wrapping around the end of memory like the instructions do.
+		void mark_written(uint32_t address, uint32_t size)
+		{
+			if (size == 0)
+				return;
+
+			uint32_t const first = (address & c_addressMask) / c_writePageSize;
+			uint32_t const last = ((address & c_addressMask) + size - 1) / c_writePageSize;
+			for (uint32_t page = first; page <= last; ++page)
+			{
+				uint32_t const wrapped = page % c_writePageCount;
+				m_writtenPages[wrapped / 64] |= 1ull << (wrapped % 64);
+			}
+		}
+#endif
+
+	private:
+		template<class Interpreter>
+		friend class basic_lockstep;
+
+		// The machine state is a dependent base, so its members are brought in by name.
+		using machine_state::m_memory;
+		using machine_state::m_display;
+		using machine_state::m_registers;
+		using machine_state::m_timers;
+		using machine_state::m_audio;
+		using machine_state::m_input;
+		using machine_state::m_state;
+		using machine_state::m_cycles;
+		using machine_state::m_frameCycles;
+		using machine_state::m_random;
+		using machine_state::m_isWaitingForInput;
+		using machine_state::m_isWaitingForVblank;
+
+		static constexpr uint32_t c_addressMask = MemorySize - 1;
+
+#if !defined(TINY8_FREESTANDING)
+		using time_point = std::chrono::high_resolution_clock::time_point;
+#endif
+
+		// Number of distinct flags combinations, used to size the shared dispatch table cache.
+		static constexpr size_t c_flagsCombinations = flags::all_legacy + 1;
+
+		// Position of each handler in TINY8_HANDLERS.
+		enum threaded_id : uint8_t
+		{
+#define TINY8_THREADED_ID(name, body) threaded_##name,
+			TINY8_HANDLERS(TINY8_THREADED_ID)
+#undef TINY8_THREADED_ID
+			threaded_count
+		};
+
+		// Handler position for every dispatch table slot.
+		using threaded_ids = std::array<uint8_t, c_dispatchTableSize>;
+
+		// Longest straight-line block kept in the decode cache.
+		static constexpr uint32_t c_maxBlockLength = 64;
+
+		// A superinstruction: the common pair of instructions starting at pair[0], the second one being pair[2] (the cache is indexed by address).
+		using fused_handler = void(*)(basic_interpreter&, decoded_instruction const* pair);
+
+		// Pre-decoded instructions, see set_decode_cache(). A block is the run of instructions from an address up to and including
+		// the first one that may change the program counter or write memory, so everything before its last instruction runs unconditionally.
+		struct decode_cache
+		{
+			decoded_instruction	m_instructions[MemorySize];		// Instruction decoded at each address.
+			uint8_t				m_blockLength[MemorySize];		// Instructions in the block starting at each address, 0 if not decoded yet.
+			uint64_t			m_code[MemorySize / 64];		// One bit per memory byte covered by a decoded instruction.
+			native_block		m_native[MemorySize];			// Compiled code for the block starting at each address, if any.
+			block_compiler		m_compiler;
+			bool				m_blockFused[MemorySize];		// The block starting at each address has superinstructions.
+			fused_handler		m_fused[MemorySize];			// Superinstruction for the instruction at each address and the next one, if any.
+			uint64_t			m_breaks[MemorySize / 64];		// One bit per address blocks must start at, see set_block_break().
+			uint32_t			m_breakCount;
+			uint16_t			m_entries[MemorySize];			// Times each address was entered as a block, up to m_lastThreshold.
+			tier_thresholds		m_thresholds;
+			uint16_t			m_lastThreshold;
+			tier_counts			m_tierCounts;
+		};
+
+		// Pre-shifted sprites, see set_sprite_cache(). Direct mapped on a hash of the key.
+		struct sprite_cache
+		{
+			static constexpr size_t c_entryBits = 7;
+			static constexpr uint32_t c_noSprite = UINT32_MAX;
+
+			struct entry
+			{
+				uint32_t	m_key;				// Address, shift, rows and width, see cached_sprite().
+				uint32_t	m_dirty;			// Rows with any pixel set.
+				uint64_t	m_bits[16];			// Each row shifted into the word it starts in...
+				uint64_t	m_spill[16];		// ...and what crosses into the next one.
+			};
+
+			entry		m_entries[1 << c_entryBits];
+			uint64_t	m_data[MemorySize / 64];	// One bit per memory byte some cached sprite was read from.
+			bool		m_used;						// Anything cached since the last clear().
+
+			void clear()
+			{
+				if (!m_used)
+					return;
+				for (entry& e : m_entries)
+					e.m_key = c_noSprite;
+				memset(m_data, 0, sizeof(m_data));
+				m_used = false;
+			}
+		};
+
+	public:
+		struct shared_decode_cache
+		{
+			std::unique_ptr<decode_cache>	m_cache;
+			uint8_t							m_memory[MemorySize];	// Memory when the cache was shared, for checking the code of new users.
+			uint64_t						m_romHash;				// xxhash64() of the rom the interpreter sharing it had loaded.
+			flags							m_flags;
+		};
+
+	private:
+
+		// The machine state itself (memory, display, registers, timers, input...) is the machine_state base.
+
+		// Kept until the next attach or set_decode_cache(false), so blocks being run stay alive while an instance stops using them.
+		std::shared_ptr<shared_decode_cache const> m_sharedCache;
+
+#if !defined(TINY8_FREESTANDING)
+		using family_map = std::unordered_map<uint8_t, instruction_family<handler>>;
+#endif
+
+		// Read on every instruction or frame, kept together on the line after the display.
+		alignas(c_cacheLineSize) handler	m_currentHandler = nullptr;
+		dispatch_table const* m_table = nullptr;	// Only set in dispatch_mode::table.
+#if !defined(TINY8_FREESTANDING)
+		family_map const* m_families = nullptr;		// Only set in dispatch_mode::families.
+#endif
+		threaded_ids const* m_threadedIds = nullptr;	// Only set with set_threaded_dispatch(true).
+		std::unique_ptr<decode_cache> m_decodeCache;	// Only set with set_decode_cache(true).
+		std::unique_ptr<sprite_cache> m_spriteCache;	// Only set with set_sprite_cache(true).
+		uint8_t*		m_coverageMap = nullptr;		// Only set with set_coverage_map().
+		uint32_t		m_previousBlock = 0;			// Shifted right once, see set_coverage_map().
+		decode_cache const* m_sharedBlocks = nullptr;	// m_sharedCache's blocks while the rom matches, see attach_decode_cache().
+		std::unique_ptr<uint64_t[]> m_sharedStale;		// A bit per byte of shared code memory holds differently than the snapshot.
+		uint32_t		m_sharedStaleCount = 0;
+		bool			m_sharedCheck = false;			// Memory changed wholesale: check it against m_sharedBlocks before using them.
+#if defined(TINY8_FREESTANDING)
+		tick_source		m_tickSource = nullptr;			// See set_tick_source().
+		void*			m_tickUserData = nullptr;
+		uint32_t		m_lastTick = 0;
+#else
+		time_point		m_frame_end;
+#endif
+		uint32_t		m_cyclesPerFrame = c_defaultCyclesPerFrame;
+		flags			m_flags;
+		timer_mode		m_timerMode = timer_mode::wall_clock;
+		bool			m_idleSkipping = true;
+		uint16_t		m_stackDepth = MemorySize > c_maxMemory ? c_extendedStackDepth : c_defaultStackDepth;
+#if defined(TINY8_TRACE)
+		decode_state	m_previousState;				// See get_previous_state().
+#endif
+		input_poll		m_inputPoll = nullptr;			// See set_input_poll().
+		void*			m_inputPollUserData = nullptr;
+		uint64_t		m_nextInputPoll = 0;
+		uint32_t		m_inputPollInterval = 1;
+		sampler			m_sampler = nullptr;			// See set_sampler().
+		void*			m_samplerUserData = nullptr;
+		uint64_t		m_nextSample = 0;
+		uint32_t		m_sampleInterval = 1;
+
+		// Everything below is only touched on faults, configuration changes or by the tools.
+		trap_callback	m_trapCallback = nullptr;
+		void*			m_trapUserData = nullptr;
+		fault			m_fault = {};					// First fault since clear_fault(), valid while m_faulted.
+		bool			m_faulted = false;
+
+#if defined(TINY8_TRACE)
+		trace_callback	m_traceCallback = nullptr;
+		void*			m_traceUserData = nullptr;
+#endif
+
+#if defined(TINY8_PROFILE)
+		std::unique_ptr<profile> m_profile;		// Only set with set_profiling(true).
+#endif
+
+#if defined(TINY8_WRITE_TRACKING)
+		written_pages	m_writtenPages = {};
+#endif
+
+		std::array<input_event, c_inputQueueSize>	m_inputQueue;		// Ring of events waiting for their cycle, see queue_input().
+		size_t			m_inputFirst = 0;
+		size_t			m_inputCount = 0;
+
+		mutable uint64_t	m_displayHash = 0;			// display_hash() of m_displayHashVersion.
+		mutable uint32_t	m_displayHashVersion = 0;
+		mutable bool		m_displayHashValid = false;
+
+		// The rom loaded last, restored by reset(): a copy, or the caller's with footprint::compact.
+		std::conditional_t<c_compact, std::span<uint8_t const>, uint8_t[c_maxRomSize]>	m_romImage;
+		uint32_t		m_romSize = 0;
+		
+		// Update key data and keep the previous key data around.
+		void latch_input(uint16_t keys)
+		{
+			m_input.m_prevKeys = m_input.m_keys;
+			m_input.m_keys = keys;
+		}
+
+		// Run with the latched keys, applying queued input events as their cycles come up. A key change is seen by the one
+		// instruction that follows it, after which the previous keys catch up: the same as latching before every instruction.
+		void run_latched(uint32_t cycles)
+		{
+			while (cycles > 0)
+			{
+				// Due when the next poll isn't 1 to interval instructions away: reached, or m_cycles went back (reset, load_state).
+				if (m_inputPoll != nullptr && m_nextInputPoll - m_cycles - 1 >= m_inputPollInterval) [[unlikely]]
+				{
+					uint16_t const keys = m_inputPoll(m_inputPollUserData);
+					if (keys != m_input.m_keys)
+						latch_input(keys);
+					m_nextInputPoll = m_cycles + m_inputPollInterval;
+				}
+
+				if (m_sampler != nullptr && m_nextSample - m_cycles - 1 >= m_sampleInterval) [[unlikely]]
+				{
+					m_sampleInterval = std::max(1u, m_sampler(m_samplerUserData, *this));
+					m_nextSample = m_cycles + m_sampleInterval;
+				}
+
+				if (m_inputCount > 0 && m_inputQueue[m_inputFirst].m_cycle <= m_cycles)
+				{
+					uint16_t keys = m_input.m_keys;
+					while (m_inputCount > 0 && m_inputQueue[m_inputFirst].m_cycle <= m_cycles)
+					{
+						input_event const& e = m_inputQueue[m_inputFirst];
+						keys = static_cast<uint16_t>(e.m_pressed ? keys | (1 << e.m_key) : keys & ~(1 << e.m_key));
+						m_inputFirst = (m_inputFirst + 1) % c_inputQueueSize;
+						m_inputCount--;
+					}
+
+					if (keys != m_input.m_keys)
+						latch_input(keys);
+				}
+
+				// Held keys run up to the next event in one go, a change only for the instruction that sees it.
+				uint32_t span = cycles;
+				if (m_input.m_keys != m_input.m_prevKeys)
+					span = 1;
+				else if (m_inputCount > 0)
+					span = static_cast<uint32_t>(std::min<uint64_t>(span, m_inputQueue[m_inputFirst].m_cycle - m_cycles));
+				if (m_inputPoll != nullptr)
+					span = static_cast<uint32_t>(std::min<uint64_t>(span, m_nextInputPoll - m_cycles));
+				if (m_sampler != nullptr)
+					span = static_cast<uint32_t>(std::min<uint64_t>(span, m_nextSample - m_cycles));
+
+				if (!fast_forward_input_wait(span))
+				{
+					if (m_timerMode == timer_mode::emulated)
+						run_emulated(span);
+					else
+						run_steps(span);
+				}
+
+				m_input.m_prevKeys = m_input.m_keys;
+				cycles -= span;
+			}
+		}
+
+		// Fetch, decode, execute cycle. While waiting for input (Fx0A) the pending instruction is executed again.
+		void step()
+		{
+			if (m_isWaitingForVblank) [[unlikely]]
+			{
+				++m_cycles;
+				return;
+			}
+
+			if (m_sharedBlocks != nullptr && use_shared_cache())
+			{
+				run_cached<true>(1);
+				return;
+			}
+			if (m_decodeCache != nullptr)
+			{
+				run_cached<false>(1);
+				return;
+			}
+
+			if (!m_isWaitingForInput)
+			{
+				fetch();
+				decode();
+			}
+			execute();
+
+			++m_cycles;
+		}
+
+		// Execute a number of instructions back to back.
+		void run_steps(uint32_t cycles)
+		{
+			if (m_sharedBlocks != nullptr && use_shared_cache())
+			{
+				run_cached<true>(cycles);
+				return;
+			}
+			if (m_decodeCache != nullptr)
+			{
+				run_cached<false>(cycles);
+				return;
+			}
+
+			bool const threaded = m_threadedIds != nullptr && !is_instrumented();
+			if (!can_skip_idle())
+			{
+				if (threaded)
+					run_threaded(cycles);
+				else
+					run_single_steps(cycles);
+				return;
+			}
+
+			// Run in chunks, looking for an idle loop to fast-forward in between.
+			while (cycles > 0)
+			{
+				if (m_isWaitingForVblank)
+				{
+					m_cycles += cycles;
+					return;
+				}
+
+				cycles -= skip_idle_loop(cycles);
+
+				uint32_t const chunk = std::min(cycles, c_idleCheckInterval);
+				if (threaded)
+					run_threaded(chunk);
+				else
+					run_single_steps(chunk);
+				cycles -= chunk;
+			}
+		}
+
+		// Step a number of times, counting whatever is left at once when a draw starts waiting for the vertical blank.
+		void run_single_steps(uint32_t cycles)
+		{
+			for (uint32_t i = 0; i < cycles; ++i)
+			{
+				step();
+				if (m_isWaitingForVblank) [[unlikely]]
+				{
+					m_cycles += cycles - i - 1;
+					return;
+				}
+			}
+		}
+
+		// Idle loops are delay timer busy-waits: Fx07, then 3xnn or 4xnn on the same register, then a jump back to the Fx07.
+		// Until the timer ticks every iteration only reloads vx with the same value, so whole iterations can be skipped without
+		// executing them and the machine still ends up in the exact same state.
+		static constexpr uint32_t c_idleLoopLength = 3;
+		static constexpr uint32_t c_idleCheckInterval = 256;	// Instructions run between idle loop checks without the decode cache.
+
+		bool can_skip_idle() const
+		{
+#if defined(TINY8_TRACE)
+			if (m_traceCallback != nullptr)
+				return false;
+#endif
+			return m_idleSkipping;
+		}
+
+		// True if an idle loop starts at pc.
+		bool is_idle_loop(uint32_t pc) const
+		{
+			uint16_t const load = read_word(pc);
+			if ((load & 0xf0ff) != 0xf007 || pc >= c_maxMemory)
+				return false;
+
+			uint16_t const test = read_word(pc + 2);
+			uint16_t const family = test & 0xf000;
+			return (family == 0x3000 || family == 0x4000) && (test & 0x0f00) == (load & 0x0f00) && read_word(pc + 4) == (0x1000 | pc);
+		}
+
+		// Skip the whole iterations of an idle loop starting at pc that fit in the given number of instructions. Returns the
+		// number of instructions skipped, 0 if there is no loop at pc or the delay timer already lets it exit.
+		uint32_t skip_idle_iterations(uint32_t pc, uint32_t cycles)
+		{
+			if (cycles < c_idleLoopLength || m_isWaitingForInput || !is_idle_loop(pc))
+				return 0;
+
+			// 3xnn skips the jump back (leaving the loop) when vx == nn, 4xnn when vx != nn.
+			uint16_t const test = read_word(pc + 2);
+			uint8_t const delay = m_timers.m_delay;
+			bool const leaves = (test & 0xf000) == 0x3000 ? delay == (test & 0xff) : delay != (test & 0xff);
+			if (leaves)
+				return 0;
+
+			uint32_t const skipped = cycles - cycles % c_idleLoopLength;
+			m_registers.m_v[(test >> 8) & 0xf] = delay;
+			m_cycles += skipped;
+
+#if defined(TINY8_PROFILE)
+			if (m_profile != nullptr)
+				m_profile->m_frame.m_idle += skipped;
+#endif
+			return skipped;
+		}
+
+		// Timer ticks an idle loop the program counter is in keeps spinning for, see quiet_frames().
+		uint32_t idle_loop_frames() const
+		{
+			uint32_t const pc = m_registers.m_pc;
+			uint32_t loop = pc;
+			if (pc >= 2 && is_idle_loop(pc - 2))
+				loop = pc - 2;
+			else if (pc >= 4 && is_idle_loop(pc - 4))
+				loop = pc - 4;
+			else if (!is_idle_loop(pc))
+				return 0;
+
+			// On the test, vx still holds the timer as loaded before the last tick.
+			uint16_t const test = read_word(loop + 2);
+			uint8_t const nn = static_cast<uint8_t>(test);
+			bool const leaves_on_equal = (test & 0xf000) == 0x3000;
+			if (pc == loop + 2 && (m_registers.m_v[(test >> 8) & 0xf] == nn) == leaves_on_equal)
+				return 0;
+
+			uint8_t const delay = m_timers.m_delay;
+			if (leaves_on_equal)
+				return delay > nn ? delay - nn : delay == nn ? 0 : c_quietUntilInput;
+			return delay != nn ? 0 : delay > 0 ? 1 : c_quietUntilInput;
+		}
+
+		// Fast-forward an idle loop the program counter is in. A run can start anywhere in the loop, so the instructions up to its
+		// Fx07 are stepped first. Returns the number of instructions consumed.
+		uint32_t skip_idle_loop(uint32_t cycles)
+		{
+			uint32_t const pc = m_registers.m_pc;
+			uint32_t steps = 0;
+			if (pc >= 2 && is_idle_loop(pc - 2))
+				steps = 2;
+			else if (pc >= 4 && is_idle_loop(pc - 4))
+				steps = 1;
+
+			steps = std::min(steps, cycles);
+			for (uint32_t i = 0; i < steps; ++i)
+				step();
+
+			return steps + skip_idle_iterations(m_registers.m_pc, cycles - steps);
+		}
+
+		// Handlers in TINY8_HANDLERS order.
+		static constexpr std::array<handler, threaded_count> threaded_handlers()
+		{
+#define TINY8_THREADED_HANDLER(name, body) &body,
+			return { TINY8_HANDLERS(TINY8_THREADED_HANDLER) };
+#undef TINY8_THREADED_HANDLER
+		}
+
+		static constexpr threaded_ids build_threaded_ids(flags f)
+		{
+			dispatch_table const table = build_dispatch_table(f);
+			std::array<handler, threaded_count> const handlers = threaded_handlers();
+
+			threaded_ids ids{};
+			for (size_t i = 0; i < c_dispatchTableSize; ++i)
+			{
+				for (size_t id = 0; id < threaded_count; ++id)
+				{
+					if (table[i] == handlers[id])
+						ids[i] = static_cast<uint8_t>(id);
+				}
+			}
+			return ids;
+		}
+
+#if !defined(TINY8_FREESTANDING)
+		static threaded_ids const& shared_threaded_ids(flags f)
+		{
+			static threaded_ids s_ids[c_flagsCombinations];
+			static std::once_flag s_built[c_flagsCombinations];
+
+			size_t const slot = f & flags::all_legacy;
+			std::call_once(s_built[slot], [&]() { s_ids[slot] = build_threaded_ids(f); });
+
+			return s_ids[slot];
+		}
+#endif
+
+		// True when the threaded loop may fetch at the program counter: not waiting on Fx0A and the opcode lies within memory.
+		bool can_thread() const { return !m_isWaitingForInput && !m_isWaitingForVblank && m_registers.m_pc + 1u < MemorySize; }
+
+		decode_state fetch_threaded()
+		{
+			uint16_t& pc = m_registers.m_pc;
+			decode_state const s = decode_opcode(read_word(pc));
+			pc += 2;
+			return s;
+		}
+
+		// Execute a number of instructions through the threaded loop. When it has to stop early (Fx0A or vertical blank waiting, pc at
+		// the end of memory), the last instruction becomes the pending one and the rest runs through step().
+		void run_threaded(uint32_t cycles)
+		{
+			uint32_t remaining = cycles;
+			if (remaining > 0 && can_thread())
+			{
+				decode_state s = fetch_threaded();
+				--remaining;
+
+#if TINY8_THREADED_CORE == TINY8_THREADED_TAIL_CALL
+				remaining = threaded_tail_ops()[(*m_threadedIds)[dispatch_index(s.m_opcode)]](*this, s, remaining);
+#elif TINY8_THREADED_CORE == TINY8_THREADED_GOTO
+				static void* const s_labels[] =
+				{
+#define TINY8_THREADED_LABEL(name, body) &&label_##name,
+					TINY8_HANDLERS(TINY8_THREADED_LABEL)
+#undef TINY8_THREADED_LABEL
+				};
+
+				uint8_t const* const ids = m_threadedIds->data();
+				goto *s_labels[ids[dispatch_index(s.m_opcode)]];
+
+#define TINY8_THREADED_LABEL(name, body) \
+			label_##name: \
+				body(*this, s); \
+				if (remaining == 0 || !can_thread()) \
+				{ \
+					m_currentHandler = &body; \
+					goto done; \
+				} \
+				s = fetch_threaded(); \
+				--remaining; \
+				goto *s_labels[ids[dispatch_index(s.m_opcode)]];
+				TINY8_HANDLERS(TINY8_THREADED_LABEL)
+#undef TINY8_THREADED_LABEL
+
+			done:
+				m_state = s;
+#else
+				uint8_t const* const ids = m_threadedIds->data();
+				for (;;)
+				{
+					switch (ids[dispatch_index(s.m_opcode)])
+					{
+#define TINY8_THREADED_CASE(name, body) case threaded_##name: body(*this, s); break;
+						TINY8_HANDLERS(TINY8_THREADED_CASE)
+#undef TINY8_THREADED_CASE
+					}
+
+					if (remaining == 0 || !can_thread())
+						break;
+
+					s = fetch_threaded();
+					--remaining;
+				}
+				m_state = s;
+				m_currentHandler = threaded_handlers()[ids[dispatch_index(s.m_opcode)]];
+#endif
+				m_cycles += cycles - remaining;
+			}
+
+			run_single_steps(remaining);
+		}
+
+#if TINY8_THREADED_CORE == TINY8_THREADED_TAIL_CALL
+		// Tail call flavour: each handler gets a wrapper that fetches and jumps straight to the next wrapper. Returns the instructions left.
+		using threaded_op = uint32_t(*)(basic_interpreter&, decode_state, uint32_t);
+
+		template<handler Body>
+		static uint32_t threaded_tail(basic_interpreter& self, decode_state s, uint32_t remaining)
+		{
+			Body(self, s);
+			if (remaining == 0 || !self.can_thread())
+			{
+				self.m_state = s;
+				self.m_currentHandler = Body;
+				return remaining;
+			}
+
+			decode_state const next = self.fetch_threaded();
+			TINY8_MUSTTAIL return threaded_tail_ops()[(*self.m_threadedIds)[dispatch_index(next.m_opcode)]](self, next, remaining - 1);
+		}
+
+		static std::array<threaded_op, threaded_count> const& threaded_tail_ops()
+		{
+#define TINY8_THREADED_TAIL(name, body) &threaded_tail<&body>,
+			static constexpr std::array<threaded_op, threaded_count> s_ops = { TINY8_HANDLERS(TINY8_THREADED_TAIL) };
+#undef TINY8_THREADED_TAIL
+			return s_ops;
+		}
+#endif
+
+		// Execute a number of instructions from the decode cache, a whole block at a time. A shared cache is only read: blocks
+		// missing from it run an instruction at a time, and nothing gets compiled.
+		template<bool Shared>
+		void run_cached(uint32_t cycles)
+		{
+			auto& cache = cached_blocks<Shared>();
+			bool const skip_idle = can_skip_idle();
+			bool const fuse = !is_instrumented();
+			while (cycles > 0)
+			{
+				uint32_t pc = m_registers.m_pc;
+
+				// Draws end their block when they wait for the vertical blank, the rest of the slice is idle.
+				if (m_isWaitingForVblank)
+				{
+					m_cycles += cycles;
+					return;
+				}
+
+				// A pending Fx0A and instructions straddling the end of memory go through the regular path.
+				if (m_isWaitingForInput || pc + 1 >= MemorySize || (Shared && is_shared_block_stale(pc)))
+				{
+					if (!m_isWaitingForInput)
+					{
+						fetch();
+						decode();
+					}
+					execute();
+
+					++m_cycles;
+					--cycles;
+					continue;
+				}
+
+				if (m_coverageMap != nullptr) [[unlikely]]
+				{
+					m_coverageMap[(m_previousBlock ^ pc) & (c_coverageMapSize - 1)]++;
+					m_previousBlock = pc >> 1;
+				}
+
+				uint32_t length = cache.m_blockLength[pc];
+				[[maybe_unused]] uint32_t entries = 0;
+				if constexpr (!Shared)
+				{
+					entries = count_entry(pc);
+					if (length == 0)
+					{
+						if (entries < cache.m_thresholds.m_decode)
+						{
+							cycles -= run_cold(cycles);
+							continue;
+						}
+						length = build_block(pc);
+					}
+				}
+
+				// A block starting with Fx07 may be the top of an idle loop.
+				if (skip_idle && cache.m_instructions[pc].m_handler == &op_fx07)
+				{
+					uint32_t const skipped = skip_idle_iterations(pc, cycles);
+					cycles -= skipped;
+					if (skipped > 0)
+						continue;
+				}
+
+				// Only the last instruction of a block can branch, so a partial block still runs straight through.
+				uint32_t const count = std::min(length, cycles);
+				decoded_instruction const* instr = &cache.m_instructions[pc + 2 * (count - 1)];
+
+				native_block native = nullptr;
+				if (count == length && cache.m_compiler.m_compile != nullptr && !is_instrumented())
+				{
+					native = cache.m_native[pc];
+					if constexpr (!Shared)
+					{
+						if (native == nullptr && entries >= cache.m_thresholds.m_compile)
+							native = compile_block(pc, length);
+					}
+				}
+
+				if constexpr (!Shared)
+					count_tier(native != nullptr ? tier::native : tier::decoded, count);
+
+				if (native != nullptr)
+					native(*this);
+				else if (fuse && cache.m_blockFused[pc])
+					run_fused(cache, pc, count);
+				else
+				{
+					for (uint32_t i = 0; i < count; ++i, pc += 2)
+					{
+						m_registers.m_pc = static_cast<uint16_t>(pc + 2);
+						execute(cache.m_instructions[pc].m_handler, cache.m_instructions[pc].m_state);
+					}
+				}
+
+				m_cycles += count;
+				cycles -= count;
+
+				// Fx0A ends a block: keep it as the pending instruction so it executes again until a key is released.
+				if (m_isWaitingForInput)
+				{
+					m_state = instr->m_state;
+					m_currentHandler = instr->m_handler;
+				}
+
+			}
+		}
+
+		// Count an entry to the block at an address, up to the last tier threshold. Returns the entries so far.
+		uint32_t count_entry(uint32_t pc)
+		{
+			decode_cache& cache = *m_decodeCache;
+			uint16_t& entries = cache.m_entries[pc];
+			if (entries < cache.m_lastThreshold)
+				++entries;
+			return entries;
+		}
+
+		// Run the block at the program counter through the regular path without decoding it, up to the instruction that would end
+		// it. Returns the instructions run.
+		uint32_t run_cold(uint32_t cycles)
+		{
+			decode_cache const& cache = *m_decodeCache;
+			uint32_t count = 0;
+			while (count < cycles && count < c_maxBlockLength)
+			{
+				fetch();
+				decode();
+				execute();
+				++m_cycles;
+				++count;
+
+				uint32_t const pc = m_registers.m_pc;
+				bool const at_break = cache.m_breakCount > 0 && pc < MemorySize && ((cache.m_breaks[pc / 64] >> (pc % 64)) & 1);
+				if (ends_block(m_state.m_opcode, m_currentHandler) || (m_state.m_opcode >> 12) == 0xd || m_isWaitingForInput || pc + 1 >= MemorySize || at_break)
+					break;
+			}
+			count_tier(tier::interpreted, count);
+			return count;
+		}
+
+		native_block compile_block(uint32_t pc, uint32_t length)
+		{
+			decode_cache& cache = *m_decodeCache;
+			native_block const native = cache.m_compiler.m_compile(cache.m_compiler.m_userData, *this, cache.m_instructions, pc, length);
+			cache.m_native[pc] = native;
+			if (native != nullptr)
+				count_promotion(tier::native);
+			return native;
+		}
+
+		// Instructions a tier ran, in the decode cache's counts and the profile.
+		void count_tier(tier t, uint32_t count)
+		{
+			m_decodeCache->m_tierCounts.m_instructions[size_t(t)] += count;
+#if defined(TINY8_PROFILE)
+			if (m_profile != nullptr)
+				m_profile->m_tiers.m_instructions[size_t(t)] += count;
+#endif
+		}
+
+		void count_promotion(tier t)
+		{
+			m_decodeCache->m_tierCounts.m_promotions[size_t(t)]++;
+#if defined(TINY8_PROFILE)
+			if (m_profile != nullptr)
+				m_profile->m_tiers.m_promotions[size_t(t)]++;
+#endif
+		}
+
+		// Interpret the first count instructions of a cached block with superinstructions. A pair is only fused when both halves fit
+		// in count, a block ending (or cut short) after the first one runs it alone.
+		void run_fused(decode_cache const& cache, uint32_t pc, uint32_t count)
+		{
+			for (uint32_t i = 0; i < count; )
+			{
+				fused_handler const pair = cache.m_fused[pc];
+				if (pair != nullptr && i + 1 < count)
+				{
+					m_registers.m_pc = static_cast<uint16_t>(pc + 4);
+					pair(*this, &cache.m_instructions[pc]);
+					i += 2;
+					pc += 4;
+				}
+				else
+				{
+					m_registers.m_pc = static_cast<uint16_t>(pc + 2);
+					execute(cache.m_instructions[pc].m_handler, cache.m_instructions[pc].m_state);
+					++i;
+					pc += 2;
+				}
+			}
+		}
+
+		// Decode the straight-line block starting at an address into the cache and return its length.
+		uint32_t build_block(uint32_t pc)
+		{
+			decode_cache& cache = *m_decodeCache;
+
+			uint32_t length = 0;
+			bool fused = false;
+			for (uint32_t address = pc; length < c_maxBlockLength && address + 1 < MemorySize; address += 2)
+			{
+				if (length > 0 && cache.m_breakCount > 0 && (cache.m_breaks[address / 64] >> (address % 64)) & 1)
+					break;
+
+				uint16_t const opcode = read_word(address);
+
+				decoded_instruction& instr = cache.m_instructions[address];
+				instr.m_state = decode_opcode(opcode);
+				instr.m_handler = resolve(opcode);
+
+				cache.m_code[address / 64] |= 1ull << (address % 64);
+				cache.m_code[(address + 1) / 64] |= 1ull << ((address + 1) % 64);
+
+				// Every block running through an instruction and the next one decodes both and rewrites the pair, so a stale pair is
+				// only ever left on the last instruction of a block, where it's never used.
+				if (length > 0)
+				{
+					cache.m_fused[address - 2] = fuse_pair(cache.m_instructions[address - 2].m_handler, instr.m_handler);
+					fused |= cache.m_fused[address - 2] != nullptr;
+				}
+				++length;
+
+				if (ends_block(opcode, instr.m_handler) || ((opcode >> 12) == 0xd && display_sync()))
+					break;
+			}
+
+			cache.m_blockLength[pc] = static_cast<uint8_t>(length);
+			cache.m_blockFused[pc] = fused;
+			count_promotion(tier::decoded);
+			return length;
+		}
+
+		// Both halves of a superinstruction inlined into one body. The program counter already points past the second one, which neither
+		// first half reads; a second half skipping or jumping does so from there, exactly as when run alone.
+		template<handler First, handler Second>
+		static void op_fused(basic_interpreter& self, decoded_instruction const* pair)
+		{
+			First(self, pair[0].m_state);
+			Second(self, pair[2].m_state);
+		}
+
+		// The superinstruction for a pair of handlers, nullptr if they aren't a common pair: register setup, table lookups and the
+		// counter updates closing a loop. Draws are left alone, their dispatch is lost in the cost of the draw itself.
+		static fused_handler fuse_pair(handler first, handler second)
+		{
+			if (first == &op_6xnn)
+			{
+				if (second == &op_6xnn) return &op_fused<&op_6xnn, &op_6xnn>;
+				if (second == &op_annn) return &op_fused<&op_6xnn, &op_annn>;
+			}
+			else if (first == &op_annn)
+			{
+				if (second == &op_fx65<false>) return &op_fused<&op_annn, &op_fx65<false>>;
+				if (second == &op_fx65<true>) return &op_fused<&op_annn, &op_fx65<true>>;
+			}
+			else if (first == &op_7xnn)
+			{
+				if (second == &op_3xnn) return &op_fused<&op_7xnn, &op_3xnn>;
+				if (second == &op_4xnn) return &op_fused<&op_7xnn, &op_4xnn>;
+			}
+			else if (first == &op_fx1e)
+			{
+				if (second == &op_fx65<false>) return &op_fused<&op_fx1e, &op_fx65<false>>;
+				if (second == &op_fx65<true>) return &op_fused<&op_fx1e, &op_fx65<true>>;
+			}
+			return nullptr;
+		}
+
+		// True for instructions that may change the program counter or write memory, and for invalid ones.
+		static constexpr bool ends_block(uint16_t opcode, handler body)
+		{
+			switch (opcode >> 12)
+			{
+			case 0x0:
+				return opcode != 0x00e0;
+			case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x9: case 0xb: case 0xe:
+				return true;
+			case 0xf:
+				return (opcode & 0xff) == 0x00 || (opcode & 0xff) == 0x0a || (opcode & 0xff) == 0x33 || (opcode & 0xff) == 0x55;
+			default:
+				return body == &op_unimplemented;
+			}
+		}
+
+		// Called by the instructions writing memory, after the write.
+		void memory_written(uint32_t address, uint32_t size)
+		{
+#if defined(TINY8_WRITE_TRACKING)
+			mark_written(address, size);
+#endif
+			invalidate_code(address, size);
+			if (m_spriteCache != nullptr && m_spriteCache->m_used)
+				invalidate_sprites(address, size);
+		}
+
+		// Drop the cached sprites if a write lands on the data of any of them.
+		void invalidate_sprites(uint32_t address, uint32_t size)
+		{
+			for (uint32_t offset = 0; offset < size; ++offset)
+			{
+				uint32_t const i = (address + offset) & c_addressMask;
+				if (m_spriteCache->m_data[i / 64] & (1ull << (i % 64)))
+				{
+					m_spriteCache->clear();
+					return;
+				}
+			}
+		}
+
+		// Drop the decode cache if a write lands on decoded code. With a shared one, track which of its code bytes this instance
+		// now holds differently instead.
+		// Self-modifying code is rare enough that flushing everything beats tracking individual blocks.
+		void invalidate_code(uint32_t address, uint32_t size)
+		{
+			if (m_sharedBlocks != nullptr)
+			{
+				for (uint32_t offset = 0; offset < size; ++offset)
+				{
+					uint32_t const i = (address + offset) & c_addressMask;
+					uint64_t const bit = 1ull << (i % 64);
+					if ((m_sharedBlocks->m_code[i / 64] & bit) == 0)
+						continue;
+
+					bool const stale = m_memory.m_data[i] != m_sharedCache->m_memory[i];
+					if (stale != ((m_sharedStale[i / 64] & bit) != 0))
+					{
+						m_sharedStale[i / 64] ^= bit;
+						m_sharedStaleCount = stale ? m_sharedStaleCount + 1 : m_sharedStaleCount - 1;
+					}
+				}
+				return;
+			}
+
+			if (m_decodeCache == nullptr)
+				return;
+
+			for (uint32_t offset = 0; offset < size; ++offset)
+			{
+				uint32_t const i = (address + offset) & c_addressMask;
+				if (m_decodeCache->m_code[i / 64] & (1ull << (i % 64)))
+				{
+					invalidate_decode_cache();
+					return;
+				}
+			}
+		}
+
+		template<bool Shared>
+		auto& cached_blocks()
+		{
+			if constexpr (Shared)
+				return *m_sharedBlocks;
+			else
+				return *m_decodeCache;
+		}
+
+		// Check the shared blocks against memory if it changed wholesale since they were last used: a different rom or flags go
+		// back to a private cache. True while they're in use.
+		bool use_shared_cache()
+		{
+			if (m_sharedCheck) [[unlikely]]
+			{
+				m_sharedCheck = false;
+				std::span<uint8_t const> const rom = rom_image();
+				if (m_sharedCache->m_flags != m_flags || m_sharedCache->m_romHash != xxhash64(rom.data(), rom.size(), 0))
+					detach_shared_cache();
+				else
+					mark_stale_shared_code();
+			}
+			return m_sharedBlocks != nullptr;
+		}
+
+		// Compare every byte the shared blocks were decoded from with memory.
+		void mark_stale_shared_code()
+		{
+			decode_cache const& cache = *m_sharedBlocks;
+			m_sharedStaleCount = 0;
+			for (size_t word = 0; word < MemorySize / 64; ++word)
+			{
+				m_sharedStale[word] = 0;
+				for (uint64_t bits = cache.m_code[word]; bits != 0; bits &= bits - 1)
+				{
+					size_t const i = word * 64 + std::countr_zero(bits);
+					if (m_memory.m_data[i] != m_sharedCache->m_memory[i])
+					{
+						m_sharedStale[word] |= 1ull << (i % 64);
+						++m_sharedStaleCount;
+					}
+				}
+			}
+		}
+
+		// True if the shared cache has no block at an address, or this instance holds any of its code differently.
+		bool is_shared_block_stale(uint32_t pc) const
+		{
+			uint32_t const length = m_sharedBlocks->m_blockLength[pc];
+			if (length == 0)
+				return true;
+			if (m_sharedStaleCount == 0) [[likely]]
+				return false;
+
+			for (uint32_t i = pc; i < pc + 2 * length; ++i)
+			{
+				uint32_t const address = i & c_addressMask;
+				if (m_sharedStale[address / 64] & (1ull << (address % 64)))
+					return true;
+			}
+			return false;
+		}
+
+		// Stop running from the shared blocks, decoding into a private cache from now on.
+		void detach_shared_cache()
+		{
+			m_sharedBlocks = nullptr;
+			m_decodeCache = std::make_unique<decode_cache>();
+		}
+
+		void leave_shared_cache()
+		{
+			m_sharedBlocks = nullptr;
+			m_sharedCache.reset();
+		}
+
+		// The rom loaded last, as kept for reset().
+		std::span<uint8_t const> rom_image() const
+		{
+			if constexpr (c_compact)
+				return m_romImage;
+			else
+				return { m_romImage, m_romSize };
+		}
+
+		// Execute a number of instructions, ticking the timers on every emulated frame boundary.
+		void run_emulated(uint32_t cycles)
+		{
+			for_emulated_slices(cycles, [this](uint32_t slice) { run_steps(slice); });
+		}
+
+		// Split a number of instructions at the emulated frame boundaries and tick the timers on each one crossed.
+		template<class Run>
+		void for_emulated_slices(uint32_t cycles, Run&& run)
+		{
+			while (cycles > 0)
+			{
+				uint32_t const slice = std::min(cycles, m_cyclesPerFrame - m_frameCycles);
+				run(slice);
+
+				cycles -= slice;
+				m_frameCycles += slice;
+				if (m_frameCycles == m_cyclesPerFrame)
+				{
+					m_frameCycles = 0;
+					tick_timers();
+				}
+			}
+		}
+
+		// Account for instructions spent re-executing an Fx0A that can't complete with the latched keys, without executing them:
+		// each one would only rescan unchanged keys, so counting it (and ticking emulated timers) leaves the exact same state.
+		// Returns false when not blocked, or while tracing or profiling, which want to see every instruction.
+		bool fast_forward_input_wait(uint32_t cycles)
+		{
+			if (!m_isWaitingForInput || m_input.m_keys != m_input.m_prevKeys || is_instrumented())
+				return false;
+
+			if (m_timerMode == timer_mode::emulated)
+				for_emulated_slices(cycles, [this](uint32_t slice) { m_cycles += slice; });
+			else
+				m_cycles += cycles;
+
+			return true;
+		}
+
+		// Decrement the delay and sound timers, called at 60Hz. This is also the vertical blank draws may be waiting for.
+		void tick_timers()
+		{
+			m_isWaitingForVblank = false;
+
+			if (m_timers.m_delay > 0)
+				m_timers.m_delay--;
+
+			if (m_timers.m_sound > 0)
+				m_timers.m_sound--;
+
+#if defined(TINY8_PROFILE)
+			if (m_profile != nullptr)
+				m_profile->end_frame();
+#endif
+		}
+
+		// Fetch the next opcode and update the decoder state.
+		void fetch()
+		{
+			uint16_t& pc = m_registers.m_pc;
+
+#if defined(TINY8_TRACE)
+			m_previousState = m_state;
+#endif
+			m_state = decode_opcode(read_word(pc));
+
+			// Advance program counter. It's fine to do this here, as very few instructions modify the counter during execution.
+			pc += 2;
+		}
+
+		// Read a big endian word, wrapping around the end of memory.
+		uint16_t read_word(uint32_t address) const
+		{
+			return static_cast<uint16_t>((m_memory.m_data[address & c_addressMask] << 8) | m_memory.m_data[(address + 1) & c_addressMask]);
+		}
+
+		uint8_t& memory_at(uint32_t address) { return m_memory.m_data[address & c_addressMask]; }
+
+		// Skip the next instruction, which is two words long if it's F000 nnnn.
+		void skip() { m_registers.m_pc += read_word(m_registers.m_pc) == 0xf000 ? 4 : 2; }
+
+		// Get the instruction handler for the current opcode.
+		void decode()
+		{
+			m_currentHandler = resolve(m_state.m_opcode);
+		}
+
+		// Look up the handler of an opcode in the dispatch table or its instruction family. Unknown opcodes trap as unimplemented.
+		handler resolve(uint16_t opcode) const
+		{
+#if defined(TINY8_FREESTANDING)
+			return (*m_table)[dispatch_index(opcode)];
+#else
+			if (m_table != nullptr)
+				return (*m_table)[dispatch_index(opcode)];
+
+			auto const family_it = m_families->find(static_cast<uint8_t>((opcode & 0xf000) >> 8));
+			if (family_it == m_families->end())
+				return &op_unimplemented;
+
+			auto const& family = family_it->second;
+			auto const instr_it = family.m_instructions.find(opcode & family.m_opcodeMask);
+			if (instr_it == family.m_instructions.end())
+				return &op_unimplemented;
+
+			return instr_it->second.m_body;
+#endif
+		}
+
+		// Native blocks and the threaded loop skip the per instruction trace and profile points, so they are only used while
+		// neither a trace callback nor profiling is installed.
+		bool is_instrumented() const
+		{
+			bool instrumented = false;
+#if defined(TINY8_TRACE)
+			instrumented |= m_traceCallback != nullptr;
+#endif
+#if defined(TINY8_PROFILE)
+			instrumented |= m_profile != nullptr;
+#endif
+			return instrumented;
+		}
+
+		void execute()
+		{
+			assert(m_currentHandler != nullptr);
+			execute(m_currentHandler, m_state);
+		}
+
+		void execute(handler body, decode_state const& s)
+		{
+#if defined(TINY8_TRACE)
+			if (m_traceCallback != nullptr)
+				m_traceCallback(m_traceUserData, trace_point::pre_execute, s, m_registers);
+#endif
+
+#if defined(TINY8_PROFILE)
+			// The program counter already points past the instruction (or past the pending Fx0A).
+			if (m_profile != nullptr)
+				m_profile->record(s.m_opcode, (m_registers.m_pc - 2u) & c_addressMask);
+#endif
+
+			body(*this, s);
+
+#if defined(TINY8_PROFILE)
+			if (m_profile != nullptr && m_isWaitingForInput)
+				m_profile->m_frame.m_waits++;
+#endif
+
+#if defined(TINY8_TRACE)
+			if (m_traceCallback != nullptr)
+				m_traceCallback(m_traceUserData, trace_point::post_execute, s, m_registers);
+#endif
+		}
+
+#if !defined(TINY8_FREESTANDING)
+		// Add a new instruction and/or instruction family along with a callback to the instruction's body.
+		static void add_instruction(family_map& families, uint8_t family_key, uint8_t instruction_key, uint16_t opcodeMask, handler body)
+		{				
+			if (!families.contains(family_key))
+			{
+				instruction_family<handler> family = { .m_opcodeMask = opcodeMask };
+				families[family_key] = family;
+			}
+
+			auto const it = families.find(family_key);
+			instruction<handler> const instr = { .m_body = body, .m_family = &it->second };
+
+			it->second.m_instructions[instruction_key] = instr;
+		}
+
+		// Get the dispatch table for a given run time flags combination, building it on first use.
+		static dispatch_table const& shared_dispatch_table(flags f)
+		{
+			static std::unique_ptr<dispatch_table> s_tables[c_flagsCombinations];
+			static std::once_flag s_built[c_flagsCombinations];
+
+			size_t const slot = f & flags::all_legacy;
+			std::call_once(s_built[slot], [&]() { s_tables[slot] = std::make_unique<dispatch_table>(build_dispatch_table(f)); });
+
+			return *s_tables[slot];
+		}
+
+		// Get the instruction families for a given run time flags combination, building them on first use.
+		static family_map const& shared_families(flags f)
+		{
+			static family_map s_families[c_flagsCombinations];
+			static std::once_flag s_built[c_flagsCombinations];
+
+			size_t const slot = f & flags::all_legacy;
+			std::call_once(s_built[slot], [&]()
+				{
+					register_instructions(f, [&](uint8_t family_key, uint8_t instruction_key, uint16_t opcodeMask, handler body) { add_instruction(s_families[slot], family_key, instruction_key, opcodeMask, body); });
+				});
+
+			return s_families[slot];
+		}
+
+		// Point dispatch at the structures shared per flags combination, so constructing an instance never allocates.
+		void use_shared_dispatch(dispatch_mode mode)
+		{
+			if (mode == dispatch_mode::table)
+				m_table = &shared_dispatch_table(m_flags);
+			else
+				m_families = &shared_families(m_flags);
+		}
+#endif
+
+		void use_static_table() requires (c_staticFlags)
+		{
+			static constexpr dispatch_table s_table = build_dispatch_table(F);
+			m_table = &s_table;
+		}
+
+		// Register all instructions for the given flags through a callback taking (family_key, instruction_key, opcodeMask, handler).
+		// Quirk dependent instructions get the variant matching the flags, so handlers never test the flags at run time.
+		// http://devernay.free.fr/hacks/chip8/C8TECH10.HTM
+		template<class T>
+		static constexpr void register_instructions(flags f, T&& add)
+		{
+			bool const shift = (f & flags::shift_legacy) != 0;
+			bool const store_load = (f & flags::store_load_legacy) != 0;
+			bool const jump_offset = (f & flags::jump_offset_legacy) != 0;
+			bool const logical = (f & flags::logical_legacy) != 0;
+			bool const draw = (f & flags::draw_legacy) != 0;
+
+			add(0x00, 0xe0, 0x00ff, &op_00e0);
+			add(0x00, 0xee, 0x00ff, &op_00ee);
+			for (uint8_t n = 0; n < 16; ++n)
+			{
+				add(0x00, 0xc0 | n, 0x00ff, &op_00cn);
+				add(0x00, 0xd0 | n, 0x00ff, &op_00dn);
+			}
+			add(0x00, 0xfb, 0x00ff, &op_00fb);
+			add(0x00, 0xfc, 0x00ff, &op_00fc);
+			add(0x00, 0xfe, 0x00ff, &op_00fe);
+			add(0x00, 0xff, 0x00ff, &op_00ff);
+			add(0x00, 0x00, 0x0000, &op_unimplemented);
+			add(0x10, 0x00, 0x0000, &op_1nnn);
+			add(0x20, 0x00, 0x0000, &op_2nnn);
+			add(0x30, 0x00, 0x0000, &op_3xnn);
+			add(0x40, 0x00, 0x0000, &op_4xnn);
+			add(0x50, 0x00, 0x000f, &op_5xy0);
+			add(0x50, 0x02, 0x000f, &op_5xy2);
+			add(0x50, 0x03, 0x000f, &op_5xy3);
+			add(0x60, 0x00, 0x0000, &op_6xnn);
+			add(0x70, 0x00, 0x0000, &op_7xnn);
+			add(0x80, 0x00, 0x000f, &op_8xy0);
+			add(0x80, 0x01, 0x000f, logical ? &op_8xy1<true> : &op_8xy1<false>);
+			add(0x80, 0x02, 0x000f, logical ? &op_8xy2<true> : &op_8xy2<false>);
+			add(0x80, 0x03, 0x000f, logical ? &op_8xy3<true> : &op_8xy3<false>);
+			add(0x80, 0x04, 0x000f, &op_8xy4);
+			add(0x80, 0x05, 0x000f, &op_8xy5);
+			add(0x80, 0x06, 0x000f, shift ? &op_8xy6<true> : &op_8xy6<false>);
+			add(0x80, 0x07, 0x000f, &op_8xy7);
+			add(0x80, 0x0e, 0x000f, shift ? &op_8xye<true> : &op_8xye<false>);
+			add(0x90, 0x00, 0x000f, &op_9xy0);
+			add(0xa0, 0x00, 0x0000, &op_annn);
+			add(0xb0, 0x00, 0x0000, jump_offset ? &op_bnnn<true> : &op_bnnn<false>);
+			add(0xc0, 0x00, 0x0000, &op_cxnn);
+			add(0xd0, 0x00, 0x0000, draw ? &op_dxyn<true> : &op_dxyn<false>);
+			add(0xe0, 0x9e, 0x00ff, &op_ex9e);
+			add(0xe0, 0xa1, 0x00ff, &op_exa1);
+			add(0xf0, 0x00, 0x00ff, &op_f000);
+			add(0xf0, 0x01, 0x00ff, &op_fn01);
+			add(0xf0, 0x02, 0x00ff, &op_f002);
+			add(0xf0, 0x07, 0x00ff, &op_fx07);
+			add(0xf0, 0x0a, 0x00ff, &op_fx0a);
+			add(0xf0, 0x15, 0x00ff, &op_fx15);
+			add(0xf0, 0x18, 0x00ff, &op_fx18);
+			add(0xf0, 0x1e, 0x00ff, &op_fx1e);
+			add(0xf0, 0x29, 0x00ff, &op_fx29);
+			add(0xf0, 0x30, 0x00ff, &op_fx30);
+			add(0xf0, 0x33, 0x00ff, &op_fx33);
+			add(0xf0, 0x3a, 0x00ff, &op_fx3a);
+			add(0xf0, 0x55, 0x00ff, store_load ? &op_fx55<true> : &op_fx55<false>);
+			add(0xf0, 0x65, 0x00ff, store_load ? &op_fx65<true> : &op_fx65<false>);
+		}
+
+		// Reset the machine state: clear memory, display, registers and input (unless the storage is known to be zero already), and
+		// copy the fonts in.
+		void initialise(bool zeroed)
+		{
+			if (!zeroed)
+			{
+				memset(m_memory.m_data, 0, sizeof(m_memory.m_data));
+				memset(m_memory.m_stack, 0, sizeof(m_memory.m_stack));
+				memset(m_display.m_planes, 0, sizeof(m_display.m_planes));
+				memset(m_registers.m_v, 0, sizeof(m_registers.m_v));
+			}
+			memcpy(m_memory.font(), c_fontset, sizeof(c_fontset));
+			memcpy(m_memory.font() + (c_bigFontStartAddress - c_fontStartAddress), c_bigFontset, sizeof(c_bigFontset));
+
+			m_input = input();
+			m_inputFirst = 0;
+			m_inputCount = 0;
+
+			m_audio = audio();
+			m_displayHashValid = false;
+			m_faulted = false;
+		}
+
+		// Put every part of the machine state back the way initialise() and the member initialisers leave it. Memory is only
+		// cleared again where it was written since the last reset when TINY8_WRITE_TRACKING is compiled in.
+		void reset_state()
+		{
+#if defined(TINY8_WRITE_TRACKING)
+			for (size_t page = 0; page < c_writePageCount; ++page)
+			{
+				if (is_page_written(page))
+					memset(&m_memory.m_data[page * c_writePageSize], 0, c_writePageSize);
+			}
+			clear_written_pages();
+#else
+			memset(m_memory.m_data, 0, sizeof(m_memory.m_data));
+#endif
+			memset(m_memory.m_stack, 0, sizeof(m_memory.m_stack));
+			memcpy(m_memory.font(), c_fontset, sizeof(c_fontset));
+			memcpy(m_memory.font() + (c_bigFontStartAddress - c_fontStartAddress), c_bigFontset, sizeof(c_bigFontset));
+
+			// Frontends compare versions, so the cleared screen counts as a change rather than starting over from version 0.
+			memset(m_display.m_planes, 0, sizeof(m_display.m_planes));
+			m_display.m_version++;
+			m_display.m_dirtyRows = ~0ull;
+			m_display.m_planeMask = 1;
+			m_display.m_hires = false;
+
+			m_registers = registers();
+			m_timers = timers();
+			m_input = input();
+			m_audio = audio();
+			m_state = {};
+#if defined(TINY8_TRACE)
+			m_previousState = {};
+#endif
+			m_isWaitingForInput = false;
+			m_isWaitingForVblank = false;
+			m_cycles = 0;
+			m_frameCycles = 0;
+			m_random = random_state(0);
+
+			m_inputFirst = 0;
+			m_inputCount = 0;
+			m_displayHashValid = false;
+			m_faulted = false;
+
+			invalidate_decode_cache();
+		}
+
+		// Use the dispatch structures of other behaviour flags. Blocks decoded with the previous ones are left to reset_state() to drop.
+#if !defined(TINY8_FREESTANDING)
+		void switch_flags(flags behaviour_flags)
+		{
+			m_flags = behaviour_flags;
+			if (m_table != nullptr)
+				m_table = &shared_dispatch_table(m_flags);
+			else
+				m_families = &shared_families(m_flags);
+			if (m_threadedIds != nullptr)
+				m_threadedIds = &shared_threaded_ids(m_flags);
+		}
+#endif
 
 		// Update the flag register with a given value.
 		void update_flag(uint8_t value)
 		{
 			m_registers.m_v[15] = value;
 		}
+
+		// Instruction bodies.
+		static void op_unimplemented(basic_interpreter& self, decode_state const& s) { self.raise(trap::unimplemented, s.m_opcode); }
+		static void op_00e0(basic_interpreter& self, decode_state const&)
+		{
+			display& disp = self.m_display;
+
+			uint64_t cleared = 0;
+			for (size_t plane = 0; plane < c_displayPlanes; ++plane)
+			{
+				if ((disp.m_planeMask & (1 << plane)) == 0)
+					continue;
+
+				auto& rows = disp.m_planes[plane];
+				for (size_t y = 0; y < disp.height(); ++y)
+					cleared |= static_cast<uint64_t>((rows[y][0] | rows[y][1]) != 0) << y;
+
+				memset(rows, 0, sizeof(rows));
+			}
+
+			self.touch_rows(cleared);
+		}
+
+		// Scrolls move whole rows (up/down) or shift the packed words (left/right) of the selected planes, in pixels of the current resolution.
+		static void op_00cn(basic_interpreter& self, decode_state const& s)
+		{
+			display& disp = self.m_display;
+			size_t const height = disp.height();
+			self.for_selected_planes([&](auto& rows)
+				{
+					memmove(&rows[s.m_n], &rows[0], (height - s.m_n) * sizeof(rows[0]));
+					memset(&rows[0], 0, s.m_n * sizeof(rows[0]));
+				});
+		}
+
+		static void op_00dn(basic_interpreter& self, decode_state const& s)
+		{
+			display& disp = self.m_display;
+			size_t const height = disp.height();
+			self.for_selected_planes([&](auto& rows)
+				{
+					memmove(&rows[0], &rows[s.m_n], (height - s.m_n) * sizeof(rows[0]));
+					memset(&rows[height - s.m_n], 0, s.m_n * sizeof(rows[0]));
+				});
+		}
+
+		static void op_00fb(basic_interpreter& self, decode_state const&)
+		{
+			display& disp = self.m_display;
+			bool const hires = disp.m_hires;
+			size_t const height = disp.height();
+			self.for_selected_planes([&](auto& rows)
+				{
+					for (size_t y = 0; y < height; ++y)
+					{
+						if (hires)
+							rows[y][1] = (rows[y][1] >> 4) | (rows[y][0] << 60);
+						rows[y][0] >>= 4;
+					}
+				});
+		}
+
+		static void op_00fc(basic_interpreter& self, decode_state const&)
+		{
+			display& disp = self.m_display;
+			bool const hires = disp.m_hires;
+			size_t const height = disp.height();
+			self.for_selected_planes([&](auto& rows)
+				{
+					for (size_t y = 0; y < height; ++y)
+					{
+						rows[y][0] <<= 4;
+						if (hires)
+						{
+							rows[y][0] |= rows[y][1] >> 60;
+							rows[y][1] <<= 4;
+						}
+					}
+				});
+		}
+
+		// Switching resolution clears every plane.
+		static void op_00fe(basic_interpreter& self, decode_state const&) { self.set_resolution(false); }
+		static void op_00ff(basic_interpreter& self, decode_state const&) { self.set_resolution(true); }
+
+		void set_resolution(bool hires)
+		{
+			memset(m_display.m_planes, 0, sizeof(m_display.m_planes));
+			m_display.m_hires = hires;
+			touch_rows(~0ull);
+		}
+
+		// Run a scroll over every selected plane and mark the whole screen as changed.
+		template<class T>
+		void for_selected_planes(T&& scroll)
+		{
+			for (size_t plane = 0; plane < c_displayPlanes; ++plane)
+			{
+				if (m_display.m_planeMask & (1 << plane))
+					scroll(m_display.m_planes[plane]);
+			}
+			touch_rows(m_display.m_hires ? ~0ull : (1ull << c_displayHeight) - 1);
+		}
+
+		void touch_rows(uint64_t rows)
+		{
+			if (rows != 0)
+			{
+				m_display.m_dirtyRows |= rows;
+				m_display.m_version++;
+			}
+		}
+
+		// Skip the instruction just fetched and report it, see set_trap_callback().
+		void raise(trap kind, uint16_t opcode)
+		{
+			fault const f = { kind, static_cast<uint16_t>(m_registers.m_pc - 2), opcode };
+			if (!m_faulted)
+			{
+				m_fault = f;
+				m_faulted = true;
+			}
+
+			if (m_trapCallback != nullptr)
+				m_trapCallback(m_trapUserData, f, m_registers);
+		}
+
+		static void op_00ee(basic_interpreter& self, decode_state const& s)
+		{
+			// Also catches a stack pointer beyond the depth, e.g. from a state saved with a deeper stack.
+			if (self.m_registers.m_sp - 1u >= self.m_stackDepth) [[unlikely]]
+			{
+				self.raise(trap::stack_underflow, s.m_opcode);
+				return;
+			}
+			self.m_registers.m_pc = self.m_memory.m_stack[--self.m_registers.m_sp];
+		}
+		static void op_1nnn(basic_interpreter& self, decode_state const& s) { self.m_registers.m_pc = s.m_nnn; }
+		static void op_2nnn(basic_interpreter& self, decode_state const& s)
+		{
+			if (self.m_registers.m_sp >= self.m_stackDepth) [[unlikely]]
+			{
+				self.raise(trap::stack_overflow, s.m_opcode);
+				return;
+			}
+			self.m_memory.m_stack[self.m_registers.m_sp++] = self.m_registers.m_pc;
+			self.m_registers.m_pc = s.m_nnn;
+		}
+		static void op_3xnn(basic_interpreter& self, decode_state const& s) { if (self.m_registers.m_v[s.m_x] == s.m_nn) self.skip(); }
+		static void op_4xnn(basic_interpreter& self, decode_state const& s) { if (self.m_registers.m_v[s.m_x] != s.m_nn) self.skip(); }
+		static void op_5xy0(basic_interpreter& self, decode_state const& s) { if (self.m_registers.m_v[s.m_x] == self.m_registers.m_v[s.m_y]) self.skip(); }
+
+		// XO-CHIP register range save and load: vx to vy (in either direction) to and from memory at I, leaving I untouched.
+		static void op_5xy2(basic_interpreter& self, decode_state const& s)
+		{
+			int const step = s.m_x <= s.m_y ? 1 : -1;
+			uint32_t const count = (s.m_x <= s.m_y ? s.m_y - s.m_x : s.m_x - s.m_y) + 1;
+			for (uint32_t i = 0; i < count; ++i)
+				self.memory_at(self.m_registers.m_index + i) = self.m_registers.m_v[s.m_x + step * static_cast<int>(i)];
+			self.memory_written(self.m_registers.m_index, count);
+		}
+
+		static void op_5xy3(basic_interpreter& self, decode_state const& s)
+		{
+			int const step = s.m_x <= s.m_y ? 1 : -1;
+			uint32_t const count = (s.m_x <= s.m_y ? s.m_y - s.m_x : s.m_x - s.m_y) + 1;
+			for (uint32_t i = 0; i < count; ++i)
+				self.m_registers.m_v[s.m_x + step * static_cast<int>(i)] = self.memory_at(self.m_registers.m_index + i);
+		}
+
+		static void op_6xnn(basic_interpreter& self, decode_state const& s) { self.m_registers.m_v[s.m_x] = s.m_nn; }
+		static void op_7xnn(basic_interpreter& self, decode_state const& s) { self.m_registers.m_v[s.m_x] += s.m_nn; }
+		static void op_8xy0(basic_interpreter& self, decode_state const& s) { self.m_registers.m_v[s.m_x] = self.m_registers.m_v[s.m_y]; }
+
+		template<bool Legacy>
+		static void op_8xy1(basic_interpreter& self, decode_state const& s) { semantics::logical_or<Legacy>(self.m_registers, s.m_x, s.m_y); }
+
+		template<bool Legacy>
+		static void op_8xy2(basic_interpreter& self, decode_state const& s) { semantics::logical_and<Legacy>(self.m_registers, s.m_x, s.m_y); }
+
+		template<bool Legacy>
+		static void op_8xy3(basic_interpreter& self, decode_state const& s) { semantics::logical_xor<Legacy>(self.m_registers, s.m_x, s.m_y); }
+
+		static void op_8xy4(basic_interpreter& self, decode_state const& s) { semantics::add(self.m_registers, s.m_x, s.m_y); }
+		static void op_8xy5(basic_interpreter& self, decode_state const& s) { semantics::subtract(self.m_registers, s.m_x, s.m_x, s.m_y); }
+
+		template<bool Legacy>
+		static void op_8xy6(basic_interpreter& self, decode_state const& s) { semantics::shift_right<Legacy>(self.m_registers, s.m_x, s.m_y); }
+
+		static void op_8xy7(basic_interpreter& self, decode_state const& s) { semantics::subtract(self.m_registers, s.m_x, s.m_y, s.m_x); }
+
+		template<bool Legacy>
+		static void op_8xye(basic_interpreter& self, decode_state const& s) { semantics::shift_left<Legacy>(self.m_registers, s.m_x, s.m_y); }
+
+		static void op_9xy0(basic_interpreter& self, decode_state const& s) { if (self.m_registers.m_v[s.m_x] != self.m_registers.m_v[s.m_y]) self.skip(); }
+		static void op_annn(basic_interpreter& self, decode_state const& s) { self.m_registers.m_index = s.m_nnn; }
+
+		template<bool Legacy>
+		static void op_bnnn(basic_interpreter& self, decode_state const& s) { self.m_registers.m_pc = semantics::jump_offset<Legacy>(self.m_registers, s.m_nnn, s.m_x); }
+
+		static void op_cxnn(basic_interpreter& self, decode_state const& s) { self.m_registers.m_v[s.m_x] = next_random(self.m_random) & s.m_nn; }
+
+		// Dxyn for a sprite known to be entirely on screen, read straight out of memory from I: every row is the same couple of shifts,
+		// with no clipping, wrapping or resolution checks. Nothing is shifted out either, so a row is lit if its sprite data is.
+		// Straddles is set for high resolution sprites crossing from the first word of a row into the second one; everything else
+		// only touches the word it lands in.
+		template<bool Wide, bool Straddles>
+		void draw_unclipped(uint32_t coordx, uint32_t coordy, uint32_t rows, uint64_t& any_invalidated, uint64_t& dirty)
+		{
+			uint32_t const word = coordx >> 6;
+			uint32_t const shift = coordx & 63;
+			uint8_t const* data = &m_memory.m_data[m_registers.m_index];
+
+			for (size_t plane = 0; plane < c_displayPlanes; ++plane)
+			{
+				if ((m_display.m_planeMask & (1 << plane)) == 0)
+					continue;
+
+				auto& plane_rows = m_display.m_planes[plane];
+				if (m_spriteCache != nullptr)
+				{
+					auto const& sprite = cached_sprite<Wide>(static_cast<uint32_t>(data - m_memory.m_data), shift, rows);
+					for (uint32_t y = 0; y < rows; ++y)
+					{
+						uint64_t* const row = plane_rows[coordy + y];
+						any_invalidated |= row[word] & sprite.m_bits[y];
+						row[word] ^= sprite.m_bits[y];
+
+						if constexpr (Straddles)
+						{
+							any_invalidated |= row[1] & sprite.m_spill[y];
+							row[1] ^= sprite.m_spill[y];
+						}
+					}
+
+					dirty |= static_cast<uint64_t>(sprite.m_dirty) << coordy;
+					data += Wide ? 32 : rows;
+					continue;
+				}
+
+				for (uint32_t y = 0; y < rows; ++y)
+				{
+					uint64_t const sprite = Wide
+						? static_cast<uint64_t>((data[2 * y] << 8) | data[2 * y + 1]) << 48
+						: static_cast<uint64_t>(data[y]) << 56;
+
+					uint64_t* const row = plane_rows[coordy + y];
+					uint64_t const bits = sprite >> shift;
+					any_invalidated |= row[word] & bits;
+					row[word] ^= bits;
+
+					if constexpr (Straddles)
+					{
+						uint64_t const spill = sprite << (64 - shift);
+						any_invalidated |= row[1] & spill;
+						row[1] ^= spill;
+					}
+
+					dirty |= static_cast<uint64_t>(sprite != 0) << (coordy + y);
+				}
+
+				data += Wide ? 32 : rows;
+			}
+		}
+
+		// The rows of the sprite at address shifted right by shift bits, from the sprite cache or read and shifted into it.
+		template<bool Wide>
+		typename sprite_cache::entry const& cached_sprite(uint32_t address, uint32_t shift, uint32_t rows)
+		{
+			sprite_cache& cache = *m_spriteCache;
+			uint32_t const key = address | (shift << 16) | (rows << 22) | (static_cast<uint32_t>(Wide) << 27);
+			auto& entry = cache.m_entries[((key ^ (key >> 13)) * 0x9e3779b1u) >> (32 - sprite_cache::c_entryBits)];
+			if (entry.m_key == key) [[likely]]
+				return entry;
+
+			uint8_t const* const data = &m_memory.m_data[address];
+			entry.m_key = key;
+			entry.m_dirty = 0;
+			for (uint32_t y = 0; y < rows; ++y)
+			{
+				uint64_t const sprite = Wide
+					? static_cast<uint64_t>((data[2 * y] << 8) | data[2 * y + 1]) << 48
+					: static_cast<uint64_t>(data[y]) << 56;
+				entry.m_bits[y] = sprite >> shift;
+				entry.m_spill[y] = shift != 0 ? sprite << (64 - shift) : 0;
+				entry.m_dirty |= static_cast<uint32_t>(sprite != 0) << y;
+			}
+
+			uint32_t const end = address + (Wide ? 2 * rows : rows);
+			for (uint32_t i = address; i < end; i = (i | 63) + 1)
+				cache.m_data[i / 64] |= (~0ull >> (64 - std::min(end - i, 64 - i % 64))) << (i % 64);
+			cache.m_used = true;
+			return entry;
+		}
+
+		// Draws wait for the vertical blank in the original interpreter.
+		bool display_sync() const
+		{
+			if constexpr (c_staticFlags)
+				return (F & disp_sync_legacy) != 0;
+			else
+				return (m_flags & disp_sync_legacy) != 0;
+		}
+
+		template<bool Legacy>
+		static void op_dxyn(basic_interpreter& self, decode_state const& s)
+		{
+			if (self.display_sync())
+				self.m_isWaitingForVblank = true;
+
+			display& disp = self.m_display;
+			bool const hires = disp.m_hires;
+			uint32_t const width = static_cast<uint32_t>(disp.width());
+			uint32_t const height = static_cast<uint32_t>(disp.height());
+			uint32_t const coordx = self.m_registers.m_v[s.m_x] & (width - 1);
+			uint32_t const coordy = self.m_registers.m_v[s.m_y] & (height - 1);
+
+			// Dxy0 draws a 16x16 sprite in high resolution. With both planes selected, the second plane's sprite follows the first one.
+			bool const wide = hires && s.m_n == 0;
+			uint32_t const rows = wide ? 16 : s.m_n;
+			uint32_t address = self.m_registers.m_index;
+
+			uint64_t any_invalidated = 0;
+			uint64_t dirty = 0;
+
+			// Most draws are entirely on screen with their data in one piece, so nothing clips or wraps and the quirk doesn't matter.
+			uint32_t const sprite_width = wide ? 16 : 8;
+			uint32_t const bytes = ((disp.m_planeMask & 1) + (disp.m_planeMask >> 1)) * (wide ? 32 : rows);
+			if (coordx + sprite_width <= width && coordy + rows <= height && address + bytes <= MemorySize)
+			{
+				bool const straddles = (coordx & 63) + sprite_width > 64;
+				if (wide)
+				{
+					if (straddles)
+						self.draw_unclipped<true, true>(coordx, coordy, rows, any_invalidated, dirty);
+					else
+						self.draw_unclipped<true, false>(coordx, coordy, rows, any_invalidated, dirty);
+				}
+				else if (straddles)
+					self.draw_unclipped<false, true>(coordx, coordy, rows, any_invalidated, dirty);
+				else
+					self.draw_unclipped<false, false>(coordx, coordy, rows, any_invalidated, dirty);
+
+				self.touch_rows(dirty);
+				self.update_flag(any_invalidated != 0);
+				return;
+			}
+
+			for (size_t plane = 0; plane < c_displayPlanes; ++plane)
+			{
+				if ((disp.m_planeMask & (1 << plane)) == 0)
+					continue;
+
+				auto& plane_rows = disp.m_planes[plane];
+				for (uint32_t y = 0; y < rows; ++y)
+				{
+					// Sprite rows are 8 (or 16) bit packed columns, place them at the leftmost pixel and move them into position.
+					uint64_t const sprite = wide
+						? static_cast<uint64_t>(self.read_word(address + 2 * y)) << 48
+						: static_cast<uint64_t>(self.memory_at(address + y)) << 56;
+
+					// Legacy sprites clip at the bottom edge, otherwise they wrap around.
+					uint32_t coordyy = coordy + y;
+					if constexpr (Legacy)
+					{
+						if (coordyy >= height)
+							break;
+					}
+					else
+						coordyy &= (height - 1);
+
+					// Legacy sprites clip at the right edge, otherwise they wrap around.
+					uint64_t* const row = plane_rows[coordyy];
+					uint64_t left, right = 0;
+					if (!hires)
+						left = Legacy ? (sprite >> coordx) : std::rotr(sprite, coordx);
+					else if (coordx < 64)
+					{
+						left = sprite >> coordx;
+						right = coordx != 0 ? sprite << (64 - coordx) : 0;
+					}
+					else
+					{
+						right = sprite >> (coordx - 64);
+						left = !Legacy && coordx > 64 ? sprite << (128 - coordx) : 0;
+					}
+
+					// Any lit pixel that gets XORed off sets vf.
+					any_invalidated |= (row[0] & left) | (row[1] & right);
+					row[0] ^= left;
+					row[1] ^= right;
+
+					dirty |= static_cast<uint64_t>((left | right) != 0) << coordyy;
+				}
+
+				address += wide ? 32 : s.m_n;
+			}
+
+			self.touch_rows(dirty);
+			self.update_flag(any_invalidated != 0);
+		}
+
+		static void op_ex9e(basic_interpreter& self, decode_state const& s) { if ((self.m_input.m_keys >> (self.m_registers.m_v[s.m_x] & 0xf)) & 1) self.skip(); }
+		static void op_exa1(basic_interpreter& self, decode_state const& s) { if (!((self.m_input.m_keys >> (self.m_registers.m_v[s.m_x] & 0xf)) & 1)) self.skip(); }
+		// F000 nnnn: load a 16 bit address into I from the word following the instruction.
+		static void op_f000(basic_interpreter& self, decode_state const&)
+		{
+			self.m_registers.m_index = self.read_word(self.m_registers.m_pc);
+			self.m_registers.m_pc += 2;
+		}
+
+		static void op_fn01(basic_interpreter& self, decode_state const& s) { self.m_display.m_planeMask = s.m_x & 3; }	// Select the planes to clear, scroll and draw.
+
+		// F002: load the 16 byte audio pattern from I.
+		static void op_f002(basic_interpreter& self, decode_state const&)
+		{
+			for (uint32_t i = 0; i < c_audioPatternSize; ++i)
+				self.m_audio.m_pattern[i] = self.memory_at(self.m_registers.m_index + i);
+		}
+
+		static void op_fx07(basic_interpreter& self, decode_state const& s) { self.m_registers.m_v[s.m_x] = self.m_timers.m_delay; }
+
+		static void op_fx0a(basic_interpreter& self, decode_state const& s)
+		{
+			// The lowest key that changed is taken; the wait is over once it's been released.
+			uint16_t const changed = self.m_input.m_keys ^ self.m_input.m_prevKeys;
+			bool keyReleased = false;
+			if (changed != 0)
+			{
+				int const key = std::countr_zero(changed);
+				self.m_registers.m_v[s.m_x] = static_cast<uint8_t>(key);
+				keyReleased = ((self.m_input.m_keys >> key) & 1) == 0;
+			}
+
+			self.m_isWaitingForInput = !keyReleased;
+		}
+
+		static void op_fx15(basic_interpreter& self, decode_state const& s) { self.m_timers.m_delay = self.m_registers.m_v[s.m_x]; }
+		static void op_fx18(basic_interpreter& self, decode_state const& s) { self.m_timers.m_sound = self.m_registers.m_v[s.m_x]; }
+
+		static void op_fx1e(basic_interpreter& self, decode_state const& s) { semantics::add_index(self.m_registers, s.m_x); }
+
+		static void op_fx29(basic_interpreter& self, decode_state const& s) { semantics::font_glyph(self.m_registers, s.m_x); }
+
+		static void op_fx30(basic_interpreter& self, decode_state const& s) { semantics::big_font_glyph(self.m_registers, s.m_x); }
+
+		static void op_fx33(basic_interpreter& self, decode_state const& s)
+		{
+			semantics::store_bcd(self.m_registers, s.m_x, [&self](uint32_t address) -> uint8_t& { return self.memory_at(address); });
+			self.memory_written(self.m_registers.m_index, 3);
+		}
+
+		static void op_fx3a(basic_interpreter& self, decode_state const& s) { self.m_audio.m_pitch = self.m_registers.m_v[s.m_x]; }	// Set the pattern playback pitch.
+
+		template<bool Legacy>
+		static void op_fx55(basic_interpreter& self, decode_state const& s)
+		{
+			uint16_t const index = self.m_registers.m_index;
+			semantics::store_registers<Legacy>(self.m_registers, s.m_x, [&self](uint32_t address) -> uint8_t& { return self.memory_at(address); });
+			self.memory_written(index, s.m_x + 1);
+		}
+
+		template<bool Legacy>
+		static void op_fx65(basic_interpreter& self, decode_state const& s)
+		{
+			semantics::load_registers<Legacy>(self.m_registers, s.m_x, [&self](uint32_t address) -> uint8_t& { return self.memory_at(address); });
+		}
 	};
+
+	// The chip-8 interpreter with behaviour flags chosen at run time.
+	using interpreter = basic_interpreter<runtime_flags>;
+
+	// Same, without a copy of the rom and with a short input queue, for very many instances (see footprint).
+	using compact_interpreter = basic_interpreter<runtime_flags, c_maxMemory, footprint::compact>;
+
+	// Same, with the 64KB XO-CHIP address space.
+	using extended_interpreter = basic_interpreter<runtime_flags, c_extendedMemory>;
+
+#if defined(TINY8_EXTERN_TEMPLATES) && !defined(TINY8_IMPLEMENTATION)
+	// Instantiated once in src/tiny8.cpp (the TINY8_COMPILED CMake option) instead of in every file including this one.
+	extern template class basic_interpreter<runtime_flags>;
+	extern template class basic_interpreter<runtime_flags, c_extendedMemory>;
+#endif
 }
 
 
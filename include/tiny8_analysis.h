@@ -0,0 +1,448 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_pack.h"
+
+#include <vector>
+
+/*
+* Static rom analysis: disassembly, control-flow graph and code/data map.
+*
+* analyze() decodes a rom with an interpreter's own dispatch (so quirks such as Bnnn/Bxnn follow its flags) by recursive descent
+* from the entry point, following jumps, calls, returns and skips. Every instruction reached is code, every other rom byte data.
+* Instructions are grouped into basic blocks, each starting at a branch target, a return address or either side of a skip.
+* Code only reached through Bnnn or written at run time isn't found.
+*
+* The result is saved with the rom hash and flags it was made for, so later loads of the same rom skip the analysis and
+* prewarm() an interpreter's decode cache with every block before the first frame runs.
+*
+* Layout, all fields little endian:
+*   header		magic "T8AN", version, rom hash, rom size, flags and block count
+*   blocks		one analysis_block per basic block, in address order
+*   code		one bit per rom byte, set for code
+*/
+namespace tiny8
+{
+	static_assert(std::endian::native == std::endian::little, "analyses are stored little endian");
+
+	constexpr char		c_analysisMagic[4] = { 'T', '8', 'A', 'N' };
+	constexpr uint32_t	c_analysisVersion = 1;
+	constexpr size_t	c_maxDisassemblyLength = 32;
+
+	// How control leaves a basic block.
+	enum class block_exit : uint8_t
+	{
+		fallthrough,	// Into the next block, which something else branches to.
+		jump,			// 1nnn.
+		call,			// 2nnn, successors are the subroutine and the return address.
+		ret,			// 00EE.
+		skip,			// 3xnn, 4xnn, 5xy0, 9xy0, Ex9E, ExA1: successors are the next instruction and the one after.
+		indirect,		// Bnnn, the target depends on a register.
+		trap,			// An instruction the flags don't implement.
+		end				// Runs off the end of the rom.
+	};
+
+	struct analysis_block
+	{
+		uint16_t	m_start;
+		uint16_t	m_end;				// Address after the last instruction.
+		uint16_t	m_successors[2];
+		uint8_t		m_successorCount;
+		block_exit	m_exit;
+		uint8_t		m_reserved[2];
+	};
+
+	struct analysis_header
+	{
+		char		m_magic[4];
+		uint32_t	m_version;
+		uint64_t	m_romHash;			// rom_hash() of the analysed rom.
+		uint32_t	m_romSize;
+		uint32_t	m_blockCount;
+		uint8_t		m_flags;
+		uint8_t		m_reserved[7];
+	};
+	static_assert(sizeof(analysis_block) == 12 && sizeof(analysis_header) == 32, "analysis layout must not depend on the compiler");
+
+	namespace analysis_detail
+	{
+		// Instruction syntax in the usual CHIP-8 assembler mnemonics. x, y, n: nibbles, b: nn, a: nnn, l: the address word of F000.
+		struct syntax
+		{
+			std::string_view	m_name;
+			char const*			m_format;
+		};
+
+		constexpr syntax c_syntax[] =
+		{
+			{ "00cn", "SCD n" }, { "00dn", "SCU n" }, { "00e0", "CLS" }, { "00ee", "RET" }, { "00fb", "SCR" }, { "00fc", "SCL" },
+			{ "00fe", "LOW" }, { "00ff", "HIGH" }, { "1nnn", "JP a" }, { "2nnn", "CALL a" }, { "3xnn", "SE Vx, b" }, { "4xnn", "SNE Vx, b" },
+			{ "5xy0", "SE Vx, Vy" }, { "5xy2", "SAVE Vx-Vy" }, { "5xy3", "LOAD Vx-Vy" }, { "6xnn", "LD Vx, b" }, { "7xnn", "ADD Vx, b" },
+			{ "8xy0", "LD Vx, Vy" }, { "8xy1", "OR Vx, Vy" }, { "8xy2", "AND Vx, Vy" }, { "8xy3", "XOR Vx, Vy" }, { "8xy4", "ADD Vx, Vy" },
+			{ "8xy5", "SUB Vx, Vy" }, { "8xy6", "SHR Vx, Vy" }, { "8xy7", "SUBN Vx, Vy" }, { "8xye", "SHL Vx, Vy" }, { "9xy0", "SNE Vx, Vy" },
+			{ "annn", "LD I, a" }, { "bnnn", "JP Vx, a" }, { "bnnn_legacy", "JP V0, a" }, { "cxnn", "RND Vx, b" }, { "dxyn", "DRW Vx, Vy, n" },
+			{ "ex9e", "SKP Vx" }, { "exa1", "SKNP Vx" }, { "f000", "LD I, l" }, { "fn01", "PLANE x" }, { "f002", "AUDIO" }, { "fx07", "LD Vx, DT" },
+			{ "fx0a", "LD Vx, K" }, { "fx15", "LD DT, Vx" }, { "fx18", "LD ST, Vx" }, { "fx1e", "ADD I, Vx" }, { "fx29", "LD F, Vx" },
+			{ "fx30", "LD HF, Vx" }, { "fx33", "LD B, Vx" }, { "fx3a", "PITCH Vx" }, { "fx55", "LD [I], Vx" }, { "fx65", "LD Vx, [I]" }
+		};
+
+		// The syntax of a handler name, sharing it between the regular and _legacy variants unless one has its own.
+		inline char const* format(std::string_view name)
+		{
+			for (int pass = 0; pass < 2; ++pass)
+			{
+				for (syntax const& s : c_syntax)
+				{
+					if (s.m_name == name)
+						return s.m_format;
+				}
+				if (name.ends_with("_legacy"))
+					name.remove_suffix(7);
+			}
+			return nullptr;
+		}
+
+		struct instruction_info
+		{
+			uint32_t	m_size;
+			block_exit	m_exit;			// fallthrough for straight-line instructions.
+			uint32_t	m_target;		// Of jumps and calls.
+		};
+
+		inline uint16_t read_word(std::span<uint8_t const> rom, uint32_t address)
+		{
+			uint32_t const offset = address - c_romStartAddress;
+			return static_cast<uint16_t>((rom[offset] << 8) | (offset + 1 < rom.size() ? rom[offset + 1] : 0));
+		}
+
+		template<class Interpreter>
+		instruction_info classify(Interpreter const& interpreter, std::span<uint8_t const> rom, uint32_t address)
+		{
+			uint16_t const opcode = read_word(rom, address);
+			std::string_view const name = interpreter.instruction_name(opcode);
+
+			if (name == "unimplemented")
+				return { 2, block_exit::trap, 0 };
+			if (name == "00ee")
+				return { 2, block_exit::ret, 0 };
+			if (name == "1nnn")
+				return { 2, block_exit::jump, opcode & 0xfffu };
+			if (name == "2nnn")
+				return { 2, block_exit::call, opcode & 0xfffu };
+			if (name.starts_with("bnnn"))
+				return { 2, block_exit::indirect, 0 };
+			if (name == "f000")
+				return { 4, block_exit::fallthrough, 0 };
+			if (name == "3xnn" || name == "4xnn" || name == "5xy0" || name == "9xy0" || name == "ex9e" || name == "exa1")
+				return { 2, block_exit::skip, 0 };
+			return { 2, block_exit::fallthrough, 0 };
+		}
+	}
+
+	// Text of the instruction at an address of a rom loaded at c_romStartAddress, decoded with an interpreter's flags. Returns its
+	// size in bytes.
+	template<class Interpreter>
+	uint32_t disassemble(Interpreter const& interpreter, std::span<uint8_t const> rom, uint32_t address, char (&text)[c_maxDisassemblyLength])
+	{
+		uint16_t const opcode = analysis_detail::read_word(rom, address);
+		std::string_view const name = interpreter.instruction_name(opcode);
+		char const* const format = analysis_detail::format(name);
+		if (format == nullptr)
+		{
+			snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+			return 2;
+		}
+
+		uint32_t const offset = address - c_romStartAddress;
+		uint16_t const word = offset + 3 < rom.size() ? analysis_detail::read_word(rom, address + 2) : 0;
+		size_t length = 0;
+		for (char const* f = format; *f != 0 && length + 8 < sizeof(text); ++f)
+		{
+			int written;
+			switch (*f)
+			{
+			case 'x': written = snprintf(text + length, sizeof(text) - length, "%X", (opcode >> 8) & 0xf); break;
+			case 'y': written = snprintf(text + length, sizeof(text) - length, "%X", (opcode >> 4) & 0xf); break;
+			case 'n': written = snprintf(text + length, sizeof(text) - length, "%u", opcode & 0xf); break;
+			case 'b': written = snprintf(text + length, sizeof(text) - length, "0x%02X", opcode & 0xff); break;
+			case 'a': written = snprintf(text + length, sizeof(text) - length, "0x%03X", opcode & 0xfff); break;
+			case 'l': written = snprintf(text + length, sizeof(text) - length, "0x%04X", word); break;
+			default: text[length] = *f; written = 1; break;
+			}
+			length += static_cast<size_t>(written);
+		}
+		text[length] = 0;
+		return name == "f000" ? 4 : 2;
+	}
+
+	class analysis
+	{
+	public:
+		// Analyse a rom with the dispatch of an interpreter. Returns false, leaving the analysis empty, if the rom doesn't fit in its
+		// memory.
+		template<class Interpreter>
+		bool analyze(Interpreter const& interpreter, std::span<uint8_t const> rom)
+		{
+			using namespace analysis_detail;
+
+			m_header = {};
+			m_blocks.clear();
+			m_code.clear();
+			if (rom.size() > std::min<size_t>(Interpreter::c_maxRomSize, 0x10000 - c_romStartAddress))
+				return false;
+
+			memcpy(m_header.m_magic, c_analysisMagic, sizeof(c_analysisMagic));
+			m_header.m_version = c_analysisVersion;
+			m_header.m_romHash = tiny8::rom_hash(rom);
+			m_header.m_romSize = static_cast<uint32_t>(rom.size());
+			m_header.m_flags = static_cast<uint8_t>(interpreter.get_flags());
+			m_code.assign((rom.size() + 63) / 64, 0);
+
+			uint32_t const end = c_romStartAddress + static_cast<uint32_t>(rom.size());
+			auto const in_rom = [&](uint32_t address) { return address >= c_romStartAddress && address < end; };
+
+			// Recursive descent: follow every path from the entry point, marking instructions and where blocks start.
+			constexpr uint8_t c_instruction = 1 << 0, c_leader = 1 << 1;
+			std::vector<uint8_t> marks(rom.size(), 0);
+			std::vector<uint32_t> pending;
+			auto const branch_to = [&](uint32_t address)
+			{
+				if (!in_rom(address))
+					return;
+				marks[address - c_romStartAddress] |= c_leader;
+				if (!(marks[address - c_romStartAddress] & c_instruction))
+					pending.push_back(address);
+			};
+
+			branch_to(c_romStartAddress);
+			while (!pending.empty())
+			{
+				uint32_t address = pending.back();
+				pending.pop_back();
+				while (in_rom(address) && !(marks[address - c_romStartAddress] & c_instruction))
+				{
+					marks[address - c_romStartAddress] |= c_instruction;
+					instruction_info const info = classify(interpreter, rom, address);
+					for (uint32_t i = address; i < address + info.m_size && i < end; ++i)
+						m_code[(i - c_romStartAddress) / 64] |= 1ull << ((i - c_romStartAddress) % 64);
+
+					uint32_t const next = address + info.m_size;
+					if (info.m_exit == block_exit::jump)
+					{
+						branch_to(info.m_target);
+						break;
+					}
+					if (info.m_exit == block_exit::call)
+					{
+						branch_to(info.m_target);
+						branch_to(next);
+					}
+					else if (info.m_exit == block_exit::skip)
+					{
+						branch_to(next);
+						if (in_rom(next))
+							branch_to(next + classify(interpreter, rom, next).m_size);
+					}
+					else if (info.m_exit != block_exit::fallthrough)
+						break;
+
+					address = next;
+				}
+			}
+
+			// Group the instructions into blocks, in address order.
+			for (uint32_t address = c_romStartAddress; address < end; )
+			{
+				if (!(marks[address - c_romStartAddress] & c_instruction))
+				{
+					++address;
+					continue;
+				}
+
+				analysis_block block = {};
+				block.m_start = static_cast<uint16_t>(address);
+				block.m_exit = block_exit::end;
+				for (;;)
+				{
+					instruction_info const info = classify(interpreter, rom, address);
+					uint32_t const next = address + info.m_size;
+					address = next;
+
+					if (info.m_exit == block_exit::jump || info.m_exit == block_exit::call)
+						add_successor(block, info.m_target);
+					if (info.m_exit == block_exit::call || info.m_exit == block_exit::skip)
+						add_successor(block, next);
+					if (info.m_exit == block_exit::skip && in_rom(next))
+						add_successor(block, next + classify(interpreter, rom, next).m_size);
+					if (info.m_exit != block_exit::fallthrough)
+					{
+						block.m_exit = info.m_exit;
+						break;
+					}
+					if (!in_rom(next) || !(marks[next - c_romStartAddress] & c_instruction))
+						break;
+					if (marks[next - c_romStartAddress] & c_leader)
+					{
+						block.m_exit = block_exit::fallthrough;
+						add_successor(block, next);
+						break;
+					}
+				}
+				block.m_end = static_cast<uint16_t>(address);
+				m_blocks.push_back(block);
+			}
+
+			m_header.m_blockCount = static_cast<uint32_t>(m_blocks.size());
+			return true;
+		}
+
+		// True if this is the analysis of a rom with an interpreter's flags.
+		template<class Interpreter>
+		bool matches(Interpreter const& interpreter, std::span<uint8_t const> rom) const
+		{
+			return m_header.m_version == c_analysisVersion && m_header.m_flags == interpreter.get_flags() && m_header.m_romSize == rom.size()
+				&& m_header.m_romHash == tiny8::rom_hash(rom);
+		}
+
+		// Decode every block into an interpreter's decode cache (when enabled) ahead of the first frame. The interpreter is expected
+		// to have the analysed rom loaded, see matches().
+		template<class Interpreter>
+		void prewarm(Interpreter& interpreter) const
+		{
+			for (analysis_block const& block : m_blocks)
+				interpreter.prewarm_decode_cache(block.m_start, block.m_end);
+		}
+
+		std::span<analysis_block const> blocks() const { return m_blocks; }
+		uint64_t get_rom_hash() const { return m_header.m_romHash; }
+
+		// True for rom bytes reached as instructions, false for data and anything outside the rom.
+		bool is_code(uint32_t address) const
+		{
+			uint32_t const offset = address - c_romStartAddress;
+			return address >= c_romStartAddress && offset < m_header.m_romSize && (m_code[offset / 64] >> (offset % 64)) & 1;
+		}
+
+		// Print the rom as a listing: the blocks disassembled with their successors, data as bytes.
+		template<class Interpreter>
+		void print(Interpreter const& interpreter, std::span<uint8_t const> rom, FILE* out) const
+		{
+			constexpr char const* c_exits[] = { "fallthrough", "jump", "call", "ret", "skip", "indirect", "trap", "end" };
+
+			uint32_t const end = c_romStartAddress + m_header.m_romSize;
+			auto block = m_blocks.begin();
+			for (uint32_t address = c_romStartAddress; address < end; )
+			{
+				if (block != m_blocks.end() && block->m_start == address)
+				{
+					fprintf(out, "block_%03X:\t\t\t; %s", address, c_exits[static_cast<size_t>(block->m_exit)]);
+					for (uint8_t i = 0; i < block->m_successorCount; ++i)
+						fprintf(out, " block_%03X", block->m_successors[i]);
+					fprintf(out, "\n");
+
+					for (address = block->m_start; address < block->m_end; )
+					{
+						char text[c_maxDisassemblyLength];
+						uint32_t const size = disassemble(interpreter, rom, address, text);
+						fprintf(out, "\t%03X: %04X\t%s\n", address, analysis_detail::read_word(rom, address), text);
+						address += size;
+					}
+					++block;
+					continue;
+				}
+
+				// Data up to the next block, 8 bytes a line.
+				uint32_t const data_end = block != m_blocks.end() ? block->m_start : end;
+				fprintf(out, "\t%03X: DB", address);
+				for (uint32_t i = 0; i < 8 && address < data_end; ++i, ++address)
+					fprintf(out, " 0x%02X", rom[address - c_romStartAddress]);
+				fprintf(out, "\n");
+			}
+		}
+
+		std::vector<uint8_t> save() const
+		{
+			size_t const blocks_size = m_blocks.size() * sizeof(analysis_block);
+			std::vector<uint8_t> bytes(sizeof(analysis_header) + blocks_size + m_code.size() * sizeof(uint64_t));
+			memcpy(&bytes[0], &m_header, sizeof(m_header));
+			if (!m_blocks.empty())
+				memcpy(&bytes[sizeof(analysis_header)], m_blocks.data(), blocks_size);
+			if (!m_code.empty())
+				memcpy(&bytes[sizeof(analysis_header) + blocks_size], m_code.data(), m_code.size() * sizeof(uint64_t));
+			return bytes;
+		}
+
+		// Returns false, leaving the analysis untouched, if the bytes aren't a valid analysis of this version.
+		bool load(std::span<uint8_t const> bytes)
+		{
+			analysis_header header;
+			if (bytes.size() < sizeof(header))
+				return false;
+
+			memcpy(&header, bytes.data(), sizeof(header));
+			if (memcmp(header.m_magic, c_analysisMagic, sizeof(c_analysisMagic)) != 0 || header.m_version != c_analysisVersion
+				|| header.m_romSize > 0x10000 - c_romStartAddress)
+				return false;
+
+			uint64_t const blocks_size = uint64_t(header.m_blockCount) * sizeof(analysis_block);
+			size_t const code_words = (header.m_romSize + 63) / 64;
+			if (bytes.size() != sizeof(header) + blocks_size + code_words * sizeof(uint64_t))
+				return false;
+
+			std::vector<analysis_block> blocks(header.m_blockCount);
+			std::vector<uint64_t> code(code_words);
+			if (!blocks.empty())
+				memcpy(blocks.data(), &bytes[sizeof(header)], blocks_size);
+			if (!code.empty())
+				memcpy(code.data(), &bytes[sizeof(header) + blocks_size], code_words * sizeof(uint64_t));
+
+			// print() walks the blocks in order and names their exits from a table, so they must be in order, disjoint and known.
+			uint32_t const end = c_romStartAddress + header.m_romSize;
+			uint32_t previous_end = c_romStartAddress;
+			for (analysis_block const& block : blocks)
+			{
+				if (block.m_start < previous_end || block.m_end > end || block.m_start >= block.m_end || block.m_successorCount > 2
+					|| block.m_exit > block_exit::end)
+					return false;
+				previous_end = block.m_end;
+			}
+
+			m_header = header;
+			m_blocks = std::move(blocks);
+			m_code = std::move(code);
+			return true;
+		}
+
+	private:
+		analysis_header				m_header = {};
+		std::vector<analysis_block>	m_blocks;
+		std::vector<uint64_t>		m_code;		// One bit per rom byte, set for code.
+
+		static void add_successor(analysis_block& block, uint32_t address)
+		{
+			if (block.m_successorCount < 2)
+				block.m_successors[block.m_successorCount++] = static_cast<uint16_t>(address);
+		}
+	};
+}
@@ -0,0 +1,224 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_analysis.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+* Ahead-of-time translation of roms to C++, for platforms where generating code at run time isn't allowed.
+*
+* Offline, an aot_translator attached to an interpreter records every block of its decode cache as it's compiled: prewarming from
+* an analysis covers everything the control-flow graph reaches, running the rom for a while adds blocks only reached through Bnnn.
+* write() then emits a translation unit with one function per block, register arithmetic, loads and jumps translated inline with
+* the quirks of the interpreter's flags and every other instruction executed through execute_opcode(), plus an aot_program table.
+*
+* At run time attach_aot() installs the table as the interpreter's block compiler. A block runs its translation only if the
+* decode cache hands it the exact opcodes that were translated, so code modified at run time (or another rom) is interpreted,
+* and so are blocks that were never translated and the targets of indirect jumps nobody recorded.
+*/
+namespace tiny8
+{
+	// A translated block, see aot_program.
+	template<class Interpreter>
+	struct aot_block
+	{
+		uint16_t							m_address;
+		uint16_t							m_length;		// Instructions.
+		uint32_t							m_opcodes;		// Index of the block's first opcode in aot_program::m_opcodes.
+		typename Interpreter::native_block	m_run;
+	};
+
+	// What a generated translation unit defines.
+	template<class Interpreter>
+	struct aot_program
+	{
+		uint64_t							m_romHash;		// rom_hash() of the translated rom.
+		uint8_t								m_flags;
+		aot_block<Interpreter> const*		m_blocks;		// In address order.
+		size_t								m_blockCount;
+		uint16_t const*						m_opcodes;		// The opcodes each block was translated from.
+	};
+
+	namespace aot_detail
+	{
+		template<class Interpreter>
+		typename Interpreter::native_block lookup(void* user_data, Interpreter&, typename Interpreter::decoded_instruction const* instructions, uint32_t address, uint32_t length)
+		{
+			auto const& program = *static_cast<aot_program<Interpreter> const*>(user_data);
+			aot_block<Interpreter> const* const end = program.m_blocks + program.m_blockCount;
+			aot_block<Interpreter> const* const block = std::lower_bound(program.m_blocks, end, address,
+				[](aot_block<Interpreter> const& b, uint32_t a) { return b.m_address < a; });
+			if (block == end || block->m_address != address || block->m_length != length)
+				return nullptr;
+
+			uint16_t const* const opcodes = program.m_opcodes + block->m_opcodes;
+			for (uint32_t i = 0; i < length; ++i)
+			{
+				if (instructions[address + 2 * i].m_state.m_opcode != opcodes[i])
+					return nullptr;
+			}
+			return block->m_run;
+		}
+	}
+
+	// Run an interpreter's blocks from a translated program (this enables its decode cache). Returns false, leaving the interpreter
+	// alone, if the program was translated for other behaviour flags.
+	template<class Interpreter>
+	bool attach_aot(Interpreter& interpreter, aot_program<Interpreter> const& program)
+	{
+		if (program.m_flags != interpreter.get_flags())
+			return false;
+
+		typename Interpreter::block_compiler compiler;
+		compiler.m_compile = &aot_detail::lookup<Interpreter>;
+		compiler.m_userData = const_cast<aot_program<Interpreter>*>(&program);
+		interpreter.set_block_compiler(compiler);
+		return true;
+	}
+
+	class aot_translator
+	{
+	public:
+		// Record the blocks an interpreter compiles from now on (this enables its decode cache). Nothing is compiled, they keep
+		// being interpreted. The translator must outlive the interpreter.
+		template<class Interpreter>
+		void attach(Interpreter& interpreter)
+		{
+			typename Interpreter::block_compiler compiler;
+			compiler.m_compile = &record<Interpreter>;
+			compiler.m_userData = this;
+			interpreter.set_block_compiler(compiler);
+		}
+
+		size_t block_count() const { return m_blocks.size(); }
+
+		// Write the translation unit of the recorded blocks, defining program_name as an aot_program<interpreter_type>. The
+		// interpreter (with the same flags as the one recorded from) names the instructions.
+		template<class Interpreter>
+		void write(Interpreter const& interpreter, std::span<uint8_t const> rom, char const* program_name, char const* interpreter_type, FILE* out) const
+		{
+			assert(!m_blocks.empty());
+
+			flags const behaviour_flags = interpreter.get_flags();
+			fprintf(out, "// Ahead-of-time translation generated by tiny8::aot_translator, do not edit.\n");
+			fprintf(out, "// Rom hash 0x%016llx, flags 0x%02x, %zu blocks.\n", (unsigned long long)tiny8::rom_hash(rom), unsigned(behaviour_flags), m_blocks.size());
+			fprintf(out, "#include <tiny8_aot.h>\n\nnamespace\n{\n\tusing interpreter_type = %s;\n", interpreter_type);
+
+			for (auto const& [address, opcodes] : m_blocks)
+			{
+				fprintf(out, "\n\tvoid block_%04X(interpreter_type& self)\n\t{\n\t\t[[maybe_unused]] tiny8::registers& r = *self.get_registers();\n", address);
+				for (size_t i = 0; i < opcodes.size(); ++i)
+				{
+					uint32_t const instruction_address = address + 2 * static_cast<uint32_t>(i);
+					uint16_t const opcode = opcodes[i];
+					std::string_view const name = interpreter.instruction_name(opcode);
+
+					// Only the last instruction of a block can read or change the program counter.
+					if (i + 1 == opcodes.size() && name != "1nnn")
+						fprintf(out, "\t\tr.m_pc = 0x%04X;\n", instruction_address + 2);
+
+					char text[c_maxDisassemblyLength];
+					uint8_t const word[2] = { static_cast<uint8_t>(opcode >> 8), static_cast<uint8_t>(opcode) };
+					disassemble(interpreter, std::span<uint8_t const>(word), c_romStartAddress, text);
+					fprintf(out, "\t\t%-64s// %04X: %s\n", translate(name, opcode).c_str(), instruction_address, text);
+				}
+				fprintf(out, "\t}\n");
+			}
+
+			fprintf(out, "\n\tconstexpr uint16_t c_opcodes[] =\n\t{");
+			size_t count = 0;
+			for (auto const& [address, opcodes] : m_blocks)
+			{
+				for (uint16_t const opcode : opcodes)
+					fprintf(out, "%s0x%04X,", count++ % 16 == 0 ? "\n\t\t" : " ", opcode);
+			}
+			fprintf(out, "\n\t};\n\n\tconstexpr tiny8::aot_block<interpreter_type> c_blocks[] =\n\t{\n");
+
+			uint32_t first = 0;
+			for (auto const& [address, opcodes] : m_blocks)
+			{
+				fprintf(out, "\t\t{ 0x%04X, %zu, %u, &block_%04X },\n", address, opcodes.size(), first, address);
+				first += static_cast<uint32_t>(opcodes.size());
+			}
+			fprintf(out, "\t};\n}\n\nextern tiny8::aot_program<interpreter_type> const %s =\n{\n", program_name);
+			fprintf(out, "\t0x%016llxull, 0x%02x, c_blocks, std::size(c_blocks), c_opcodes\n};\n", (unsigned long long)tiny8::rom_hash(rom), unsigned(behaviour_flags));
+		}
+
+	private:
+		std::map<uint16_t, std::vector<uint16_t>>	m_blocks;	// Opcodes of the recorded blocks by address.
+
+		template<class Interpreter>
+		static typename Interpreter::native_block record(void* user_data, Interpreter&, typename Interpreter::decoded_instruction const* instructions, uint32_t address, uint32_t length)
+		{
+			std::vector<uint16_t>& opcodes = static_cast<aot_translator*>(user_data)->m_blocks[static_cast<uint16_t>(address)];
+			opcodes.resize(length);
+			for (uint32_t i = 0; i < length; ++i)
+				opcodes[i] = instructions[address + 2 * i].m_state.m_opcode;
+			return nullptr;
+		}
+
+		// C++ for one instruction, with the same semantics as its interpreter handler.
+		static std::string translate(std::string_view name, uint16_t opcode)
+		{
+			char line[128];
+			unsigned const x = (opcode >> 8) & 0xf, y = (opcode >> 4) & 0xf, nn = opcode & 0xff, nnn = opcode & 0xfff;
+			bool const legacy = name.ends_with("_legacy");
+			char const* const logical = name.starts_with("8xy1") ? "|" : name.starts_with("8xy2") ? "&" : "^";
+
+			if (name == "6xnn")
+				snprintf(line, sizeof(line), "r.m_v[0x%X] = 0x%02X;", x, nn);
+			else if (name == "7xnn")
+				snprintf(line, sizeof(line), "r.m_v[0x%X] += 0x%02X;", x, nn);
+			else if (name == "8xy0")
+				snprintf(line, sizeof(line), "r.m_v[0x%X] = r.m_v[0x%X];", x, y);
+			else if (name.starts_with("8xy1") || name.starts_with("8xy2") || name.starts_with("8xy3"))
+				snprintf(line, sizeof(line), "r.m_v[0x%X] %s= r.m_v[0x%X];%s", x, logical, y, legacy ? " r.m_v[0xF] = 0;" : "");
+			else if (name == "8xy4")
+				snprintf(line, sizeof(line), "tiny8::semantics::add(r, 0x%X, 0x%X);", x, y);
+			else if (name == "8xy5" || name == "8xy7")
+				snprintf(line, sizeof(line), "tiny8::semantics::subtract(r, 0x%X, 0x%X, 0x%X);", x, name == "8xy5" ? x : y, name == "8xy5" ? y : x);
+			else if (name.starts_with("8xy6") || name.starts_with("8xye"))
+			{
+				char const* const shift = name.starts_with("8xy6") ? "prev >> 1); r.m_v[0xF] = prev & 1" : "prev << 1); r.m_v[0xF] = prev >> 7";
+				char load[32] = "";
+				if (legacy)
+					snprintf(load, sizeof(load), "r.m_v[0x%X] = r.m_v[0x%X]; ", x, y);
+				snprintf(line, sizeof(line), "{ %suint8_t const prev = r.m_v[0x%X]; r.m_v[0x%X] = uint8_t(%s; }", load, x, x, shift);
+			}
+			else if (name == "annn")
+				snprintf(line, sizeof(line), "r.m_index = 0x%03X;", nnn);
+			else if (name == "1nnn")
+				snprintf(line, sizeof(line), "r.m_pc = 0x%03X;", nnn);
+			else if (name == "fx1e")
+				snprintf(line, sizeof(line), "r.m_v[0xF] = r.m_index + r.m_v[0x%X] > 0xfff; r.m_index += r.m_v[0x%X];", x, x);
+			else
+				snprintf(line, sizeof(line), "self.execute_opcode(0x%04X);", opcode);
+			return line;
+		}
+	};
+}
@@ -0,0 +1,125 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <coroutine>
+#include <type_traits>
+#include <vector>
+
+/*
+* C++20 coroutine support: run interpreters from coroutines multiplexed on a few executor threads.
+*
+* co_await co_run(interpreter, budget, schedule) runs one run_slice() (up to budget instructions, stopping at the end of an
+* emulated frame) and suspends the coroutine, handing it to schedule, any callable taking a std::coroutine_handle<> that
+* queues it on the host's executor. The coroutine resumes with the slice_result, which tells it whether a frame is ready to
+* present and whether the machine is blocked on Fx0A and may be parked until its keys change. Input is what the interpreter
+* has latched plus its queued events, see queue_input().
+*
+* run_queue is a minimal single threaded executor for hosts without one.
+*/
+namespace tiny8
+{
+	// Awaitable returned by co_run().
+	template<class Interpreter, class Schedule>
+	class run_awaiter
+	{
+	public:
+		run_awaiter(Interpreter& interpreter, uint32_t budget, Schedule schedule)
+			: m_interpreter(interpreter), m_schedule(std::move(schedule)), m_budget(budget)
+		{
+		}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			m_result = m_interpreter.run_slice(m_budget);
+
+			// The coroutine may resume (and free this awaiter) on another thread as soon as it's scheduled.
+			Schedule schedule = m_schedule;
+			schedule(handle);
+		}
+
+		slice_result await_resume() const noexcept { return m_result; }
+
+	private:
+		Interpreter&	m_interpreter;
+		Schedule		m_schedule;
+		uint32_t		m_budget;
+		slice_result	m_result = {};
+	};
+
+	template<class Interpreter, class Schedule>
+	run_awaiter<Interpreter, std::decay_t<Schedule>> co_run(Interpreter& interpreter, uint32_t budget, Schedule&& schedule)
+	{
+		return { interpreter, budget, std::forward<Schedule>(schedule) };
+	}
+
+	// Resumes scheduled coroutines in order on the thread calling run(). Not thread safe. The ring only grows, so once it has
+	// held as many coroutines as are ever scheduled at once, scheduling doesn't allocate.
+	class run_queue
+	{
+	public:
+		void schedule(std::coroutine_handle<> handle)
+		{
+			if (m_count == m_ring.size())
+				grow();
+
+			m_ring[(m_first + m_count) % m_ring.size()] = handle;
+			m_count++;
+		}
+
+		// The schedule callable to give co_run().
+		auto scheduler() { return [this](std::coroutine_handle<> handle) { schedule(handle); }; }
+
+		// Resume coroutines until none is left scheduled.
+		void run()
+		{
+			while (m_count > 0)
+			{
+				std::coroutine_handle<> const handle = m_ring[m_first];
+				m_first = (m_first + 1) % m_ring.size();
+				m_count--;
+				handle.resume();
+			}
+		}
+
+		size_t size() const { return m_count; }
+
+	private:
+		std::vector<std::coroutine_handle<>>	m_ring;
+		size_t									m_first = 0;
+		size_t									m_count = 0;
+
+		void grow()
+		{
+			std::vector<std::coroutine_handle<>> ring(std::max<size_t>(16, m_ring.size() * 2));
+			for (size_t i = 0; i < m_count; ++i)
+				ring[i] = m_ring[(m_first + i) % m_ring.size()];
+
+			m_ring = std::move(ring);
+			m_first = 0;
+		}
+	};
+}
@@ -0,0 +1,146 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_blit.h"
+
+#include <vector>
+
+/*
+* Many displays packed into a single texture.
+*
+* A blit_atlas lays out one tile per instance in a grid over a single 32-bit pixel buffer. Tiles are c_hiresDisplayWidth by
+* c_hiresDisplayHeight pixels and low resolution displays are drawn at twice the scale, so every tile covers the same area
+* whatever the resolution. Updates only expand the rows a display reports dirty and collect the span of atlas rows they touched:
+* the host uploads that span once per present and draws the whole atlas as one textured quad, so presenting costs one upload and
+* one draw call however many instances there are.
+*/
+namespace tiny8
+{
+	class blit_atlas
+	{
+	public:
+		static constexpr size_t c_tileWidth = c_hiresDisplayWidth;
+		static constexpr size_t c_tileHeight = c_hiresDisplayHeight;
+
+		// Atlas rows [m_first, m_first + m_count) that changed, see take_dirty_span().
+		struct span
+		{
+			size_t m_first = 0;
+			size_t m_count = 0;
+		};
+
+		// Lay out count tiles, in a square-ish grid unless given the number of columns. Every tile starts off.
+		explicit blit_atlas(size_t count, blit_palette const& palette, size_t columns = 0)
+			: m_palette(palette)
+			, m_tiles(count)
+		{
+			assert(count > 0);
+
+			m_columns = columns;
+			if (m_columns == 0)
+			{
+				m_columns = 1;
+				while (m_columns * m_columns < count)
+					m_columns++;
+			}
+			m_rows = (count + m_columns - 1) / m_columns;
+
+			m_pixels.assign(width() * height(), palette.m_colors[0]);
+			m_dirtyEnd = height();
+		}
+
+		size_t tile_count() const { return m_tiles.size(); }
+		size_t width() const { return m_columns * c_tileWidth; }
+		size_t height() const { return m_rows * c_tileHeight; }
+		size_t pitch() const { return width() * sizeof(uint32_t); }
+		uint32_t const* pixels() const { return m_pixels.data(); }
+
+		// Top left pixel of a tile.
+		size_t tile_x(size_t tile) const { return tile % m_columns * c_tileWidth; }
+		size_t tile_y(size_t tile) const { return tile / m_columns * c_tileHeight; }
+
+		// Redraw the rows of a tile's display that changed, as kept in its m_dirtyRows (taken with take_dirty_rows(), or the rows of a
+		// frame_mailbox frame). The first update and resolution changes redraw the whole tile. Returns false if nothing was drawn.
+		bool update(size_t tile, display const& source, uint64_t dirty_rows)
+		{
+			assert(tile < m_tiles.size());
+
+			tile_state& state = m_tiles[tile];
+			if (!state.m_drawn || state.m_hires != source.m_hires)
+				dirty_rows = ~0ull;
+			state.m_drawn = true;
+			state.m_hires = source.m_hires;
+
+			size_t const rows = source.height();
+			dirty_rows &= rows == 64 ? ~0ull : (1ull << rows) - 1;
+			if (dirty_rows == 0)
+				return false;
+
+			uint32_t const scale = static_cast<uint32_t>(c_tileWidth / source.width());
+			auto* const origin = reinterpret_cast<uint8_t*>(m_pixels.data() + tile_y(tile) * width() + tile_x(tile));
+
+			// One blit per run of consecutive dirty rows.
+			for (uint64_t left = dirty_rows; left != 0; )
+			{
+				size_t const begin = std::countr_zero(left);
+				size_t const end = begin + std::countr_one(left >> begin);
+				blit(source, begin, end - begin, origin + begin * scale * pitch(), pitch(), m_palette, scale);
+				left = end < 64 ? left & (~0ull << end) : 0;
+			}
+
+			size_t const first = tile_y(tile) + std::countr_zero(dirty_rows) * scale;
+			size_t const last = tile_y(tile) + (64 - std::countl_zero(dirty_rows)) * scale;
+			m_dirtyFirst = std::min(m_dirtyFirst, first);
+			m_dirtyEnd = std::max(m_dirtyEnd, last);
+			return true;
+		}
+
+		// Same as above, taking the display's dirty rows.
+		bool update(size_t tile, display& source) { return update(tile, source, source.take_dirty_rows()); }
+
+		// The atlas rows changed since the last call (all of them the first time), empty if none did, and reset it.
+		span take_dirty_span()
+		{
+			span const changed = m_dirtyFirst < m_dirtyEnd ? span{ m_dirtyFirst, m_dirtyEnd - m_dirtyFirst } : span{};
+			m_dirtyFirst = height();
+			m_dirtyEnd = 0;
+			return changed;
+		}
+
+	private:
+		struct tile_state
+		{
+			bool	m_drawn = false;
+			bool	m_hires = false;
+		};
+
+		blit_palette				m_palette;
+		std::vector<tile_state>		m_tiles;
+		std::vector<uint32_t>		m_pixels;
+		size_t						m_columns = 0;
+		size_t						m_rows = 0;
+		size_t						m_dirtyFirst = 0;
+		size_t						m_dirtyEnd = 0;
+	};
+}
@@ -0,0 +1,208 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+/*
+* Audio output for a tiny8 interpreter.
+*
+* While the sound timer is non zero the 128 bit pattern buffer (F002) is played back one bit per step, at 4000 * 2^((pitch - 64) / 48)
+* bits per second (Fx3A). The emulation thread renders that into 16 bit mono samples and pushes them into a single producer, single
+* consumer ring; the audio thread (typically an SDL audio callback) pops them. Neither side ever takes a lock or allocates, an
+* empty ring plays silence and a full one drops the newest samples.
+*/
+namespace tiny8
+{
+	// Playback rate of the pattern buffer in bits per second for a given Fx3A pitch.
+	inline double pattern_rate(uint8_t pitch)
+	{
+		return 4000.0 * std::exp2((static_cast<int>(pitch) - c_defaultAudioPitch) / 48.0);
+	}
+
+	// Fixed capacity ring shared by exactly one producer and one consumer thread. The capacity is rounded up to a power of two.
+	template<class T>
+	class spsc_ring
+	{
+	public:
+		explicit spsc_ring(size_t capacity)
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+
+			m_data.resize(size);
+			m_mask = size - 1;
+		}
+
+		// Producer: append up to count items, returns how many fit.
+		size_t push(T const* data, size_t count)
+		{
+			size_t const head = m_head.load(std::memory_order_relaxed);
+			size_t const tail = m_tail.load(std::memory_order_acquire);
+			size_t const n = std::min(count, capacity() - (head - tail));
+
+			for (size_t i = 0; i < n; ++i)
+				m_data[(head + i) & m_mask] = data[i];
+
+			m_head.store(head + n, std::memory_order_release);
+			return n;
+		}
+
+		// Consumer: take up to count items, returns how many were available.
+		size_t pop(T* out, size_t count)
+		{
+			size_t const tail = m_tail.load(std::memory_order_relaxed);
+			size_t const head = m_head.load(std::memory_order_acquire);
+			size_t const n = std::min(count, head - tail);
+
+			for (size_t i = 0; i < n; ++i)
+				out[i] = m_data[(tail + i) & m_mask];
+
+			m_tail.store(tail + n, std::memory_order_release);
+			return n;
+		}
+
+		// Items waiting to be popped. Exact from either thread's point of view for its own side, a snapshot otherwise.
+		size_t size() const { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire); }
+		size_t capacity() const { return m_mask + 1; }
+
+	private:
+		std::vector<T>	m_data;
+		size_t			m_mask = 0;
+
+		// Kept on separate cache lines so the two threads don't invalidate each other's counters.
+		alignas(64) std::atomic<size_t>	m_head = 0;	// Written by the producer only.
+		alignas(64) std::atomic<size_t>	m_tail = 0;	// Written by the consumer only.
+	};
+
+	class audio_stream
+	{
+	public:
+		audio_stream(uint32_t sample_rate = 44100, size_t capacity = 8192, int16_t volume = 3000)
+			: m_ring(capacity), m_block(c_blockSize), m_sampleRate(sample_rate), m_volume(volume)
+		{
+			assert(sample_rate > 0);
+		}
+
+		// Producer: render count samples from the current sound timer, pattern and pitch of an interpreter.
+		template<class Interpreter>
+		void render(Interpreter& interpreter, size_t count)
+		{
+			render(*interpreter.get_audio(), interpreter.get_timers()->m_sound > 0, count);
+		}
+
+		// Producer: render one 60Hz frame worth of samples, call after every run_frame(). Fractions of a sample carry over to the next frame.
+		// Fast-forwarding speed frames per real one (see tiny8::turbo), each frame renders 1/speed of that instead, so the audio
+		// plays speed times as fast at its own pitch.
+		template<class Interpreter>
+		void render_frame(Interpreter& interpreter, uint32_t speed = 1)
+		{
+			uint32_t const frames_per_second = 60 * std::max<uint32_t>(speed, 1);
+			m_frameSamples += m_sampleRate;
+			size_t const count = m_frameSamples / frames_per_second;
+			m_frameSamples %= frames_per_second;
+			render(interpreter, count);
+		}
+
+		// Producer: top the ring up to a given number of queued samples, for loops paced by wall clock time (advance()).
+		// The consumer drains the ring in real time, so the target is also the output latency.
+		template<class Interpreter>
+		void fill(Interpreter& interpreter, size_t target)
+		{
+			size_t const queued = m_ring.size();
+			if (queued < target)
+				render(interpreter, target - queued);
+		}
+
+		void render(audio const& state, bool playing, size_t count)
+		{
+			double const step = pattern_rate(state.m_pitch) / m_sampleRate;
+			constexpr double c_patternBits = c_audioPatternSize * 8;
+
+			while (count > 0)
+			{
+				size_t const n = std::min(count, c_blockSize);
+				for (size_t i = 0; i < n; ++i)
+				{
+					if (!playing)
+					{
+						m_block[i] = 0;
+						continue;
+					}
+
+					uint32_t const bit = static_cast<uint32_t>(m_phase);
+					bool const high = (state.m_pattern[bit >> 3] >> (7 - (bit & 7))) & 1;
+					m_block[i] = high ? m_volume : static_cast<int16_t>(-m_volume);
+
+					m_phase += step;
+					if (m_phase >= c_patternBits)
+						m_phase -= c_patternBits;
+				}
+
+				m_dropped += n - m_ring.push(m_block.data(), n);
+				count -= n;
+			}
+		}
+
+		// Consumer: copy count samples out, padding with silence if the producer fell behind. Returns the samples actually read.
+		size_t read(int16_t* out, size_t count)
+		{
+			size_t const n = m_ring.pop(out, count);
+			if (n < count)
+			{
+				memset(out + n, 0, (count - n) * sizeof(int16_t));
+				m_underruns.fetch_add(1, std::memory_order_relaxed);
+			}
+			return n;
+		}
+
+		// Matches SDL_AudioCallback for a mono AUDIO_S16SYS device, with the stream as the user data.
+		static void callback(void* userdata, uint8_t* stream, int len)
+		{
+			static_cast<audio_stream*>(userdata)->read(reinterpret_cast<int16_t*>(stream), static_cast<size_t>(len) / sizeof(int16_t));
+		}
+
+		uint32_t sample_rate() const { return m_sampleRate; }
+		size_t queued() const { return m_ring.size(); }
+
+		// Samples the producer couldn't fit in the ring, and reads the consumer had to pad with silence.
+		size_t dropped() const { return m_dropped; }
+		size_t underruns() const { return m_underruns.load(std::memory_order_relaxed); }
+
+	private:
+		static constexpr size_t c_blockSize = 256;
+
+		spsc_ring<int16_t>		m_ring;
+		std::vector<int16_t>	m_block;				// Rendered before being pushed, so the ring is written in runs.
+		uint32_t				m_sampleRate;
+		int16_t					m_volume;
+		uint32_t				m_frameSamples = 0;		// Sample rate accumulated over frames, in 1/(60 * speed)ths of a sample.
+		double					m_phase = 0.0;			// Position in the pattern, in bits.
+		size_t					m_dropped = 0;
+		std::atomic<size_t>		m_underruns = 0;
+	};
+}
@@ -0,0 +1,644 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_cycles.h"
+#include "tiny8_metrics.h"
+#include "tiny8_numa.h"
+#include "tiny8_savestate.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+/*
+* Run many tiny8 interpreters in lockstep on a thread pool.
+*
+* A batch owns its interpreters and a pool of worker threads sized to the core count (the calling thread is one of them).
+* Every emulated frame, each instance runs one run_frame() worth of instructions; instances are handed out in contiguous
+* ranges per worker, and workers that run out steal half of the remaining range of another one, so uneven instances
+* (some waiting on input, some drawing) still keep every core busy. With disp_sync_legacy a draw ends the instance's frame
+* right away, so the worker moves on to the next instance. All instances have finished a frame before the next
+* one starts, which is when the frame callback runs and input can be changed.
+* Instances where has_fault() is set are left alone until the frame callback recycles them (load_state() and clear_fault()).
+* An instance can have a runner that runs its frames instead, on whichever worker picks it up (a debugger stub, see tiny8_gdb.h).
+* Instances of the same rom can run from one decode cache (share_decode_cache()), only read while the batch runs.
+* With a cycle_costs table (set_cycle_costs(), see tiny8_cycles.h) a frame is a budget of machine cycles instead of instructions.
+*
+* Each worker constructs the instances of its own range, so their memory is first touched, and placed, on the node it runs on. On
+* systems with more than one NUMA node the workers are spread over the nodes and pinned to a core each, and steal from workers
+* on their own node before going to another one.
+*
+* With balancing on, each worker starts a frame on a range of equal cost rather than an equal count, costed by the instructions
+* every instance ran the frame before, so instances that idle or finish early don't leave some workers stealing all frame.
+* Between frames an instance can move to another slot, of this batch or another one, through the save state format:
+* export_instance() serializes it and parks its slot, import_instance() resumes it from the bytes wherever they were sent.
+*
+* Interactive instances can share the batch with background ones (set_priority()): every frame the workers take the interactive
+* instances first, then background ones in turn until the frame budget is spent, so a frame returns on time however many
+* background instances there are. Background instances left out go first the next frame, each runs at most a frame per frame.
+*
+* Results don't depend on the worker count or on who ran or stole what: instances share nothing they write while a frame runs
+* (a shared decode cache is only read, Cxnn draws from each instance's own generator, seeded with its index), every frame ends
+* on all of them before the frame callback runs, and digest() combines the instances in index order. Only a frame budget, which
+* runs as many background instances as fit in wall clock time, and instance runners with state of their own can tell them apart.
+*/
+namespace tiny8
+{
+	enum class batch_priority : uint8_t
+	{
+		background,		// Runs after the interactive instances, while the frame budget lasts.
+		interactive		// Runs every frame, ahead of any background instance.
+	};
+
+	template<class Interpreter>
+	class basic_batch
+	{
+	public:
+		// Called on the calling thread after every frame, while no instance is running.
+		using frame_callback = void(*)(void* user_data, basic_batch& batch, uint64_t frame);
+
+		// Runs one frame of an instance in place of its run_frame(), on a worker thread.
+		using instance_runner = void(*)(void* user_data, Interpreter& interpreter, uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame);
+
+		// Create count interpreters, each constructed with args by the worker that starts out running it and seeded with its index.
+		// threads = 0 uses one worker per hardware thread.
+		template<class... Args>
+		explicit basic_batch(size_t count, size_t threads = 0, Args const&... args)
+			: m_keys(count)
+		{
+			assert(count <= 0xffffffff);
+
+			for (auto& keys : m_keys)
+				keys.fill(0);
+
+			if (threads == 0)
+				threads = std::max(1u, std::thread::hardware_concurrency());
+			threads = std::max<size_t>(1, std::min(threads, count));
+
+			m_ranges = std::make_unique<range[]>(threads);
+			m_workerCount = threads;
+			m_instances.m_data = static_cast<Interpreter*>(::operator new(count * sizeof(Interpreter), std::align_val_t(alignof(Interpreter))));
+			m_instances.m_size = count;
+
+			// Worker w goes to node w * nodes / workers, on the next core of it. The calling thread, worker 0, is left where it is.
+			std::vector<std::vector<uint32_t>> const nodes = numa_nodes();
+			std::vector<uint32_t> cpus(threads, ~0u);
+			if (nodes.size() > 1)
+			{
+				m_workerNodes.resize(threads);
+				std::vector<size_t> used(nodes.size());
+				for (size_t worker = 0; worker < threads; ++worker)
+				{
+					size_t const node = worker * nodes.size() / threads;
+					m_workerNodes[worker] = static_cast<uint32_t>(node);
+					cpus[worker] = nodes[node][used[node]++ % nodes[node].size()];
+				}
+			}
+
+			m_busyWorkers = threads - 1;
+			for (size_t worker = 1; worker < threads; ++worker)
+			{
+				m_threads.emplace_back([this, worker, cpu = cpus[worker], &args...]
+					{
+						if (cpu != ~0u)
+							pin_current_thread(cpu);
+						construct_range(worker, args...);
+						finish_work();
+						worker_main(worker);
+					});
+			}
+			construct_range(0, args...);
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [this] { return m_busyWorkers == 0; });
+		}
+
+		~basic_batch()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_wake.notify_all();
+
+			for (auto& thread : m_threads)
+				thread.join();
+
+			for (size_t i = 0; i < m_instances.m_size; ++i)
+				m_instances[i].~Interpreter();
+			::operator delete(m_instances.m_data, std::align_val_t(alignof(Interpreter)));
+		}
+
+		basic_batch(basic_batch const&) = delete;
+		basic_batch& operator=(basic_batch const&) = delete;
+
+		size_t size() const { return m_instances.size(); }
+		size_t worker_count() const { return m_workerCount; }
+
+		// Seed instance i with base + i, as the constructor does with base 0 (reset() goes back to seed 0). Only call between frames.
+		void set_seeds(uint64_t base)
+		{
+			for (size_t i = 0; i < m_instances.m_size; ++i)
+				m_instances[i].set_seed(base + i);
+		}
+
+		// Hash of the state_hash() of every instance, in index order: equal for batches that ran the same, however many workers
+		// they had. Only call between frames.
+		uint64_t digest() const
+		{
+			uint64_t hash = 0;
+			for (size_t i = 0; i < m_instances.m_size; ++i)
+			{
+				uint64_t const state = m_instances[i].state_hash();
+				hash = xxhash64(&state, sizeof(state), hash);
+			}
+			return hash;
+		}
+
+		// Instances and their key buffers. Only touch them between frames.
+		Interpreter& operator[](size_t index) { return m_instances[index]; }
+		uint8_t* keys(size_t index) { return m_keys[index].data(); }
+
+		// Instructions per frame handed to run_frame(); ignored by instances using timer_mode::emulated, which keep their own rate.
+		void set_cycles_per_frame(uint32_t cycles_per_frame) { m_cyclesPerFrame = cycles_per_frame; }
+
+		void set_frame_callback(frame_callback callback, void* user_data = nullptr)
+		{
+			m_frameCallback = callback;
+			m_frameUserData = user_data;
+		}
+
+		// Split each frame between the workers by the instructions every instance ran the frame before instead of by count.
+		void set_balancing(bool enabled)
+		{
+			if (enabled && m_costs.empty())
+				m_costs.assign(m_instances.size(), c_frameOverhead);
+			m_balancing = enabled;
+		}
+
+		// Serialize an instance between frames and park its slot, which then doesn't run until something is imported into it.
+		// Returns the state's size, 0 (leaving the instance running) if out is smaller than the serializer's c_maxStateSize.
+		template<size_t MemorySize>
+		size_t export_instance(size_t index, basic_state_serializer<MemorySize>& serializer, std::span<uint8_t> out)
+		{
+			size_t const size = serializer.save(m_instances[index], out);
+			if (size > 0)
+				set_parked(index, true);
+			return size;
+		}
+
+		// Resume an exported instance in a slot, parked or not, between frames. False, leaving the slot as it was, if the state
+		// doesn't load. Runners, decode caches and timer modes belong to the slot and stay.
+		template<size_t MemorySize>
+		bool import_instance(size_t index, basic_state_serializer<MemorySize>& serializer, std::span<uint8_t const> in)
+		{
+			if (!serializer.load(m_instances[index], in))
+				return false;
+			set_parked(index, false);
+			return true;
+		}
+
+		// Move an instance into a slot of another batch (or this one) between frames, with its key buffer and its cost.
+		template<size_t MemorySize>
+		bool migrate(size_t index, basic_batch& target, size_t target_index, basic_state_serializer<MemorySize>& serializer, std::span<uint8_t> buffer)
+		{
+			size_t const size = export_instance(index, serializer, buffer);
+			if (size == 0 || !target.import_instance(target_index, serializer, std::span<uint8_t const>(buffer.data(), size)))
+			{
+				set_parked(index, false);
+				return false;
+			}
+
+			target.m_keys[target_index] = m_keys[index];
+			if (!target.m_costs.empty())
+				target.m_costs[target_index] = m_costs.empty() ? c_frameOverhead : m_costs[index];
+			return true;
+		}
+
+		bool is_parked(size_t index) const { return !m_parked.empty() && m_parked[index] != 0; }
+
+		// Run an instance every frame ahead of the others, or in the background (every instance is until this is first called).
+		// Only call between frames.
+		void set_priority(size_t index, batch_priority priority)
+		{
+			if (m_priorities.empty())
+				m_priorities.resize(m_instances.size(), batch_priority::background);
+			m_priorities[index] = priority;
+			m_order.clear();
+		}
+
+		// Once priorities are set, stop starting background instances when a frame has run this long, 0 for no limit. A background
+		// instance started before then still runs its whole frame.
+		void set_frame_budget(std::chrono::nanoseconds budget) { m_frameBudget = budget; }
+
+		// Background instances that ran in the last frame.
+		size_t background_run() const { return m_backgroundRun; }
+
+		// Record every instance frame (on the worker that ran it), every batch frame and the instances still running into metrics,
+		// nullptr to stop. The metrics must outlive the batch or be detached. Only call between frames.
+		void set_metrics(metrics* target) { m_metrics = target; }
+
+		// Run every instance's frames as machine cycles with run_machine_frame() (instances in timer_mode::emulated can't), nullptr to
+		// go back to run_frame() and the instruction count. Instance runners still take precedence. Only call between frames.
+		void set_cycle_costs(cycle_costs const* costs)
+		{
+			if (costs != nullptr && m_carries.empty())
+				m_carries.assign(m_instances.size(), 0);
+			m_cycleCosts = costs;
+		}
+
+		// Run an instance's frames through runner instead, nullptr to go back to run_frame(). Only call between frames.
+		void set_instance_runner(size_t index, instance_runner runner, void* user_data = nullptr)
+		{
+			if (m_runners.empty())
+				m_runners.resize(m_instances.size());
+			m_runners[index] = { runner, user_data };
+		}
+
+		// Share the decode cache of the instance at leader (warmed up by running it, or with prewarm_decode_cache()) with every other
+		// instance running the same rom with the same flags, which drop their own: blocks are decoded and compiled once per rom
+		// instead of once per instance. Returns how many instances use it, the leader included. Only call between frames.
+		size_t share_decode_cache(size_t leader)
+		{
+			auto const shared = m_instances[leader].share_decode_cache();
+			size_t count = 1;
+			for (size_t i = 0; i < m_instances.size(); ++i)
+				count += i != leader && m_instances[i].attach_decode_cache(shared);
+			return count;
+		}
+
+		// Run every instance for a number of frames, with a barrier after each one.
+		void run_frames(uint64_t frames)
+		{
+			for (uint64_t i = 0; i < frames; ++i)
+			{
+				auto const start = std::chrono::steady_clock::now();
+				run_frame();
+				if (m_metrics != nullptr)
+					record_frame(std::chrono::steady_clock::now() - start);
+
+				if (m_frameCallback != nullptr)
+					m_frameCallback(m_frameUserData, *this, m_frame);
+				m_frame++;
+			}
+		}
+
+		// Frames run so far.
+		uint64_t get_frame() const { return m_frame; }
+
+	private:
+		// Remaining instances of a worker as [begin, end), packed so that taking from either end is a single compare and swap.
+		struct alignas(64) range
+		{
+			std::atomic<uint64_t>	m_bounds{ 0 };
+		};
+
+		static constexpr uint64_t pack(uint32_t begin, uint32_t end) { return (static_cast<uint64_t>(end) << 32) | begin; }
+		static constexpr uint32_t begin_of(uint64_t bounds) { return static_cast<uint32_t>(bounds); }
+		static constexpr uint32_t end_of(uint64_t bounds) { return static_cast<uint32_t>(bounds >> 32); }
+
+		// Constructed in place, not by a vector, so that each worker can construct its own.
+		struct instance_array
+		{
+			Interpreter*	m_data = nullptr;
+			size_t			m_size = 0;
+
+			size_t size() const { return m_size; }
+			Interpreter& operator[](size_t index) { return m_data[index]; }
+			Interpreter const& operator[](size_t index) const { return m_data[index]; }
+		};
+
+		instance_array									m_instances;
+		std::vector<std::array<uint8_t, c_maxKeys>>		m_keys;
+		uint32_t										m_cyclesPerFrame = c_defaultCyclesPerFrame;
+		uint64_t										m_frame = 0;
+		frame_callback									m_frameCallback = nullptr;
+		void*											m_frameUserData = nullptr;
+
+		struct runner
+		{
+			instance_runner		m_run = nullptr;
+			void*				m_userData = nullptr;
+		};
+		std::vector<runner>								m_runners;		// Empty until set_instance_runner() is first called.
+		std::vector<uint8_t>							m_parked;		// Empty until an instance is first exported.
+		std::vector<uint32_t>							m_costs;		// Instructions of the last frame, empty until balancing is first on.
+		bool											m_balancing = false;
+		cycle_costs const*								m_cycleCosts = nullptr;
+		std::vector<uint32_t>							m_carries;		// Machine cycles each instance overran its last frame by.
+
+		// Cost of running a frame of an instance on top of its instructions, so ones that are idle or done still count.
+		static constexpr uint32_t c_frameOverhead = 16;
+
+		std::vector<batch_priority>						m_priorities;		// Empty until set_priority() is first called.
+		std::vector<uint32_t>							m_order;			// Interactive instances then background ones, empty when stale.
+		size_t											m_interactiveCount = 0;
+		size_t											m_backgroundFirst = 0;	// Background instance to start from, within its part of m_order.
+		size_t											m_backgroundRun = 0;
+		std::chrono::nanoseconds						m_frameBudget{ 0 };
+		metrics*										m_metrics = nullptr;
+		std::chrono::steady_clock::time_point			m_deadline;
+		alignas(64) std::atomic<size_t>					m_ticket = 0;		// Next position in m_order to run this frame.
+
+		std::unique_ptr<range[]>	m_ranges;
+		size_t						m_workerCount = 1;
+		std::vector<uint32_t>		m_workerNodes;	// NUMA node of every worker, empty on a single node.
+		std::vector<std::thread>	m_threads;
+		std::mutex					m_mutex;
+		std::condition_variable		m_wake;			// Workers wait here for the next frame.
+		std::condition_variable		m_done;			// The calling thread waits here for the workers to finish a frame.
+		uint64_t					m_generation = 0;
+		size_t						m_busyWorkers = 0;
+		bool						m_stop = false;
+
+		void record_frame(std::chrono::steady_clock::duration duration)
+		{
+			int64_t active = 0;
+			for (size_t i = 0; i < m_instances.size(); ++i)
+				active += !m_instances[i].has_fault() && !is_parked(i);
+			m_metrics->set_active_instances(active);
+			m_metrics->record_host_frame(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+		}
+
+		void set_parked(size_t index, bool parked)
+		{
+			if (m_parked.empty())
+				m_parked.resize(m_instances.size());
+			m_parked[index] = parked;
+		}
+
+		void run_frame()
+		{
+			size_t const count = m_instances.size();
+			if (!m_priorities.empty())
+				start_by_priority();
+			else if (m_balancing)
+				split_by_cost();
+			else
+			{
+				for (size_t worker = 0; worker < m_workerCount; ++worker)
+				{
+					uint32_t const begin = static_cast<uint32_t>(count * worker / m_workerCount);
+					uint32_t const end = static_cast<uint32_t>(count * (worker + 1) / m_workerCount);
+					m_ranges[worker].m_bounds.store(pack(begin, end), std::memory_order_relaxed);
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_generation++;
+				m_busyWorkers = m_workerCount - 1;
+			}
+			m_wake.notify_all();
+
+			work(0);
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [this] { return m_busyWorkers == 0; });
+
+			// Positions were taken in order and every one taken short of the end was run.
+			if (!m_priorities.empty())
+			{
+				size_t const background = count - m_interactiveCount;
+				size_t const taken = std::min(m_ticket.load(std::memory_order_relaxed), count);
+				m_backgroundRun = taken > m_interactiveCount ? taken - m_interactiveCount : 0;
+				if (background > 0)
+					m_backgroundFirst = (m_backgroundFirst + m_backgroundRun) % background;
+			}
+		}
+
+		void start_by_priority()
+		{
+			if (m_order.empty())
+			{
+				for (batch_priority const priority : { batch_priority::interactive, batch_priority::background })
+				{
+					for (size_t i = 0; i < m_instances.size(); ++i)
+					{
+						if (m_priorities[i] == priority)
+							m_order.push_back(static_cast<uint32_t>(i));
+					}
+					if (priority == batch_priority::interactive)
+						m_interactiveCount = m_order.size();
+				}
+				m_backgroundFirst = 0;
+			}
+
+			m_ticket.store(0, std::memory_order_relaxed);
+			m_deadline = m_frameBudget.count() > 0 ? std::chrono::steady_clock::now() + m_frameBudget : std::chrono::steady_clock::time_point::max();
+		}
+
+		// Contiguous ranges of about the same total cost, worker w ending where the running cost first reaches (w + 1) / workers of it.
+		void split_by_cost()
+		{
+			uint64_t total = 0;
+			for (uint32_t const cost : m_costs)
+				total += cost;
+
+			uint64_t running = 0;
+			uint32_t begin = 0, index = 0;
+			uint32_t const count = static_cast<uint32_t>(m_instances.size());
+			for (size_t worker = 0; worker < m_workerCount; ++worker)
+			{
+				uint64_t const target = total * (worker + 1) / m_workerCount;
+				while (index < count && running < target)
+					running += m_costs[index++];
+				uint32_t const end = worker + 1 == m_workerCount ? count : index;
+				m_ranges[worker].m_bounds.store(pack(begin, end), std::memory_order_relaxed);
+				begin = end;
+			}
+		}
+
+		void worker_main(size_t worker)
+		{
+			uint64_t generation = 0;
+			for (;;)
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_wake.wait(lock, [&] { return m_stop || m_generation != generation; });
+					if (m_stop)
+						return;
+					generation = m_generation;
+				}
+
+				work(worker);
+				finish_work();
+			}
+		}
+
+		void finish_work()
+		{
+			bool last;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				last = --m_busyWorkers == 0;
+			}
+			if (last)
+				m_done.notify_one();
+		}
+
+		// Construct the instances the worker starts every frame with (unless balancing or priorities move them).
+		template<class... Args>
+		void construct_range(size_t worker, Args const&... args)
+		{
+			size_t const count = m_instances.m_size;
+			for (size_t i = count * worker / m_workerCount; i < count * (worker + 1) / m_workerCount; ++i)
+			{
+				new (&m_instances.m_data[i]) Interpreter(args...);
+				m_instances.m_data[i].set_seed(i);
+			}
+		}
+
+		// Run instances from the worker's own range, then from whatever can be stolen, until every range is empty.
+		void work(size_t worker)
+		{
+			if (!m_priorities.empty())
+				return work_by_priority();
+
+			uint32_t index;
+			for (;;)
+			{
+				while (take_front(m_ranges[worker], index))
+					run_instance(index);
+
+				if (!steal(worker))
+					return;
+			}
+		}
+
+		// Take positions in m_order one at a time: interactive instances always run, background ones only until the deadline.
+		void work_by_priority()
+		{
+			size_t const count = m_order.size();
+			size_t const background = count - m_interactiveCount;
+			for (;;)
+			{
+				if (m_ticket.load(std::memory_order_relaxed) >= m_interactiveCount && std::chrono::steady_clock::now() >= m_deadline)
+					return;
+
+				size_t const ticket = m_ticket.fetch_add(1, std::memory_order_relaxed);
+				if (ticket >= count)
+					return;
+
+				size_t const position = ticket < m_interactiveCount ? ticket : m_interactiveCount + (m_backgroundFirst + ticket - m_interactiveCount) % background;
+				run_instance(m_order[position]);
+			}
+		}
+
+		void run_instance(uint32_t index)
+		{
+			Interpreter& instance = m_instances[index];
+			if (instance.has_fault() || is_parked(index))
+			{
+				if (m_balancing)
+					m_costs[index] = c_frameOverhead;
+				return;
+			}
+
+			uint64_t const cycles = instance.get_cycles();
+			metrics::frame_start const start = m_metrics != nullptr ? metrics::start_frame(instance) : metrics::frame_start{};
+			if (!m_runners.empty() && m_runners[index].m_run != nullptr)
+				m_runners[index].m_run(m_runners[index].m_userData, instance, m_keys[index].data(), m_cyclesPerFrame);
+			else if (m_cycleCosts != nullptr)
+				run_machine_frame(instance, *m_cycleCosts, m_keys[index].data(), m_carries[index]);
+			else
+				instance.run_frame(m_keys[index].data(), m_cyclesPerFrame);
+			if (m_metrics != nullptr)
+				m_metrics->record_frame(instance, start);
+
+			// Only this worker touches the instance this frame, costs are read between frames.
+			if (m_balancing)
+			{
+				uint64_t const ran = instance.get_cycles() >= cycles ? instance.get_cycles() - cycles : 0;
+				m_costs[index] = static_cast<uint32_t>(std::min<uint64_t>(ran, 0xffffffff - c_frameOverhead)) + c_frameOverhead;
+			}
+		}
+
+		static bool take_front(range& r, uint32_t& index)
+		{
+			uint64_t bounds = r.m_bounds.load(std::memory_order_acquire);
+			for (;;)
+			{
+				uint32_t const begin = begin_of(bounds);
+				uint32_t const end = end_of(bounds);
+				if (begin >= end)
+					return false;
+
+				if (r.m_bounds.compare_exchange_weak(bounds, pack(begin + 1, end), std::memory_order_acq_rel))
+				{
+					index = begin;
+					return true;
+				}
+			}
+		}
+
+		// Move the back half of another worker's range into this (empty) one, from workers on the same node first: their instances'
+		// memory is local.
+		bool steal(size_t thief)
+		{
+			for (bool const local : { true, false })
+			{
+				for (size_t i = 1; i < m_workerCount; ++i)
+				{
+					size_t const victim = (thief + i) % m_workerCount;
+					bool const same_node = m_workerNodes.empty() || m_workerNodes[victim] == m_workerNodes[thief];
+					if (same_node == local && steal_from(thief, m_ranges[victim]))
+						return true;
+				}
+				if (m_workerNodes.empty())
+					break;
+			}
+
+			return false;
+		}
+
+		bool steal_from(size_t thief, range& victim)
+		{
+			uint64_t bounds = victim.m_bounds.load(std::memory_order_acquire);
+			for (;;)
+			{
+				uint32_t const begin = begin_of(bounds);
+				uint32_t const end = end_of(bounds);
+				if (begin >= end)
+					return false;
+
+				uint32_t const split = end - (end - begin + 1) / 2;
+				if (victim.m_bounds.compare_exchange_weak(bounds, pack(begin, split), std::memory_order_acq_rel))
+				{
+					m_ranges[thief].m_bounds.store(pack(split, end), std::memory_order_release);
+					return true;
+				}
+			}
+		}
+	};
+
+	// A batch of interpreters with behaviour flags chosen at run time.
+	using batch = basic_batch<interpreter>;
+}
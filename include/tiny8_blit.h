@@ -0,0 +1,273 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+// Vector kernel used by blit, picked at compile time from what the target enables. Define TINY8_BLIT_KERNEL before including
+// this file to force one; the scalar kernel builds everywhere and is the reference for the others.
+#define TINY8_BLIT_SCALAR	0
+#define TINY8_BLIT_SSE2		1
+#define TINY8_BLIT_AVX2		2
+#define TINY8_BLIT_NEON		3
+#define TINY8_BLIT_WASM		4
+
+#if !defined(TINY8_BLIT_KERNEL)
+#if defined(__AVX2__)
+#define TINY8_BLIT_KERNEL TINY8_BLIT_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TINY8_BLIT_KERNEL TINY8_BLIT_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define TINY8_BLIT_KERNEL TINY8_BLIT_NEON
+#elif defined(__wasm_simd128__)
+#define TINY8_BLIT_KERNEL TINY8_BLIT_WASM
+#else
+#define TINY8_BLIT_KERNEL TINY8_BLIT_SCALAR
+#endif
+#endif
+
+#if TINY8_BLIT_KERNEL == TINY8_BLIT_AVX2
+#include <immintrin.h>
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_SSE2
+#include <emmintrin.h>
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_NEON
+#include <arm_neon.h>
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_WASM
+#include <wasm_simd128.h>
+#endif
+
+/*
+* Framebuffer expansion for presentation.
+*
+* blit() turns the bit packed display, or a byte-per-pixel copy of it (display::unpack), into 32-bit pixels: row-major, at any
+* integer scale, into a caller provided buffer with its own pitch (a locked texture, a window surface...). Eight pixels are
+* expanded at a time with SSE2, AVX2, NEON or wasm SIMD128 (-msimd128); scaled rows are widened once and copied down for the remaining lines.
+*/
+namespace tiny8
+{
+	// 32-bit colours for the pixel values: off, plane 1, plane 2, both planes. Written as given, so any channel order works.
+	struct blit_palette
+	{
+		uint32_t m_colors[4];
+	};
+
+	// Two colour palette: pixels lit in any plane get the on colour.
+	constexpr blit_palette make_palette(uint32_t off_color, uint32_t on_color)
+	{
+		return { { off_color, on_color, on_color, on_color } };
+	}
+
+	class blit_kernel
+	{
+	public:
+		// Expand 8 pixels, given as one byte of each plane with the leftmost pixel in the most significant bit.
+		static void expand_packed(uint8_t plane0, uint8_t plane1, blit_palette const& palette, uint32_t* out)
+		{
+#if TINY8_BLIT_KERNEL == TINY8_BLIT_AVX2
+			__m256i const bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+			__m256i const p0 = _mm256_set1_epi32(plane0);
+			__m256i const p1 = _mm256_set1_epi32(plane1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), select(palette, _mm256_cmpeq_epi32(_mm256_and_si256(p0, bits), bits), _mm256_cmpeq_epi32(_mm256_and_si256(p1, bits), bits)));
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_SSE2
+			__m128i const bits_left = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+			__m128i const bits_right = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+			__m128i const p0 = _mm_set1_epi32(plane0);
+			__m128i const p1 = _mm_set1_epi32(plane1);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out), select(palette, _mm_cmpeq_epi32(_mm_and_si128(p0, bits_left), bits_left), _mm_cmpeq_epi32(_mm_and_si128(p1, bits_left), bits_left)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), select(palette, _mm_cmpeq_epi32(_mm_and_si128(p0, bits_right), bits_right), _mm_cmpeq_epi32(_mm_and_si128(p1, bits_right), bits_right)));
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_NEON
+			static uint32_t const c_bits[8] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+			uint32x4_t const p0 = vdupq_n_u32(plane0);
+			uint32x4_t const p1 = vdupq_n_u32(plane1);
+			for (size_t half = 0; half < 2; ++half)
+			{
+				uint32x4_t const bits = vld1q_u32(c_bits + half * 4);
+				vst1q_u32(out + half * 4, select(palette, vtstq_u32(p0, bits), vtstq_u32(p1, bits)));
+			}
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_WASM
+			v128_t const bits_left = wasm_i32x4_make(0x80, 0x40, 0x20, 0x10);
+			v128_t const bits_right = wasm_i32x4_make(0x08, 0x04, 0x02, 0x01);
+			v128_t const p0 = wasm_i32x4_splat(plane0);
+			v128_t const p1 = wasm_i32x4_splat(plane1);
+			wasm_v128_store(out, select(palette, wasm_i32x4_eq(wasm_v128_and(p0, bits_left), bits_left), wasm_i32x4_eq(wasm_v128_and(p1, bits_left), bits_left)));
+			wasm_v128_store(out + 4, select(palette, wasm_i32x4_eq(wasm_v128_and(p0, bits_right), bits_right), wasm_i32x4_eq(wasm_v128_and(p1, bits_right), bits_right)));
+#else
+			for (int bit = 7; bit >= 0; --bit)
+				*out++ = palette.m_colors[((plane0 >> bit) & 1) | (((plane1 >> bit) & 1) << 1)];
+#endif
+		}
+
+		// Expand count byte-per-pixel values (plane bits, anything above them is ignored).
+		static void expand_bytes(uint8_t const* pixels, size_t count, blit_palette const& palette, uint32_t* out)
+		{
+			size_t i = 0;
+#if TINY8_BLIT_KERNEL == TINY8_BLIT_AVX2
+			__m256i const one = _mm256_set1_epi32(1);
+			__m256i const two = _mm256_set1_epi32(2);
+			for (; i + 8 <= count; i += 8)
+			{
+				__m256i const v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(pixels + i)));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), select(palette, _mm256_cmpeq_epi32(_mm256_and_si256(v, one), one), _mm256_cmpeq_epi32(_mm256_and_si256(v, two), two)));
+			}
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_SSE2
+			__m128i const zero = _mm_setzero_si128();
+			__m128i const one = _mm_set1_epi32(1);
+			__m128i const two = _mm_set1_epi32(2);
+			for (; i + 8 <= count; i += 8)
+			{
+				__m128i const words = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(pixels + i)), zero);
+				__m128i const left = _mm_unpacklo_epi16(words, zero);
+				__m128i const right = _mm_unpackhi_epi16(words, zero);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), select(palette, _mm_cmpeq_epi32(_mm_and_si128(left, one), one), _mm_cmpeq_epi32(_mm_and_si128(left, two), two)));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), select(palette, _mm_cmpeq_epi32(_mm_and_si128(right, one), one), _mm_cmpeq_epi32(_mm_and_si128(right, two), two)));
+			}
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_NEON
+			uint32x4_t const one = vdupq_n_u32(1);
+			uint32x4_t const two = vdupq_n_u32(2);
+			for (; i + 8 <= count; i += 8)
+			{
+				uint16x8_t const words = vmovl_u8(vld1_u8(pixels + i));
+				uint32x4_t const left = vmovl_u16(vget_low_u16(words));
+				uint32x4_t const right = vmovl_u16(vget_high_u16(words));
+				vst1q_u32(out + i, select(palette, vtstq_u32(left, one), vtstq_u32(left, two)));
+				vst1q_u32(out + i + 4, select(palette, vtstq_u32(right, one), vtstq_u32(right, two)));
+			}
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_WASM
+			v128_t const one = wasm_i32x4_splat(1);
+			v128_t const two = wasm_i32x4_splat(2);
+			for (; i + 8 <= count; i += 8)
+			{
+				v128_t const words = wasm_u16x8_load8x8(pixels + i);
+				v128_t const left = wasm_u32x4_extend_low_u16x8(words);
+				v128_t const right = wasm_u32x4_extend_high_u16x8(words);
+				wasm_v128_store(out + i, select(palette, wasm_i32x4_eq(wasm_v128_and(left, one), one), wasm_i32x4_eq(wasm_v128_and(left, two), two)));
+				wasm_v128_store(out + i + 4, select(palette, wasm_i32x4_eq(wasm_v128_and(right, one), one), wasm_i32x4_eq(wasm_v128_and(right, two), two)));
+			}
+#endif
+			for (; i < count; ++i)
+				out[i] = palette.m_colors[pixels[i] & 3];
+		}
+
+	private:
+		// Pick a palette entry per lane from the plane 0 and plane 1 lane masks.
+#if TINY8_BLIT_KERNEL == TINY8_BLIT_AVX2
+		static __m256i select(blit_palette const& palette, __m256i plane0, __m256i plane1)
+		{
+			__m256i const unlit = _mm256_blendv_epi8(_mm256_set1_epi32(palette.m_colors[0]), _mm256_set1_epi32(palette.m_colors[2]), plane1);
+			__m256i const lit = _mm256_blendv_epi8(_mm256_set1_epi32(palette.m_colors[1]), _mm256_set1_epi32(palette.m_colors[3]), plane1);
+			return _mm256_blendv_epi8(unlit, lit, plane0);
+		}
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_SSE2
+		static __m128i select(blit_palette const& palette, __m128i plane0, __m128i plane1)
+		{
+			__m128i const unlit = _mm_or_si128(_mm_andnot_si128(plane1, _mm_set1_epi32(palette.m_colors[0])), _mm_and_si128(plane1, _mm_set1_epi32(palette.m_colors[2])));
+			__m128i const lit = _mm_or_si128(_mm_andnot_si128(plane1, _mm_set1_epi32(palette.m_colors[1])), _mm_and_si128(plane1, _mm_set1_epi32(palette.m_colors[3])));
+			return _mm_or_si128(_mm_andnot_si128(plane0, unlit), _mm_and_si128(plane0, lit));
+		}
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_NEON
+		static uint32x4_t select(blit_palette const& palette, uint32x4_t plane0, uint32x4_t plane1)
+		{
+			uint32x4_t const unlit = vbslq_u32(plane1, vdupq_n_u32(palette.m_colors[2]), vdupq_n_u32(palette.m_colors[0]));
+			uint32x4_t const lit = vbslq_u32(plane1, vdupq_n_u32(palette.m_colors[3]), vdupq_n_u32(palette.m_colors[1]));
+			return vbslq_u32(plane0, lit, unlit);
+		}
+#elif TINY8_BLIT_KERNEL == TINY8_BLIT_WASM
+		static v128_t select(blit_palette const& palette, v128_t plane0, v128_t plane1)
+		{
+			v128_t const unlit = wasm_v128_bitselect(wasm_i32x4_splat(palette.m_colors[2]), wasm_i32x4_splat(palette.m_colors[0]), plane1);
+			v128_t const lit = wasm_v128_bitselect(wasm_i32x4_splat(palette.m_colors[3]), wasm_i32x4_splat(palette.m_colors[1]), plane1);
+			return wasm_v128_bitselect(lit, unlit, plane0);
+		}
+#endif
+	};
+
+	// Widen a row of pixels by an integer scale into out, then copy it down to the scale - 1 lines below.
+	inline void blit_scale_row(uint32_t const* row, size_t width, uint32_t scale, uint8_t* out, size_t pitch)
+	{
+		auto* const line = reinterpret_cast<uint32_t*>(out);
+		for (size_t x = 0; x < width; ++x)
+		{
+			for (uint32_t i = 0; i < scale; ++i)
+				line[x * scale + i] = row[x];
+		}
+
+		for (uint32_t i = 1; i < scale; ++i)
+			memcpy(out + i * pitch, line, width * scale * sizeof(uint32_t));
+	}
+
+	// Expand row_count rows of the display, starting at first_row, to 32-bit pixels. out points at the first output pixel of
+	// first_row and every display row takes scale lines of pitch bytes.
+	inline void blit(display const& source, size_t first_row, size_t row_count, void* out, size_t pitch, blit_palette const& palette, uint32_t scale = 1)
+	{
+		assert(scale > 0 && first_row + row_count <= source.height());
+
+		size_t const width = source.width();
+		uint32_t row[c_hiresDisplayWidth];
+		auto* dest = static_cast<uint8_t*>(out);
+
+		for (size_t y = first_row; y < first_row + row_count; ++y, dest += pitch * scale)
+		{
+			uint32_t* const target = scale == 1 ? reinterpret_cast<uint32_t*>(dest) : row;
+			for (size_t x = 0; x < width; x += 8)
+			{
+				size_t const shift = 56 - (x & 63);
+				blit_kernel::expand_packed(static_cast<uint8_t>(source.m_planes[0][y][x >> 6] >> shift), static_cast<uint8_t>(source.m_planes[1][y][x >> 6] >> shift), palette, target + x);
+			}
+
+			if (scale > 1)
+				blit_scale_row(row, width, scale, dest, pitch);
+		}
+	}
+
+	// Expand the whole display in its current resolution.
+	inline void blit(display const& source, void* out, size_t pitch, blit_palette const& palette, uint32_t scale = 1)
+	{
+		blit(source, 0, source.height(), out, pitch, palette, scale);
+	}
+
+	// Expand a width * height byte-per-pixel framebuffer, as written by display::unpack().
+	inline void blit(uint8_t const* pixels, size_t width, size_t height, void* out, size_t pitch, blit_palette const& palette, uint32_t scale = 1)
+	{
+		assert(scale > 0);
+
+		constexpr size_t c_chunk = 256;
+		uint32_t row[c_chunk];
+		auto* dest = static_cast<uint8_t*>(out);
+
+		for (size_t y = 0; y < height; ++y, pixels += width, dest += pitch * scale)
+		{
+			if (scale == 1)
+			{
+				blit_kernel::expand_bytes(pixels, width, palette, reinterpret_cast<uint32_t*>(dest));
+				continue;
+			}
+
+			// Widened in chunks, so any width works with a fixed size buffer.
+			for (size_t x = 0; x < width; x += c_chunk)
+			{
+				size_t const count = std::min(c_chunk, width - x);
+				blit_kernel::expand_bytes(pixels + x, count, palette, row);
+				blit_scale_row(row, count, scale, dest + x * scale * sizeof(uint32_t), pitch);
+			}
+		}
+	}
+}
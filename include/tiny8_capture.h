@@ -0,0 +1,377 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_blit.h"
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/*
+* Video of a run, as an animated GIF written in the background.
+*
+* capture() runs on the emulation thread at frame boundaries and only copies the bit packed framebuffer (2KB) into a ring, or
+* nothing at all when the display didn't change since the previous frame (its version is the same). A writer thread turns the
+* ring into GIF frames: pixel values index a four colour palette, so both planes fit, and each frame only covers the rectangle
+* that changed since the one before, left in place underneath, which is what makes long runs of a mostly static screen tiny.
+* Low resolution frames are doubled, so the video is always 128x64 pixels times the scale and switching resolution mid-run works.
+* GIF delays are whole hundredths of a second, and viewers slow down anything under two, so frames closer together than that
+* are folded into the next one. A full ring drops frames instead of stalling the emulation.
+*/
+namespace tiny8
+{
+	namespace capture_detail
+	{
+		constexpr uint32_t c_width = c_hiresDisplayWidth;
+		constexpr uint32_t c_height = c_hiresDisplayHeight;
+		constexpr uint32_t c_minCodeSize = 2;		// Four colours.
+		constexpr uint32_t c_clearCode = 1 << c_minCodeSize;
+		constexpr uint32_t c_maxCode = 4095;
+
+		// LZW for GIF image data, in data sub-blocks. With four symbols a code's children fit in a small array per code.
+		class lzw_writer
+		{
+		public:
+			explicit lzw_writer(std::vector<uint8_t>& out) : m_out(out), m_children(std::make_unique<uint16_t[][4]>(c_maxCode + 1)) {}
+
+			void encode(uint8_t const* pixels, size_t count)
+			{
+				m_out.push_back(c_minCodeSize);
+				reset();
+				write(c_clearCode);
+
+				int32_t current = -1;
+				for (size_t i = 0; i < count; ++i)
+				{
+					uint8_t const symbol = pixels[i];
+					if (current < 0)
+						current = symbol;
+					else if (m_children[current][symbol] != 0)
+						current = m_children[current][symbol];
+					else
+					{
+						write(static_cast<uint32_t>(current));
+						m_children[current][symbol] = static_cast<uint16_t>(++m_lastCode);
+						if (m_lastCode >= (1u << m_codeSize))
+							m_codeSize++;
+						if (m_lastCode == c_maxCode)
+						{
+							write(c_clearCode);
+							reset();
+						}
+						current = symbol;
+					}
+				}
+
+				// Decoders add an entry after reading the last code too, which can widen the end code.
+				write(static_cast<uint32_t>(current));
+				if (++m_lastCode >= (1u << m_codeSize) && m_codeSize < 12)
+					m_codeSize++;
+				write(c_clearCode + 1);
+				if (m_bitCount > 0)
+					put_byte(static_cast<uint8_t>(m_bits));
+				m_bits = m_bitCount = 0;
+				flush_block();
+				m_out.push_back(0);
+			}
+
+		private:
+			std::vector<uint8_t>&			m_out;
+			std::unique_ptr<uint16_t[][4]>	m_children;		// Code extended by a symbol, 0 for none yet.
+			uint32_t						m_lastCode = 0;
+			uint32_t						m_codeSize = 0;
+			uint32_t						m_bits = 0;
+			uint32_t						m_bitCount = 0;
+			uint8_t							m_block[255];
+			size_t							m_blockSize = 0;
+
+			void reset()
+			{
+				memset(m_children.get(), 0, sizeof(uint16_t[4]) * (c_maxCode + 1));
+				m_lastCode = c_clearCode + 1;
+				m_codeSize = c_minCodeSize + 1;
+			}
+
+			void write(uint32_t code)
+			{
+				m_bits |= code << m_bitCount;
+				m_bitCount += m_codeSize;
+				for (; m_bitCount >= 8; m_bitCount -= 8, m_bits >>= 8)
+					put_byte(static_cast<uint8_t>(m_bits));
+			}
+
+			void put_byte(uint8_t byte)
+			{
+				m_block[m_blockSize++] = byte;
+				if (m_blockSize == sizeof(m_block))
+					flush_block();
+			}
+
+			void flush_block()
+			{
+				if (m_blockSize == 0)
+					return;
+				m_out.push_back(static_cast<uint8_t>(m_blockSize));
+				m_out.insert(m_out.end(), m_block, m_block + m_blockSize);
+				m_blockSize = 0;
+			}
+		};
+
+		inline void put16(std::vector<uint8_t>& out, uint32_t value)
+		{
+			out.push_back(static_cast<uint8_t>(value));
+			out.push_back(static_cast<uint8_t>(value >> 8));
+		}
+	}
+
+	class gif_capture
+	{
+	public:
+		// Write to out (opened for binary writing, closed by the caller after the capture is destroyed) at scale times 128x64, with
+		// the palette's colours as 0xRRGGBB in their low bytes, and room for ring frames waiting to be encoded.
+		explicit gif_capture(FILE* out, uint32_t scale = 4, blit_palette const& palette = make_palette(0x000000, 0xffffff), size_t ring = 64)
+			: m_out(out)
+			, m_scale(std::max(1u, scale))
+			, m_ring(ring)
+			, m_thread([this, palette] { encode_loop(palette); })
+		{
+			assert(out != nullptr && ring > 0);
+		}
+
+		// Encodes whatever is still in the ring and ends the file, the last frame lasting until the last capture() call.
+		~gif_capture()
+		{
+			m_stop.store(true, std::memory_order_release);
+			m_wake.fetch_add(1, std::memory_order_release);
+			m_wake.notify_one();
+			m_thread.join();
+		}
+
+		gif_capture(gif_capture const&) = delete;
+		gif_capture& operator=(gif_capture const&) = delete;
+
+		// Call once per emulated frame, from one thread. False if the frame changed and the ring was full, so it was dropped.
+		bool capture(display const& source)
+		{
+			uint64_t const frame = m_frame++;
+			if (frame > 0 && source.m_version == m_lastVersion)
+				return true;
+
+			uint64_t const tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) == m_ring.size())
+			{
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+
+			slot& s = m_ring[tail % m_ring.size()];
+			memcpy(s.m_planes, source.m_planes, sizeof(s.m_planes));
+			s.m_hires = source.m_hires;
+			s.m_frame = frame;
+			m_lastVersion = source.m_version;
+
+			m_tail.store(tail + 1, std::memory_order_release);
+			m_wake.fetch_add(1, std::memory_order_release);
+			m_wake.notify_one();
+			return true;
+		}
+
+		// Frames captured so far, frames dropped on a full ring, GIF frames and bytes written (updated as the writer goes).
+		uint64_t frame_count() const { return m_frame; }
+		uint64_t dropped_count() const { return m_dropped.load(std::memory_order_relaxed); }
+		uint64_t written_frames() const { return m_written.load(std::memory_order_relaxed); }
+		uint64_t bytes_written() const { return m_bytes.load(std::memory_order_relaxed); }
+
+	private:
+		struct slot
+		{
+			uint64_t	m_planes[c_displayPlanes][c_hiresDisplayHeight][2];
+			uint64_t	m_frame;
+			bool		m_hires;
+		};
+
+		FILE*								m_out;
+		uint32_t							m_scale;
+		std::vector<slot>					m_ring;
+		uint64_t							m_frame = 0;		// Emulation thread only, until m_stop...
+		uint32_t							m_lastVersion = 0;	// ...as is this.
+		alignas(64) std::atomic<uint64_t>	m_head = 0;			// Next slot to encode.
+		alignas(64) std::atomic<uint64_t>	m_tail = 0;			// Next slot to capture into.
+		std::atomic<uint32_t>				m_wake = 0;			// Bumped by every capture and on destruction.
+		std::atomic<uint64_t>				m_dropped = 0;
+		std::atomic<uint64_t>				m_written = 0;
+		std::atomic<uint64_t>				m_bytes = 0;
+		std::atomic<bool>					m_stop = false;
+		std::thread							m_thread;			// Last, started once everything else is constructed.
+
+		// Encoder state, writer thread only.
+		struct pending
+		{
+			uint8_t		m_pixels[capture_detail::c_width * capture_detail::c_height];
+			uint64_t	m_frame = 0;
+			bool		m_valid = false;
+		};
+
+		void encode_loop(blit_palette const& palette)
+		{
+			std::vector<uint8_t> bytes;
+			write_header(bytes, palette);
+
+			// The frame shown so far, and the next one waiting for its delay to be known.
+			auto const shown = std::make_unique<uint8_t[]>(capture_detail::c_width * capture_detail::c_height);
+			auto const next = std::make_unique<pending>();
+			memset(shown.get(), 0, capture_detail::c_width * capture_detail::c_height);
+			std::vector<uint8_t> rect;
+			capture_detail::lzw_writer lzw(bytes);
+
+			for (;;)
+			{
+				uint32_t const wake = m_wake.load(std::memory_order_acquire);
+				bool const stop = m_stop.load(std::memory_order_acquire);
+				uint64_t const tail = m_tail.load(std::memory_order_acquire);
+				for (uint64_t head = m_head.load(std::memory_order_relaxed); head != tail; ++head)
+				{
+					slot const& s = m_ring[head % m_ring.size()];
+
+					// The waiting frame lasts until this one, unless that's too short and this one replaces it.
+					if (!next->m_valid)
+						next->m_frame = s.m_frame;
+					else if (centiseconds(s.m_frame) - centiseconds(next->m_frame) >= 2)
+					{
+						write_frame(bytes, lzw, rect, shown.get(), next->m_pixels, next->m_frame, s.m_frame);
+						next->m_frame = s.m_frame;
+					}
+
+					unpack(s, next->m_pixels);
+					next->m_valid = true;
+					m_head.store(head + 1, std::memory_order_release);
+				}
+
+				if (stop)
+					break;
+				m_wake.wait(wake, std::memory_order_acquire);
+			}
+
+			if (next->m_valid)
+				write_frame(bytes, lzw, rect, shown.get(), next->m_pixels, next->m_frame, std::max(m_frame, next->m_frame + 2));
+			bytes.push_back(0x3b);
+			flush(bytes);
+		}
+
+		static int64_t centiseconds(uint64_t frame) { return static_cast<int64_t>(frame * 100 / 60); }
+
+		static void unpack(slot const& s, uint8_t* pixels)
+		{
+			for (uint32_t y = 0; y < capture_detail::c_height; ++y)
+			{
+				for (uint32_t x = 0; x < capture_detail::c_width; ++x)
+				{
+					uint32_t const sx = s.m_hires ? x : x / 2, sy = s.m_hires ? y : y / 2;
+					uint32_t const shift = 63 - (sx & 63);
+					*pixels++ = static_cast<uint8_t>(((s.m_planes[0][sy][sx >> 6] >> shift) & 1) | (((s.m_planes[1][sy][sx >> 6] >> shift) & 1) << 1));
+				}
+			}
+		}
+
+		void write_header(std::vector<uint8_t>& bytes, blit_palette const& palette)
+		{
+			static constexpr uint8_t c_signature[] = { 'G', 'I', 'F', '8', '9', 'a' };
+			bytes.insert(bytes.end(), c_signature, c_signature + sizeof(c_signature));
+			capture_detail::put16(bytes, capture_detail::c_width * m_scale);
+			capture_detail::put16(bytes, capture_detail::c_height * m_scale);
+			bytes.insert(bytes.end(), { 0x91, 0, 0 });		// Global colour table of 4 entries, 2 bits of colour resolution.
+			for (uint32_t const color : palette.m_colors)
+				bytes.insert(bytes.end(), { static_cast<uint8_t>(color >> 16), static_cast<uint8_t>(color >> 8), static_cast<uint8_t>(color) });
+
+			// Loop forever.
+			static constexpr uint8_t c_loop[] = { 0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+			bytes.insert(bytes.end(), c_loop, c_loop + sizeof(c_loop));
+			flush(bytes);
+		}
+
+		// Write the part of pixels that differs from shown, shown from first_frame until last_frame, then make it shown. An unchanged
+		// frame becomes a single pixel, so its delay still counts.
+		void write_frame(std::vector<uint8_t>& bytes, capture_detail::lzw_writer& lzw, std::vector<uint8_t>& rect, uint8_t* shown,
+			uint8_t const* pixels, uint64_t first_frame, uint64_t last_frame)
+		{
+			using namespace capture_detail;
+			bool const first = m_written.load(std::memory_order_relaxed) == 0;
+			uint32_t left = c_width, top = c_height, right = 0, bottom = 0;
+			for (uint32_t y = 0; y < c_height; ++y)
+			{
+				for (uint32_t x = 0; x < c_width; ++x)
+				{
+					if (first || pixels[y * c_width + x] != shown[y * c_width + x])
+					{
+						left = std::min(left, x);
+						right = std::max(right, x + 1);
+						top = std::min(top, y);
+						bottom = std::max(bottom, y + 1);
+					}
+				}
+			}
+			if (left >= right)
+			{
+				left = top = 0;
+				right = bottom = 1;
+			}
+
+			uint32_t const delay = static_cast<uint32_t>(centiseconds(last_frame) - centiseconds(first_frame));
+			bytes.insert(bytes.end(), { 0x21, 0xf9, 0x04, 0x04 });		// Graphic control: leave the frame in place.
+			put16(bytes, delay);
+			bytes.insert(bytes.end(), { 0, 0 });
+
+			bytes.push_back(0x2c);
+			put16(bytes, left * m_scale);
+			put16(bytes, top * m_scale);
+			put16(bytes, (right - left) * m_scale);
+			put16(bytes, (bottom - top) * m_scale);
+			bytes.push_back(0);
+
+			rect.clear();
+			for (uint32_t y = top; y < bottom; ++y)
+			{
+				for (uint32_t line = 0; line < m_scale; ++line)
+				{
+					for (uint32_t x = left; x < right; ++x)
+						rect.insert(rect.end(), m_scale, pixels[y * c_width + x]);
+				}
+			}
+			lzw.encode(rect.data(), rect.size());
+
+			memcpy(shown, pixels, c_width * c_height);
+			m_written.fetch_add(1, std::memory_order_relaxed);
+			flush(bytes);
+		}
+
+		void flush(std::vector<uint8_t>& bytes)
+		{
+			if (fwrite(bytes.data(), 1, bytes.size(), m_out) == bytes.size())
+				m_bytes.fetch_add(bytes.size(), std::memory_order_relaxed);
+			bytes.clear();
+		}
+	};
+}
@@ -0,0 +1,283 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_savestate.h"
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+/*
+* Checkpoints of long runs written to disk in the background.
+*
+* submit() copies an interpreter's machine_state into a buffer taken from a fixed set and queues it, which is all the emulation
+* thread pays: no serializing, compressing or I/O, no lock and no allocation. A writer thread serializes the queued states with a
+* state_serializer (LZ4 by default) and appends them to a file, then puts the buffers back. When every buffer is queued, submit()
+* drops the checkpoint and returns false rather than wait for the disk.
+* Both queues are bounded lock-free rings, so any number of threads can submit at once.
+*
+* The file is a sequence of records: the id given to submit() (u64), the state size (u32) and a state as written by
+* state_serializer::save(), little endian. read_checkpoint() reads them back one at a time.
+*/
+namespace tiny8
+{
+	namespace checkpoint_detail
+	{
+		constexpr size_t c_recordHeaderSize = 8 + 4;
+
+		// Bounded multi-producer multi-consumer queue of indices, every cell tagged with the turn it's next written or read in.
+		class index_queue
+		{
+		public:
+			explicit index_queue(size_t capacity)
+				: m_cells(std::make_unique<cell[]>(std::bit_ceil(capacity)))
+				, m_mask(std::bit_ceil(capacity) - 1)
+			{
+				for (size_t i = 0; i <= m_mask; ++i)
+					m_cells[i].m_turn.store(i, std::memory_order_relaxed);
+			}
+
+			bool push(uint32_t value)
+			{
+				size_t position = m_tail.load(std::memory_order_relaxed);
+				for (;;)
+				{
+					cell& c = m_cells[position & m_mask];
+					intptr_t const lag = static_cast<intptr_t>(c.m_turn.load(std::memory_order_acquire) - position);
+					if (lag < 0)
+						return false;	// Full.
+					if (lag == 0 && m_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					{
+						c.m_value = value;
+						c.m_turn.store(position + 1, std::memory_order_release);
+						return true;
+					}
+					if (lag > 0)
+						position = m_tail.load(std::memory_order_relaxed);
+				}
+			}
+
+			bool pop(uint32_t& value)
+			{
+				size_t position = m_head.load(std::memory_order_relaxed);
+				for (;;)
+				{
+					cell& c = m_cells[position & m_mask];
+					intptr_t const lag = static_cast<intptr_t>(c.m_turn.load(std::memory_order_acquire) - (position + 1));
+					if (lag < 0)
+						return false;	// Empty.
+					if (lag == 0 && m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					{
+						value = c.m_value;
+						c.m_turn.store(position + m_mask + 1, std::memory_order_release);
+						return true;
+					}
+					if (lag > 0)
+						position = m_head.load(std::memory_order_relaxed);
+				}
+			}
+
+		private:
+			struct cell
+			{
+				std::atomic<size_t>	m_turn;
+				uint32_t			m_value;
+			};
+
+			std::unique_ptr<cell[]>				m_cells;
+			size_t								m_mask;
+			alignas(64) std::atomic<size_t>		m_head = 0;
+			alignas(64) std::atomic<size_t>		m_tail = 0;
+		};
+	}
+
+	template<size_t MemorySize>
+	class basic_checkpoint_writer
+	{
+	public:
+		using machine_state = basic_machine_state<MemorySize>;
+		using serializer = basic_state_serializer<MemorySize>;
+
+		// Append checkpoints to out (opened for binary writing, not closed) with up to buffers of them in flight.
+		explicit basic_checkpoint_writer(FILE* out, size_t buffers = 64, state_compression compression = state_compression::lz4)
+			: m_out(out)
+			, m_serializer(compression)
+			, m_slots(std::make_unique<slot[]>(buffers))
+			, m_free(buffers)
+			, m_queued(buffers)
+			, m_record(std::make_unique<uint8_t[]>(checkpoint_detail::c_recordHeaderSize + serializer::c_maxStateSize))
+		{
+			assert(out != nullptr && buffers > 0 && buffers <= 0xffffffff);
+			for (size_t i = 0; i < buffers; ++i)
+				m_free.push(static_cast<uint32_t>(i));
+
+			m_thread = std::thread([this] { write_loop(); });
+		}
+
+		// Writes whatever is still queued before returning.
+		~basic_checkpoint_writer()
+		{
+			m_stop.store(true, std::memory_order_relaxed);
+			m_submitted.fetch_add(1, std::memory_order_release);
+			m_submitted.notify_one();
+			m_thread.join();
+			fflush(m_out);
+		}
+
+		basic_checkpoint_writer(basic_checkpoint_writer const&) = delete;
+		basic_checkpoint_writer& operator=(basic_checkpoint_writer const&) = delete;
+
+		// Queue the interpreter's state as checkpoint id. False, with the checkpoint dropped, if every buffer is in flight.
+		template<class Interpreter>
+		bool submit(Interpreter const& interpreter, uint64_t id)
+		{
+			static_assert(Interpreter::c_memorySize == MemorySize, "the writer and the interpreter must have the same memory size");
+
+			uint32_t index;
+			if (!m_free.pop(index))
+			{
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+
+			slot& s = m_slots[index];
+			interpreter.save_state(s.m_state);
+			s.m_flags = interpreter.get_flags();
+			s.m_id = id;
+
+			m_queued.push(index);
+			m_submitted.fetch_add(1, std::memory_order_release);
+			m_submitted.notify_one();
+			return true;
+		}
+
+		// Wait until every checkpoint submitted so far is in the file.
+		void flush()
+		{
+			m_flushes.fetch_add(1, std::memory_order_release);
+			m_submitted.fetch_add(1, std::memory_order_release);
+			m_submitted.notify_one();
+			for (uint64_t flushed = m_flushed.load(std::memory_order_acquire); flushed < m_flushes.load(std::memory_order_relaxed);
+				flushed = m_flushed.load(std::memory_order_acquire))
+			{
+				m_flushed.wait(flushed, std::memory_order_acquire);
+			}
+		}
+
+		// Checkpoints written so far, dropped because every buffer was in flight, and bytes appended to the file.
+		uint64_t written_count() const { return m_written.load(std::memory_order_relaxed); }
+		uint64_t dropped_count() const { return m_dropped.load(std::memory_order_relaxed); }
+		uint64_t bytes_written() const { return m_bytes.load(std::memory_order_relaxed); }
+
+		// Read the next record of a checkpoint file into state (at least serializer::c_maxStateSize bytes). Returns the size of the
+		// state, 0 at the end of the file or if the record is truncated or too large. Load it with a state_serializer.
+		static size_t read_checkpoint(FILE* in, uint64_t& id, std::span<uint8_t> state)
+		{
+			uint8_t header[checkpoint_detail::c_recordHeaderSize];
+			if (fread(header, 1, sizeof(header), in) != sizeof(header))
+				return 0;
+
+			id = 0;
+			for (size_t i = 0; i < 8; ++i)
+				id |= uint64_t(header[i]) << (8 * i);
+			uint32_t const size = header[8] | header[9] << 8 | header[10] << 16 | uint32_t(header[11]) << 24;
+			if (size > state.size() || fread(state.data(), 1, size, in) != size)
+				return 0;
+			return size;
+		}
+
+	private:
+		struct slot
+		{
+			machine_state	m_state;
+			flags			m_flags;
+			uint64_t		m_id;
+		};
+
+		FILE*								m_out;
+		serializer							m_serializer;		// Only used by the writer thread.
+		std::unique_ptr<slot[]>				m_slots;
+		checkpoint_detail::index_queue		m_free;				// Slots ready to be submitted into...
+		checkpoint_detail::index_queue		m_queued;			// ...and waiting to be written.
+		std::unique_ptr<uint8_t[]>			m_record;			// Record being written.
+		std::thread							m_thread;
+		std::atomic<bool>					m_stop = false;
+		alignas(64) std::atomic<uint64_t>	m_submitted = 0;	// Bumped on every submit, flush and stop to wake the writer.
+		std::atomic<uint64_t>				m_flushes = 0;		// Flushes requested...
+		std::atomic<uint64_t>				m_flushed = 0;		// ...and done.
+		std::atomic<uint64_t>				m_dropped = 0;
+		alignas(64) std::atomic<uint64_t>	m_written = 0;
+		std::atomic<uint64_t>				m_bytes = 0;
+
+		void write_loop()
+		{
+			for (;;)
+			{
+				uint64_t const seen = m_submitted.load(std::memory_order_acquire);
+				uint64_t const flushes = m_flushes.load(std::memory_order_acquire);
+
+				// Everything submitted before the flushes seen above is written by the end of this.
+				uint32_t index;
+				while (m_queued.pop(index))
+				{
+					write_record(m_slots[index]);
+					m_free.push(index);
+				}
+
+				if (flushes != m_flushed.load(std::memory_order_relaxed))
+				{
+					fflush(m_out);
+					m_flushed.store(flushes, std::memory_order_release);
+					m_flushed.notify_all();
+				}
+
+				if (m_stop.load(std::memory_order_relaxed))
+					return;
+				m_submitted.wait(seen, std::memory_order_acquire);
+			}
+		}
+
+		void write_record(slot const& s)
+		{
+			uint8_t* const record = m_record.get();
+			size_t const size = m_serializer.save(s.m_state, s.m_flags,
+				std::span<uint8_t>(record + checkpoint_detail::c_recordHeaderSize, serializer::c_maxStateSize));
+			for (size_t i = 0; i < 8; ++i)
+				record[i] = static_cast<uint8_t>(s.m_id >> (8 * i));
+			for (size_t i = 0; i < 4; ++i)
+				record[8 + i] = static_cast<uint8_t>(size >> (8 * i));
+
+			size_t const bytes = checkpoint_detail::c_recordHeaderSize + size;
+			if (fwrite(record, 1, bytes, m_out) == bytes)
+			{
+				m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+				m_written.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	};
+
+	using checkpoint_writer = basic_checkpoint_writer<c_maxMemory>;
+	using extended_checkpoint_writer = basic_checkpoint_writer<c_extendedMemory>;
+}
@@ -0,0 +1,173 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <array>
+#include <initializer_list>
+
+/*
+* Compile-time execution of small rom fragments.
+*
+* basic_interpreter can't run in a constant expression: it owns its decode cache, reads the clock and copies memory around. The
+* semantics of its register arithmetic, loads and stores live in tiny8::semantics as constexpr functions its handlers call, and
+* constexpr_machine runs fragments through those same functions with a fetch loop of its own. static_asserts on the registers and
+* memory a fragment leaves (like the ones at the end of this file) then catch behaviour changes made while optimising, at compile
+* time and at no run time cost. Only instructions without side effects outside the registers and memory are covered: no screen,
+* input, timers, sound or random numbers.
+*/
+namespace tiny8
+{
+	template<flags F>
+	struct constexpr_machine
+	{
+		static_assert(F != runtime_flags, "constexpr_machine needs the behaviour flags at compile time");
+
+		registers							m_registers = {};
+		std::array<uint8_t, c_maxMemory>	m_memory = {};
+		std::array<uint16_t, c_maxStack>	m_stack = {};
+		uint64_t							m_cycles = 0;
+		uint16_t							m_stoppedAt = 0;	// Opcode run() stopped at, 0 for an empty word or when out of cycles.
+
+		// Copy a fragment to c_romStartAddress.
+		constexpr void load(std::initializer_list<uint8_t> program)
+		{
+			uint32_t address = c_romStartAddress;
+			for (uint8_t const byte : program)
+				m_memory[address++ & (c_maxMemory - 1)] = byte;
+		}
+
+		constexpr uint8_t& at(uint32_t address) { return m_memory[address & (c_maxMemory - 1)]; }
+
+		constexpr uint16_t read_word(uint32_t address) const
+		{
+			return static_cast<uint16_t>(m_memory[address & (c_maxMemory - 1)] << 8 | m_memory[(address + 1) & (c_maxMemory - 1)]);
+		}
+
+		// Run until an instruction this doesn't cover (the empty words after the fragment), the stack over or underflows, or
+		// max_cycles ran. The program counter is left on the instruction it stopped at. Returns the instructions run.
+		constexpr uint64_t run(uint32_t max_cycles = 10'000)
+		{
+			registers& r = m_registers;
+			auto const memory = [this](uint32_t address) -> uint8_t& { return at(address); };
+			uint64_t const start = m_cycles;
+			for (uint32_t i = 0; i < max_cycles; ++i, ++m_cycles)
+			{
+				uint16_t const opcode = read_word(r.m_pc);
+				uint32_t const x = (opcode >> 8) & 0xf, y = (opcode >> 4) & 0xf, nn = opcode & 0xff, nnn = opcode & 0xfff;
+				bool skip = false;
+				bool covered = true;
+				r.m_pc += 2;
+
+				switch (opcode >> 12)
+				{
+				case 0x0: covered = opcode == 0x00ee && r.m_sp > 0; if (covered) r.m_pc = m_stack[--r.m_sp]; break;
+				case 0x1: r.m_pc = static_cast<uint16_t>(nnn); break;
+				case 0x2: covered = r.m_sp < c_maxStack; if (covered) { m_stack[r.m_sp++] = r.m_pc; r.m_pc = static_cast<uint16_t>(nnn); } break;
+				case 0x3: skip = r.m_v[x] == nn; break;
+				case 0x4: skip = r.m_v[x] != nn; break;
+				case 0x5: covered = (opcode & 0xf) == 0; skip = r.m_v[x] == r.m_v[y]; break;
+				case 0x6: r.m_v[x] = static_cast<uint8_t>(nn); break;
+				case 0x7: r.m_v[x] += static_cast<uint8_t>(nn); break;
+				case 0x8:
+					switch (opcode & 0xf)
+					{
+					case 0x0: r.m_v[x] = r.m_v[y]; break;
+					case 0x1: semantics::logical_or<(F & logical_legacy) != 0>(r, x, y); break;
+					case 0x2: semantics::logical_and<(F & logical_legacy) != 0>(r, x, y); break;
+					case 0x3: semantics::logical_xor<(F & logical_legacy) != 0>(r, x, y); break;
+					case 0x4: semantics::add(r, x, y); break;
+					case 0x5: semantics::subtract(r, x, x, y); break;
+					case 0x6: semantics::shift_right<(F & shift_legacy) != 0>(r, x, y); break;
+					case 0x7: semantics::subtract(r, x, y, x); break;
+					case 0xe: semantics::shift_left<(F & shift_legacy) != 0>(r, x, y); break;
+					default: covered = false; break;
+					}
+					break;
+				case 0x9: covered = (opcode & 0xf) == 0; skip = r.m_v[x] != r.m_v[y]; break;
+				case 0xa: r.m_index = static_cast<uint16_t>(nnn); break;
+				case 0xb: r.m_pc = semantics::jump_offset<(F & jump_offset_legacy) != 0>(r, nnn, x); break;
+				case 0xf:
+					switch (nn)
+					{
+					case 0x1e: semantics::add_index(r, x); break;
+					case 0x29: semantics::font_glyph(r, x); break;
+					case 0x30: semantics::big_font_glyph(r, x); break;
+					case 0x33: semantics::store_bcd(r, x, memory); break;
+					case 0x55: semantics::store_registers<(F & store_load_legacy) != 0>(r, x, memory); break;
+					case 0x65: semantics::load_registers<(F & store_load_legacy) != 0>(r, x, memory); break;
+					default: covered = false; break;
+					}
+					break;
+				default: covered = false; break;
+				}
+
+				if (!covered)
+				{
+					r.m_pc -= 2;
+					m_stoppedAt = opcode;
+					break;
+				}
+
+				// Like the interpreter, skipping an F000 nnnn skips both of its words.
+				if (skip)
+					r.m_pc += read_word(r.m_pc) == 0xf000 ? 4 : 2;
+			}
+			return m_cycles - start;
+		}
+	};
+
+	// Load a fragment at c_romStartAddress and run it, see constexpr_machine::run().
+	template<flags F>
+	constexpr constexpr_machine<F> run_fragment(std::initializer_list<uint8_t> program, uint32_t max_cycles = 10'000)
+	{
+		constexpr_machine<F> machine;
+		machine.load(program);
+		machine.run(max_cycles);
+		return machine;
+	}
+
+	// Behaviour every build is checked against.
+	static_assert([] { auto const m = run_fragment<none>({ 0xa3, 0x00, 0x60, 0xfe, 0xf0, 0x33 }); return m.m_memory[0x300] == 2 && m.m_memory[0x301] == 5 && m.m_memory[0x302] == 4; }(),
+		"Fx33 stores the hundreds, tens and units of vx at I");
+	static_assert([] { auto const m = run_fragment<none>({ 0x60, 0x00, 0x61, 0x05, 0x80, 0x14, 0x71, 0xff, 0x31, 0x00, 0x12, 0x04 }); return m.m_registers.m_v[0] == 15 && m.m_registers.m_pc == 0x20c; }(),
+		"a 3xnn/1nnn loop adds 5 + 4 + 3 + 2 + 1");
+	static_assert([] { auto const m = run_fragment<none>({ 0x6f, 0xff, 0x61, 0x01, 0x8f, 0x14 }); return m.m_registers.m_v[15] == 1; }(),
+		"8xy4 with vF as the destination leaves the carry in vF");
+	static_assert(run_fragment<none>({ 0x60, 0x1a, 0xf0, 0x29 }).m_registers.m_index == c_fontStartAddress + 0xa * 5
+		&& run_fragment<none>({ 0x60, 0x07, 0xf0, 0x30 }).m_registers.m_index == c_bigFontStartAddress + 7 * 10,
+		"Fx29 and Fx30 point I at the glyph of vx's low nibble");
+	static_assert([] { auto const m = run_fragment<none>({ 0x60, 0x05, 0x61, 0x07, 0x80, 0x15 }); return m.m_registers.m_v[0] == 0xfe && m.m_registers.m_v[15] == 0; }(),
+		"8xy5 wraps and clears vF on a borrow");
+	static_assert([] { auto const m = run_fragment<none>({ 0x60, 0x03, 0x61, 0x05, 0x80, 0x16 }); return m.m_registers.m_v[0] == 1 && m.m_registers.m_v[15] == 1; }()
+		&& [] { auto const m = run_fragment<shift_legacy>({ 0x60, 0x03, 0x61, 0x05, 0x80, 0x16 }); return m.m_registers.m_v[0] == 2 && m.m_registers.m_v[15] == 1; }(),
+		"8xy6 shifts vx, or vy into vx with shift_legacy");
+	static_assert([] { auto const m = run_fragment<none>({ 0xa3, 0x00, 0x60, 0x01, 0x61, 0x02, 0xf1, 0x55 }); return m.m_registers.m_index == 0x300 && m.m_memory[0x301] == 2; }()
+		&& [] { auto const m = run_fragment<store_load_legacy>({ 0xa3, 0x00, 0x60, 0x01, 0x61, 0x02, 0xf1, 0x55 }); return m.m_registers.m_index == 0x301; }(),
+		"Fx55 leaves I alone, or moves it on with store_load_legacy");
+	static_assert([] { auto const m = run_fragment<none>({ 0x6f, 0x05, 0x60, 0x01, 0x80, 0x11 }); return m.m_registers.m_v[15] == 5; }()
+		&& [] { auto const m = run_fragment<logical_legacy>({ 0x6f, 0x05, 0x60, 0x01, 0x80, 0x11 }); return m.m_registers.m_v[15] == 0; }(),
+		"8xy1 leaves vF alone, or clears it with logical_legacy");
+	static_assert(run_fragment<none>({ 0x60, 0x04, 0xb3, 0x00 }).m_registers.m_pc == 0x300 && run_fragment<jump_offset_legacy>({ 0x60, 0x04, 0xb3, 0x00 }).m_registers.m_pc == 0x304,
+		"Bxnn adds vx, or v0 with jump_offset_legacy");
+}
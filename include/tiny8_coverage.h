@@ -0,0 +1,228 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <array>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+/*
+* Instruction coverage and quirk sensitivity of a rom, to pick the cheapest behaviour flags it runs the same with.
+*
+* A coverage_recorder attached to an interpreter records every opcode its decode cache decodes, the same way aot_translator
+* records blocks, so collecting costs nothing per instruction. Besides naming the instructions a rom uses, it tells which quirks
+* the rom reaches in a form the flag can change: 8xy6/8xyE with x != y, Fx55/Fx65, Bnnn with x != 0, 8xy1 to 8xy3, and Dxyn for
+* both drawing quirks.
+*
+* Reaching one doesn't mean the outcome depends on it. check_quirks() runs the rom once with the flags asked for and recording,
+* then once more per quirk reached with that flag flipped, comparing the machines after every frame. The flags no run found a
+* difference for are free: a rom pack stores them per rom (pack_builder::add()) and choose_flags() picks a specialised variant
+* that only differs from the preferred flags there. Free is as far as the run went, so scripted input that plays the rom through
+* gives a better answer than an attract mode.
+*/
+namespace tiny8
+{
+	// The quirks an opcode depends on, in whatever form the rom uses it.
+	constexpr flags opcode_quirks(uint16_t opcode)
+	{
+		uint32_t const x = (opcode >> 8) & 0xf;
+		uint32_t const y = (opcode >> 4) & 0xf;
+		uint32_t quirks = none;
+		switch (opcode & 0xf000)
+		{
+		case 0x8000:
+			if (((opcode & 0xf) == 0x6 || (opcode & 0xf) == 0xe) && x != y)
+				quirks = shift_legacy;
+			else if ((opcode & 0xf) >= 0x1 && (opcode & 0xf) <= 0x3)
+				quirks = logical_legacy;
+			break;
+		case 0xb000:
+			quirks = x != 0 ? jump_offset_legacy : none;
+			break;
+		case 0xd000:
+			quirks = draw_legacy | disp_sync_legacy;
+			break;
+		case 0xf000:
+			quirks = (opcode & 0xff) == 0x55 || (opcode & 0xff) == 0x65 ? store_load_legacy : none;
+			break;
+		}
+		return static_cast<flags>(quirks);
+	}
+
+	// An instruction a rom uses, with the number of distinct opcodes it came in.
+	struct coverage_entry
+	{
+		std::string_view	m_name;		// As listed in TINY8_HANDLERS.
+		uint32_t			m_opcodes;
+	};
+
+	class coverage_recorder
+	{
+	public:
+		// Record the opcodes an interpreter decodes from now on (this enables its decode cache and replaces its block compiler).
+		// The recorder must outlive the interpreter.
+		template<class Interpreter>
+		void attach(Interpreter& interpreter)
+		{
+			typename Interpreter::block_compiler compiler;
+			compiler.m_compile = &record<Interpreter>;
+			compiler.m_userData = this;
+			interpreter.set_block_compiler(compiler);
+		}
+
+		void clear()
+		{
+			m_seen.fill(0);
+			m_quirks = none;
+		}
+
+		bool has(uint16_t opcode) const { return (m_seen[opcode / 64] >> (opcode % 64)) & 1; }
+
+		// Quirks of the opcodes recorded so far, see opcode_quirks().
+		flags quirks() const { return m_quirks; }
+
+		size_t opcode_count() const
+		{
+			size_t count = 0;
+			for (uint64_t const word : m_seen)
+				count += std::popcount(word);
+			return count;
+		}
+
+		// The instructions recorded, named by an interpreter with the same flags, in TINY8_HANDLERS order.
+		template<class Interpreter>
+		std::vector<coverage_entry> instructions(Interpreter const& interpreter) const
+		{
+			std::vector<coverage_entry> entries;
+			for (uint32_t opcode = 0; opcode <= 0xffff; ++opcode)
+			{
+				if (!has(static_cast<uint16_t>(opcode)))
+					continue;
+
+				std::string_view const name = interpreter.instruction_name(static_cast<uint16_t>(opcode));
+				auto it = entries.begin();
+				while (it != entries.end() && it->m_name != name)
+					++it;
+				if (it == entries.end())
+					entries.push_back({ name, 1 });
+				else
+					it->m_opcodes++;
+			}
+
+			std::vector<coverage_entry> ordered;
+#define TINY8_COVERAGE_ORDER(name, handler_body) \
+			for (auto const& e : entries) { if (e.m_name == #name) ordered.push_back(e); }
+			TINY8_HANDLERS(TINY8_COVERAGE_ORDER)
+#undef TINY8_COVERAGE_ORDER
+			return ordered;
+		}
+
+	private:
+		std::array<uint64_t, 0x10000 / 64>	m_seen = {};
+		flags								m_quirks = none;
+
+		template<class Interpreter>
+		static typename Interpreter::native_block record(void* user_data, Interpreter&, typename Interpreter::decoded_instruction const* instructions, uint32_t address, uint32_t length)
+		{
+			coverage_recorder& self = *static_cast<coverage_recorder*>(user_data);
+			for (uint32_t i = 0; i < length; ++i)
+			{
+				uint16_t const opcode = instructions[address + 2 * i].m_state.m_opcode;
+				self.m_seen[opcode / 64] |= 1ull << (opcode % 64);
+				self.m_quirks = static_cast<flags>(self.m_quirks | opcode_quirks(opcode));
+			}
+			return nullptr;
+		}
+	};
+
+	struct quirk_report
+	{
+		flags	m_reached = none;		// Quirks the rom reached, see opcode_quirks().
+		flags	m_sensitive = none;		// Reached quirks whose flag changed the outcome.
+		flags	m_free = none;			// The legacy flags that didn't: the rom ran the same either way.
+		size_t	m_opcodes = 0;			// Distinct opcodes run.
+	};
+
+	// Called after loading the rom and before every frame of check_quirks(), to poke memory or queue input with queue_input().
+	using quirk_frame = void(*)(void* user_data, interpreter& interpreter, uint32_t frame);
+
+	// Run a rom for a number of emulated frames with the given flags, recording its coverage into recorder, then once per reached
+	// quirk with that flag flipped, and compare the machines (state_hash()) after every frame. Allocates two interpreters.
+	inline quirk_report check_quirks(std::span<uint8_t const> rom, flags behaviour_flags, uint32_t frames, coverage_recorder& recorder,
+		uint32_t cycles_per_frame = c_defaultCyclesPerFrame, quirk_frame on_frame = nullptr, void* user_data = nullptr)
+	{
+		auto const run = [&](flags run_flags, auto&& after_frame)
+		{
+			auto machine = std::make_unique<interpreter>(run_flags, dispatch_mode::table);
+			machine->set_timer_mode(timer_mode::emulated, cycles_per_frame);
+			machine->load_rom(rom);
+			if (run_flags == behaviour_flags)
+				recorder.attach(*machine);
+			else
+				machine->set_decode_cache(true);
+
+			for (uint32_t frame = 0; frame < frames; ++frame)
+			{
+				if (on_frame != nullptr)
+					on_frame(user_data, *machine, frame);
+				machine->run_frame();
+				if (!after_frame(*machine, frame))
+					return false;
+			}
+			return true;
+		};
+
+		recorder.clear();
+		std::vector<uint64_t> reference(frames);
+		run(behaviour_flags, [&](interpreter& machine, uint32_t frame) { reference[frame] = machine.state_hash(); return true; });
+
+		quirk_report report;
+		report.m_reached = static_cast<flags>(recorder.quirks() & all_legacy);
+		report.m_opcodes = recorder.opcode_count();
+		for (uint32_t bit = 1; bit <= all_legacy; bit <<= 1)
+		{
+			if ((report.m_reached & bit) == 0)
+				continue;
+
+			bool const same = run(static_cast<flags>(behaviour_flags ^ bit), [&](interpreter& machine, uint32_t frame) { return machine.state_hash() == reference[frame]; });
+			if (!same)
+				report.m_sensitive = static_cast<flags>(report.m_sensitive | bit);
+		}
+		report.m_free = static_cast<flags>(all_legacy & ~report.m_sensitive);
+		return report;
+	}
+
+	// The first of the variants that only differs from the preferred flags in free ones, or the preferred flags if none does.
+	constexpr flags choose_flags(flags preferred, flags free, std::span<flags const> variants)
+	{
+		for (flags const variant : variants)
+		{
+			if (((variant ^ preferred) & all_legacy & ~free) == 0)
+				return variant;
+		}
+		return preferred;
+	}
+}
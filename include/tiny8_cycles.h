@@ -0,0 +1,129 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+/*
+* Machine cycle timing: frames as a budget of the original hardware's time instead of a count of instructions.
+*
+* Counting instructions makes a draw cost as much as a register load, so games run at the wrong speed and hosts pick a rate high
+* enough for the slowest rom. A cycle_costs table gives every instruction its cost in machine cycles of the machine a mode stands
+* for, and run_machine_frame() runs instructions until a 60Hz frame worth of them is spent, carrying what the last instruction ran
+* over into the next frame so the long run rate is exact. A draw that waits for the vertical blank (disp_sync_legacy) or an Fx0A
+* the keys can't complete idles the rest of the frame, as the machine did.
+*
+* The COSMAC VIP table averages each instruction over its operands (Bnnn page crossings, skips taken or not, sprite alignment),
+* close enough to pace games by, not to reproduce the VIP's exact interleaving with the display interrupt. Instructions run one at
+* a time to be costed, so this is slower per instruction than run_frame()'s batches: use it where the pace matters.
+*/
+namespace tiny8
+{
+	struct cycle_costs
+	{
+		uint32_t	m_frame;			// Machine cycles per 60Hz frame.
+		uint16_t	m_family[16];		// By the opcode's first nibble; 0nnn and Fxnn use the fields below, Dxyn adds m_spriteRow.
+		uint16_t	m_clear;			// 00E0.
+		uint16_t	m_return;			// 00EE, and the other 0nnn.
+		uint16_t	m_spriteRow;		// Dxyn, per row drawn.
+		uint16_t	m_timer;			// Fx07, Fx0A, Fx15, Fx18, and Fxnn not listed here.
+		uint16_t	m_addIndex;			// Fx1E.
+		uint16_t	m_font;				// Fx29.
+		uint16_t	m_bcd;				// Fx33.
+		uint16_t	m_registers;		// Fx55 and Fx65, plus m_perRegister for each of v0 to vx.
+		uint16_t	m_perRegister;
+	};
+
+	// The original interpreter on a COSMAC VIP: 1.76MHz, 8 clocks per machine cycle, ~3668 machine cycles per frame.
+	inline constexpr cycle_costs c_cosmacVipCosts =
+	{
+		3668,
+		{ 0, 12, 26, 12, 12, 18, 6, 10, 44, 18, 12, 22, 36, 26, 18, 0 },
+		24, 10, 34, 10, 16, 16, 204, 14, 14
+	};
+
+	// The table of the machine a set of behaviour flags stands for, nullptr when there's none to time against (SUPER-CHIP ran at
+	// whatever speed the calculator did, XO-CHIP never had hardware): keep counting instructions for those.
+	constexpr cycle_costs const* cycle_costs_for(flags behaviour_flags)
+	{
+		return (behaviour_flags & all_legacy) == chip8_original ? &c_cosmacVipCosts : nullptr;
+	}
+
+	// Machine cycles of one instruction.
+	constexpr uint32_t instruction_cost(cycle_costs const& costs, uint16_t opcode)
+	{
+		uint32_t const family = opcode >> 12, x = (opcode >> 8) & 0xf;
+		switch (family)
+		{
+		case 0x0:
+			return opcode == 0x00e0 ? costs.m_clear : costs.m_return;
+		case 0xd:
+			return costs.m_family[0xd] + costs.m_spriteRow * (opcode & 0xf);
+		case 0xf:
+			switch (opcode & 0xff)
+			{
+			case 0x1e: return costs.m_addIndex;
+			case 0x29: return costs.m_font;
+			case 0x33: return costs.m_bcd;
+			case 0x55:
+			case 0x65: return costs.m_registers + costs.m_perRegister * (x + 1);
+			default: return costs.m_timer;
+			}
+		default:
+			return costs.m_family[family];
+		}
+	}
+
+	// Run one 60Hz frame of machine cycles, with the keys latched as run_frame() does, then tick the timers. carry holds the cycles
+	// the previous frame overran by (start it at 0) and gets this frame's. The interpreter must not use timer_mode::emulated, whose
+	// frames are instruction counts. Returns the number of instructions executed.
+	template<class Interpreter>
+	uint32_t run_machine_frame(Interpreter& interpreter, cycle_costs const& costs, uint8_t const key_buffer[c_maxKeys], uint32_t& carry)
+	{
+		assert(interpreter.get_timer_mode() != timer_mode::emulated);
+
+		interpreter.begin_frame(key_buffer);
+
+		uint8_t const* const memory = interpreter.get_memory()->m_data;
+		uint32_t const address_mask = sizeof(interpreter.get_memory()->m_data) - 1;
+		uint32_t spent = carry, instructions = 0;
+		carry = 0;
+		while (spent < costs.m_frame && !interpreter.has_fault())
+		{
+			if (interpreter.is_waiting_for_vblank() || interpreter.is_blocked_on_input(key_buffer))
+				break;
+
+			// An Fx0A still waiting is executed again, the program counter already past it.
+			uint32_t const pc = interpreter.get_registers()->m_pc;
+			uint16_t const opcode = static_cast<uint16_t>((memory[pc & address_mask] << 8) | memory[(pc + 1) & address_mask]);
+			spent += interpreter.is_waiting_for_input() ? costs.m_timer : instruction_cost(costs, opcode);
+			interpreter.run_cycles(1);
+			++instructions;
+
+			if (spent > costs.m_frame)
+				carry = spent - costs.m_frame;
+		}
+
+		interpreter.end_frame();
+		return instructions;
+	}
+}
@@ -0,0 +1,272 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <algorithm>
+#include <vector>
+
+/*
+* Debugger backend: breakpoints, conditional breakpoints, memory watchpoints, step, step over and run to.
+*
+* Breakpoints are patched into the interpreter's decode cache rather than checked before every instruction: every address with
+* a breakpoint starts a block (see set_block_break()), and the debugger runs the program a block at a time, looking at the
+* program counter between blocks only. With nothing set run() is a plain run_cycles(), so unset breakpoints cost nothing.
+*
+* Memory only changes through Fx33, Fx55 and 5xy2, which always end a block, so watchpoints are compared between blocks too and
+* stop right after the instruction that changed them. Conditions are evaluated when the program reaches their breakpoint.
+* Everything the run loops do on their own (timers, vblank waits, queued input, idle skipping) happens exactly as it would have
+* in a single run_cycles() of the same length.
+*/
+namespace tiny8
+{
+	// Why a debugger call returned.
+	enum class stop_reason : uint8_t
+	{
+		budget,			// Ran every cycle it was given.
+		breakpoint,		// The program counter reached a breakpoint whose condition holds.
+		watchpoint,		// The last instruction changed watched memory.
+		target			// Reached the address of a step_over() or run_to().
+	};
+
+	struct debug_stop
+	{
+		stop_reason		m_reason;
+		uint32_t		m_cycles;		// Instructions executed.
+		uint16_t		m_address;		// Of the watchpoint that changed, the program counter otherwise.
+	};
+
+	// A breakpoint condition on the registers, evaluated when the breakpoint is reached.
+	using break_condition = bool(*)(void* user_data, registers const& regs);
+
+	template<class Interpreter>
+	class basic_debugger
+	{
+	public:
+		// Enables the interpreter's decode cache, which has to stay on. The interpreter must outlive the debugger.
+		explicit basic_debugger(Interpreter& interpreter) : m_interpreter(interpreter) { m_interpreter.set_decode_cache(true); }
+
+		~basic_debugger() { clear_breakpoints(); }
+
+		basic_debugger(basic_debugger const&) = delete;
+		basic_debugger& operator=(basic_debugger const&) = delete;
+
+		// Stop before the instruction at an address, if condition (when set) returns true.
+		void set_breakpoint(uint16_t address, break_condition condition = nullptr, void* user_data = nullptr)
+		{
+			auto const it = find(address);
+			if (it != m_breakpoints.end())
+				*it = { address, condition, user_data };
+			else
+				m_breakpoints.push_back({ address, condition, user_data });
+			m_interpreter.set_block_break(address, true);
+		}
+
+		void clear_breakpoint(uint16_t address)
+		{
+			auto const it = find(address);
+			if (it == m_breakpoints.end())
+				return;
+
+			m_breakpoints.erase(it);
+			m_interpreter.set_block_break(address, false);
+		}
+
+		void clear_breakpoints()
+		{
+			for (breakpoint const& b : m_breakpoints)
+				m_interpreter.set_block_break(b.m_address, false);
+			m_breakpoints.clear();
+		}
+
+		// Stop after any instruction that changes a byte from address to address + size - 1.
+		void add_watchpoint(uint16_t address, uint16_t size = 1)
+		{
+			assert(size > 0 && address + size <= sizeof(m_interpreter.get_memory()->m_data));
+			uint8_t const* const data = m_interpreter.get_memory()->m_data + address;
+			m_watchpoints.push_back({ address, std::vector<uint8_t>(data, data + size) });
+		}
+
+		void remove_watchpoint(uint16_t address)
+		{
+			std::erase_if(m_watchpoints, [address](watchpoint const& w) { return w.m_address == address; });
+		}
+
+		void clear_watchpoints() { m_watchpoints.clear(); }
+
+		// Run up to cycles instructions (as run_cycles() does), stopping at breakpoints and watchpoints. Continuing from a breakpoint
+		// or run_to() target doesn't stop at it again right away.
+		debug_stop run(uint32_t cycles) { return run_until(cycles, c_noTarget, 0, !m_resuming); }
+
+		// Execute a single instruction.
+		debug_stop step() { return run_until(1, c_noTarget, 0, false); }
+
+		// Run the rest of the current frame like interpreter::run_frame(), stopping at breakpoints and watchpoints. After a stop,
+		// calling this again continues the same frame: the keys only latch when a new one starts.
+		debug_stop run_frame(uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			return frame(key_buffer, cycles_per_frame, ~0u);
+		}
+
+		// Execute a single instruction of the current frame, starting a new one if needed.
+		debug_stop step_frame(uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			return frame(key_buffer, cycles_per_frame, 1);
+		}
+
+		// Execute a single instruction, or the whole subroutine when it's a call (2nnn), up to cycles instructions. Stops at the
+		// breakpoints and watchpoints inside the subroutine.
+		debug_stop step_over(uint32_t cycles)
+		{
+			registers const& regs = *m_interpreter.get_registers();
+			uint8_t const* const data = m_interpreter.get_memory()->m_data;
+			if (m_interpreter.instruction_name(static_cast<uint16_t>((data[regs.m_pc] << 8) | data[regs.m_pc + 1])) != "2nnn")
+				return step();
+
+			// The return address, at the same stack depth so recursive calls back through it don't count.
+			return run_to(static_cast<uint16_t>(regs.m_pc + 2), regs.m_sp, cycles);
+		}
+
+		// Run until the program counter reaches an address, up to cycles instructions.
+		debug_stop run_to(uint16_t address, uint32_t cycles) { return run_to(address, c_anyStackPointer, cycles); }
+
+	private:
+		struct breakpoint
+		{
+			uint16_t		m_address;
+			break_condition	m_condition;
+			void*			m_userData;
+		};
+
+		struct watchpoint
+		{
+			uint16_t				m_address;
+			std::vector<uint8_t>	m_value;		// Last seen bytes.
+		};
+
+		static constexpr uint32_t c_noTarget = ~0u;
+		static constexpr uint32_t c_anyStackPointer = ~0u;
+
+		Interpreter&				m_interpreter;
+		std::vector<breakpoint>		m_breakpoints;
+		std::vector<watchpoint>		m_watchpoints;
+		uint32_t					m_frameLeft = 0;		// Instructions left in the frame run_frame() is running.
+		bool						m_resuming = false;		// Stopped at a breakpoint or target that hasn't executed yet.
+
+		typename std::vector<breakpoint>::iterator find(uint16_t address)
+		{
+			return std::find_if(m_breakpoints.begin(), m_breakpoints.end(), [address](breakpoint const& b) { return b.m_address == address; });
+		}
+
+		debug_stop run_to(uint16_t address, uint32_t sp, uint32_t cycles)
+		{
+			// A temporary breakpoint, unless the address already has one.
+			bool const temporary = find(address) == m_breakpoints.end();
+			if (temporary)
+				m_interpreter.set_block_break(address, true);
+
+			debug_stop const stop = run_until(cycles, address, sp, !m_resuming);
+
+			if (temporary)
+				m_interpreter.set_block_break(address, false);
+			return stop;
+		}
+
+		debug_stop frame(uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame, uint32_t limit)
+		{
+			if (m_frameLeft == 0)
+				m_frameLeft = m_interpreter.begin_frame(key_buffer, cycles_per_frame);
+
+			debug_stop const stop = run_until(std::min(m_frameLeft, limit), c_noTarget, 0, !m_resuming && limit > 1);
+			m_frameLeft -= stop.m_cycles;
+			if (m_frameLeft == 0)
+				m_interpreter.end_frame();
+			return stop;
+		}
+
+		debug_stop run_until(uint32_t cycles, uint32_t target, uint32_t target_sp, bool check_first)
+		{
+			registers const& regs = *m_interpreter.get_registers();
+			if (m_breakpoints.empty() && m_watchpoints.empty() && target == c_noTarget)
+			{
+				m_interpreter.run_cycles(cycles);
+				m_resuming = false;
+				return { stop_reason::budget, cycles, regs.m_pc };
+			}
+
+			uint32_t executed = 0;
+			while (executed < cycles)
+			{
+				if (executed > 0 || check_first)
+				{
+					bool const at_target = regs.m_pc == target && (target_sp == c_anyStackPointer || regs.m_sp == target_sp);
+					if (at_target || breakpoint_hit(regs))
+					{
+						m_resuming = true;
+						return { at_target ? stop_reason::target : stop_reason::breakpoint, executed, regs.m_pc };
+					}
+				}
+				m_resuming = false;
+
+				// Blocks start at every breakpoint, so this never runs past one.
+				uint32_t const length = std::min(m_interpreter.block_length_at_pc(), cycles - executed);
+				m_interpreter.run_cycles(length);
+				executed += length;
+
+				if (uint16_t address; watchpoint_hit(address))
+					return { stop_reason::watchpoint, executed, address };
+			}
+			return { stop_reason::budget, executed, regs.m_pc };
+		}
+
+		bool breakpoint_hit(registers const& regs)
+		{
+			for (breakpoint const& b : m_breakpoints)
+			{
+				if (b.m_address == regs.m_pc)
+					return b.m_condition == nullptr || b.m_condition(b.m_userData, regs);
+			}
+			return false;
+		}
+
+		// Updates the last seen values of every watchpoint that changed.
+		bool watchpoint_hit(uint16_t& address)
+		{
+			uint8_t const* const data = m_interpreter.get_memory()->m_data;
+			bool hit = false;
+			for (watchpoint& w : m_watchpoints)
+			{
+				if (memcmp(w.m_value.data(), data + w.m_address, w.m_value.size()) == 0)
+					continue;
+
+				if (!hit)
+					address = w.m_address;
+				memcpy(w.m_value.data(), data + w.m_address, w.m_value.size());
+				hit = true;
+			}
+			return hit;
+		}
+	};
+
+	using debugger = basic_debugger<interpreter>;
+}
@@ -0,0 +1,229 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <cstdio>
+
+/*
+* Differential execution: run a reference interpreter and a candidate engine (another dispatch mode, the threaded loop, the
+* decode cache, the jit) side by side on the same keys and stop at the first instruction where they no longer agree.
+*
+* After every block of instructions both machines are compared on their registers, timers, cycle counts, pending Fx0A and
+* hashes of memory (with the stack) and display. With blocks longer than one instruction, a mismatch is narrowed down by
+* restoring both machines to the start of the block and stepping them one instruction at a time, so the report names the
+* exact instruction either way. Restoring drops the candidate's decode cache; when that makes the difference go away the
+* report is left at the end of the block, with m_narrowed false. A difference that heals before the end of a block (a register
+* written over again) goes unseen, so use single instructions when chasing one that does.
+*/
+namespace tiny8
+{
+	// Parts of the machine compared after every block.
+	enum diff_parts : uint8_t
+	{
+		diff_registers	= 1 << 0,
+		diff_timers		= 1 << 1,
+		diff_memory		= 1 << 2,	// Including the stack.
+		diff_display	= 1 << 3,
+		diff_cycles		= 1 << 4,
+		diff_waiting	= 1 << 5	// Only one of them is waiting on Fx0A or the vertical blank.
+	};
+
+	struct divergence
+	{
+		uint64_t		m_cycle = 0;				// Instructions both had executed in agreement.
+		uint8_t			m_parts = 0;				// diff_parts that differ after the next one.
+		bool			m_narrowed = false;			// False if only known to be somewhere in the block starting there.
+
+		// The diverging instruction on each machine (the first of the block when not narrowed) and the registers left after it.
+		uint16_t		m_referencePc = 0;
+		uint16_t		m_candidatePc = 0;
+		decode_state	m_reference = {};
+		decode_state	m_candidate = {};
+		registers		m_referenceRegisters = {};
+		registers		m_candidateRegisters = {};
+
+		void print(FILE* out) const
+		{
+			fprintf(out, "diverged after %llu instructions%s:", (unsigned long long)m_cycle, m_narrowed ? "" : " (somewhere in the block)");
+			constexpr char const* c_names[] = { "registers", "timers", "memory", "display", "cycles", "waiting" };
+			for (size_t i = 0; i < std::size(c_names); ++i)
+			{
+				if (m_parts & (1 << i))
+					fprintf(out, " %s", c_names[i]);
+			}
+			fprintf(out, "\n  reference %03x: %04x", m_referencePc, m_reference.m_opcode);
+			print_registers(out, m_referenceRegisters);
+			fprintf(out, "\n  candidate %03x: %04x", m_candidatePc, m_candidate.m_opcode);
+			print_registers(out, m_candidateRegisters);
+			fprintf(out, "\n");
+		}
+
+	private:
+		static void print_registers(FILE* out, registers const& regs)
+		{
+			fprintf(out, "  pc=%03x i=%03x sp=%02x v=", regs.m_pc, regs.m_index, regs.m_sp);
+			for (uint8_t const v : regs.m_v)
+				fprintf(out, "%02x", v);
+		}
+	};
+
+	// Both interpreters should start from the same state, with the same rom, seed and timer mode; they're compared as they are.
+	template<class Reference, class Candidate>
+	class differential
+	{
+	public:
+		differential(Reference& reference, Candidate& candidate, uint32_t block_size = 1)
+			: m_reference(reference), m_candidate(candidate), m_blockSize(block_size)
+		{
+			assert(block_size > 0);
+		}
+
+		// Run both machines for a number of instructions on the same keys. Returns false at the first divergence, see get_divergence().
+		bool run(uint64_t cycles, uint8_t const key_buffer[c_maxKeys])
+		{
+			while (cycles > 0)
+			{
+				uint32_t const block = static_cast<uint32_t>(std::min<uint64_t>(cycles, m_blockSize));
+				bool const single = block == 1;
+				if (!single)
+				{
+					m_reference.save_state(m_referenceStart);
+					m_candidate.save_state(m_candidateStart);
+				}
+
+				uint64_t const start = m_reference.get_cycles();
+				uint16_t const reference_pc = m_reference.get_registers()->m_pc;
+				uint16_t const candidate_pc = m_candidate.get_registers()->m_pc;
+				m_reference.run_cycles(block, key_buffer);
+				m_candidate.run_cycles(block, key_buffer);
+
+				uint8_t const parts = compare();
+				if (parts != 0)
+				{
+					if (single)
+						report(start, parts, reference_pc, candidate_pc, true);
+					else
+						narrow(start, block, parts, reference_pc, candidate_pc, key_buffer);
+					return false;
+				}
+
+				m_compared += block;
+				cycles -= block;
+			}
+			return true;
+		}
+
+		divergence const& get_divergence() const { return m_divergence; }
+
+		// Instructions run in agreement so far.
+		uint64_t compared() const { return m_compared; }
+
+	private:
+		Reference&		m_reference;
+		Candidate&		m_candidate;
+		uint32_t		m_blockSize;
+		uint64_t		m_compared = 0;
+		divergence		m_divergence;
+
+		typename Reference::machine_state	m_referenceStart;
+		typename Candidate::machine_state	m_candidateStart;
+
+		template<class Interpreter>
+		static uint64_t memory_hash(Interpreter& interpreter)
+		{
+			auto const* const memory = interpreter.get_memory();
+			return xxhash64(memory->m_stack, sizeof(memory->m_stack), xxhash64(memory->m_data, sizeof(memory->m_data)));
+		}
+
+		template<class Interpreter>
+		static uint16_t opcode_at(Interpreter& interpreter, uint16_t pc)
+		{
+			auto const* const memory = interpreter.get_memory();
+			constexpr size_t c_mask = sizeof(memory->m_data) - 1;
+			return static_cast<uint16_t>((memory->m_data[pc & c_mask] << 8) | memory->m_data[(pc + 1) & c_mask]);
+		}
+
+		uint8_t compare()
+		{
+			registers const& a = *m_reference.get_registers();
+			registers const& b = *m_candidate.get_registers();
+			timers const& ta = *m_reference.get_timers();
+			timers const& tb = *m_candidate.get_timers();
+
+			uint8_t parts = 0;
+			if (a.m_pc != b.m_pc || a.m_index != b.m_index || a.m_sp != b.m_sp || memcmp(a.m_v, b.m_v, sizeof(a.m_v)) != 0)
+				parts |= diff_registers;
+			if (ta.m_delay != tb.m_delay || ta.m_sound != tb.m_sound)
+				parts |= diff_timers;
+			if (memory_hash(m_reference) != memory_hash(m_candidate))
+				parts |= diff_memory;
+			if (m_reference.display_hash() != m_candidate.display_hash())
+				parts |= diff_display;
+			if (m_reference.get_cycles() != m_candidate.get_cycles())
+				parts |= diff_cycles;
+			if (m_reference.is_waiting_for_input() != m_candidate.is_waiting_for_input() || m_reference.is_waiting_for_vblank() != m_candidate.is_waiting_for_vblank())
+				parts |= diff_waiting;
+			return parts;
+		}
+
+		// Replay the block one instruction at a time from its start to find the one that diverged.
+		void narrow(uint64_t start, uint32_t block, uint8_t parts, uint16_t reference_pc, uint16_t candidate_pc, uint8_t const key_buffer[c_maxKeys])
+		{
+			m_reference.load_state(m_referenceStart);
+			m_candidate.load_state(m_candidateStart);
+
+			for (uint32_t i = 0; i < block; ++i)
+			{
+				uint16_t const pc_a = m_reference.get_registers()->m_pc;
+				uint16_t const pc_b = m_candidate.get_registers()->m_pc;
+				m_reference.run_cycles(1, key_buffer);
+				m_candidate.run_cycles(1, key_buffer);
+
+				uint8_t const step_parts = compare();
+				if (step_parts != 0)
+				{
+					m_compared += i;
+					report(start + i, step_parts, pc_a, pc_b, true);
+					return;
+				}
+			}
+
+			// Not reproduced one step at a time: only the block is known, and the machines are left at its end.
+			report(start, parts, reference_pc, candidate_pc, false);
+		}
+
+		void report(uint64_t cycle, uint8_t parts, uint16_t reference_pc, uint16_t candidate_pc, bool narrowed)
+		{
+			m_divergence.m_cycle = cycle;
+			m_divergence.m_parts = parts;
+			m_divergence.m_narrowed = narrowed;
+			m_divergence.m_referencePc = reference_pc;
+			m_divergence.m_candidatePc = candidate_pc;
+			m_divergence.m_reference = Reference::decode_opcode(opcode_at(m_reference, reference_pc));
+			m_divergence.m_candidate = Candidate::decode_opcode(opcode_at(m_candidate, candidate_pc));
+			m_divergence.m_referenceRegisters = *m_reference.get_registers();
+			m_divergence.m_candidateRegisters = *m_candidate.get_registers();
+		}
+	};
+}
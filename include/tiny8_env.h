@@ -0,0 +1,206 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_batch.h"
+
+#include <span>
+#include <vector>
+
+/*
+* A vectorised environment for reinforcement learning: many instances of one rom stepped together.
+*
+* step() takes one action per instance (the mask of keys held, bit k for key k), runs every instance for a number of frames on a
+* basic_batch and writes each instance's observation straight from its display into a caller-provided contiguous buffer, along
+* with its reward and whether its episode ended. Rewards and termination come from hooks reading the machine (a score in memory,
+* a lives counter), checked after every frame; a faulted instance, or one reaching the episode frame limit, ends its episode too.
+*
+* Ended episodes reset automatically at the end of the step: the instance goes back to the state saved right after loading the
+* rom with a new random seed, and the observation written is the first one of its next episode (the gym vector env convention).
+* An instance that ended mid-step sits out the rest of it.
+*/
+namespace tiny8
+{
+	// How observations are laid out, see basic_vec_env::observation_size().
+	enum class observation_format : uint8_t
+	{
+		packed,		// The display's bit planes as stored: c_displayPlanes x c_hiresDisplayHeight rows of two 64-bit words.
+		bytes,		// One byte per pixel (plane bits, 0 to 3), 128x64 row-major; low resolution pixels are doubled.
+	};
+
+	template<class Interpreter>
+	class basic_vec_env
+	{
+	public:
+		using batch_type = basic_batch<Interpreter>;
+		using reward_hook = float(*)(void* user_data, Interpreter& interpreter);
+		using terminated_hook = bool(*)(void* user_data, Interpreter& interpreter);
+
+		// Create count instances, each constructed with args and loaded with rom (which is copied), on a batch with threads
+		// workers (0 for one per hardware thread). seed gives every instance and episode its own Cxnn random sequence.
+		template<class... Args>
+		basic_vec_env(size_t count, std::span<uint8_t const> rom, observation_format format, uint64_t seed, size_t threads, Args const&... args)
+			: m_batch(count, threads, args...), m_rom(rom.begin(), rom.end()), m_format(format), m_seed(seed)
+			, m_episodeFrames(count, 0), m_episodes(count, 0), m_done(count, 0), m_rewards(count, 0.0f)
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				m_batch[i].load_rom(m_rom);
+				if (i == 0)
+					m_batch[0].save_state(m_initial);
+			}
+			m_batch.set_frame_callback(&basic_vec_env::after_frame, this);
+		}
+
+		size_t size() const { return m_batch.size(); }
+		Interpreter& operator[](size_t index) { return m_batch[index]; }
+		batch_type& batch() { return m_batch; }
+
+		// Bytes of one instance's observation.
+		size_t observation_size() const
+		{
+			return m_format == observation_format::packed ? sizeof(display::m_planes) : c_hiresDisplayWidth * c_hiresDisplayHeight;
+		}
+
+		void set_cycles_per_frame(uint32_t cycles_per_frame) { m_batch.set_cycles_per_frame(cycles_per_frame); }
+
+		// Frames after which an episode ends (truncated), 0 for no limit.
+		void set_episode_limit(uint32_t frames) { m_episodeLimit = frames; }
+
+		// Rewards summed over the frames of a step, 0 without a hook. Termination is checked after every frame.
+		void set_hooks(reward_hook reward, terminated_hook terminated, void* user_data = nullptr)
+		{
+			m_reward = reward;
+			m_terminated = terminated;
+			m_hookUserData = user_data;
+		}
+
+		// Start a new episode on every instance and write their observations, size() * observation_size() bytes.
+		void reset(uint8_t* observations)
+		{
+			for (size_t i = 0; i < size(); ++i)
+			{
+				restart(i);
+				observe(i, observations + i * observation_size());
+			}
+		}
+
+		// Hold actions[i] on instance i for frames frames. Writes size() observations, rewards and done flags (1 if the episode
+		// ended during this step, after which the observation is the first of the next one).
+		void step(std::span<uint16_t const> actions, uint32_t frames, uint8_t* observations, float* rewards, uint8_t* done)
+		{
+			assert(actions.size() >= size() && frames > 0);
+
+			for (size_t i = 0; i < size(); ++i)
+			{
+				for (size_t key = 0; key < c_maxKeys; ++key)
+					m_batch.keys(i)[key] = (actions[i] >> key) & 1;
+			}
+			std::fill(m_done.begin(), m_done.end(), uint8_t(0));
+			std::fill(m_rewards.begin(), m_rewards.end(), 0.0f);
+
+			m_batch.run_frames(frames);
+
+			for (size_t i = 0; i < size(); ++i)
+			{
+				rewards[i] = m_rewards[i];
+				done[i] = m_done[i];
+				if (m_done[i])
+				{
+					m_batch.set_instance_runner(i, nullptr);
+					restart(i);
+				}
+				observe(i, observations + i * observation_size());
+			}
+		}
+
+	private:
+		batch_type						m_batch;
+		std::vector<uint8_t>			m_rom;
+		typename Interpreter::machine_state	m_initial;		// Right after loading the rom, restored at every episode start.
+		observation_format				m_format;
+		uint64_t						m_seed;
+		uint32_t						m_episodeLimit = 0;
+		reward_hook						m_reward = nullptr;
+		terminated_hook					m_terminated = nullptr;
+		void*							m_hookUserData = nullptr;
+
+		std::vector<uint32_t>			m_episodeFrames;	// Frames into the current episode, per instance.
+		std::vector<uint64_t>			m_episodes;			// Episodes started, per instance.
+		std::vector<uint8_t>			m_done;				// Ended during the step in progress.
+		std::vector<float>				m_rewards;			// Summed over the step in progress.
+
+		void restart(size_t index)
+		{
+			Interpreter& instance = m_batch[index];
+			instance.load_state(m_initial);
+			instance.clear_fault();
+			instance.set_seed(m_seed ^ (static_cast<uint64_t>(index) << 32) ^ m_episodes[index]++);
+			m_episodeFrames[index] = 0;
+		}
+
+		// Runs on the calling thread between frames: score the frame and take instances whose episode ended out of the step.
+		static void after_frame(void* user_data, batch_type& batch, uint64_t)
+		{
+			basic_vec_env& self = *static_cast<basic_vec_env*>(user_data);
+			for (size_t i = 0; i < batch.size(); ++i)
+			{
+				if (self.m_done[i])
+					continue;
+
+				Interpreter& instance = batch[i];
+				if (self.m_reward != nullptr)
+					self.m_rewards[i] += self.m_reward(self.m_hookUserData, instance);
+
+				bool const ended = instance.has_fault() || ++self.m_episodeFrames[i] == self.m_episodeLimit
+					|| (self.m_terminated != nullptr && self.m_terminated(self.m_hookUserData, instance));
+				if (ended)
+				{
+					self.m_done[i] = 1;
+					batch.set_instance_runner(i, &sit_out);
+				}
+			}
+		}
+
+		static void sit_out(void*, Interpreter&, uint8_t const*, uint32_t) {}
+
+		void observe(size_t index, uint8_t* out)
+		{
+			display const& source = *m_batch[index].get_display();
+			if (m_format == observation_format::packed)
+			{
+				memcpy(out, source.m_planes, sizeof(source.m_planes));
+				return;
+			}
+
+			uint32_t const shift = source.m_hires ? 0 : 1;
+			for (size_t y = 0; y < c_hiresDisplayHeight; ++y)
+			{
+				for (size_t x = 0; x < c_hiresDisplayWidth; ++x)
+					*out++ = source.pixel(x >> shift, y >> shift);
+			}
+		}
+	};
+
+	using vec_env = basic_vec_env<interpreter>;
+}
@@ -0,0 +1,405 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_batch.h"
+
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+/*
+* State-space exploration of small games: every reachable machine state, each stored once.
+*
+* An explorer starts from a root state and expands states in turn, running every action (a key mask, held for a few frames)
+* from each on the instances of a batch, one (state, action) pair per instance, restored, run and captured on its worker thread.
+* States come out of the frontier breadth-first, or best-first with a score function. A state is the hot cache line of the
+* machine_state, with the cycle count cleared, plus pointers to the pages of the rest: memory, stack, display and audio cut into
+* pages interned in a page_store, so a page exists once however many states hold its contents and equal states hold equal
+* pointers. Reaching a state already seen is detected in a transposition table keyed by the hash of those pointers, and the
+* duplicate dropped; thousands of states a few frames apart then cost little more than the pages they actually changed.
+*
+* Runs use timer_mode::emulated, so a state and the keys held from it always lead to the same state.
+*/
+namespace tiny8
+{
+	// Immutable pages of PageSize bytes, one per distinct contents, kept until the store goes away. Thread safe.
+	template<size_t PageSize>
+	class page_store
+	{
+	public:
+		static constexpr size_t c_pageSize = PageSize;
+
+		struct page
+		{
+			uint8_t m_data[PageSize];
+		};
+
+		page_store() = default;
+		page_store(page_store const&) = delete;
+		page_store& operator=(page_store const&) = delete;
+
+		// The page holding these PageSize bytes, created the first time they're seen.
+		page const* intern(uint8_t const* bytes)
+		{
+			uint64_t const hash = xxhash64(bytes, PageSize);
+			shard& s = m_shards[hash >> 60];
+			std::lock_guard<std::mutex> lock(s.m_mutex);
+
+			auto [first, last] = s.m_index.equal_range(hash);
+			for (; first != last; ++first)
+			{
+				if (memcmp(first->second->m_data, bytes, PageSize) == 0)
+					return first->second;
+			}
+
+			page& fresh = s.m_pages.emplace_back();
+			memcpy(fresh.m_data, bytes, PageSize);
+			s.m_index.emplace(hash, &fresh);
+			return &fresh;
+		}
+
+		size_t page_count() const
+		{
+			size_t count = 0;
+			for (shard const& s : m_shards)
+			{
+				std::lock_guard<std::mutex> lock(s.m_mutex);
+				count += s.m_pages.size();
+			}
+			return count;
+		}
+
+		void clear()
+		{
+			for (shard& s : m_shards)
+			{
+				std::lock_guard<std::mutex> lock(s.m_mutex);
+				s.m_index.clear();
+				s.m_pages.clear();
+			}
+		}
+
+	private:
+		// Split by the top bits of the hash, so threads interning different pages rarely wait on each other.
+		struct alignas(c_cacheLineSize) shard
+		{
+			mutable std::mutex								m_mutex;
+			std::deque<page>								m_pages;	// Never moved once created.
+			std::unordered_multimap<uint64_t, page const*>	m_index;
+		};
+
+		std::array<shard, 16>	m_shards;
+	};
+
+	template<class Interpreter>
+	class basic_explorer
+	{
+	public:
+		using state_type = typename Interpreter::machine_state;
+
+		static constexpr size_t c_hotSize = offsetof(state_type, m_memory);
+		static constexpr size_t c_pageSize = 256;
+		static constexpr size_t c_pageCount = (sizeof(state_type) - c_hotSize + c_pageSize - 1) / c_pageSize;
+		static constexpr uint32_t c_noState = UINT32_MAX;
+
+		using store_type = page_store<c_pageSize>;
+		using page = typename store_type::page;
+
+		// Scores a state just reached, on the worker that ran it; higher scores are expanded first.
+		using score_function = int64_t(*)(void* user_data, Interpreter& interpreter);
+
+		struct explored_state
+		{
+			uint8_t							m_hot[c_hotSize];	// The fields before memory, cycle count cleared.
+			std::array<page const*, c_pageCount> m_pages;
+			uint64_t						m_hash;
+			int64_t							m_score;
+			uint32_t						m_parent;			// c_noState for the root.
+			uint32_t						m_depth;			// Steps from the root.
+			uint16_t						m_keys;				// Held for the step from the parent.
+		};
+
+		// width instances expand states at once, on threads workers (0 for one per hardware thread); each constructed with args.
+		template<class... Args>
+		explicit basic_explorer(size_t width, size_t threads = 0, Args const&... args)
+			: m_batch(width, threads, args...)
+			, m_jobs(width)
+		{
+			for (size_t i = 0; i < width; ++i)
+			{
+				m_jobs[i].m_explorer = this;
+				m_jobs[i].m_scratch = std::make_unique<state_type>();
+				m_batch.set_instance_runner(i, &run_job, &m_jobs[i]);
+			}
+
+			// Nothing held, then each key on its own.
+			m_actions.push_back(0);
+			for (uint32_t key = 0; key < c_maxKeys; ++key)
+				m_actions.push_back(static_cast<uint16_t>(1u << key));
+		}
+
+		basic_explorer(basic_explorer const&) = delete;
+		basic_explorer& operator=(basic_explorer const&) = delete;
+
+		// Key masks tried from every state.
+		void set_actions(std::span<uint16_t const> actions) { m_actions.assign(actions.begin(), actions.end()); }
+
+		// Frames an action is held for, and the instructions per frame they run.
+		void set_frames_per_step(uint32_t frames) { m_framesPerStep = std::max(1u, frames); }
+		void set_cycles_per_frame(uint32_t cycles_per_frame) { m_cyclesPerFrame = cycles_per_frame; }
+
+		// States this many steps from the root are kept but not expanded.
+		void set_max_depth(uint32_t depth) { m_maxDepth = depth; }
+
+		// Expand the best scored states first instead of breadth-first; nullptr to go back.
+		void set_score_function(score_function score, void* user_data = nullptr)
+		{
+			m_score = score;
+			m_scoreUserData = user_data;
+		}
+
+		// Drop everything explored and start again from the interpreter's state. Call after the settings above.
+		void start(Interpreter const& root)
+		{
+			m_states.clear();
+			m_visited.clear();
+			m_frontier = {};
+			m_store.clear();
+			m_duplicates = 0;
+			m_faults = 0;
+			m_nextAction = m_actions.size();
+
+			for (size_t i = 0; i < m_batch.size(); ++i)
+				m_batch[i].set_timer_mode(timer_mode::emulated, m_cyclesPerFrame);
+			m_batch.set_cycles_per_frame(m_cyclesPerFrame);
+
+			explored_state state;
+			capture(root, *m_jobs[0].m_scratch, state);
+			state.m_score = 0;
+			add(state, c_noState, 0);
+		}
+
+		// Expand a batch worth of (state, action) pairs. Returns false once the frontier is exhausted.
+		bool step()
+		{
+			size_t count = 0;
+			while (count < m_jobs.size())
+			{
+				if (m_nextAction == m_actions.size())
+				{
+					if (m_frontier.empty())
+						break;
+					m_expanding = static_cast<uint32_t>(-m_frontier.top().second);
+					m_frontier.pop();
+					m_nextAction = 0;
+				}
+
+				job& j = m_jobs[count];
+				j.m_source = m_expanding;
+				j.m_keys = m_actions[m_nextAction++];
+				j.m_frame = 0;
+				j.m_captured = false;
+				m_batch[count++].clear_fault();
+			}
+
+			if (count == 0)
+				return false;
+			for (size_t i = count; i < m_jobs.size(); ++i)
+				m_jobs[i].m_source = c_noState;
+
+			m_batch.run_frames(m_framesPerStep);
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				job const& j = m_jobs[i];
+				if (j.m_captured)
+					add(j.m_result, j.m_source, j.m_keys);
+				else
+					m_faults++;
+			}
+			return true;
+		}
+
+		// Step until at least max_states states are known or nothing is left to expand. Returns the state count.
+		size_t explore(size_t max_states)
+		{
+			while (m_states.size() < max_states && step())
+				;
+			return m_states.size();
+		}
+
+		size_t state_count() const { return m_states.size(); }
+		size_t frontier_size() const { return m_frontier.size() + (m_nextAction < m_actions.size()); }
+		uint64_t duplicate_count() const { return m_duplicates; }	// Steps that reached a state already known.
+		uint64_t fault_count() const { return m_faults; }			// Steps that faulted, dropped.
+		size_t page_count() const { return m_store.page_count(); }
+		explored_state const& get_state(size_t index) const { return m_states[index]; }
+
+		// Memory held: the states plus every distinct page.
+		size_t bytes() const { return m_states.size() * sizeof(explored_state) + page_count() * sizeof(page); }
+
+		// Load a state into an interpreter, which then runs like the instance that reached it (with its cycle count at zero).
+		void restore(size_t index, Interpreter& interpreter) const
+		{
+			auto const state = std::make_unique<state_type>();
+			restore(static_cast<uint32_t>(index), interpreter, *state);
+		}
+
+		// The keys held for each step from the root to a state, each for set_frames_per_step() frames.
+		std::vector<uint16_t> path(size_t index) const
+		{
+			std::vector<uint16_t> keys;
+			for (uint32_t i = static_cast<uint32_t>(index); m_states[i].m_parent != c_noState; i = m_states[i].m_parent)
+				keys.push_back(m_states[i].m_keys);
+			return { keys.rbegin(), keys.rend() };
+		}
+
+	private:
+		// A (state, action) pair expanded on one batch instance.
+		struct job
+		{
+			basic_explorer*				m_explorer = nullptr;
+			std::unique_ptr<state_type>	m_scratch;
+			uint32_t					m_source = c_noState;
+			uint16_t					m_keys = 0;
+			uint32_t					m_frame = 0;
+			bool						m_captured = false;
+			explored_state				m_result;
+		};
+
+		basic_batch<Interpreter>					m_batch;
+		std::vector<job>							m_jobs;
+		std::vector<uint16_t>						m_actions;
+		uint32_t									m_framesPerStep = 4;
+		uint32_t									m_cyclesPerFrame = c_defaultCyclesPerFrame;
+		uint32_t									m_maxDepth = UINT32_MAX;
+		score_function								m_score = nullptr;
+		void*										m_scoreUserData = nullptr;
+
+		store_type									m_store;
+		std::vector<explored_state>					m_states;
+		std::unordered_multimap<uint64_t, uint32_t>	m_visited;		// Transposition table, state hash to index.
+		std::priority_queue<std::pair<int64_t, int64_t>> m_frontier;	// Score and negated index, so ties go in order.
+		uint32_t									m_expanding = c_noState;
+		size_t										m_nextAction = 0;
+		uint64_t									m_duplicates = 0;
+		uint64_t									m_faults = 0;
+
+		static constexpr size_t page_bytes(size_t index)
+		{
+			return index + 1 < c_pageCount ? c_pageSize : sizeof(state_type) - c_hotSize - index * c_pageSize;
+		}
+
+		void capture(Interpreter const& interpreter, state_type& state, explored_state& out)
+		{
+			// Cleared first so padding bytes are always zero and never make pages look different.
+			memset(static_cast<void*>(&state), 0, sizeof(state));
+			interpreter.save_state(state);
+			state.m_cycles = 0;
+
+			uint8_t const* const bytes = reinterpret_cast<uint8_t const*>(&state);
+			memcpy(out.m_hot, bytes, c_hotSize);
+			for (size_t i = 0; i < c_pageCount; ++i)
+			{
+				uint8_t const* const src = bytes + c_hotSize + i * c_pageSize;
+				if (page_bytes(i) == c_pageSize)
+				{
+					out.m_pages[i] = m_store.intern(src);
+					continue;
+				}
+
+				page last = {};
+				memcpy(last.m_data, src, page_bytes(i));
+				out.m_pages[i] = m_store.intern(last.m_data);
+			}
+			out.m_hash = xxhash64(out.m_hot, c_hotSize, xxhash64(out.m_pages.data(), sizeof(out.m_pages)));
+		}
+
+		void restore(uint32_t index, Interpreter& interpreter, state_type& state) const
+		{
+			explored_state const& s = m_states[index];
+			uint8_t* const bytes = reinterpret_cast<uint8_t*>(&state);
+			memcpy(bytes, s.m_hot, c_hotSize);
+			for (size_t i = 0; i < c_pageCount; ++i)
+				memcpy(bytes + c_hotSize + i * c_pageSize, s.m_pages[i]->m_data, page_bytes(i));
+			interpreter.load_state(state);
+		}
+
+		// Keep a state reached from parent, unless it's already known.
+		void add(explored_state const& state, uint32_t parent, uint16_t keys)
+		{
+			auto [first, last] = m_visited.equal_range(state.m_hash);
+			for (; first != last; ++first)
+			{
+				explored_state const& known = m_states[first->second];
+				if (known.m_pages == state.m_pages && memcmp(known.m_hot, state.m_hot, c_hotSize) == 0)
+				{
+					m_duplicates++;
+					return;
+				}
+			}
+
+			uint32_t const index = static_cast<uint32_t>(m_states.size());
+			explored_state& added = m_states.emplace_back(state);
+			added.m_parent = parent;
+			added.m_keys = keys;
+			added.m_depth = parent == c_noState ? 0 : m_states[parent].m_depth + 1;
+			m_visited.emplace(state.m_hash, index);
+
+			if (added.m_depth < m_maxDepth)
+				m_frontier.emplace(m_score != nullptr ? added.m_score : -static_cast<int64_t>(added.m_depth), -static_cast<int64_t>(index));
+		}
+
+		static void run_job(void* user_data, Interpreter& interpreter, uint8_t const*, uint32_t cycles_per_frame)
+		{
+			job& j = *static_cast<job*>(user_data);
+			if (j.m_source == c_noState)
+				return;
+
+			basic_explorer& self = *j.m_explorer;
+			if (j.m_frame == 0)
+				self.restore(j.m_source, interpreter, *j.m_scratch);
+
+			uint8_t keys[c_maxKeys];
+			for (uint32_t key = 0; key < c_maxKeys; ++key)
+				keys[key] = (j.m_keys >> key) & 1;
+			interpreter.run_frame(keys, cycles_per_frame);
+
+			// A fault stops the batch from running the instance, so a faulted step is never captured.
+			if (++j.m_frame == self.m_framesPerStep && !interpreter.has_fault())
+			{
+				self.capture(interpreter, *j.m_scratch, j.m_result);
+				j.m_result.m_score = self.m_score != nullptr ? self.m_score(self.m_scoreUserData, interpreter) : 0;
+				j.m_captured = true;
+			}
+		}
+	};
+
+	// An explorer of interpreters with behaviour flags chosen at run time.
+	using explorer = basic_explorer<interpreter>;
+}
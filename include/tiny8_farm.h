@@ -0,0 +1,263 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_batch.h"
+#include "tiny8_movie.h"
+#include "tiny8_pack.h"
+
+#include <algorithm>
+#include <span>
+#include <vector>
+
+/*
+* Regression farm building blocks: the work units of a pass, running a shard of them and aggregating the results, see
+* farm/tiny8_farm.cpp for the driver sharding them over processes and machines.
+*
+* A pass covers every rom of a pack run for a number of frames without input, then every movie of a replay set against the pack's
+* rom with its hash. Units are numbered in that order and shard i of n takes units i, i + n, i + 2n... so every process works out
+* its share from the pack and the movies alone. A shard runs its units as the instances of a batch, each through an instance
+* runner feeding it its movie's keys (or none) until its frames are done, checking the movie's framebuffer hashes on the way.
+*
+* Results are fixed size little endian records that travel as they are. The digest of a pass hashes them in unit order, minus the
+* profiling counters (only there with TINY8_PROFILE), so two passes agree exactly when every unit ended on the same screen and
+* machine state after the same number of instructions.
+*/
+namespace tiny8
+{
+	static_assert(std::endian::native == std::endian::little, "farm results are sent little endian");
+
+	constexpr uint32_t c_noMovie = ~0u;
+	constexpr size_t c_farmBatchSize = 256;		// Units run at once by a shard, bounding its memory.
+
+	struct farm_unit
+	{
+		uint32_t	m_rom;			// Index in the pack.
+		uint32_t	m_movie;		// Index in the replay set, c_noMovie to run without input.
+	};
+
+	struct farm_result
+	{
+		uint32_t	m_unit;
+		uint32_t	m_movie;
+		uint64_t	m_romHash;
+		uint64_t	m_displayHash;
+		uint64_t	m_stateHash;
+		uint64_t	m_cycles;
+		uint32_t	m_frames;
+		uint32_t	m_divergedFrame;	// First checkpoint frame that didn't match, with replay_status::diverged.
+		uint8_t		m_status;			// replay_status.
+		uint8_t		m_faulted;			// The unit stopped on a fault (see has_fault()).
+		uint8_t		m_reserved[6];
+
+		// Profiling totals, 0 without TINY8_PROFILE. Not part of the digest.
+		uint64_t	m_draws;
+		uint64_t	m_clears;
+		uint64_t	m_waits;
+		uint64_t	m_idle;
+	};
+	static_assert(sizeof(farm_result) == 88, "farm results must not depend on the compiler");
+
+	struct farm_summary
+	{
+		uint64_t	m_units = 0;
+		uint64_t	m_failed = 0;		// Diverged, faulted or without their rom.
+		uint64_t	m_digest = 0;
+		uint64_t	m_cycles = 0;
+		uint64_t	m_draws = 0;
+		uint64_t	m_clears = 0;
+		uint64_t	m_waits = 0;
+		uint64_t	m_idle = 0;
+	};
+
+	// Every unit of a pass, in unit order. Movie units whose rom isn't in the pack are kept, they fail with rom_mismatch.
+	inline std::vector<farm_unit> farm_units(rom_pack const& pack, std::span<movie const> movies)
+	{
+		std::vector<farm_unit> units;
+		for (uint32_t rom = 0; rom < pack.size(); ++rom)
+			units.push_back({ rom, c_noMovie });
+
+		for (uint32_t m = 0; m < movies.size(); ++m)
+		{
+			uint32_t rom = static_cast<uint32_t>(pack.size());
+			for (uint32_t i = 0; i < pack.size(); ++i)
+			{
+				if (pack.at(i).m_hash == movies[m].m_header.m_romHash)
+				{
+					rom = i;
+					break;
+				}
+			}
+			units.push_back({ rom, m });
+		}
+		return units;
+	}
+
+	inline bool farm_failed(farm_result const& r) { return r.m_status != static_cast<uint8_t>(replay_status::ok) || r.m_faulted != 0; }
+
+	// Aggregate the results of a whole pass, in unit order.
+	inline farm_summary summarize(std::span<farm_result const> results)
+	{
+		farm_summary summary;
+		for (farm_result const& r : results)
+		{
+			summary.m_units++;
+			summary.m_failed += farm_failed(r);
+			summary.m_digest = xxhash64(&r, offsetof(farm_result, m_draws), summary.m_digest);
+			summary.m_cycles += r.m_cycles;
+			summary.m_draws += r.m_draws;
+			summary.m_clears += r.m_clears;
+			summary.m_waits += r.m_waits;
+			summary.m_idle += r.m_idle;
+		}
+		return summary;
+	}
+
+	namespace farm_detail
+	{
+		struct job
+		{
+			movie const*	m_movie;
+			size_t			m_run;			// Current run of the movie.
+			uint32_t		m_runFrames;	// Frames of it already played.
+			uint32_t		m_frames;		// Frames to run in all.
+			farm_result		m_result;
+		};
+
+		inline void run_frame(void* user_data, interpreter& interp, uint8_t const*, uint32_t)
+		{
+			job& j = *static_cast<job*>(user_data);
+			farm_result& result = j.m_result;
+			if (result.m_frames == j.m_frames || result.m_status != static_cast<uint8_t>(replay_status::ok))
+				return;
+
+			uint8_t key_buffer[c_maxKeys] = {};
+			if (j.m_movie != nullptr)
+			{
+				uint16_t const keys = j.m_movie->m_runs[j.m_run].m_keys;
+				for (size_t i = 0; i < c_maxKeys; ++i)
+					key_buffer[i] = (keys >> i) & 1;
+				if (++j.m_runFrames == j.m_movie->m_runs[j.m_run].m_frames)
+				{
+					j.m_run++;
+					j.m_runFrames = 0;
+				}
+			}
+
+			interp.run_frame(key_buffer);
+			result.m_frames++;
+
+			if (j.m_movie != nullptr && result.m_frames % j.m_movie->m_header.m_checkpointInterval == 0
+				&& interp.display_hash() != j.m_movie->m_checkpoints[result.m_frames / j.m_movie->m_header.m_checkpointInterval - 1])
+			{
+				result.m_status = static_cast<uint8_t>(replay_status::diverged);
+				result.m_divergedFrame = result.m_frames;
+			}
+		}
+	}
+
+	// Run the units of a shard, c_farmBatchSize at a time on a batch of threads workers (0 for one per hardware thread), plain
+	// units for frames frames and movie units for their whole length. Results come back in unit order.
+	inline std::vector<farm_result> run_farm_shard(rom_pack const& pack, std::span<movie const> movies, uint32_t frames, uint32_t shard,
+		uint32_t shard_count, size_t threads = 0)
+	{
+		assert(shard < shard_count);
+
+		std::vector<farm_unit> const units = farm_units(pack, movies);
+		std::vector<uint32_t> mine;
+		for (uint32_t unit = shard; unit < units.size(); unit += shard_count)
+			mine.push_back(unit);
+
+		std::vector<farm_result> results;
+		for (size_t first = 0; first < mine.size(); first += c_farmBatchSize)
+		{
+			size_t const count = std::min(c_farmBatchSize, mine.size() - first);
+			basic_batch<interpreter> batch(count, threads);
+			batch.set_balancing(true);		// Units finish at different frames, the ones done cost next to nothing.
+			std::vector<farm_detail::job> jobs(count);
+
+			uint32_t longest = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				farm_unit const& unit = units[mine[first + i]];
+				farm_detail::job& j = jobs[i];
+				j = {};
+				j.m_movie = unit.m_movie != c_noMovie ? &movies[unit.m_movie] : nullptr;
+				j.m_frames = j.m_movie != nullptr ? j.m_movie->m_header.m_frameCount : frames;
+				j.m_result.m_unit = mine[first + i];
+				j.m_result.m_movie = unit.m_movie;
+				batch.set_instance_runner(i, &farm_detail::run_frame, &j);
+
+				interpreter& interp = batch[i];
+				if (unit.m_rom >= pack.size())
+				{
+					j.m_result.m_romHash = j.m_movie->m_header.m_romHash;
+					j.m_result.m_status = static_cast<uint8_t>(replay_status::rom_mismatch);
+					continue;
+				}
+
+				pack_rom const rom = pack.at(unit.m_rom);
+				flags const behaviour_flags = j.m_movie != nullptr ? static_cast<flags>(j.m_movie->m_header.m_flags) : rom.m_flags;
+				uint32_t const cycles_per_frame = j.m_movie != nullptr ? j.m_movie->m_header.m_cyclesPerFrame
+					: rom.m_cyclesPerFrame != 0 ? rom.m_cyclesPerFrame : c_defaultCyclesPerFrame;
+				j.m_result.m_romHash = rom.m_hash;
+				if (!interp.reset(rom.m_data, behaviour_flags))
+				{
+					j.m_result.m_status = static_cast<uint8_t>(replay_status::rom_mismatch);
+					continue;
+				}
+
+				interp.set_seed(j.m_movie != nullptr ? j.m_movie->m_header.m_seed : 0);
+				interp.set_timer_mode(timer_mode::emulated, cycles_per_frame);
+#if defined(TINY8_PROFILE)
+				interp.set_profiling(true);
+#endif
+				longest = std::max(longest, j.m_frames);
+			}
+
+			batch.run_frames(longest);
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				interpreter& interp = batch[i];
+				farm_result& result = jobs[i].m_result;
+				result.m_displayHash = interp.display_hash();
+				result.m_stateHash = interp.state_hash();
+				result.m_cycles = interp.get_cycles();
+				result.m_faulted = interp.has_fault();
+#if defined(TINY8_PROFILE)
+				if (auto const* profile = interp.get_profile())
+				{
+					frame_counts const& total = profile->m_total;
+					result.m_draws = total.m_draws + profile->m_frame.m_draws;
+					result.m_clears = total.m_clears + profile->m_frame.m_clears;
+					result.m_waits = total.m_waits + profile->m_frame.m_waits;
+					result.m_idle = total.m_idle + profile->m_frame.m_idle;
+				}
+#endif
+				results.push_back(result);
+			}
+		}
+		return results;
+	}
+}
@@ -0,0 +1,134 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <array>
+#include <memory>
+
+/*
+* Copy-on-write machine states for tree search.
+*
+* A cow_state holds a machine_state cut into fixed size pages, each shared between every state it hasn't changed in.
+* fork() copies the page pointers only, a few hundred bytes. capture() stores an interpreter's state again, keeping
+* the pages equal to the ones already held and allocating only those that changed, so branches exploring from the
+* same state share their memory, stack and display until they actually write to them. Pages are immutable once created,
+* so states can be captured and restored from any number of threads.
+*
+* Interpreters are not forked themselves: keep one per worker and restore() states into it. They already share their
+* dispatch table, and restoring drops their decode cache like any other load_state().
+*/
+namespace tiny8
+{
+	// State is the machine state type of the interpreters captured: machine_state, or extended_machine_state for 64KB ones.
+	template<class State>
+	class basic_cow_state
+	{
+	public:
+		static constexpr size_t c_pageSize = 256;
+		static constexpr size_t c_pageCount = (sizeof(State) + c_pageSize - 1) / c_pageSize;
+
+		basic_cow_state() = default;
+
+		// Share every page with this state; the copy only diverges as it is captured again.
+		basic_cow_state fork() const { return *this; }
+
+		// Store the interpreter state, keeping any held page whose contents didn't change.
+		template<class Interpreter>
+		void capture(Interpreter const& interpreter)
+		{
+			// Cleared first so padding bytes are always zero and never make pages look different.
+			State state;
+			memset(static_cast<void*>(&state), 0, sizeof(state));
+			interpreter.save_state(state);
+
+			uint8_t const* const bytes = reinterpret_cast<uint8_t const*>(&state);
+			for (size_t i = 0; i < c_pageCount; ++i)
+			{
+				uint8_t const* const src = bytes + i * c_pageSize;
+				size_t const size = page_bytes(i);
+				if (m_pages[i] != nullptr && memcmp(m_pages[i]->m_data, src, size) == 0)
+					continue;
+
+				auto fresh = std::make_shared<page>();
+				memcpy(fresh->m_data, src, size);
+				m_pages[i] = std::move(fresh);
+			}
+		}
+
+		// Load the state into an interpreter. Returns false if nothing was captured yet.
+		template<class Interpreter>
+		bool restore(Interpreter& interpreter) const
+		{
+			if (empty())
+				return false;
+
+			State state;
+			uint8_t* const bytes = reinterpret_cast<uint8_t*>(&state);
+			for (size_t i = 0; i < c_pageCount; ++i)
+				memcpy(bytes + i * c_pageSize, m_pages[i]->m_data, page_bytes(i));
+
+			interpreter.load_state(state);
+			return true;
+		}
+
+		bool empty() const { return m_pages[0] == nullptr; }
+
+		// Pages held by this state that no other state shares, i.e. what it costs on top of its ancestors.
+		size_t owned_bytes() const
+		{
+			size_t bytes = 0;
+			for (auto const& p : m_pages)
+			{
+				if (p != nullptr && p.use_count() == 1)
+					bytes += sizeof(page);
+			}
+			return bytes;
+		}
+
+		// Number of pages shared with another state.
+		size_t shared_pages(basic_cow_state const& other) const
+		{
+			size_t count = 0;
+			for (size_t i = 0; i < c_pageCount; ++i)
+				count += m_pages[i] != nullptr && m_pages[i] == other.m_pages[i];
+			return count;
+		}
+
+	private:
+		struct page
+		{
+			uint8_t m_data[c_pageSize];
+		};
+
+		std::array<std::shared_ptr<page const>, c_pageCount> m_pages;
+
+		static constexpr size_t page_bytes(size_t index)
+		{
+			return index + 1 < c_pageCount ? c_pageSize : sizeof(State) - index * c_pageSize;
+		}
+	};
+
+	using cow_state = basic_cow_state<machine_state>;
+	using extended_cow_state = basic_cow_state<extended_machine_state>;
+}
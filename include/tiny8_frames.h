@@ -0,0 +1,301 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <span>
+#include <thread>
+
+/*
+* Hand frames from an emulation thread to a presentation thread.
+*
+* A triple buffer keeps three copies of the display: the emulation thread fills one, the presentation thread draws another, and
+* the third holds the latest published frame until it is picked up. Publishing and picking up are a single atomic exchange each,
+* so neither thread ever waits for the other: a slow present skips frames instead of throttling the emulation.
+*
+* A turbo fast-forwards on top of that: it runs several emulated frames per presented one, timers ticking once per emulated frame,
+* and publishes only the last one's display, whose dirty rows cover every frame run since the previous publish.
+*
+* Monitoring tools read the registers, timers and display of a running interpreter from a state_monitor the emulation thread
+* publishes to at frame boundaries: a double-buffered seqlock, so readers on any number of threads get consistent snapshots,
+* retrying in the rare case publishes overlapped their copy, and the emulation thread never waits for them.
+*/
+namespace tiny8
+{
+	template<class T>
+	class triple_buffer
+	{
+	public:
+		// Producer: the slot to fill before publish().
+		T& back() { return m_slots[m_back]; }
+
+		// Producer: make the back slot the latest frame and take over another one. Returns false if the frame it replaced was never
+		// picked up, in which case back() is that frame.
+		bool publish()
+		{
+			uint8_t const previous = m_latest.exchange(m_back | c_fresh, std::memory_order_acq_rel);
+			m_back = previous & c_indexMask;
+			return (previous & c_fresh) == 0;
+		}
+
+		// Consumer: switch front() to the latest published frame. Returns false if nothing was published since the last call.
+		bool acquire()
+		{
+			// Only the producer sets the fresh bit, so it can't be cleared between the check and the exchange.
+			if ((m_latest.load(std::memory_order_relaxed) & c_fresh) == 0)
+				return false;
+
+			m_front = m_latest.exchange(m_front, std::memory_order_acq_rel) & c_indexMask;
+			return true;
+		}
+
+		// Consumer: the frame being presented, stable until the next acquire().
+		T const& front() const { return m_slots[m_front]; }
+
+	private:
+		static constexpr uint8_t c_indexMask = 3;
+		static constexpr uint8_t c_fresh = 4;
+
+		T		m_slots[3] = {};
+		uint8_t	m_back = 0;							// Owned by the producer.
+		alignas(64) std::atomic<uint8_t>	m_latest = 1;	// Slot index of the latest frame, with c_fresh until it's picked up.
+		alignas(64) uint8_t					m_front = 2;	// Owned by the consumer.
+	};
+
+	// Publishes the display of an interpreter once per frame. The dirty rows of frames that were skipped are carried over, so the
+	// presented frame's m_dirtyRows always covers every row that changed since the previous present.
+	class frame_mailbox
+	{
+	public:
+		// Emulation thread: publish the display if it changed since the last publish. Takes the display's dirty rows.
+		template<class Interpreter>
+		bool publish(Interpreter& interpreter)
+		{
+			display& source = *interpreter.get_display();
+			if (source.m_version == m_publishedVersion)
+				return false;
+
+			uint64_t const changed = source.take_dirty_rows();
+			uint64_t const rows = changed | m_carriedRows;
+			display& frame = m_frames.back();
+			frame = source;
+			frame.m_dirtyRows = rows;
+			m_publishedVersion = source.m_version;
+
+			// Whether this frame gets presented is only known on the next publish, so the next one repeats its rows. If the previous
+			// frame was skipped, this one already repeated its rows too and all of them carry over.
+			bool const previous_presented = m_frames.publish();
+			m_carriedRows = previous_presented ? changed : rows;
+			return true;
+		}
+
+		// Presentation thread: pick up the latest frame, returns false if there is no new one.
+		bool acquire() { return m_frames.acquire(); }
+		display const& front() const { return m_frames.front(); }
+
+	private:
+		triple_buffer<display>	m_frames;
+		uint64_t				m_carriedRows = 0;
+		uint32_t				m_publishedVersion = ~0u;
+	};
+
+	// A value one thread publishes and any number of others read without locks. The writer never waits: it fills the one of two
+	// slots readers aren't pointed at, so a reader only retries when two publishes overlapped its copy. Values are copied a word at
+	// a time through relaxed atomics, so T must be trivially copyable.
+	template<class T>
+	class seqlock
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+
+	public:
+		// Writer, one thread at a time.
+		void publish(T const& value)
+		{
+			uint64_t words[c_words] = {};
+			memcpy(words, &value, sizeof(T));
+
+			uint64_t const version = m_latest.load(std::memory_order_relaxed) + 1;
+			slot& target = m_slots[version & 1];
+			target.m_version.store(0, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			for (size_t i = 0; i < c_words; ++i)
+				target.m_words[i].store(words[i], std::memory_order_relaxed);
+			target.m_version.store(version, std::memory_order_release);
+			m_latest.store(version, std::memory_order_release);
+		}
+
+		// Reader: copy the latest value out. Returns false, leaving value alone, if publishes overlapped or nothing was published yet.
+		bool try_read(T& value) const
+		{
+			uint64_t const version = m_latest.load(std::memory_order_acquire);
+			slot const& source = m_slots[version & 1];
+			if (version == 0 || source.m_version.load(std::memory_order_acquire) != version)
+				return false;
+
+			uint64_t words[c_words];
+			for (size_t i = 0; i < c_words; ++i)
+				words[i] = source.m_words[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (source.m_version.load(std::memory_order_relaxed) != version)
+				return false;
+
+			memcpy(&value, words, sizeof(T));
+			return true;
+		}
+
+		// Reader: retry until a copy is consistent. Returns false only if nothing was published yet.
+		bool read(T& value) const
+		{
+			while (!try_read(value))
+			{
+				if (version() == 0)
+					return false;
+				std::this_thread::yield();
+			}
+			return true;
+		}
+
+		// Publishes so far.
+		uint64_t version() const { return m_latest.load(std::memory_order_acquire); }
+
+	private:
+		static constexpr size_t c_words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+		struct slot
+		{
+			alignas(64) std::atomic<uint64_t>	m_version = 0;		// The publish it holds, 0 while being written.
+			std::atomic<uint64_t>				m_words[c_words] = {};
+		};
+
+		alignas(64) std::atomic<uint64_t>	m_latest = 0;
+		slot								m_slots[2];
+	};
+
+	// A snapshot of an interpreter for monitoring, see state_monitor.
+	struct observed_state
+	{
+		registers	m_registers;
+		timers		m_timers;
+		display		m_display;
+		uint64_t	m_cycles = 0;
+		bool		m_waitingForInput = false;
+	};
+
+	// Publishes snapshots of an interpreter for dashboards and other monitoring threads. Read the registers, timers and display
+	// through it instead of get_registers() and get_display(), which the emulation thread keeps writing to.
+	class state_monitor
+	{
+	public:
+		// Emulation thread: take a snapshot, between frames (or any other point where the interpreter isn't running).
+		template<class Interpreter>
+		void publish(Interpreter& interpreter)
+		{
+			observed_state snapshot;
+			snapshot.m_registers = *interpreter.get_registers();
+			snapshot.m_timers = *interpreter.get_timers();
+			snapshot.m_display = *interpreter.get_display();
+			snapshot.m_cycles = interpreter.get_cycles();
+			snapshot.m_waitingForInput = interpreter.is_waiting_for_input();
+			m_state.publish(snapshot);
+		}
+
+		// Any thread: the latest snapshot, false if none was published yet.
+		bool read(observed_state& state) const { return m_state.read(state); }
+
+		// Any thread: snapshots published so far, to skip reading one already seen.
+		uint64_t version() const { return m_state.version(); }
+
+	private:
+		seqlock<observed_state>	m_state;
+	};
+
+	// What happens to the audio of fast-forwarded frames: nothing is rendered, or every emulated frame is heard for 1/speed of a
+	// frame (see audio_stream::render_frame()), keeping its pitch.
+	enum class turbo_audio : uint8_t
+	{
+		mute,
+		stretch,
+	};
+
+	// Runs a number of emulated frames per presented frame. The speed can be changed from any thread.
+	class turbo
+	{
+	public:
+		static constexpr uint32_t c_maxSpeed = 64;
+
+		explicit turbo(uint32_t speed = 1, turbo_audio audio = turbo_audio::stretch) : m_audio(audio) { set_speed(speed); }
+
+		void set_speed(uint32_t speed) { m_speed.store(std::clamp<uint32_t>(speed, 1, c_maxSpeed), std::memory_order_relaxed); }
+		uint32_t speed() const { return m_speed.load(std::memory_order_relaxed); }
+		turbo_audio audio_mode() const { return m_audio; }
+
+		// Whether audio should be rendered at this speed.
+		bool audible() const { return speed() == 1 || m_audio == turbo_audio::stretch; }
+
+		// Speed of the run in progress (or the last one), for the thread calling run(), e.g. from a batch's frame callback.
+		uint32_t running_speed() const { return m_running; }
+
+		// Run speed() frames of an interpreter and publish the last one. on_frame(interpreter, speed) runs after every emulated
+		// frame, e.g. to render its audio. Returns whether a frame was published.
+		template<class Interpreter, class OnFrame>
+		bool run(Interpreter& interpreter, frame_mailbox& mailbox, uint32_t cycles_per_frame, OnFrame&& on_frame)
+		{
+			m_running = speed();
+			for (uint32_t i = 0; i < m_running; ++i)
+			{
+				interpreter.run_frame(cycles_per_frame);
+				on_frame(interpreter, m_running);
+			}
+			return mailbox.publish(interpreter);
+		}
+
+		template<class Interpreter>
+		bool run(Interpreter& interpreter, frame_mailbox& mailbox, uint32_t cycles_per_frame)
+		{
+			return run(interpreter, mailbox, cycles_per_frame, [](Interpreter&, uint32_t) {});
+		}
+
+		// The same for every instance of a basic_batch (tiny8_batch.h), one mailbox each; its frame callback runs after every
+		// emulated frame. Returns how many instances published a frame.
+		template<class Batch>
+		size_t run_batch(Batch& batch, std::span<frame_mailbox> mailboxes)
+		{
+			assert(mailboxes.size() >= batch.size());
+
+			m_running = speed();
+			batch.run_frames(m_running);
+			size_t published = 0;
+			for (size_t i = 0; i < batch.size(); ++i)
+				published += mailboxes[i].publish(batch[i]);
+			return published;
+		}
+
+	private:
+		std::atomic<uint32_t>	m_speed = 1;
+		uint32_t				m_running = 1;
+		turbo_audio				m_audio;
+	};
+}
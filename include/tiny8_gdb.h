@@ -0,0 +1,536 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_debug.h"
+#include "tiny8_net.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+* GDB remote serial protocol stub serving one interpreter over TCP, on loopback, to gdb, lldb or anything else speaking RSP.
+*
+* The stub runs on its own thread. The target's frames run wherever they ran before, through run_frame(): attached to a batch,
+* the instance's work unit goes through the stub and every other instance keeps running on the workers as usual. While the
+* target is halted its work unit returns right away, so only that instance stops. A client connecting halts the target at its
+* next frame (like an attach) and disconnecting resumes it.
+*
+* Execution goes through a basic_debugger: software and hardware breakpoints (Z0/Z1), write watchpoints (Z2), continue, step
+* and interrupt (^C). A stop in the middle of a frame leaves the rest of it to the next run_frame() calls.
+* Registers, described to the client by target.xml: v0-vf (0-15), i (16), sp (17), pc (18), dt (19), st (20), little endian.
+* Memory is the interpreter's whole address space.
+*/
+namespace tiny8
+{
+	namespace gdb_detail
+	{
+		constexpr int c_pollMs = 20;		// How often the stub thread checks for shutdown and stops.
+		constexpr uint32_t c_registerCount = 21;
+		constexpr char c_hex[] = "0123456789abcdef";
+
+		inline int hex_digit(char c)
+		{
+			if (c >= '0' && c <= '9')
+				return c - '0';
+			if (c >= 'a' && c <= 'f')
+				return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F')
+				return c - 'A' + 10;
+			return -1;
+		}
+
+		// True if text starts with at least digits hex digits. Packets end with a null, which isn't one.
+		inline bool has_hex(char const* text, size_t digits)
+		{
+			for (size_t i = 0; i < digits; ++i)
+			{
+				if (hex_digit(text[i]) < 0)
+					return false;
+			}
+			return true;
+		}
+
+		// Bytes of register n: i, sp and pc are 16 bit, the others 8.
+		constexpr uint32_t register_size(uint32_t n) { return n >= 16 && n < 19 ? 2 : 1; }
+		constexpr uint32_t c_registerBytes = 16 + 3 * 2 + 2;
+
+		// Parse a hex number up to the first non hex digit, advancing text past it.
+		inline uint32_t parse_hex(char const*& text)
+		{
+			uint32_t value = 0;
+			for (int digit; (digit = hex_digit(*text)) >= 0; ++text)
+				value = (value << 4) | static_cast<uint32_t>(digit);
+			return value;
+		}
+
+		inline void append_hex(std::string& out, uint8_t byte)
+		{
+			out += c_hex[byte >> 4];
+			out += c_hex[byte & 0xf];
+		}
+
+		inline std::string target_xml()
+		{
+			std::string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><target version=\"1.0\"><feature name=\"org.tiny8.chip8\">";
+			for (uint32_t i = 0; i < 16; ++i)
+				xml += "<reg name=\"v" + std::string(1, c_hex[i]) + "\" bitsize=\"8\" type=\"uint8\"/>";
+			xml += "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/><reg name=\"sp\" bitsize=\"16\" type=\"uint16\"/>";
+			xml += "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/><reg name=\"dt\" bitsize=\"8\" type=\"uint8\"/><reg name=\"st\" bitsize=\"8\" type=\"uint8\"/>";
+			return xml + "</feature></target>";
+		}
+	}
+
+	template<class Interpreter>
+	class basic_gdb_server
+	{
+	public:
+		// Listen on 127.0.0.1:port (see is_listening()). The target runs until a client connects. The interpreter must outlive the
+		// server, and must not run other than through run_frame() while it exists.
+		basic_gdb_server(Interpreter& interpreter, uint16_t port) : m_interpreter(interpreter), m_debugger(interpreter)
+		{
+			m_listen = net::listen_tcp(port, true);
+			if (m_listen != net::c_invalidSocket)
+				m_thread = std::thread([this] { serve(); });
+		}
+
+		// Detach it from its batch (set_instance_runner(index, nullptr)) first.
+		~basic_gdb_server()
+		{
+			m_stop = true;
+			if (m_thread.joinable())
+				m_thread.join();
+			if (m_listen != net::c_invalidSocket)
+				net::close_socket(m_listen);
+		}
+
+		basic_gdb_server(basic_gdb_server const&) = delete;
+		basic_gdb_server& operator=(basic_gdb_server const&) = delete;
+
+		bool is_listening() const { return m_listen != net::c_invalidSocket; }
+		bool is_connected() const { return m_connected; }
+		bool is_halted() const { return m_halted; }
+
+		// Run a frame of the target as interpreter::run_frame() would, unless it's halted. Called from wherever the target runs.
+		void run_frame(uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_halted)
+				return;
+
+			if (m_interrupt.exchange(false))
+			{
+				halt(c_sigint, { stop_reason::budget, 0, 0 });
+				return;
+			}
+
+			debug_stop const stop = m_stepping ? m_debugger.step_frame(key_buffer, cycles_per_frame) : m_debugger.run_frame(key_buffer, cycles_per_frame);
+			if (m_stepping || stop.m_reason != stop_reason::budget)
+				halt(c_sigtrap, stop);
+		}
+
+		// Run the frames of a batch's instance through the stub.
+		template<class Batch>
+		void attach(Batch& batch, size_t index) { batch.set_instance_runner(index, &run_instance, this); }
+
+	private:
+		static constexpr uint8_t c_sigint = 2;
+		static constexpr uint8_t c_sigtrap = 5;
+
+		Interpreter&					m_interpreter;
+		basic_debugger<Interpreter>		m_debugger;			// Only used with m_mutex held.
+		net::startup					m_startup;
+		net::socket_handle		m_listen = net::c_invalidSocket;
+		net::socket_handle		m_client = net::c_invalidSocket;
+		std::thread						m_thread;
+		std::mutex						m_mutex;
+		std::condition_variable			m_haltedChanged;
+		std::atomic<bool>				m_stop{ false };
+		std::atomic<bool>				m_interrupt{ false };	// Halt at the start of the next frame.
+		std::atomic<bool>				m_connected{ false };
+		std::atomic<bool>				m_halted{ false };		// Written with m_mutex held, also read by is_halted() without it.
+		bool							m_stepping = false;
+		debug_stop						m_lastStop = {};
+		uint8_t							m_lastSignal = c_sigtrap;
+		std::string						m_packet;			// Incoming bytes not handled yet.
+		std::string						m_targetXml = gdb_detail::target_xml();
+
+		static void run_instance(void* user_data, Interpreter&, uint8_t const key_buffer[c_maxKeys], uint32_t cycles_per_frame)
+		{
+			static_cast<basic_gdb_server*>(user_data)->run_frame(key_buffer, cycles_per_frame);
+		}
+
+		// With m_mutex held.
+		void halt(uint8_t signal, debug_stop const& stop)
+		{
+			m_halted = true;
+			m_stepping = false;
+			m_lastSignal = signal;
+			m_lastStop = stop;
+			m_haltedChanged.notify_all();
+		}
+
+		void resume(bool step)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stepping = step;
+			m_halted = false;
+		}
+
+		// Wait for the target to halt, handling ^C from the client meanwhile. False if the client went away or the server stops.
+		bool wait_for_halt()
+		{
+			for (;;)
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (m_haltedChanged.wait_for(lock, std::chrono::milliseconds(gdb_detail::c_pollMs), [this] { return m_halted.load(); }))
+						return true;
+				}
+				if (m_stop)
+					return false;
+
+				if (net::poll_socket(m_client, 0) > 0)
+				{
+					char c;
+					if (recv(m_client, &c, 1, 0) <= 0)
+						return false;
+					if (c == 0x03)
+						m_interrupt = true;
+				}
+			}
+		}
+
+		void serve()
+		{
+			while (!m_stop)
+			{
+				if (net::poll_socket(m_listen, gdb_detail::c_pollMs) <= 0)
+					continue;
+
+				m_client = accept(m_listen, nullptr, nullptr);
+				if (m_client == net::c_invalidSocket)
+					continue;
+
+				m_connected = true;
+				m_packet.clear();
+				m_interrupt = true;
+				if (wait_for_halt())
+					session();
+
+				// Detached, killed or gone: let the target run free again.
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_debugger.clear_breakpoints();
+					m_debugger.clear_watchpoints();
+					m_interrupt = false;
+					m_halted = false;
+					m_stepping = false;
+				}
+				net::close_socket(m_client);
+				m_client = net::c_invalidSocket;
+				m_connected = false;
+			}
+		}
+
+		// Handle packets until the client detaches or goes away.
+		void session()
+		{
+			char buffer[1024];
+			while (!m_stop)
+			{
+				if (net::poll_socket(m_client, gdb_detail::c_pollMs) <= 0)
+					continue;
+
+				int const received = static_cast<int>(recv(m_client, buffer, sizeof(buffer), 0));
+				if (received <= 0)
+					return;
+				m_packet.append(buffer, static_cast<size_t>(received));
+
+				// Acknowledgements and stray ^C (the target is halted) are dropped, packets are $data#checksum.
+				for (;;)
+				{
+					size_t const start = m_packet.find('$');
+					size_t const end = start == std::string::npos ? std::string::npos : m_packet.find('#', start);
+					if (end == std::string::npos || end + 2 >= m_packet.size())
+						break;
+
+					std::string const data = m_packet.substr(start + 1, end - start - 1);
+					m_packet.erase(0, end + 3);
+					if (!send_raw("+") || !handle(data))
+						return;
+				}
+			}
+		}
+
+		// False if the client went away, which ends the session.
+		bool send_raw(std::string const& bytes) { return net::send_all(m_client, bytes.data(), bytes.size()); }
+
+		bool send_packet(std::string const& data)
+		{
+			uint8_t checksum = 0;
+			for (char const c : data)
+				checksum = static_cast<uint8_t>(checksum + c);
+
+			std::string packet = "$" + data + "#";
+			gdb_detail::append_hex(packet, checksum);
+			return send_raw(packet);
+		}
+
+		std::string stop_reply() const
+		{
+			std::string reply = "T";
+			gdb_detail::append_hex(reply, m_lastSignal);
+			if (m_lastStop.m_reason == stop_reason::watchpoint)
+			{
+				char watch[16];
+				snprintf(watch, sizeof(watch), "watch:%x;", m_lastStop.m_address);
+				reply += watch;
+			}
+			else if (m_lastStop.m_reason == stop_reason::breakpoint)
+				reply += "swbreak:;";
+			return reply + "thread:1;";
+		}
+
+		// Register number n, little endian.
+		void append_register(std::string& out, uint32_t n)
+		{
+			registers const& regs = *m_interpreter.get_registers();
+			timers const& t = *m_interpreter.get_timers();
+			uint16_t const wide[] = { regs.m_index, regs.m_sp, regs.m_pc };
+			if (n < 16)
+				gdb_detail::append_hex(out, regs.m_v[n]);
+			else if (n < 19)
+			{
+				gdb_detail::append_hex(out, static_cast<uint8_t>(wide[n - 16]));
+				gdb_detail::append_hex(out, static_cast<uint8_t>(wide[n - 16] >> 8));
+			}
+			else
+				gdb_detail::append_hex(out, n == 19 ? t.m_delay : t.m_sound);
+		}
+
+		// Parse register number n from hex, advancing text past it.
+		void parse_register(char const*& text, uint32_t n)
+		{
+			registers& regs = *m_interpreter.get_registers();
+			timers& t = *m_interpreter.get_timers();
+			auto const byte = [&text]()
+			{
+				int const high = gdb_detail::hex_digit(text[0]);
+				int const low = high < 0 ? -1 : gdb_detail::hex_digit(text[1]);
+				if (low < 0)
+					return 0;
+				text += 2;
+				return (high << 4) | low;
+			};
+
+			if (n < 16)
+				regs.m_v[n] = static_cast<uint8_t>(byte());
+			else if (n < 19)
+			{
+				uint16_t const value = static_cast<uint16_t>(byte() | (byte() << 8));
+				(n == 16 ? regs.m_index : n == 17 ? regs.m_sp : regs.m_pc) = value;
+			}
+			else
+				(n == 19 ? t.m_delay : t.m_sound) = static_cast<uint8_t>(byte());
+		}
+
+		// Reply to one packet. False to end the session.
+		bool handle(std::string const& packet)
+		{
+			uint32_t const memory_size = sizeof(m_interpreter.get_memory()->m_data);
+			char const* args = packet.c_str() + 1;
+			std::string reply;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			switch (packet.empty() ? 0 : packet[0])
+			{
+			case '?':
+				reply = stop_reply();
+				break;
+			case 'g':
+				for (uint32_t n = 0; n < gdb_detail::c_registerCount; ++n)
+					append_register(reply, n);
+				break;
+			case 'G':
+				// Every register must be there, or the missing ones would be zeroed.
+				if (!gdb_detail::has_hex(args, 2 * gdb_detail::c_registerBytes))
+				{
+					reply = "E01";
+					break;
+				}
+				for (uint32_t n = 0; n < gdb_detail::c_registerCount; ++n)
+					parse_register(args, n);
+				reply = "OK";
+				break;
+			case 'p':
+			{
+				uint32_t const n = gdb_detail::parse_hex(args);
+				if (n < gdb_detail::c_registerCount)
+					append_register(reply, n);
+				else
+					reply = "E01";
+				break;
+			}
+			case 'P':
+			{
+				uint32_t const n = gdb_detail::parse_hex(args);
+				if (n < gdb_detail::c_registerCount && *args++ == '=' && gdb_detail::has_hex(args, 2 * gdb_detail::register_size(n)))
+				{
+					parse_register(args, n);
+					reply = "OK";
+				}
+				else
+					reply = "E01";
+				break;
+			}
+			case 'm':
+			case 'M':
+			{
+				uint32_t const address = gdb_detail::parse_hex(args);
+				uint32_t const length = *args == ',' ? gdb_detail::parse_hex(++args) : 0;
+				if (address >= memory_size || length > memory_size - address)
+				{
+					reply = "E01";
+					break;
+				}
+
+				uint8_t* const data = m_interpreter.get_memory()->m_data + address;
+				if (packet[0] == 'm')
+				{
+					for (uint32_t i = 0; i < length; ++i)
+						gdb_detail::append_hex(reply, data[i]);
+					break;
+				}
+
+				// All of the data must be there and be hex before any of it is written.
+				bool valid = *args++ == ':' && static_cast<size_t>(packet.c_str() + packet.size() - args) >= 2 * size_t(length);
+				for (uint32_t i = 0; valid && i < 2 * length; ++i)
+					valid = gdb_detail::hex_digit(args[i]) >= 0;
+				if (!valid)
+				{
+					reply = "E01";
+					break;
+				}
+
+				for (uint32_t i = 0; i < length; ++i)
+					data[i] = static_cast<uint8_t>((gdb_detail::hex_digit(args[2 * i]) << 4) | gdb_detail::hex_digit(args[2 * i + 1]));
+#if defined(TINY8_WRITE_TRACKING)
+				m_interpreter.mark_written(address, length);
+#endif
+				m_interpreter.invalidate_decode_cache();
+				reply = "OK";
+				break;
+			}
+			case 'Z':
+			case 'z':
+			{
+				// Ztype,address,kind
+				if (packet.size() < 3 || packet[2] != ',')
+				{
+					reply = "E01";
+					break;
+				}
+				char const type = *args;
+				args += 2;
+				uint32_t const address = gdb_detail::parse_hex(args);
+				uint32_t const length = *args == ',' ? gdb_detail::parse_hex(++args) : 0;
+				bool const insert = packet[0] == 'Z';
+				if (address >= memory_size || (type != '0' && type != '1' && type != '2'))
+					break;
+
+				if (type == '2')
+				{
+					if (!insert)
+						m_debugger.remove_watchpoint(static_cast<uint16_t>(address));
+					else if (length == 0 || length > memory_size - address)
+					{
+						reply = "E01";
+						break;
+					}
+					else
+						m_debugger.add_watchpoint(static_cast<uint16_t>(address), static_cast<uint16_t>(length));
+				}
+				else if (insert)
+					m_debugger.set_breakpoint(static_cast<uint16_t>(address));
+				else
+					m_debugger.clear_breakpoint(static_cast<uint16_t>(address));
+				reply = "OK";
+				break;
+			}
+			case 'c':
+			case 's':
+				lock.unlock();
+				resume(packet[0] == 's');
+				if (!wait_for_halt())
+					return false;
+				lock.lock();
+				reply = stop_reply();
+				break;
+			case 'D':
+				send_packet("OK");
+				return false;
+			case 'k':
+				return false;
+			case 'H':
+				reply = "OK";
+				break;
+			case 'q':
+				if (packet.starts_with("qSupported"))
+					reply = "PacketSize=1000;qXfer:features:read+;swbreak+";
+				else if (packet == "qAttached")
+					reply = "1";
+				else if (packet == "qC")
+					reply = "QC1";
+				else if (packet == "qfThreadInfo")
+					reply = "m1";
+				else if (packet == "qsThreadInfo")
+					reply = "l";
+				else if (packet.starts_with("qXfer:features:read:target.xml:"))
+				{
+					char const* range = packet.c_str() + sizeof("qXfer:features:read:target.xml:") - 1;
+					size_t const offset = gdb_detail::parse_hex(range);
+					size_t const length = *range == ',' ? gdb_detail::parse_hex(++range) : 0;
+					if (offset >= m_targetXml.size())
+						reply = "l";
+					else
+					{
+						std::string const chunk = m_targetXml.substr(offset, length);
+						reply = (offset + chunk.size() < m_targetXml.size() ? "m" : "l") + chunk;
+					}
+				}
+				break;
+			default:
+				break;
+			}
+
+			lock.unlock();
+			return send_packet(reply);
+		}
+	};
+
+	using gdb_server = basic_gdb_server<interpreter>;
+}
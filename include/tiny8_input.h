@@ -0,0 +1,126 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <atomic>
+
+/*
+* Key input from other threads (an event loop, network I/O) to the thread running an interpreter, without either ever waiting.
+*
+* An input_port keeps the keys the producer last reported in an atomic mask, and the presses and releases leading there in a
+* single producer, single consumer ring. The interpreter polls the port (see basic_interpreter::set_input_poll()) and takes one
+* queued change per poll, so a tap shorter than a poll interval still reaches the rom as a press and then a release, in order;
+* once the ring is empty it holds the mask. A producer that only knows whole key states sets the mask instead.
+*/
+namespace tiny8
+{
+	class input_port
+	{
+	public:
+		// Producer: a key press or release, taking effect after the ones pushed before it. Returns false when the consumer is
+		// c_capacity changes behind, in which case the change only reaches the mask and a tap may go unseen.
+		bool push(uint8_t key, bool pressed)
+		{
+			assert(key < c_maxKeys);
+			uint16_t const bit = static_cast<uint16_t>(1 << key);
+			if (pressed)
+				m_keys.fetch_or(bit, std::memory_order_release);
+			else
+				m_keys.fetch_and(static_cast<uint16_t>(~bit), std::memory_order_release);
+
+			uint32_t const tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) == c_capacity)
+				return false;
+
+			m_events[tail % c_capacity] = static_cast<uint8_t>(key | (pressed ? c_pressed : 0));
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Producer: the whole set of held keys (see key_mask()), taking effect once the changes pushed before have.
+		void set_keys(uint16_t keys) { m_keys.store(keys, std::memory_order_release); }
+
+		// Any thread: the keys the producer reported last.
+		uint16_t keys() const { return m_keys.load(std::memory_order_acquire); }
+
+		// Consumer: the keys to hold now, applying the oldest queued change, or the latest mask once none are left.
+		uint16_t sample()
+		{
+			uint32_t const head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail.load(std::memory_order_acquire))
+			{
+				m_sampled = m_keys.load(std::memory_order_acquire);
+				return m_sampled;
+			}
+
+			uint8_t const e = m_events[head % c_capacity];
+			uint16_t const bit = static_cast<uint16_t>(1 << (e & c_keyMask));
+			m_sampled = static_cast<uint16_t>((e & c_pressed) != 0 ? m_sampled | bit : m_sampled & ~bit);
+			m_head.store(head + 1, std::memory_order_release);
+			return m_sampled;
+		}
+
+		// Consumer: apply every queued change at once, for instances that only take their keys between frames.
+		uint16_t drain()
+		{
+			uint32_t const tail = m_tail.load(std::memory_order_acquire);
+			while (m_head.load(std::memory_order_relaxed) != tail)
+				sample();
+			return sample();
+		}
+
+		// Consumer: sample() into a key buffer, for advance() and run_frame().
+		void sample(uint8_t key_buffer[c_maxKeys])
+		{
+			uint16_t const keys = sample();
+			for (uint8_t key = 0; key < c_maxKeys; ++key)
+				key_buffer[key] = (keys >> key) & 1;
+		}
+
+		// Input poll callback, see basic_interpreter::set_input_poll().
+		static uint16_t poll(void* user_data) { return static_cast<input_port*>(user_data)->sample(); }
+
+		// Have an interpreter poll the port every interval instructions while it runs (with run_frame() and run_cycles() holding the
+		// keys). The port must outlive the interpreter, or the next set_input_poll().
+		template<class Interpreter>
+		void attach(Interpreter& interpreter, uint32_t interval = 1)
+		{
+			interpreter.set_input_poll(&poll, this, interval);
+		}
+
+	private:
+		static constexpr uint32_t	c_capacity = 64;
+		static constexpr uint8_t	c_pressed = 0x80;
+		static constexpr uint8_t	c_keyMask = 0xf;
+
+		// Written by the producer.
+		alignas(64) std::atomic<uint16_t>	m_keys = 0;
+		std::atomic<uint32_t>				m_tail = 0;
+		uint8_t								m_events[c_capacity] = {};
+
+		// Written by the consumer.
+		alignas(64) std::atomic<uint32_t>	m_head = 0;
+		uint16_t							m_sampled = 0;
+	};
+}
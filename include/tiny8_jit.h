@@ -0,0 +1,350 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <chrono>
+#include <initializer_list>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/*
+* Block compiler for tiny8 interpreters on x86-64.
+*
+* Attached to an interpreter, every straight-line block of its decode cache is translated to native code the first time it runs
+* from start to end. The register file is addressed off a base register pinned for the whole block, register and index loads,
+* stores and arithmetic are emitted inline, and VF writes overwritten later in the same block are dropped. Everything else
+* (draw, Fx0A, timers, memory stores, branches...) calls the interpreter's own handler, so the quirks of every flags combination
+* stay exact. Self-modifying code is caught by the decode cache, which drops the compiled blocks along with the decoded ones.
+* On other architectures compile() always fails and the blocks are interpreted from the decode cache.
+*/
+namespace tiny8
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	constexpr bool c_jitSupported = true;
+#else
+	constexpr bool c_jitSupported = false;
+#endif
+
+	// One block_jit per interpreter: the generated code refers to that interpreter's decode cache.
+	class block_jit
+	{
+	public:
+		explicit block_jit(size_t code_bytes = 1024 * 1024)
+		{
+			if constexpr (c_jitSupported)
+			{
+#if defined(_WIN32)
+				void* const code = VirtualAlloc(nullptr, code_bytes, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+				void* code = mmap(nullptr, code_bytes, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (code == MAP_FAILED)
+					code = nullptr;
+#endif
+				m_code = static_cast<uint8_t*>(code);
+				m_capacity = m_code != nullptr ? code_bytes : 0;
+			}
+		}
+
+		~block_jit()
+		{
+			if (m_code == nullptr)
+				return;
+
+#if defined(_WIN32)
+			VirtualFree(m_code, 0, MEM_RELEASE);
+#else
+			munmap(m_code, m_capacity);
+#endif
+		}
+
+		block_jit(block_jit const&) = delete;
+		block_jit& operator=(block_jit const&) = delete;
+
+		// Start compiling the blocks of an interpreter (this enables its decode cache). The jit must outlive the interpreter.
+		template<class Interpreter>
+		void attach(Interpreter& interpreter)
+		{
+			typename Interpreter::block_compiler compiler;
+			compiler.m_compile = &compile<Interpreter>;
+			compiler.m_reset = &reset;
+			compiler.m_userData = this;
+			interpreter.set_block_compiler(compiler);
+		}
+
+		// True if native code can be generated at all (supported architecture and executable memory available).
+		bool is_available() const { return m_code != nullptr; }
+
+		// Bytes of native code currently generated. When the code buffer is full, new blocks are interpreted until the cache is dropped.
+		size_t used_bytes() const { return m_used; }
+
+		// Blocks compiled so far, and the time spent generating them.
+		uint64_t compiled_blocks() const { return m_compiledBlocks; }
+		uint64_t compile_nanoseconds() const { return m_compileNanoseconds; }
+
+	private:
+		// Longest code sequence a single instruction can take (a handler call), with room for the prologue and epilogue.
+		static constexpr uint32_t c_maxBlockInstructions = 64;
+		static constexpr size_t c_maxInstructionSize = 48;
+		static constexpr size_t c_scratchSize = c_maxBlockInstructions * c_maxInstructionSize + 64;
+
+		uint8_t*	m_code = nullptr;
+		size_t		m_capacity = 0;
+		size_t		m_used = 0;
+		uint64_t	m_compiledBlocks = 0;
+		uint64_t	m_compileNanoseconds = 0;
+
+		uint8_t		m_scratch[c_scratchSize];
+		size_t		m_size = 0;
+
+		static void reset(void* user_data) { static_cast<block_jit*>(user_data)->m_used = 0; }
+
+		// What a natively emitted instruction reads and writes, one bit per V register.
+		struct native_op
+		{
+			bool		m_native = false;
+			uint16_t	m_reads = 0;
+			uint16_t	m_writes = 0;
+		};
+
+		static constexpr uint16_t c_vf = 1 << 15;
+
+		static native_op classify(decode_state const& s, flags f)
+		{
+			uint16_t const vx = static_cast<uint16_t>(1 << s.m_x);
+			uint16_t const vy = static_cast<uint16_t>(1 << s.m_y);
+
+			switch (s.m_opcode >> 12)
+			{
+			case 0x6: return { true, 0, vx };
+			case 0x7: return { true, vx, vx };
+			case 0xa: return { true, 0, 0 };
+			case 0x8:
+				switch (s.m_n)
+				{
+				case 0x0: return { true, vy, vx };
+				case 0x1: case 0x2: case 0x3: return { true, static_cast<uint16_t>(vx | vy), static_cast<uint16_t>((f & logical_legacy) ? vx | c_vf : vx) };
+				case 0x4: case 0x5: case 0x7: return { true, static_cast<uint16_t>(vx | vy), static_cast<uint16_t>(vx | c_vf) };
+				case 0x6: case 0xe: return { true, (f & shift_legacy) ? vy : vx, static_cast<uint16_t>(vx | c_vf) };
+				}
+				break;
+			}
+
+			return {};
+		}
+
+		template<class Interpreter>
+		static typename Interpreter::native_block compile(void* user_data, Interpreter& self, typename Interpreter::decoded_instruction const* instructions, uint32_t address, uint32_t length)
+		{
+			if constexpr (!c_jitSupported)
+				return nullptr;
+			else
+			{
+				block_jit& jit = *static_cast<block_jit*>(user_data);
+				if (jit.m_code == nullptr || length > c_maxBlockInstructions)
+					return nullptr;
+
+				auto const start = std::chrono::steady_clock::now();
+				flags const f = self.get_flags();
+				int32_t const registers_offset = static_cast<int32_t>(reinterpret_cast<uint8_t*>(self.get_registers()) - reinterpret_cast<uint8_t*>(&self));
+
+				// Walk the block backwards to find the VF writes that are overwritten before anything reads them.
+				native_op ops[c_maxBlockInstructions];
+				bool flag_live[c_maxBlockInstructions];
+				bool live = true;
+				for (uint32_t i = length; i-- > 0;)
+				{
+					ops[i] = classify(instructions[address + 2 * i].m_state, f);
+					flag_live[i] = live;
+					live = ops[i].m_native ? (live && !(ops[i].m_writes & c_vf)) || (ops[i].m_reads & c_vf) : true;
+				}
+
+				jit.m_size = 0;
+				jit.prologue(registers_offset);
+				for (uint32_t i = 0; i < length; ++i)
+				{
+					auto const& instr = instructions[address + 2 * i];
+
+					// Only the last instruction of a block can read or change the program counter.
+					if (i == length - 1)
+						jit.store16(offsetof(registers, m_pc), static_cast<uint16_t>(address + 2 * i + 2));
+
+					if (ops[i].m_native)
+						jit.emit_native(instr.m_state, f, flag_live[i]);
+					else
+						jit.emit_call(registers_offset, reinterpret_cast<uint64_t>(instr.m_handler), reinterpret_cast<uint64_t>(&instr.m_state));
+				}
+				jit.epilogue();
+
+				if (jit.m_used + jit.m_size > jit.m_capacity)
+					return nullptr;
+
+				uint8_t* const code = jit.m_code + jit.m_used;
+				memcpy(code, jit.m_scratch, jit.m_size);
+				jit.m_used += (jit.m_size + 15) & ~size_t(15);
+				jit.m_compiledBlocks++;
+				jit.m_compileNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+				return reinterpret_cast<typename Interpreter::native_block>(code);
+			}
+		}
+
+		void emit(std::initializer_list<uint8_t> bytes)
+		{
+			for (uint8_t b : bytes)
+				m_scratch[m_size++] = b;
+		}
+
+		void emit_imm(uint64_t value, size_t size)
+		{
+			for (size_t i = 0; i < size; ++i)
+				m_scratch[m_size++] = static_cast<uint8_t>(value >> (8 * i));
+		}
+
+		// Operand for [rbx + disp8] with the given register field.
+		static constexpr uint8_t modrm_rbx(uint8_t reg) { return static_cast<uint8_t>(0x43 | (reg << 3)); }
+		static constexpr uint8_t v(uint8_t x) { return static_cast<uint8_t>(offsetof(registers, m_v) + x); }
+
+		// rbx holds the address of the register file for the whole block.
+		void prologue(int32_t registers_offset)
+		{
+			emit({ 0x53 });										// push rbx
+#if defined(_WIN32)
+			emit({ 0x48, 0x83, 0xec, 0x20 });					// sub rsp, 32 (shadow space)
+			emit({ 0x48, 0x8d, 0x99 });							// lea rbx, [rcx + registers_offset]
+#else
+			emit({ 0x48, 0x8d, 0x9f });							// lea rbx, [rdi + registers_offset]
+#endif
+			emit_imm(static_cast<uint32_t>(registers_offset), 4);
+		}
+
+		void epilogue()
+		{
+#if defined(_WIN32)
+			emit({ 0x48, 0x83, 0xc4, 0x20 });					// add rsp, 32
+#endif
+			emit({ 0x5b, 0xc3 });								// pop rbx; ret
+		}
+
+		void store16(size_t offset, uint16_t value)
+		{
+			emit({ 0x66, 0xc7, modrm_rbx(0), static_cast<uint8_t>(offset) });	// mov word [rbx + offset], value
+			emit_imm(value, 2);
+		}
+
+		// handler(interpreter, state), the interpreter being recovered from the register file address.
+		void emit_call(int32_t registers_offset, uint64_t body, uint64_t state)
+		{
+#if defined(_WIN32)
+			emit({ 0x48, 0x8d, 0x8b });							// lea rcx, [rbx - registers_offset]
+			emit_imm(static_cast<uint32_t>(-registers_offset), 4);
+			emit({ 0x48, 0xba });								// mov rdx, state
+#else
+			emit({ 0x48, 0x8d, 0xbb });							// lea rdi, [rbx - registers_offset]
+			emit_imm(static_cast<uint32_t>(-registers_offset), 4);
+			emit({ 0x48, 0xbe });								// mov rsi, state
+#endif
+			emit_imm(state, 8);
+			emit({ 0x48, 0xb8 });								// mov rax, body
+			emit_imm(body, 8);
+			emit({ 0xff, 0xd0 });								// call rax
+		}
+
+		// Same semantics as the matching interpreter handlers, see classify() for the instructions covered.
+		void emit_native(decode_state const& s, flags f, bool flag_live)
+		{
+			uint8_t const x = v(s.m_x);
+			uint8_t const y = v(s.m_y);
+			uint8_t const vf = v(15);
+
+			switch (s.m_opcode >> 12)
+			{
+			case 0x6:
+				emit({ 0xc6, modrm_rbx(0), x, s.m_nn });			// mov byte [vx], nn
+				return;
+			case 0x7:
+				emit({ 0x80, modrm_rbx(0), x, s.m_nn });			// add byte [vx], nn
+				return;
+			case 0xa:
+				store16(offsetof(registers, m_index), s.m_nnn);
+				return;
+			}
+
+			switch (s.m_n)
+			{
+			case 0x0:
+				emit({ 0x8a, modrm_rbx(0), y });					// mov al, [vy]
+				emit({ 0x88, modrm_rbx(0), x });					// mov [vx], al
+				break;
+			case 0x1: case 0x2: case 0x3:
+			{
+				uint8_t const op = s.m_n == 0x1 ? 0x0a : s.m_n == 0x2 ? 0x22 : 0x32;
+				emit({ 0x8a, modrm_rbx(0), x });					// mov al, [vx]
+				emit({ op, modrm_rbx(0), y });						// or/and/xor al, [vy]
+				emit({ 0x88, modrm_rbx(0), x });					// mov [vx], al
+				if ((f & logical_legacy) && flag_live)
+					emit({ 0xc6, modrm_rbx(0), vf, 0x00 });			// mov byte [vf], 0
+				break;
+			}
+			case 0x4: case 0x5: case 0x7:
+			{
+				bool const reverse = s.m_n == 0x7;
+				// Byte arithmetic leaves the flag in CF (semantics::add_carry) or CF and ZF (semantics::subtract_borrow).
+				emit({ 0x8a, modrm_rbx(0), reverse ? y : x });		// mov al, [vx]
+				emit({ static_cast<uint8_t>(s.m_n == 0x4 ? 0x02 : 0x2a), modrm_rbx(0), reverse ? x : y });	// add/sub al, [vy]
+				emit({ 0x88, modrm_rbx(0), x });					// mov [vx], al
+				if (flag_live)
+				{
+					emit({ 0x0f, static_cast<uint8_t>(s.m_n == 0x4 ? 0x92 : 0x97), 0xc0 });	// setc/seta al
+					emit({ 0x88, modrm_rbx(0), vf });				// mov [vf], al
+				}
+				break;
+			}
+			case 0x6: case 0xe:
+				if (f & shift_legacy)
+				{
+					emit({ 0x8a, modrm_rbx(0), y });				// mov al, [vy]
+					emit({ 0x88, modrm_rbx(0), x });				// mov [vx], al
+				}
+				emit({ 0x0f, 0xb6, modrm_rbx(0), x });				// movzx eax, [vx]
+				emit({ 0x89, 0xc1 });								// mov ecx, eax
+				emit({ 0xd0, static_cast<uint8_t>(s.m_n == 0x6 ? 0xe8 : 0xe0) });	// shr/shl al, 1
+				emit({ 0x88, modrm_rbx(0), x });					// mov [vx], al
+				if (flag_live)
+				{
+					if (s.m_n == 0xe)
+						emit({ 0xc1, 0xe9, 0x07 });					// shr ecx, 7
+					emit({ 0x83, 0xe1, 0x01 });						// and ecx, 1
+					emit({ 0x88, modrm_rbx(1), vf });				// mov [vf], cl
+				}
+				break;
+			}
+		}
+	};
+}
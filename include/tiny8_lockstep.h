@@ -0,0 +1,410 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <vector>
+
+/*
+* Lockstep execution of many instances of the same program, structure-of-arrays style.
+*
+* The registers, index and program counter of every lane are stored as arrays indexed by lane, and every step the lanes are
+* grouped by program counter. When a group shares the opcode, register arithmetic, loads and (conditional) jumps run as one
+* loop across the group; when all lanes are converged that loop covers contiguous arrays and is vectorised by the compiler
+* (SSE/AVX2 on x86, NEON on ARM); key skips, timer moves and Cxnn also run within the group, using each lane's own input, timers and random generator.
+* Everything touching memory, display or stack (draw, Fx0A, BCD, store/load, calls...) and lanes that diverged on their own
+* run as a regular interpreter step on the lane itself, so the quirks of every flags combination stay exact.
+*
+* Frames follow interpreter::run_frame() in timer_mode::wall_clock: the keys are latched once, cycles_per_frame instructions
+* run, and the timers tick once.
+*/
+namespace tiny8
+{
+	template<class Interpreter>
+	class basic_lockstep
+	{
+	public:
+		// Create lanes interpreters, each constructed with args.
+		template<class... Args>
+		explicit basic_lockstep(size_t lanes, Args const&... args)
+			: m_stride((lanes + 31) & ~size_t(31)), m_v(16 * m_stride), m_index(m_stride), m_pc(m_stride), m_waiting(m_stride),
+			m_startCycles(lanes), m_keys(lanes), m_next(lanes), m_group(lanes)
+		{
+			assert(lanes > 0);
+
+			m_lanes.reserve(lanes);
+			for (size_t i = 0; i < lanes; ++i)
+				m_lanes.emplace_back(args...);
+
+			for (auto& keys : m_keys)
+				keys.fill(0);
+
+			m_flags = m_lanes[0].get_flags();
+			std::fill(std::begin(m_head), std::end(m_head), c_noLane);
+
+			// Every address holding lanes is listed once per step; reserved so stepping never allocates.
+			m_addresses.reserve(std::min(lanes, Interpreter::c_memorySize));
+		}
+
+		size_t size() const { return m_lanes.size(); }
+
+		// Access a lane as a regular interpreter, e.g. to load a rom or read the display. Changes are picked up by the next run.
+		Interpreter& lane(size_t index)
+		{
+			if (!m_lanesCurrent)
+				store_lanes();
+			m_lanesCurrent = true;
+			m_lanesDirty = true;
+			return m_lanes[index];
+		}
+
+		uint8_t* keys(size_t index) { return m_keys[index].data(); }
+
+		// Run one frame on every lane: cycles_per_frame instructions, then a timer tick.
+		void run_frame(uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			if (m_lanesDirty)
+				load_lanes();
+			m_lanesCurrent = false;
+
+			if (cycles_per_frame == 0)
+				return;
+
+			for (size_t i = 0; i < m_lanes.size(); ++i)
+				m_lanes[i].latch_input(key_mask(m_keys[i].data()));
+
+			step();
+
+			// Same as run_cycles(): after the first instruction the previous keys match the current ones.
+			for (auto& lane : m_lanes)
+				lane.m_input.m_prevKeys = lane.m_input.m_keys;
+
+			for (uint32_t i = 1; i < cycles_per_frame; ++i)
+				step();
+
+			// The tick also ends any wait for the vertical blank.
+			for (uint32_t i = 0; i < m_lanes.size(); ++i)
+			{
+				m_lanes[i].tick_timers();
+				m_waiting[i] = m_lanes[i].m_isWaitingForInput;
+			}
+		}
+
+		void run_frames(uint64_t frames, uint32_t cycles_per_frame = c_defaultCyclesPerFrame)
+		{
+			for (uint64_t i = 0; i < frames; ++i)
+				run_frame(cycles_per_frame);
+		}
+
+		// How lane instructions were executed so far: in groups sharing the same opcode, or one lane at a time.
+		uint64_t get_grouped_instructions() const { return m_groupedInstructions; }
+		uint64_t get_scalar_instructions() const { return m_scalarInstructions; }
+
+	private:
+		static constexpr uint32_t c_noLane = ~0u;
+
+		std::vector<Interpreter>	m_lanes;
+		flags						m_flags;
+
+		// Lane registers, m_v holds 16 arrays of m_stride lanes.
+		size_t						m_stride;
+		std::vector<uint8_t>		m_v;
+		std::vector<uint16_t>		m_index;
+		std::vector<uint16_t>		m_pc;
+		std::vector<uint8_t>		m_waiting;
+		std::vector<uint64_t>		m_startCycles;		// Lane cycle count when the registers were loaded, minus m_steps.
+		uint64_t					m_steps = 0;
+
+		std::vector<std::array<uint8_t, c_maxKeys>>	m_keys;
+
+		// Grouping by program counter: one linked list of lanes per address, rebuilt every step. Each head is reset once its group ran.
+		uint32_t					m_head[Interpreter::c_memorySize];
+		uint32_t					m_tail[Interpreter::c_memorySize];
+		std::vector<uint32_t>		m_next;
+		std::vector<uint32_t>		m_group;
+		std::vector<uint16_t>		m_addresses;
+
+		bool						m_lanesCurrent = true;	// The interpreters hold the up to date registers.
+		bool						m_lanesDirty = true;	// The interpreters may have been changed since the registers were loaded.
+
+		uint64_t					m_groupedInstructions = 0;
+		uint64_t					m_scalarInstructions = 0;
+
+		uint8_t* v(size_t index) { return &m_v[index * m_stride]; }
+
+		void load_lanes()
+		{
+			for (uint32_t i = 0; i < m_lanes.size(); ++i)
+				load_lane(i);
+			m_lanesDirty = false;
+		}
+
+		void store_lanes()
+		{
+			for (uint32_t i = 0; i < m_lanes.size(); ++i)
+				store_lane(i);
+		}
+
+		void load_lane(uint32_t i)
+		{
+			Interpreter const& lane = m_lanes[i];
+			for (size_t r = 0; r < 16; ++r)
+				v(r)[i] = lane.m_registers.m_v[r];
+			m_index[i] = lane.m_registers.m_index;
+			m_pc[i] = lane.m_registers.m_pc;
+			m_waiting[i] = lane.m_isWaitingForInput || lane.m_isWaitingForVblank;
+			m_startCycles[i] = lane.m_cycles - m_steps;
+		}
+
+		void store_lane(uint32_t i)
+		{
+			Interpreter& lane = m_lanes[i];
+			for (size_t r = 0; r < 16; ++r)
+				lane.m_registers.m_v[r] = v(r)[i];
+			lane.m_registers.m_index = m_index[i];
+			lane.m_registers.m_pc = m_pc[i];
+			lane.m_cycles = m_startCycles[i] + m_steps;
+		}
+
+		// Run one interpreter step on a single lane.
+		void step_scalar(uint32_t i)
+		{
+			store_lane(i);
+			m_lanes[i].step();
+			load_lane(i);
+			m_startCycles[i]--;		// m_steps is only incremented once the whole step is done.
+			m_scalarInstructions++;
+		}
+
+		// Every lane executes exactly one instruction.
+		void step()
+		{
+			uint32_t const lanes = static_cast<uint32_t>(m_lanes.size());
+
+			m_addresses.clear();
+			for (uint32_t i = 0; i < lanes; ++i)
+			{
+				uint16_t const pc = m_pc[i];
+				if (m_waiting[i] || pc + 1u >= Interpreter::c_memorySize)
+				{
+					step_scalar(i);
+					continue;
+				}
+
+				m_next[i] = c_noLane;
+				if (m_head[pc] == c_noLane)
+				{
+					m_head[pc] = m_tail[pc] = i;
+					m_addresses.push_back(pc);
+				}
+				else
+				{
+					m_next[m_tail[pc]] = i;
+					m_tail[pc] = i;
+				}
+			}
+
+			for (uint16_t const pc : m_addresses)
+			{
+				// Lanes may have rewritten their own code, only the ones still holding the leader's opcode run together.
+				uint32_t const leader = m_head[pc];
+				uint16_t const opcode = opcode_at(leader, pc);
+
+				uint32_t count = 0;
+				for (uint32_t i = leader; i != c_noLane; i = m_next[i])
+				{
+					if (opcode_at(i, pc) == opcode)
+						m_group[count++] = i;
+					else
+						step_scalar(i);
+				}
+
+				if (!execute_group(opcode, count, count == lanes))
+				{
+					for (uint32_t k = 0; k < count; ++k)
+						step_scalar(m_group[k]);
+				}
+				else
+					m_groupedInstructions += count;
+
+				m_head[pc] = c_noLane;
+			}
+
+			m_steps++;
+		}
+
+		uint16_t opcode_at(uint32_t lane, uint32_t pc) const { return m_lanes[lane].read_word(pc); }
+
+		// Where a lane continues after a skip instruction at pc: F000 nnnn takes two words.
+		uint16_t skip(uint32_t lane, uint16_t pc, bool taken) const
+		{
+			if (!taken)
+				return static_cast<uint16_t>(pc + 2);
+			return static_cast<uint16_t>(pc + (opcode_at(lane, pc + 2) == 0xf000 ? 6 : 4));
+		}
+
+		// Run body on every lane of the group, over whole contiguous arrays when every lane is in it.
+		template<class Body>
+		void for_lanes(uint32_t count, bool all, Body&& body)
+		{
+			if (all)
+			{
+				for (uint32_t i = 0; i < count; ++i)
+					body(i);
+			}
+			else
+			{
+				for (uint32_t k = 0; k < count; ++k)
+					body(m_group[k]);
+			}
+		}
+
+		// Execute an opcode across a group of lanes. Returns false for instructions that need a full interpreter step.
+		bool execute_group(uint16_t opcode, uint32_t count, bool all)
+		{
+			decode_state const s = Interpreter::decode_opcode(opcode);
+			uint8_t* const vx = v(s.m_x);
+			uint8_t* const vy = v(s.m_y);
+			uint8_t* const vf = v(15);
+			uint16_t* const pc = m_pc.data();
+			uint16_t* const index = m_index.data();
+
+			switch (opcode >> 12)
+			{
+			case 0x1: for_lanes(count, all, [&](uint32_t i) { pc[i] = s.m_nnn; }); return true;
+			case 0x3: for_lanes(count, all, [&](uint32_t i) { pc[i] = skip(i, pc[i], vx[i] == s.m_nn); }); return true;
+			case 0x4: for_lanes(count, all, [&](uint32_t i) { pc[i] = skip(i, pc[i], vx[i] != s.m_nn); }); return true;
+			case 0x5:
+				if (s.m_n != 0)
+					return false;
+				for_lanes(count, all, [&](uint32_t i) { pc[i] = skip(i, pc[i], vx[i] == vy[i]); });
+				return true;
+			case 0x6: for_lanes(count, all, [&](uint32_t i) { vx[i] = s.m_nn; pc[i] += 2; }); return true;
+			case 0x7: for_lanes(count, all, [&](uint32_t i) { vx[i] += s.m_nn; pc[i] += 2; }); return true;
+			case 0x9:
+				if (s.m_n != 0)
+					return false;
+				for_lanes(count, all, [&](uint32_t i) { pc[i] = skip(i, pc[i], vx[i] != vy[i]); });
+				return true;
+			case 0xa: for_lanes(count, all, [&](uint32_t i) { index[i] = s.m_nnn; pc[i] += 2; }); return true;
+			case 0xc: for_lanes(count, all, [&](uint32_t i) { vx[i] = next_random(m_lanes[i].m_random) & s.m_nn; pc[i] += 2; }); return true;
+			case 0x8: return execute_alu(s, count, all, vx, vy, vf, pc);
+			case 0xe:
+				if (s.m_nn != 0x9e && s.m_nn != 0xa1)
+					return false;
+				for_lanes(count, all, [&](uint32_t i)
+					{
+						bool const pressed = ((m_lanes[i].m_input.m_keys >> (vx[i] & 0xf)) & 1) != 0;
+						pc[i] = skip(i, pc[i], pressed == (s.m_nn == 0x9e));
+					});
+				return true;
+			case 0xf:
+				switch (s.m_nn)
+				{
+				case 0x07: for_lanes(count, all, [&](uint32_t i) { vx[i] = m_lanes[i].m_timers.m_delay; pc[i] += 2; }); return true;
+				case 0x15: for_lanes(count, all, [&](uint32_t i) { m_lanes[i].m_timers.m_delay = vx[i]; pc[i] += 2; }); return true;
+				case 0x18: for_lanes(count, all, [&](uint32_t i) { m_lanes[i].m_timers.m_sound = vx[i]; pc[i] += 2; }); return true;
+				case 0x1e:
+					for_lanes(count, all, [&](uint32_t i)
+						{
+							vf[i] = index[i] + vx[i] > 0xfff;
+							index[i] += vx[i];
+							pc[i] += 2;
+						});
+					return true;
+				case 0x29: for_lanes(count, all, [&](uint32_t i) { index[i] = c_fontAddresses[vx[i] & 0xf]; pc[i] += 2; }); return true;
+				case 0x30: for_lanes(count, all, [&](uint32_t i) { index[i] = c_bigFontAddresses[vx[i] & 0xf]; pc[i] += 2; }); return true;
+				default:
+					return false;
+				}
+			default:
+				return false;
+			}
+		}
+
+		// 8xyN, same semantics as the interpreter handlers: the result is written before the flag, so VF as a destination ends up holding the flag.
+		bool execute_alu(decode_state const& s, uint32_t count, bool all, uint8_t* vx, uint8_t* vy, uint8_t* vf, uint16_t* pc)
+		{
+			bool const logical = (m_flags & flags::logical_legacy) != 0;
+			bool const shift = (m_flags & flags::shift_legacy) != 0;
+
+			switch (s.m_n)
+			{
+			case 0x0: for_lanes(count, all, [&](uint32_t i) { vx[i] = vy[i]; pc[i] += 2; }); return true;
+			case 0x1: for_lanes(count, all, [&](uint32_t i) { vx[i] |= vy[i]; if (logical) vf[i] = 0; pc[i] += 2; }); return true;
+			case 0x2: for_lanes(count, all, [&](uint32_t i) { vx[i] &= vy[i]; if (logical) vf[i] = 0; pc[i] += 2; }); return true;
+			case 0x3: for_lanes(count, all, [&](uint32_t i) { vx[i] ^= vy[i]; if (logical) vf[i] = 0; pc[i] += 2; }); return true;
+			case 0x4:
+				for_lanes(count, all, [&](uint32_t i)
+					{
+						semantics::flagged const result = semantics::add_carry(vx[i], vy[i]);
+						vx[i] = result.m_value;
+						vf[i] = result.m_flag;
+						pc[i] += 2;
+					});
+				return true;
+			case 0x5:
+				for_lanes(count, all, [&](uint32_t i)
+					{
+						semantics::flagged const result = semantics::subtract_borrow(vx[i], vy[i]);
+						vx[i] = result.m_value;
+						vf[i] = result.m_flag;
+						pc[i] += 2;
+					});
+				return true;
+			case 0x7:
+				for_lanes(count, all, [&](uint32_t i)
+					{
+						semantics::flagged const result = semantics::subtract_borrow(vy[i], vx[i]);
+						vx[i] = result.m_value;
+						vf[i] = result.m_flag;
+						pc[i] += 2;
+					});
+				return true;
+			case 0x6:
+				for_lanes(count, all, [&](uint32_t i)
+					{
+						uint8_t const prev = shift ? vy[i] : vx[i];
+						vx[i] = prev >> 1;
+						vf[i] = prev & 1;
+						pc[i] += 2;
+					});
+				return true;
+			case 0xe:
+				for_lanes(count, all, [&](uint32_t i)
+					{
+						uint8_t const prev = shift ? vy[i] : vx[i];
+						vx[i] = static_cast<uint8_t>(prev << 1);
+						vf[i] = (prev >> 7) & 1;
+						pc[i] += 2;
+					});
+				return true;
+			default:
+				return false;
+			}
+		}
+	};
+
+	// Lockstep lanes with behaviour flags chosen at run time.
+	using lockstep = basic_lockstep<interpreter>;
+}
@@ -0,0 +1,264 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+* Service metrics for hosts running many instances: instructions, frames, faults, decode cache tiers, block compiler time, active
+* instances and a histogram of host frame times.
+*
+* Every thread recording gets its own shard of counters, found through a thread_local on every call after its first, which only
+* it writes (plain relaxed stores, no read-modify-write) and anyone can read: recording never takes a lock or shares a cache line.
+* snapshot() sums the shards; write_prometheus() formats them in the Prometheus text exposition format, as counters that
+* Prometheus turns into rates (instructions per second is rate(tiny8_instructions_total[1m])). A metrics_server
+* (tiny8_metrics_server.h) answers any HTTP request with that text, or read snapshot() from your own callback or exporter.
+* basic_batch::set_metrics() records every instance frame of a batch and every batch frame.
+*/
+namespace tiny8
+{
+	// Upper bounds of the host frame time histogram's buckets in seconds, plus one catching everything slower.
+	constexpr double c_frameTimeBuckets[] = { 0.001, 0.002, 0.004, 0.008, 0.0166, 0.033, 0.066, 0.25 };
+	constexpr size_t c_frameTimeBucketCount = std::size(c_frameTimeBuckets) + 1;
+
+	// Every thread's counters added up.
+	struct metrics_snapshot
+	{
+		double		m_seconds = 0.0;		// Since the metrics were created.
+		uint64_t	m_instructions = 0;
+		uint64_t	m_frames = 0;			// Instance frames.
+		uint64_t	m_faults = 0;			// Instance frames ending on a fault.
+		uint64_t	m_tierInstructions[size_t(tier::count)] = {};
+		uint64_t	m_compiledBlocks = 0;
+		uint64_t	m_compileNanoseconds = 0;
+		uint64_t	m_hostFrames = 0;
+		uint64_t	m_hostFrameNanoseconds = 0;
+		uint64_t	m_hostFrameBuckets[c_frameTimeBucketCount] = {};	// Not cumulative.
+		int64_t		m_activeInstances = 0;
+
+		// Share of the decode cache's instructions that ran from a decoded or compiled block.
+		double cache_hit_rate() const
+		{
+			uint64_t const total = m_tierInstructions[size_t(tier::interpreted)] + m_tierInstructions[size_t(tier::decoded)] + m_tierInstructions[size_t(tier::native)];
+			return total > 0 ? 1.0 - double(m_tierInstructions[size_t(tier::interpreted)]) / double(total) : 0.0;
+		}
+	};
+
+	class metrics
+	{
+	public:
+		// Where an instance was before a frame, see record_frame().
+		struct frame_start
+		{
+			uint64_t		m_cycles;
+			tier_counts		m_tiers;
+		};
+
+		metrics() : m_start(std::chrono::steady_clock::now()), m_id(s_nextId.fetch_add(1, std::memory_order_relaxed)) {}
+
+		metrics(metrics const&) = delete;
+		metrics& operator=(metrics const&) = delete;
+
+		template<class Interpreter>
+		static frame_start start_frame(Interpreter const& interpreter) { return { interpreter.get_cycles(), interpreter.get_tier_counts() }; }
+
+		// Count a frame an instance just ran on the calling thread.
+		template<class Interpreter>
+		void record_frame(Interpreter const& interpreter, frame_start const& start)
+		{
+			shard& s = local();
+			add(s.m_instructions, interpreter.get_cycles() >= start.m_cycles ? interpreter.get_cycles() - start.m_cycles : 0);
+			add(s.m_frames, 1);
+			add(s.m_faults, interpreter.has_fault());
+
+			tier_counts const tiers = interpreter.get_tier_counts();
+			for (size_t t = 0; t < size_t(tier::count); ++t)
+				add(s.m_tiers[t], tiers.m_instructions[t] >= start.m_tiers.m_instructions[t] ? tiers.m_instructions[t] - start.m_tiers.m_instructions[t] : 0);
+		}
+
+		// Count a host frame (all the instances' frames of one step) that took this long.
+		void record_host_frame(std::chrono::nanoseconds duration)
+		{
+			shard& s = local();
+			double const seconds = std::chrono::duration<double>(duration).count();
+			size_t bucket = 0;
+			while (bucket < std::size(c_frameTimeBuckets) && seconds > c_frameTimeBuckets[bucket])
+				++bucket;
+
+			add(s.m_hostFrames, 1);
+			add(s.m_hostFrameNanoseconds, static_cast<uint64_t>(duration.count()));
+			add(s.m_hostFrameBuckets[bucket], 1);
+		}
+
+		// Count blocks a block compiler generated, e.g. the change in block_jit::compiled_blocks() and compile_nanoseconds().
+		void record_compiles(uint64_t blocks, uint64_t nanoseconds)
+		{
+			shard& s = local();
+			add(s.m_compiledBlocks, blocks);
+			add(s.m_compileNanoseconds, nanoseconds);
+		}
+
+		void set_active_instances(int64_t count) { m_activeInstances.store(count, std::memory_order_relaxed); }
+
+		metrics_snapshot snapshot() const
+		{
+			metrics_snapshot totals;
+			totals.m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+			totals.m_activeInstances = m_activeInstances.load(std::memory_order_relaxed);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (shard const& s : m_shards)
+			{
+				totals.m_instructions += s.m_instructions.load(std::memory_order_relaxed);
+				totals.m_frames += s.m_frames.load(std::memory_order_relaxed);
+				totals.m_faults += s.m_faults.load(std::memory_order_relaxed);
+				for (size_t t = 0; t < size_t(tier::count); ++t)
+					totals.m_tierInstructions[t] += s.m_tiers[t].load(std::memory_order_relaxed);
+				totals.m_compiledBlocks += s.m_compiledBlocks.load(std::memory_order_relaxed);
+				totals.m_compileNanoseconds += s.m_compileNanoseconds.load(std::memory_order_relaxed);
+				totals.m_hostFrames += s.m_hostFrames.load(std::memory_order_relaxed);
+				totals.m_hostFrameNanoseconds += s.m_hostFrameNanoseconds.load(std::memory_order_relaxed);
+				for (size_t b = 0; b < c_frameTimeBucketCount; ++b)
+					totals.m_hostFrameBuckets[b] += s.m_hostFrameBuckets[b].load(std::memory_order_relaxed);
+			}
+			return totals;
+		}
+
+		// Append the current totals in the Prometheus text format, every metric name starting with prefix.
+		void write_prometheus(std::string& out, char const* prefix = "tiny8") const
+		{
+			metrics_snapshot const totals = snapshot();
+			char line[256];
+			auto const metric = [&](char const* name, char const* type, char const* help)
+			{
+				snprintf(line, sizeof(line), "# HELP %s_%s %s\n# TYPE %s_%s %s\n", prefix, name, help, prefix, name, type);
+				out += line;
+			};
+			auto const value = [&](char const* name, char const* labels, double v)
+			{
+				snprintf(line, sizeof(line), "%s_%s%s %.17g\n", prefix, name, labels, v);
+				out += line;
+			};
+
+			metric("uptime_seconds", "gauge", "Seconds since the metrics were created.");
+			value("uptime_seconds", "", totals.m_seconds);
+			metric("instructions_total", "counter", "Instructions executed.");
+			value("instructions_total", "", double(totals.m_instructions));
+			metric("frames_total", "counter", "Instance frames run.");
+			value("frames_total", "", double(totals.m_frames));
+			metric("faults_total", "counter", "Instance frames that ended on a fault.");
+			value("faults_total", "", double(totals.m_faults));
+			metric("instances_active", "gauge", "Instances currently running.");
+			value("instances_active", "", double(totals.m_activeInstances));
+
+			metric("tier_instructions_total", "counter", "Instructions run by each tier of the decode cache.");
+			value("tier_instructions_total", "{tier=\"interpreted\"}", double(totals.m_tierInstructions[size_t(tier::interpreted)]));
+			value("tier_instructions_total", "{tier=\"decoded\"}", double(totals.m_tierInstructions[size_t(tier::decoded)]));
+			value("tier_instructions_total", "{tier=\"native\"}", double(totals.m_tierInstructions[size_t(tier::native)]));
+			metric("decode_cache_hit_ratio", "gauge", "Share of the decode cache's instructions run from a decoded or compiled block.");
+			value("decode_cache_hit_ratio", "", totals.cache_hit_rate());
+
+			metric("compiled_blocks_total", "counter", "Blocks generated by the block compiler.");
+			value("compiled_blocks_total", "", double(totals.m_compiledBlocks));
+			metric("compile_seconds_total", "counter", "Time spent generating blocks.");
+			value("compile_seconds_total", "", totals.m_compileNanoseconds * 1e-9);
+
+			metric("frame_seconds", "histogram", "Time taken by host frames.");
+			uint64_t cumulative = 0;
+			for (size_t b = 0; b < c_frameTimeBucketCount; ++b)
+			{
+				cumulative += totals.m_hostFrameBuckets[b];
+				char labels[32];
+				if (b < std::size(c_frameTimeBuckets))
+					snprintf(labels, sizeof(labels), "{le=\"%g\"}", c_frameTimeBuckets[b]);
+				else
+					snprintf(labels, sizeof(labels), "{le=\"+Inf\"}");
+				value("frame_seconds_bucket", labels, double(cumulative));
+			}
+			value("frame_seconds_sum", "", totals.m_hostFrameNanoseconds * 1e-9);
+			value("frame_seconds_count", "", double(totals.m_hostFrames));
+		}
+
+	private:
+		struct alignas(64) shard
+		{
+			std::thread::id			m_thread;
+			std::atomic<uint64_t>	m_instructions = 0;
+			std::atomic<uint64_t>	m_frames = 0;
+			std::atomic<uint64_t>	m_faults = 0;
+			std::atomic<uint64_t>	m_tiers[size_t(tier::count)] = {};
+			std::atomic<uint64_t>	m_compiledBlocks = 0;
+			std::atomic<uint64_t>	m_compileNanoseconds = 0;
+			std::atomic<uint64_t>	m_hostFrames = 0;
+			std::atomic<uint64_t>	m_hostFrameNanoseconds = 0;
+			std::atomic<uint64_t>	m_hostFrameBuckets[c_frameTimeBucketCount] = {};
+		};
+
+		static inline std::atomic<uint64_t>	s_nextId = 1;
+
+		std::chrono::steady_clock::time_point	m_start;
+		uint64_t								m_id;			// Tells apart metrics at the same address over time.
+		std::atomic<int64_t>					m_activeInstances = 0;
+		mutable std::mutex						m_mutex;		// Only held to add a shard and to sum them.
+		std::deque<shard>						m_shards;		// Never move once added.
+
+		// Only the owning thread writes a shard.
+		static void add(std::atomic<uint64_t>& counter, uint64_t value)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		// The calling thread's shard, cached for the last metrics it recorded to.
+		shard& local()
+		{
+			thread_local uint64_t t_id = 0;
+			thread_local shard* t_shard = nullptr;
+			if (t_id == m_id)
+				return *t_shard;
+
+			std::thread::id const thread = std::this_thread::get_id();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			shard* found = nullptr;
+			for (shard& s : m_shards)
+			{
+				if (s.m_thread == thread)
+					found = &s;
+			}
+			if (found == nullptr)
+			{
+				found = &m_shards.emplace_back();
+				found->m_thread = thread;
+			}
+
+			t_id = m_id;
+			t_shard = found;
+			return *found;
+		}
+	};
+}
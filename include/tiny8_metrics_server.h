@@ -0,0 +1,106 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8_metrics.h"
+#include "tiny8_net.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+/*
+* A tiny HTTP endpoint for scraping metrics: every request, whatever its path, gets write_prometheus() back and the connection
+* closed. Kept apart from tiny8_metrics.h so that recording doesn't pull in the socket headers.
+*/
+namespace tiny8
+{
+	// Serves a metrics' write_prometheus() text on a port, from its own thread.
+	class metrics_server
+	{
+	public:
+		// Listen on the port, on loopback only or on every interface (see is_listening()). The metrics must outlive the server.
+		metrics_server(metrics const& source, uint16_t port, bool loopback_only = true) : m_metrics(source)
+		{
+			m_listen = net::listen_tcp(port, loopback_only);
+			if (m_listen != net::c_invalidSocket)
+				m_thread = std::thread([this] { serve(); });
+		}
+
+		~metrics_server()
+		{
+			m_stop = true;
+			if (m_thread.joinable())
+				m_thread.join();
+			if (m_listen != net::c_invalidSocket)
+				net::close_socket(m_listen);
+		}
+
+		metrics_server(metrics_server const&) = delete;
+		metrics_server& operator=(metrics_server const&) = delete;
+
+		bool is_listening() const { return m_listen != net::c_invalidSocket; }
+		uint16_t port() const { return is_listening() ? net::local_port(m_listen) : 0; }
+
+	private:
+		static constexpr int c_pollMs = 50;		// How often the server thread checks for shutdown.
+
+		metrics const&				m_metrics;
+		net::startup				m_startup;
+		net::socket_handle			m_listen = net::c_invalidSocket;
+		std::thread					m_thread;
+		std::atomic<bool>			m_stop = false;
+
+		void serve()
+		{
+			std::string body, response;
+			while (!m_stop)
+			{
+				if (net::poll_socket(m_listen, c_pollMs) <= 0)
+					continue;
+
+				net::socket_handle const client = accept(m_listen, nullptr, nullptr);
+				if (client == net::c_invalidSocket)
+					continue;
+
+				// Read the request up to the end of its headers, whatever it asks for, then answer and close.
+				std::string request;
+				char buffer[512];
+				while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192 && net::poll_socket(client, 1000) > 0)
+				{
+					int const received = static_cast<int>(recv(client, buffer, sizeof(buffer), 0));
+					if (received <= 0)
+						break;
+					request.append(buffer, static_cast<size_t>(received));
+				}
+
+				body.clear();
+				m_metrics.write_prometheus(body);
+				response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+				response += body;
+				// send_all doesn't raise SIGPIPE, so a scraper that hangs up early only loses its own response.
+				net::send_all(client, response.data(), response.size());
+				net::close_socket(client);
+			}
+		}
+	};
+}
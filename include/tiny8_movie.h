@@ -0,0 +1,266 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_pack.h"
+
+#include <vector>
+
+/*
+* Input movies: record a session's keys and replay it exactly, headless and as fast as the interpreter runs.
+*
+* With emulated timers and a fixed seed the only outside input is the keys, so a movie stores the rom hash, flags, seed and
+* cycles per frame, followed by the key mask of every frame as runs of frames holding the same mask. Every checkpoint_interval
+* frames the recorder also stores the display_hash(); the replay compares them and reports the first frame that differs.
+*
+* Layout, all fields little endian:
+*   header		magic "T8MV", version, rom hash, seed, settings and the run and checkpoint counts
+*   runs		one movie_run per change of keys: mask and number of frames it is held for
+*   checkpoints	one display_hash() after every checkpoint_interval frames
+*/
+namespace tiny8
+{
+	static_assert(std::endian::native == std::endian::little, "movies are stored little endian");
+
+	constexpr char		c_movieMagic[4] = { 'T', '8', 'M', 'V' };
+	constexpr uint32_t	c_movieVersion = 1;
+	constexpr uint32_t	c_defaultCheckpointInterval = 60;
+
+	struct movie_header
+	{
+		char		m_magic[4];
+		uint32_t	m_version;
+		uint64_t	m_romHash;				// rom_hash() of the recorded rom.
+		uint64_t	m_seed;
+		uint32_t	m_cyclesPerFrame;
+		uint32_t	m_checkpointInterval;	// Frames between framebuffer hashes.
+		uint32_t	m_frameCount;
+		uint32_t	m_runCount;
+		uint32_t	m_checkpointCount;
+		uint8_t		m_flags;
+		uint8_t		m_reserved[3];
+	};
+
+	struct movie_run
+	{
+		uint16_t	m_keys;		// key_mask() held for the whole run.
+		uint16_t	m_frames;
+	};
+	static_assert(sizeof(movie_header) == 48 && sizeof(movie_run) == 4, "movie layout must not depend on the compiler");
+
+	// Replays run up to a checkpoint interval of frames as one run_cycles(), so its instructions must fit in 32 bits.
+	constexpr bool fits_batch(uint32_t cycles_per_frame, uint32_t checkpoint_interval)
+	{
+		return uint64_t(cycles_per_frame) * checkpoint_interval <= UINT32_MAX;
+	}
+
+	struct movie
+	{
+		movie_header			m_header = {};
+		std::vector<movie_run>	m_runs;
+		std::vector<uint64_t>	m_checkpoints;
+
+		std::vector<uint8_t> save() const
+		{
+			std::vector<uint8_t> bytes(sizeof(movie_header) + m_runs.size() * sizeof(movie_run) + m_checkpoints.size() * sizeof(uint64_t));
+
+			movie_header header = m_header;
+			header.m_runCount = static_cast<uint32_t>(m_runs.size());
+			header.m_checkpointCount = static_cast<uint32_t>(m_checkpoints.size());
+			memcpy(&bytes[0], &header, sizeof(header));
+
+			size_t const checkpoints_offset = sizeof(movie_header) + m_runs.size() * sizeof(movie_run);
+			if (!m_runs.empty())
+				memcpy(&bytes[sizeof(movie_header)], m_runs.data(), m_runs.size() * sizeof(movie_run));
+			if (!m_checkpoints.empty())
+				memcpy(&bytes[checkpoints_offset], m_checkpoints.data(), m_checkpoints.size() * sizeof(uint64_t));
+			return bytes;
+		}
+
+		// Returns false, leaving the movie untouched, if the bytes aren't a valid movie.
+		bool load(std::span<uint8_t const> bytes)
+		{
+			movie_header header;
+			if (bytes.size() < sizeof(header))
+				return false;
+
+			memcpy(&header, bytes.data(), sizeof(header));
+			if (memcmp(header.m_magic, c_movieMagic, sizeof(c_movieMagic)) != 0 || header.m_version != c_movieVersion
+				|| header.m_cyclesPerFrame == 0 || header.m_checkpointInterval == 0 || !fits_batch(header.m_cyclesPerFrame, header.m_checkpointInterval))
+				return false;
+
+			uint64_t const runs_size = uint64_t(header.m_runCount) * sizeof(movie_run);
+			if (bytes.size() != sizeof(header) + runs_size + uint64_t(header.m_checkpointCount) * sizeof(uint64_t))
+				return false;
+
+			std::vector<movie_run> runs(header.m_runCount);
+			std::vector<uint64_t> checkpoints(header.m_checkpointCount);
+			if (!runs.empty())
+				memcpy(runs.data(), &bytes[sizeof(header)], runs_size);
+			if (!checkpoints.empty())
+				memcpy(checkpoints.data(), &bytes[sizeof(header) + runs_size], checkpoints.size() * sizeof(uint64_t));
+
+			// The recorder never writes an empty run, and players that count frames within a run would never leave one.
+			uint64_t frames = 0;
+			for (movie_run const& r : runs)
+			{
+				if (r.m_frames == 0)
+					return false;
+				frames += r.m_frames;
+			}
+			if (frames != header.m_frameCount || checkpoints.size() != header.m_frameCount / header.m_checkpointInterval)
+				return false;
+
+			m_header = header;
+			m_runs = std::move(runs);
+			m_checkpoints = std::move(checkpoints);
+			return true;
+		}
+	};
+
+	// Runs an interpreter one frame at a time while recording its keys.
+	class movie_recorder
+	{
+	public:
+		// Load the rom into a freshly constructed interpreter and set it up for a reproducible run: the seed and emulated timers.
+		// Returns false if the interpreter has already run, the rom doesn't fit, or a checkpoint interval of frames has more
+		// instructions than a movie can hold (see fits_batch()).
+		template<class Interpreter>
+		bool start(Interpreter& interpreter, std::span<uint8_t const> rom, uint64_t seed, uint32_t cycles_per_frame = c_defaultCyclesPerFrame,
+			uint32_t checkpoint_interval = c_defaultCheckpointInterval)
+		{
+			assert(cycles_per_frame > 0 && checkpoint_interval > 0);
+
+			if (!fits_batch(cycles_per_frame, checkpoint_interval) || interpreter.get_cycles() != 0 || !interpreter.load_rom(rom))
+				return false;
+
+			interpreter.set_seed(seed);
+			interpreter.set_timer_mode(timer_mode::emulated, cycles_per_frame);
+
+			m_movie = {};
+			memcpy(m_movie.m_header.m_magic, c_movieMagic, sizeof(c_movieMagic));
+			m_movie.m_header.m_version = c_movieVersion;
+			m_movie.m_header.m_romHash = rom_hash(rom);
+			m_movie.m_header.m_seed = seed;
+			m_movie.m_header.m_cyclesPerFrame = cycles_per_frame;
+			m_movie.m_header.m_checkpointInterval = checkpoint_interval;
+			m_movie.m_header.m_flags = static_cast<uint8_t>(interpreter.get_flags());
+			return true;
+		}
+
+		// Record the keys and run one frame with them.
+		template<class Interpreter>
+		void run_frame(Interpreter& interpreter, uint8_t const key_buffer[c_maxKeys])
+		{
+			uint16_t const keys = key_mask(key_buffer);
+			if (m_movie.m_runs.empty() || m_movie.m_runs.back().m_keys != keys || m_movie.m_runs.back().m_frames == 0xffff)
+				m_movie.m_runs.push_back({ keys, 0 });
+			m_movie.m_runs.back().m_frames++;
+
+			interpreter.run_frame(key_buffer);
+
+			movie_header& header = m_movie.m_header;
+			if (++header.m_frameCount % header.m_checkpointInterval == 0)
+				m_movie.m_checkpoints.push_back(interpreter.display_hash());
+		}
+
+		movie const& get_movie() const { return m_movie; }
+
+	private:
+		movie m_movie;
+	};
+
+	enum class replay_status : uint8_t
+	{
+		ok,
+		rom_mismatch,		// The rom's hash isn't the recorded one, or it doesn't fit.
+		flags_mismatch,		// The interpreter wasn't built with the recorded flags.
+		not_fresh,			// The interpreter has already run.
+		diverged			// A framebuffer hash differs from the recording.
+	};
+
+	struct replay_result
+	{
+		replay_status	m_status = replay_status::ok;
+		uint32_t		m_frames = 0;					// Frames replayed.
+		uint32_t		m_checkpoints = 0;				// Framebuffer hashes that matched.
+		uint32_t		m_divergedFrame = 0;			// First checkpoint frame that didn't match, with replay_status::diverged.
+	};
+
+	// Replay a movie on a freshly constructed interpreter built with the recorded flags; any dispatch mode, decode cache or jit
+	// setting can be used, which is what makes it useful for finding where a backend goes wrong. Frames holding the same keys
+	// up to the next checkpoint run as one batch. Stops at the first checkpoint that doesn't match.
+	template<class Interpreter>
+	replay_result replay_movie(Interpreter& interpreter, movie const& m, std::span<uint8_t const> rom)
+	{
+		replay_result result;
+		movie_header const& header = m.m_header;
+
+		// Check everything before load_rom, which would otherwise change the interpreter we're rejecting.
+		if (rom_hash(rom) != header.m_romHash)
+			result.m_status = replay_status::rom_mismatch;
+		else if (static_cast<uint8_t>(interpreter.get_flags()) != header.m_flags)
+			result.m_status = replay_status::flags_mismatch;
+		else if (interpreter.get_cycles() != 0)
+			result.m_status = replay_status::not_fresh;
+		else if (!interpreter.load_rom(rom))
+			result.m_status = replay_status::rom_mismatch;
+		if (result.m_status != replay_status::ok)
+			return result;
+
+		interpreter.set_seed(header.m_seed);
+		interpreter.set_timer_mode(timer_mode::emulated, header.m_cyclesPerFrame);
+
+		uint8_t key_buffer[c_maxKeys];
+		for (movie_run const& r : m.m_runs)
+		{
+			for (size_t i = 0; i < c_maxKeys; ++i)
+				key_buffer[i] = (r.m_keys >> i) & 1;
+
+			uint32_t left = r.m_frames;
+			while (left > 0)
+			{
+				// A movie put together in memory rather than loaded may not pass fits_batch(), so its batches are cut to what does.
+				uint32_t const to_checkpoint = header.m_checkpointInterval - result.m_frames % header.m_checkpointInterval;
+				uint32_t const frames = std::min({ left, to_checkpoint, std::max(1u, UINT32_MAX / header.m_cyclesPerFrame) });
+
+				// Every recorded frame ended on a frame boundary, so a batch of them is just their instructions back to back.
+				interpreter.run_cycles(frames * header.m_cyclesPerFrame, key_buffer);
+				result.m_frames += frames;
+				left -= frames;
+
+				if (frames == to_checkpoint)
+				{
+					if (interpreter.display_hash() != m.m_checkpoints[result.m_checkpoints])
+					{
+						result.m_status = replay_status::diverged;
+						result.m_divergedFrame = result.m_frames;
+						return result;
+					}
+					result.m_checkpoints++;
+				}
+			}
+		}
+		return result;
+	}
+}
@@ -0,0 +1,191 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32")
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/*
+* The few blocking TCP socket calls the remote tools need (the gdb stub, the farm driver), over BSD sockets or Winsock.
+* Keep a net::startup alive while using any of them.
+*/
+namespace tiny8
+{
+	namespace net
+	{
+#if defined(_WIN32)
+		using socket_handle = SOCKET;
+		constexpr socket_handle c_invalidSocket = INVALID_SOCKET;
+		inline void close_socket(socket_handle s) { closesocket(s); }
+
+		// Returns > 0 if the socket is readable (or has a connection to accept), 0 on timeout.
+		inline int poll_socket(socket_handle s, int timeout_ms)
+		{
+			WSAPOLLFD fd = { s, POLLRDNORM, 0 };
+			return WSAPoll(&fd, 1, timeout_ms);
+		}
+
+		struct startup
+		{
+			startup()
+			{
+				WSADATA data;
+				WSAStartup(MAKEWORD(2, 2), &data);
+			}
+			~startup() { WSACleanup(); }
+		};
+#else
+		using socket_handle = int;
+		constexpr socket_handle c_invalidSocket = -1;
+		inline void close_socket(socket_handle s) { close(s); }
+
+		// Returns > 0 if the socket is readable (or has a connection to accept), 0 on timeout.
+		inline int poll_socket(socket_handle s, int timeout_ms)
+		{
+			pollfd fd = { s, POLLIN, 0 };
+			return poll(&fd, 1, timeout_ms);
+		}
+
+		// Nothing to set up, but user-provided so a local startup isn't reported as unused, as the Win32 one isn't.
+		struct startup
+		{
+			startup() {}
+			~startup() {}
+		};
+#endif
+
+		// Listen on a port, on loopback only or on every interface. Port 0 picks a free one, see local_port().
+		inline socket_handle listen_tcp(uint16_t port, bool loopback_only)
+		{
+			socket_handle const s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (s == c_invalidSocket)
+				return c_invalidSocket;
+
+			int const reuse = 1;
+			setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char const*>(&reuse), sizeof(reuse));
+
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(port);
+			address.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+			if (bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(s, SOMAXCONN) != 0)
+			{
+				close_socket(s);
+				return c_invalidSocket;
+			}
+			return s;
+		}
+
+		inline uint16_t local_port(socket_handle s)
+		{
+			sockaddr_in address = {};
+			socklen_t size = sizeof(address);
+			if (getsockname(s, reinterpret_cast<sockaddr*>(&address), &size) != 0)
+				return 0;
+			return ntohs(address.sin_port);
+		}
+
+		inline socket_handle connect_tcp(char const* host, uint16_t port)
+		{
+			addrinfo hints = {};
+			hints.ai_family = AF_INET;
+			hints.ai_socktype = SOCK_STREAM;
+			addrinfo* found = nullptr;
+			if (getaddrinfo(host, nullptr, &hints, &found) != 0 || found == nullptr)
+				return c_invalidSocket;
+
+			sockaddr_in address;
+			memcpy(&address, found->ai_addr, sizeof(address));
+			address.sin_port = htons(port);
+			freeaddrinfo(found);
+
+			socket_handle const s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (s != c_invalidSocket && connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+			{
+				close_socket(s);
+				return c_invalidSocket;
+			}
+			return s;
+		}
+
+		// One send() that fails instead of raising SIGPIPE when the peer has gone, which would end the whole process. Returns the
+		// bytes sent, <= 0 on failure.
+		inline int send_bytes(socket_handle s, void const* data, size_t size)
+		{
+#if defined(_WIN32)
+			return send(s, static_cast<char const*>(data), static_cast<int>(size), 0);
+#elif defined(MSG_NOSIGNAL)
+			return static_cast<int>(send(s, data, size, MSG_NOSIGNAL));
+#else
+#if defined(SO_NOSIGPIPE)
+			int const on = 1;
+			setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+			return static_cast<int>(send(s, data, size, 0));
+#endif
+		}
+
+		// Send or receive exactly size bytes. Returns false if the connection closed or failed first.
+		inline bool send_all(socket_handle s, void const* data, size_t size)
+		{
+			for (char const* bytes = static_cast<char const*>(data); size > 0; )
+			{
+				int const sent = send_bytes(s, bytes, size);
+				if (sent <= 0)
+					return false;
+				bytes += sent;
+				size -= static_cast<size_t>(sent);
+			}
+			return true;
+		}
+
+		inline bool receive_all(socket_handle s, void* data, size_t size)
+		{
+			for (char* bytes = static_cast<char*>(data); size > 0; )
+			{
+				int const received = static_cast<int>(recv(s, bytes, static_cast<int>(size), 0));
+				if (received <= 0)
+					return false;
+				bytes += received;
+				size -= static_cast<size_t>(received);
+			}
+			return true;
+		}
+	}
+}
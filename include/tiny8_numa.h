@@ -0,0 +1,117 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+* NUMA topology and thread pinning, for keeping instances on the memory node of the cores that run them.
+*
+* Memory is placed on the node of the thread that first touches it, so pinning a thread to a core and having it construct the
+* instances it runs keeps them local (see basic_batch). Topology comes from /sys on Linux; everywhere else, and on Linux without
+* NUMA, every cpu is on one node and nothing needs pinning.
+*/
+namespace tiny8
+{
+	namespace numa_detail
+	{
+		// Parse a cpu list such as "0-3,8-11" into cpus.
+		inline void parse_cpu_list(char const* text, std::vector<uint32_t>& cpus)
+		{
+			while (*text >= '0' && *text <= '9')
+			{
+				char* end;
+				uint32_t const first = static_cast<uint32_t>(strtoul(text, &end, 10));
+				uint32_t last = first;
+				if (*end == '-')
+					last = static_cast<uint32_t>(strtoul(end + 1, &end, 10));
+				for (uint32_t cpu = first; cpu <= last; ++cpu)
+					cpus.push_back(cpu);
+				text = *end == ',' ? end + 1 : end;
+			}
+		}
+	}
+
+	// The cpus of every node that has some, in node order.
+	inline std::vector<std::vector<uint32_t>> numa_nodes()
+	{
+		std::vector<std::vector<uint32_t>> nodes;
+#if defined(__linux__)
+		std::vector<uint32_t> online;
+		char text[4096];
+		if (FILE* const file = fopen("/sys/devices/system/node/online", "r"))
+		{
+			if (fgets(text, sizeof(text), file) != nullptr)
+				numa_detail::parse_cpu_list(text, online);		// Same format as a cpu list.
+			fclose(file);
+		}
+
+		for (uint32_t const node : online)
+		{
+			char path[64];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+			std::vector<uint32_t> cpus;
+			if (FILE* const file = fopen(path, "r"))
+			{
+				if (fgets(text, sizeof(text), file) != nullptr)
+					numa_detail::parse_cpu_list(text, cpus);
+				fclose(file);
+			}
+			if (!cpus.empty())
+				nodes.push_back(std::move(cpus));
+		}
+#endif
+		if (nodes.empty())
+		{
+			nodes.emplace_back();
+			for (uint32_t cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+				nodes.back().push_back(cpu);
+		}
+		return nodes;
+	}
+
+	// Run the calling thread on one cpu only. False where that isn't supported.
+	inline bool pin_current_thread(uint32_t cpu)
+	{
+#if defined(__linux__)
+		if (cpu >= CPU_SETSIZE)
+			return false;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpu;
+		return false;
+#endif
+	}
+}
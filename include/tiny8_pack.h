@@ -0,0 +1,351 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+#include "tiny8_rom.h"
+
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+* Rom packs: many roms in a single file, opened with one mapping and looked up by name or content hash in O(1).
+*
+* Layout, all fields little endian:
+*   header		magic "T8PK", version, rom count, bucket count and the offsets of the sections below
+*   entries		one pack_entry per rom: content hash, data and name location, preferred and free flags, cycles per frame
+*   buckets		two open addressing tables (by name hash, then by content hash) of entry index + 1, 0 meaning empty
+*   names		rom names, each followed by a zero
+*   data		the rom images, back to back
+*/
+namespace tiny8
+{
+	static_assert(std::endian::native == std::endian::little, "rom packs are read in place and stored little endian");
+
+	// FNV-1a, used for both names and rom contents.
+	constexpr uint64_t fnv1a(std::span<uint8_t const> bytes, uint64_t hash = 0xcbf29ce484222325ull)
+	{
+		for (uint8_t const b : bytes)
+			hash = (hash ^ b) * 0x100000001b3ull;
+		return hash;
+	}
+
+	inline uint64_t rom_hash(std::span<uint8_t const> rom) { return fnv1a(rom); }
+	inline uint64_t name_hash(std::string_view name) { return fnv1a({ reinterpret_cast<uint8_t const*>(name.data()), name.size() }); }
+
+	constexpr char		c_packMagic[4] = { 'T', '8', 'P', 'K' };
+	constexpr uint32_t	c_packVersion = 1;
+
+	struct pack_header
+	{
+		char		m_magic[4];
+		uint32_t	m_version;
+		uint32_t	m_romCount;
+		uint32_t	m_bucketCount;		// Power of two, at least twice the rom count.
+		uint32_t	m_entriesOffset;
+		uint32_t	m_nameBucketsOffset;
+		uint32_t	m_hashBucketsOffset;
+		uint32_t	m_size;				// Total size of the pack in bytes.
+	};
+
+	struct pack_entry
+	{
+		uint64_t	m_hash;				// rom_hash() of the data.
+		uint32_t	m_dataOffset;
+		uint32_t	m_dataSize;
+		uint32_t	m_nameOffset;
+		uint32_t	m_nameSize;			// Not counting the terminating zero.
+		uint32_t	m_cyclesPerFrame;	// 0 when the rom has no preference.
+		uint8_t		m_flags;			// Preferred behaviour flags.
+		uint8_t		m_freeFlags;		// Legacy flags the rom runs the same with either way (see tiny8_coverage.h), 0 if unknown.
+		uint8_t		m_reserved[2];
+	};
+	static_assert(sizeof(pack_header) == 32 && sizeof(pack_entry) == 32, "pack layout must not depend on the compiler");
+
+	// A rom found in a pack. The spans point into the pack and stay valid while it is open.
+	struct pack_rom
+	{
+		std::string_view			m_name;
+		std::span<uint8_t const>	m_data;
+		uint64_t					m_hash = 0;
+		flags						m_flags = flags::none;
+		flags						m_freeFlags = flags::none;
+		uint32_t					m_cyclesPerFrame = 0;
+	};
+
+	// Builds a pack in memory; write the bytes out with any file API.
+	class pack_builder
+	{
+	public:
+		// Returns false for roms that don't fit in XO-CHIP memory or names already in the pack. free_flags are the legacy flags the rom
+		// doesn't depend on, as found by check_quirks().
+		bool add(std::string_view name, std::span<uint8_t const> rom, flags preferred_flags = flags::none, uint32_t cycles_per_frame = 0, flags free_flags = flags::none)
+		{
+			if (rom.size() > c_maxExtendedRomSize)
+				return false;
+
+			for (auto const& r : m_roms)
+			{
+				if (r.m_name == name)
+					return false;
+			}
+
+			m_roms.push_back({ std::string(name), std::vector<uint8_t>(rom.begin(), rom.end()), preferred_flags, free_flags, cycles_per_frame });
+			return true;
+		}
+
+		size_t size() const { return m_roms.size(); }
+
+		std::vector<uint8_t> build() const
+		{
+			uint32_t const count = static_cast<uint32_t>(m_roms.size());
+			uint32_t buckets = 2;
+			while (buckets < 2 * count)
+				buckets *= 2;
+
+			pack_header header = {};
+			memcpy(header.m_magic, c_packMagic, sizeof(c_packMagic));
+			header.m_version = c_packVersion;
+			header.m_romCount = count;
+			header.m_bucketCount = buckets;
+			header.m_entriesOffset = sizeof(pack_header);
+			header.m_nameBucketsOffset = header.m_entriesOffset + count * sizeof(pack_entry);
+			header.m_hashBucketsOffset = header.m_nameBucketsOffset + buckets * sizeof(uint32_t);
+
+			uint32_t const names_offset = header.m_hashBucketsOffset + buckets * sizeof(uint32_t);
+			uint32_t data_offset = names_offset;
+			for (auto const& r : m_roms)
+				data_offset += static_cast<uint32_t>(r.m_name.size() + 1);
+
+			std::vector<pack_entry> entries(count);
+			std::vector<uint32_t> name_buckets(buckets, 0);
+			std::vector<uint32_t> hash_buckets(buckets, 0);
+
+			uint32_t name_cursor = names_offset;
+			uint32_t data_cursor = data_offset;
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				auto const& r = m_roms[i];
+
+				pack_entry& e = entries[i];
+				e = {};
+				e.m_hash = rom_hash(r.m_data);
+				e.m_nameOffset = name_cursor;
+				e.m_nameSize = static_cast<uint32_t>(r.m_name.size());
+				e.m_dataOffset = data_cursor;
+				e.m_dataSize = static_cast<uint32_t>(r.m_data.size());
+				e.m_cyclesPerFrame = r.m_cyclesPerFrame;
+				e.m_flags = static_cast<uint8_t>(r.m_flags);
+				e.m_freeFlags = static_cast<uint8_t>(r.m_freeFlags & flags::all_legacy);
+
+				name_cursor += e.m_nameSize + 1;
+				data_cursor += e.m_dataSize;
+
+				insert(name_buckets, name_hash(r.m_name), i);
+				insert(hash_buckets, e.m_hash, i);
+			}
+			header.m_size = data_cursor;
+
+			std::vector<uint8_t> pack(header.m_size);
+			memcpy(&pack[0], &header, sizeof(header));
+			memcpy(&pack[header.m_entriesOffset], entries.data(), count * sizeof(pack_entry));
+			memcpy(&pack[header.m_nameBucketsOffset], name_buckets.data(), buckets * sizeof(uint32_t));
+			memcpy(&pack[header.m_hashBucketsOffset], hash_buckets.data(), buckets * sizeof(uint32_t));
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				memcpy(&pack[entries[i].m_nameOffset], m_roms[i].m_name.data(), entries[i].m_nameSize);
+				if (entries[i].m_dataSize > 0)
+					memcpy(&pack[entries[i].m_dataOffset], m_roms[i].m_data.data(), entries[i].m_dataSize);
+			}
+			return pack;
+		}
+
+	private:
+		struct rom
+		{
+			std::string				m_name;
+			std::vector<uint8_t>	m_data;
+			flags					m_flags;
+			flags					m_freeFlags;
+			uint32_t				m_cyclesPerFrame;
+		};
+
+		std::vector<rom> m_roms;
+
+		static void insert(std::vector<uint32_t>& buckets, uint64_t hash, uint32_t index)
+		{
+			size_t const mask = buckets.size() - 1;
+			size_t slot = hash & mask;
+			while (buckets[slot] != 0)
+				slot = (slot + 1) & mask;
+			buckets[slot] = index + 1;
+		}
+	};
+
+	// Read-only view of a pack, either over bytes already in memory or over its own mapping of a file.
+	class rom_pack
+	{
+	public:
+		rom_pack() = default;
+
+		// Open a pack file. Returns false if it can't be mapped or isn't a valid pack.
+		bool open(char const* path)
+		{
+			m_file.close();
+			m_bytes = {};
+			if (!m_file.open(path))
+				return false;
+			return open(m_file.bytes());
+		}
+
+		// Use a pack already in memory; the bytes must outlive the rom_pack.
+		bool open(std::span<uint8_t const> bytes)
+		{
+			m_bytes = {};
+			if (!validate(bytes))
+				return false;
+
+			m_bytes = bytes;
+			memcpy(&m_header, bytes.data(), sizeof(m_header));
+			return true;
+		}
+
+		bool is_open() const { return !m_bytes.empty(); }
+		size_t size() const { return is_open() ? m_header.m_romCount : 0; }
+
+		pack_rom at(size_t index) const
+		{
+			assert(index < size());
+			return to_rom(entry(static_cast<uint32_t>(index)));
+		}
+
+		// Look up a rom by name or by the hash of its contents. Returns false if the pack doesn't hold it.
+		bool find(std::string_view name, pack_rom& out) const
+		{
+			return lookup(m_header.m_nameBucketsOffset, name_hash(name), [&](pack_entry const& e) { return name_of(e) == name; }, out);
+		}
+
+		bool find(uint64_t hash, pack_rom& out) const
+		{
+			return lookup(m_header.m_hashBucketsOffset, hash, [&](pack_entry const& e) { return e.m_hash == hash; }, out);
+		}
+
+	private:
+		mapped_file					m_file;
+		std::span<uint8_t const>	m_bytes;
+		pack_header					m_header = {};
+
+		static bool validate(std::span<uint8_t const> bytes)
+		{
+			pack_header header;
+			if (bytes.size() < sizeof(header))
+				return false;
+
+			memcpy(&header, bytes.data(), sizeof(header));
+			if (memcmp(header.m_magic, c_packMagic, sizeof(c_packMagic)) != 0 || header.m_version != c_packVersion || header.m_size != bytes.size())
+				return false;
+
+			uint64_t const buckets = header.m_bucketCount;
+			if (buckets == 0 || (buckets & (buckets - 1)) != 0 || buckets < 2ull * header.m_romCount)
+				return false;
+
+			if (uint64_t(header.m_entriesOffset) + uint64_t(header.m_romCount) * sizeof(pack_entry) > bytes.size()
+				|| uint64_t(header.m_nameBucketsOffset) + buckets * sizeof(uint32_t) > bytes.size()
+				|| uint64_t(header.m_hashBucketsOffset) + buckets * sizeof(uint32_t) > bytes.size())
+				return false;
+
+			for (uint32_t i = 0; i < header.m_romCount; ++i)
+			{
+				pack_entry e;
+				memcpy(&e, &bytes[header.m_entriesOffset + i * sizeof(pack_entry)], sizeof(e));
+				if (uint64_t(e.m_dataOffset) + e.m_dataSize > bytes.size() || e.m_dataSize > c_maxExtendedRomSize
+					|| uint64_t(e.m_nameOffset) + e.m_nameSize >= bytes.size())
+					return false;
+			}
+
+			// No more used buckets than roms, so the tables are at most half full and lookups always reach an empty bucket.
+			for (uint32_t const offset : { header.m_nameBucketsOffset, header.m_hashBucketsOffset })
+			{
+				uint64_t used = 0;
+				for (uint64_t i = 0; i < buckets; ++i)
+				{
+					uint32_t index;
+					memcpy(&index, &bytes[offset + i * sizeof(uint32_t)], sizeof(index));
+					if (index > header.m_romCount)
+						return false;
+					used += index != 0;
+				}
+				if (used > header.m_romCount)
+					return false;
+			}
+			return true;
+		}
+
+		pack_entry entry(uint32_t index) const
+		{
+			pack_entry e;
+			memcpy(&e, &m_bytes[m_header.m_entriesOffset + index * sizeof(pack_entry)], sizeof(e));
+			return e;
+		}
+
+		std::string_view name_of(pack_entry const& e) const { return { reinterpret_cast<char const*>(&m_bytes[e.m_nameOffset]), e.m_nameSize }; }
+
+		pack_rom to_rom(pack_entry const& e) const
+		{
+			pack_rom rom;
+			rom.m_name = name_of(e);
+			rom.m_data = m_bytes.subspan(e.m_dataOffset, e.m_dataSize);
+			rom.m_hash = e.m_hash;
+			rom.m_flags = static_cast<flags>(e.m_flags);
+			rom.m_freeFlags = static_cast<flags>(e.m_freeFlags);
+			rom.m_cyclesPerFrame = e.m_cyclesPerFrame;
+			return rom;
+		}
+
+		// Linear probing from the hash's home slot; validate() made sure the tables are at most half full, so an empty slot is always
+		// reached.
+		template<class Match>
+		bool lookup(uint32_t buckets_offset, uint64_t hash, Match&& match, pack_rom& out) const
+		{
+			if (!is_open())
+				return false;
+
+			uint32_t const mask = m_header.m_bucketCount - 1;
+			for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask)
+			{
+				uint32_t index;
+				memcpy(&index, &m_bytes[buckets_offset + slot * sizeof(uint32_t)], sizeof(index));
+				if (index == 0)
+					return false;
+
+				pack_entry const e = entry(index - 1);
+				if (match(e))
+				{
+					out = to_rom(e);
+					return true;
+				}
+			}
+		}
+	};
+}
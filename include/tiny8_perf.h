@@ -0,0 +1,163 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+* Hardware performance counters around a stretch of code, for telling why a backend is slow rather than only that it is.
+*
+* A perf_counters opens the cycle, instruction, branch miss and L1 data cache read miss counters of the calling thread (user
+* space only) through Linux perf_event. Each event is opened on its own, so whichever the CPU, the hypervisor or
+* /proc/sys/kernel/perf_event_paranoid refuse are simply unavailable, and everywhere but Linux they all are. When the kernel
+* multiplexes more events than the PMU has counters, values are scaled up by the fraction of time they were counting.
+*/
+namespace tiny8
+{
+	enum class perf_event : uint8_t
+	{
+		cycles,
+		instructions,
+		branch_misses,
+		l1d_misses,		// L1 data cache read misses.
+		count
+	};
+
+	constexpr char const* c_perfEventNames[] = { "cycles", "instructions", "branch-misses", "L1d-misses" };
+	static_assert(std::size(c_perfEventNames) == static_cast<size_t>(perf_event::count));
+
+	struct perf_sample
+	{
+		uint64_t	m_values[static_cast<size_t>(perf_event::count)] = {};
+		bool		m_valid[static_cast<size_t>(perf_event::count)] = {};	// Counted, see perf_counters::available().
+
+		bool valid(perf_event e) const { return m_valid[static_cast<size_t>(e)]; }
+		uint64_t operator[](perf_event e) const { return m_values[static_cast<size_t>(e)]; }
+	};
+
+	class perf_counters
+	{
+	public:
+		perf_counters()
+		{
+#if defined(__linux__)
+			constexpr uint64_t c_l1dReadMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			constexpr struct { uint32_t m_type; uint64_t m_config; } c_events[] =
+			{
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+				{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+				{ PERF_TYPE_HW_CACHE, c_l1dReadMiss },
+			};
+			static_assert(std::size(c_events) == static_cast<size_t>(perf_event::count));
+
+			for (size_t i = 0; i < std::size(c_events); ++i)
+			{
+				perf_event_attr attr = {};
+				attr.size = sizeof(attr);
+				attr.type = c_events[i].m_type;
+				attr.config = c_events[i].m_config;
+				attr.disabled = 1;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+				m_fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+			}
+#endif
+		}
+
+		~perf_counters()
+		{
+#if defined(__linux__)
+			for (int const fd : m_fds)
+			{
+				if (fd >= 0)
+					close(fd);
+			}
+#endif
+		}
+
+		perf_counters(perf_counters const&) = delete;
+		perf_counters& operator=(perf_counters const&) = delete;
+
+		bool available(perf_event e) const { return m_fds[static_cast<size_t>(e)] >= 0; }
+
+		bool any_available() const
+		{
+			for (int const fd : m_fds)
+			{
+				if (fd >= 0)
+					return true;
+			}
+			return false;
+		}
+
+		// Zero the counters and start counting.
+		void start()
+		{
+#if defined(__linux__)
+			for (int const fd : m_fds)
+			{
+				if (fd < 0)
+					continue;
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+		}
+
+		// Stop counting and read what was counted since start().
+		perf_sample stop()
+		{
+			perf_sample sample;
+#if defined(__linux__)
+			for (int const fd : m_fds)
+			{
+				if (fd >= 0)
+					ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			}
+
+			for (size_t i = 0; i < std::size(m_fds); ++i)
+			{
+				uint64_t values[3];		// Value, time enabled, time running.
+				if (m_fds[i] < 0 || read(m_fds[i], values, sizeof(values)) != sizeof(values) || values[2] == 0)
+					continue;
+
+				sample.m_values[i] = values[2] < values[1] ? static_cast<uint64_t>(double(values[0]) * values[1] / values[2]) : values[0];
+				sample.m_valid[i] = true;
+			}
+#endif
+			return sample;
+		}
+
+	private:
+		int		m_fds[static_cast<size_t>(perf_event::count)] = { -1, -1, -1, -1 };
+	};
+}
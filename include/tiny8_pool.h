@@ -0,0 +1,218 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <memory>
+#include <new>
+#include <tuple>
+#include <vector>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/*
+* A fixed set of interpreters for many short runs (fuzzing, search), recycled instead of constructed and destroyed.
+*
+* Interpreters live in one contiguous arena, backed by huge pages where the system allows it (transparent huge pages on
+* Linux, large pages on Windows when the process holds the privilege), so instances next to each other share TLB entries.
+* The arena comes from the system already zeroed, so each instance is constructed with zeroed_storage the first time it's
+* handed out: a pool costs a mapping up front, and the pages of instances that are never used are never touched.
+* Pages land on the NUMA node of the thread that first touches them, so on a multi-node system keep a pool per node and acquire
+* from a thread pinned to it (see tiny8_numa.h).
+* acquire() hands out a free instance restarted in place with interpreter::reset(), which re-zeroes only the memory the
+* previous run wrote when TINY8_WRITE_TRACKING is compiled in; release() returns it. Once every flags combination in use
+* has been seen by some instance, neither ever touches the heap.
+* A pool is not thread safe: acquire and release from one thread, and run the instances from any.
+*/
+namespace tiny8
+{
+	template<class Interpreter>
+	class basic_instance_pool
+	{
+	public:
+		// Map an arena for capacity interpreters, each constructed with args on first acquire. If the arena can't be mapped the pool
+		// is left empty.
+		template<class... Args>
+		explicit basic_instance_pool(size_t capacity, Args const&... args)
+		{
+			assert(capacity > 0 && capacity <= 0xffffffff);
+
+			m_instances = allocate_arena(capacity * sizeof(Interpreter));
+			if (m_instances == nullptr)
+				return;
+
+			m_capacity = capacity;
+			m_constructor = std::make_unique<constructor<Args...>>(args...);
+			m_free.reserve(capacity);
+		}
+
+		~basic_instance_pool()
+		{
+			for (size_t i = 0; i < m_constructed; ++i)
+				m_instances[i].~Interpreter();
+
+			if (m_arena == nullptr)
+				return;
+
+#if defined(_WIN32)
+			VirtualFree(m_arena, 0, MEM_RELEASE);
+#else
+			munmap(m_arena, m_arenaBytes);
+#endif
+		}
+
+		basic_instance_pool(basic_instance_pool const&) = delete;
+		basic_instance_pool& operator=(basic_instance_pool const&) = delete;
+
+		// A free instance restarted with the rom, nullptr if every instance is in use or the rom doesn't fit.
+		Interpreter* acquire(std::span<uint8_t const> rom)
+		{
+			if (m_free.empty() && !construct_next())
+				return nullptr;
+
+			Interpreter& instance = m_instances[m_free.back()];
+			if (!instance.reset(rom))
+				return nullptr;
+
+			m_free.pop_back();
+			return &instance;
+		}
+
+		// Same as above, switching the instance to other behaviour flags.
+		Interpreter* acquire(std::span<uint8_t const> rom, flags behaviour_flags) requires (!Interpreter::c_staticFlags)
+		{
+			if (m_free.empty() && !construct_next())
+				return nullptr;
+
+			Interpreter& instance = m_instances[m_free.back()];
+			if (!instance.reset(rom, behaviour_flags))
+				return nullptr;
+
+			m_free.pop_back();
+			return &instance;
+		}
+
+		// Hand an instance back. Its state is left as is until it's acquired again.
+		void release(Interpreter* instance)
+		{
+			assert(instance >= m_instances && instance < m_instances + m_constructed && m_free.size() < m_constructed);
+			m_free.push_back(static_cast<uint32_t>(instance - m_instances));
+		}
+
+		size_t capacity() const { return m_capacity; }
+		size_t available() const { return m_free.size() + m_capacity - m_constructed; }
+
+		// Instances constructed so far, the rest of the arena hasn't been touched.
+		size_t constructed() const { return m_constructed; }
+
+		// True when the arena got huge (or large) pages.
+		bool has_huge_pages() const { return m_hugePages; }
+
+	private:
+		static constexpr size_t c_hugePageSize = 2 * 1024 * 1024;
+
+		void*					m_arena = nullptr;		// The whole mapping, m_instances may start further in.
+		size_t					m_arenaBytes = 0;
+		bool					m_hugePages = false;
+		// Constructs an instance in place with the arguments the pool was given.
+		struct constructor_base
+		{
+			virtual ~constructor_base() = default;
+			virtual void construct(Interpreter* where) const = 0;
+		};
+
+		template<class... Args>
+		struct constructor final : constructor_base
+		{
+			std::tuple<Args...> m_args;
+
+			explicit constructor(Args const&... args) : m_args(args...) {}
+
+			void construct(Interpreter* where) const override
+			{
+				std::apply([where](Args const&... args) { new (where) Interpreter(zeroed_storage, args...); }, m_args);
+			}
+		};
+
+		Interpreter*						m_instances = nullptr;
+		size_t								m_capacity = 0;
+		size_t								m_constructed = 0;		// Instances below this index exist, in use or free.
+		std::unique_ptr<constructor_base>	m_constructor;
+		std::vector<uint32_t>				m_free;		// Indices of the constructed instances not in use.
+
+		// Construct the next untouched instance onto the free list. The free list only runs dry once every constructed instance
+		// is in use, so instances are constructed in order and the first ones go first.
+		bool construct_next()
+		{
+			if (m_constructed == m_capacity)
+				return false;
+
+			m_constructor->construct(&m_instances[m_constructed]);
+			m_free.push_back(static_cast<uint32_t>(m_constructed++));
+			return true;
+		}
+
+		// Map the arena and return where the instances start, nullptr on failure. Huge pages only back whole aligned 2MB ranges, so
+		// on Linux the mapping is padded by one and the instances start at the first boundary in it.
+		Interpreter* allocate_arena(size_t bytes)
+		{
+#if defined(_WIN32)
+			size_t const large = GetLargePageMinimum();
+			if (large > 0)
+			{
+				m_arenaBytes = (bytes + large - 1) / large * large;
+				m_arena = VirtualAlloc(nullptr, m_arenaBytes, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+				m_hugePages = m_arena != nullptr;
+			}
+			if (m_arena == nullptr)
+			{
+				m_arenaBytes = bytes;
+				m_arena = VirtualAlloc(nullptr, m_arenaBytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			}
+			return static_cast<Interpreter*>(m_arena);
+#else
+			m_arenaBytes = (bytes + c_hugePageSize - 1) / c_hugePageSize * c_hugePageSize + c_hugePageSize;
+			void* const arena = mmap(nullptr, m_arenaBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (arena == MAP_FAILED)
+				return nullptr;
+
+			m_arena = arena;
+			uintptr_t const start = (reinterpret_cast<uintptr_t>(arena) + c_hugePageSize - 1) & ~uintptr_t(c_hugePageSize - 1);
+#if defined(MADV_HUGEPAGE)
+			m_hugePages = madvise(reinterpret_cast<void*>(start), m_arenaBytes - c_hugePageSize, MADV_HUGEPAGE) == 0;
+#endif
+			return reinterpret_cast<Interpreter*>(start);
+#endif
+		}
+	};
+
+	// A pool of interpreters with behaviour flags chosen at acquire() time.
+	using instance_pool = basic_instance_pool<interpreter>;
+}
@@ -0,0 +1,297 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <vector>
+
+/*
+* Rewind history for a tiny8 interpreter.
+*
+* Record the machine state once per frame and step back through it later. Every keyframe_interval frames a keyframe is taken,
+* every other frame is stored as the XOR against the latest keyframe with the runs of zeroes removed. Memory and display barely
+* change from frame to frame, so most frames take a few dozen bytes instead of a full machine_state.
+* All storage is allocated up front: once the byte budget is used up, the oldest keyframe and its deltas are dropped.
+*/
+namespace tiny8
+{
+	class rewind_buffer
+	{
+	public:
+		rewind_buffer(size_t capacity_bytes, uint32_t keyframe_interval = 60, size_t max_frames = 60 * 60 * 10)
+			: m_storage(capacity_bytes), m_entries(max_frames), m_scratch(c_maxEncodedSize), m_keyframeInterval(keyframe_interval)
+		{
+			assert(keyframe_interval > 0 && max_frames > 0);
+			memset(static_cast<void*>(&m_keyframe), 0, sizeof(m_keyframe));
+		}
+
+		// Record the current state of an interpreter, typically once per frame.
+		template<class Interpreter>
+		bool record(Interpreter const& interpreter)
+		{
+			// Cleared first so padding bytes are always zero and never show up in the deltas.
+			machine_state state;
+			memset(static_cast<void*>(&state), 0, sizeof(state));
+			interpreter.save_state(state);
+			return push(state);
+		}
+
+		// Append a state to the history. Returns false if a single frame doesn't fit in the buffer at all.
+		bool push(machine_state const& state)
+		{
+			bool keyframe = m_count == 0 || m_sinceKeyframe + 1 >= m_keyframeInterval;
+
+			// Keyframes are encoded against an all-zero state, which still strips the (mostly empty) memory, stack and display.
+			size_t size = encode(keyframe ? c_zero : as_bytes(m_keyframe), state);
+			if (!reserve(size))
+				return false;
+
+			// Making room may have evicted the keyframe this delta was encoded against.
+			if (!keyframe && m_count == 0)
+			{
+				keyframe = true;
+				size = encode(c_zero, state);
+				if (!reserve(size))
+					return false;
+			}
+
+			entry& e = m_entries[(m_first + m_count) % m_entries.size()];
+			e.m_offset = m_writeOffset;
+			e.m_size = static_cast<uint32_t>(size);
+			e.m_keyframe = keyframe;
+			memcpy(&m_storage[e.m_offset], m_scratch.data(), size);
+			m_writeOffset += size;
+			m_count++;
+
+			if (keyframe)
+			{
+				m_keyframe = state;
+				m_sinceKeyframe = 0;
+			}
+			else
+				m_sinceKeyframe++;
+
+			return true;
+		}
+
+		// Step back a number of frames from the most recent recording (0 restores the most recent one) and drop everything newer,
+		// so recording resumes from the restored frame. Going back further than the history reaches restores the oldest frame.
+		bool rewind(size_t frames, machine_state& out)
+		{
+			if (m_count == 0)
+				return false;
+
+			size_t const target = frames >= m_count ? 0 : m_count - 1 - frames;
+
+			// Find the keyframe the target frame was encoded against.
+			size_t key = target;
+			while (!at(key).m_keyframe)
+				key--;
+
+			decode(c_zero, at(key), m_keyframe);
+			if (key == target)
+				out = m_keyframe;
+			else
+				decode(as_bytes(m_keyframe), at(target), out);
+
+			m_count = target + 1;
+			m_sinceKeyframe = static_cast<uint32_t>(target - key);
+			m_writeOffset = at(target).m_offset + at(target).m_size;
+			return true;
+		}
+
+		template<class Interpreter>
+		bool rewind(Interpreter& interpreter, size_t frames = 1)
+		{
+			machine_state state;
+			if (!rewind(frames, state))
+				return false;
+
+			interpreter.load_state(state);
+			return true;
+		}
+
+		// Number of frames that can be rewound to.
+		size_t size() const { return m_count; }
+
+		// Bytes currently used by the recorded frames.
+		size_t used_bytes() const
+		{
+			if (m_count == 0)
+				return 0;
+
+			size_t const head = at(0).m_offset;
+			return m_writeOffset > head ? m_writeOffset - head : m_storage.size() - head + m_writeOffset;
+		}
+
+		void clear()
+		{
+			m_first = 0;
+			m_count = 0;
+			m_writeOffset = 0;
+			m_sinceKeyframe = 0;
+		}
+
+	private:
+		struct entry
+		{
+			size_t		m_offset;
+			uint32_t	m_size;
+			bool		m_keyframe;
+		};
+
+		// Worst case encoding: every run of bytes is a literal run with a 4 byte header.
+		static constexpr size_t c_stateSize = sizeof(machine_state);
+		static constexpr size_t c_maxEncodedSize = 2 * c_stateSize + 8;
+		static_assert(c_stateSize <= 0xffff, "run lengths are stored as 16 bit values");
+
+		std::vector<uint8_t>	m_storage;			// Byte ring holding the encoded frames.
+		std::vector<entry>		m_entries;			// Ring of frame entries, oldest at m_first.
+		std::vector<uint8_t>	m_scratch;
+		size_t					m_first = 0;
+		size_t					m_count = 0;
+		size_t					m_writeOffset = 0;	// Where the next frame goes in m_storage.
+		uint32_t				m_keyframeInterval;
+		uint32_t				m_sinceKeyframe = 0;
+		machine_state			m_keyframe;			// Latest keyframe, decoded.
+
+		alignas(machine_state) static inline uint8_t const c_zero[c_stateSize] = {};
+
+		static uint8_t const* as_bytes(machine_state const& state) { return reinterpret_cast<uint8_t const*>(&state); }
+
+		entry const& at(size_t index) const { return m_entries[(m_first + index) % m_entries.size()]; }
+
+		// Make room for a frame of the given size at the write offset, evicting the oldest keyframe groups as needed.
+		bool reserve(size_t size)
+		{
+			if (size > m_storage.size())
+				return false;
+
+			for (;;)
+			{
+				if (m_count == m_entries.size())
+				{
+					evict_oldest_group();
+					continue;
+				}
+
+				if (m_count == 0)
+				{
+					m_first = 0;
+					m_writeOffset = 0;
+					return true;
+				}
+
+				// The live frames span [head, m_writeOffset), possibly wrapping around the end of the storage.
+				size_t const head = at(0).m_offset;
+				if (m_writeOffset > head)
+				{
+					if (m_writeOffset + size <= m_storage.size())
+						return true;
+
+					if (size <= head)
+					{
+						m_writeOffset = 0;
+						return true;
+					}
+				}
+				else if (m_writeOffset + size <= head)
+					return true;
+
+				evict_oldest_group();
+			}
+		}
+
+		// Drop the oldest keyframe along with the deltas depending on it.
+		void evict_oldest_group()
+		{
+			do
+			{
+				m_first = (m_first + 1) % m_entries.size();
+				m_count--;
+			} while (m_count > 0 && !at(0).m_keyframe);
+		}
+
+		// XOR the state against a reference and store it as (zero run, literal run, literal bytes) tokens. Returns the encoded size.
+		size_t encode(uint8_t const* ref, machine_state const& state)
+		{
+			uint8_t const* const cur = as_bytes(state);
+			uint8_t* out = m_scratch.data();
+
+			size_t i = 0;
+			while (i < c_stateSize)
+			{
+				size_t const zero_start = i;
+				while (i < c_stateSize && ref[i] == cur[i])
+					++i;
+
+				// A literal run ends at the first run of 4 matching bytes, shorter ones are cheaper to keep inline.
+				size_t const literal_start = i;
+				while (i < c_stateSize)
+				{
+					size_t same = 0;
+					while (same < 4 && i + same < c_stateSize && ref[i + same] == cur[i + same])
+						++same;
+					if (same == 4 || i + same == c_stateSize)
+						break;
+					i += same + 1;
+				}
+
+				uint16_t const zero_run = static_cast<uint16_t>(literal_start - zero_start);
+				uint16_t const literal_run = static_cast<uint16_t>(i - literal_start);
+				memcpy(out, &zero_run, sizeof(zero_run));
+				memcpy(out + 2, &literal_run, sizeof(literal_run));
+				out += 4;
+
+				for (size_t j = literal_start; j < i; ++j)
+					*out++ = ref[j] ^ cur[j];
+			}
+
+			return static_cast<size_t>(out - m_scratch.data());
+		}
+
+		void decode(uint8_t const* ref, entry const& e, machine_state& state) const
+		{
+			auto* const cur = reinterpret_cast<uint8_t*>(&state);
+			uint8_t const* in = &m_storage[e.m_offset];
+			uint8_t const* const end = in + e.m_size;
+
+			size_t i = 0;
+			while (in < end)
+			{
+				uint16_t zero_run, literal_run;
+				memcpy(&zero_run, in, sizeof(zero_run));
+				memcpy(&literal_run, in + 2, sizeof(literal_run));
+				in += 4;
+
+				memcpy(cur + i, ref + i, zero_run);
+				i += zero_run;
+
+				for (uint16_t j = 0; j < literal_run; ++j, ++i)
+					cur[i] = ref[i] ^ *in++;
+			}
+
+			assert(i == c_stateSize);
+		}
+	};
+}
@@ -0,0 +1,168 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <utility>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+* Zero-copy rom files.
+*
+* A mapped_file maps a file read-only into memory and hands out spans straight into the mapping, so a rom (or a pack of them)
+* is read from disk once no matter how many interpreters load it. Each interpreter still copies the bytes it needs into its
+* own memory in load_rom(), since the program is free to overwrite its code.
+*/
+namespace tiny8
+{
+	class mapped_file
+	{
+	public:
+		mapped_file() = default;
+		explicit mapped_file(char const* path) { open(path); }
+		~mapped_file() { close(); }
+
+		mapped_file(mapped_file const&) = delete;
+		mapped_file& operator=(mapped_file const&) = delete;
+
+		mapped_file(mapped_file&& other) noexcept { swap(other); }
+		mapped_file& operator=(mapped_file&& other) noexcept
+		{
+			close();
+			swap(other);
+			return *this;
+		}
+
+		// Map a whole file, closing any previous mapping. Empty files open fine and have no bytes.
+		bool open(char const* path)
+		{
+			close();
+
+#if defined(_WIN32)
+			HANDLE const file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file, &size))
+			{
+				CloseHandle(file);
+				return false;
+			}
+
+			m_size = static_cast<size_t>(size.QuadPart);
+			if (m_size > 0)
+			{
+				HANDLE const mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (mapping != nullptr)
+				{
+					m_data = static_cast<uint8_t const*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+					CloseHandle(mapping);
+				}
+			}
+			CloseHandle(file);
+#else
+			int const file = ::open(path, O_RDONLY);
+			if (file < 0)
+				return false;
+
+			struct stat info;
+			if (fstat(file, &info) != 0)
+			{
+				::close(file);
+				return false;
+			}
+
+			m_size = static_cast<size_t>(info.st_size);
+			if (m_size > 0)
+			{
+				void* const data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, file, 0);
+				m_data = data != MAP_FAILED ? static_cast<uint8_t const*>(data) : nullptr;
+			}
+			::close(file);
+#endif
+
+			if (m_size > 0 && m_data == nullptr)
+			{
+				m_size = 0;
+				return false;
+			}
+
+			m_isOpen = true;
+			return true;
+		}
+
+		void close()
+		{
+			if (m_data != nullptr)
+			{
+#if defined(_WIN32)
+				UnmapViewOfFile(m_data);
+#else
+				munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+			}
+
+			m_data = nullptr;
+			m_size = 0;
+			m_isOpen = false;
+		}
+
+		bool is_open() const { return m_isOpen; }
+		size_t size() const { return m_size; }
+
+		// The whole file, valid until the file is closed.
+		std::span<uint8_t const> bytes() const { return { m_data, m_size }; }
+
+	private:
+		uint8_t const*	m_data = nullptr;
+		size_t			m_size = 0;
+		bool			m_isOpen = false;
+
+		void swap(mapped_file& other)
+		{
+			std::swap(m_data, other.m_data);
+			std::swap(m_size, other.m_size);
+			std::swap(m_isOpen, other.m_isOpen);
+		}
+	};
+
+	// Load a rom file straight from a mapping. Fails if the file can't be opened or doesn't fit in memory.
+	template<class Interpreter>
+	bool load_rom_file(Interpreter& interpreter, char const* path)
+	{
+		mapped_file const file(path);
+		return file.is_open() && interpreter.load_rom(file.bytes());
+	}
+}
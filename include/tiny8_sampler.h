@@ -0,0 +1,182 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <utility>
+#include <vector>
+
+/*
+* Statistical profiling of the emulated program.
+*
+* A sampling_profiler attached to an interpreter is called back by its run loops every so many instructions (a jittered
+* interval, so loops whose period divides it aren't always caught at the same point) and records the program counter and the
+* call stack into a lock-free ring. Nothing is counted per instruction, so the interpreter runs at full speed between samples
+* on whatever backend it uses. Any one other thread, or the same one between runs, collects the ring into aggregated stacks,
+* written out as folded stacks for flame graph tools (flamegraph.pl, inferno, speedscope).
+*
+* Subroutines are named by their entry point, read from the 2nnn before each return address when the sample is taken.
+*/
+namespace tiny8
+{
+	// A sampled call stack: the entry point of every subroutine being run, outermost first, then the program counter.
+	struct stack_sample
+	{
+		uint16_t	m_pc;
+		uint8_t		m_depth;
+		uint16_t	m_calls[c_maxStack];
+	};
+
+	class sampling_profiler
+	{
+	public:
+		// Room for capacity samples between collect() calls (later ones are dropped), taken every interval instructions on average.
+		explicit sampling_profiler(size_t capacity = 4096, uint32_t interval = 1000)
+			: m_ring(capacity)
+			, m_interval(std::max(interval, 2u))
+		{
+			assert(capacity > 0);
+		}
+
+		sampling_profiler(sampling_profiler const&) = delete;
+		sampling_profiler& operator=(sampling_profiler const&) = delete;
+
+		// Start sampling an interpreter; the profiler must outlive it or be detached. One interpreter at a time.
+		template<class Interpreter>
+		void attach(Interpreter& interpreter) { interpreter.set_sampler(&sample<Interpreter>, this, next_interval()); }
+
+		template<class Interpreter>
+		static void detach(Interpreter& interpreter) { interpreter.set_sampler(nullptr); }
+
+		// Move the samples taken since the last call into the aggregated stacks. Returns how many were moved.
+		size_t collect()
+		{
+			uint64_t const tail = m_tail.load(std::memory_order_acquire);
+			uint64_t head = m_head.load(std::memory_order_relaxed);
+			size_t const moved = static_cast<size_t>(tail - head);
+			for (; head != tail; ++head)
+			{
+				stack_sample const& s = m_ring[head % m_ring.size()];
+				std::vector<uint16_t> key(s.m_calls, s.m_calls + s.m_depth);
+				key.push_back(s.m_pc);
+				m_stacks[key]++;
+			}
+			m_head.store(head, std::memory_order_release);
+			m_collected += moved;
+			return moved;
+		}
+
+		// Samples collected so far, and samples lost to a full ring.
+		uint64_t sample_count() const { return m_collected; }
+		uint64_t dropped_count() const { return m_dropped.load(std::memory_order_relaxed); }
+
+		// Forget the collected samples.
+		void clear()
+		{
+			m_stacks.clear();
+			m_collected = 0;
+		}
+
+		// The program counters sampled most, heaviest first, with their sample counts.
+		std::vector<std::pair<uint16_t, uint64_t>> hottest(size_t count) const
+		{
+			std::map<uint16_t, uint64_t> by_pc;
+			for (auto const& [stack, samples] : m_stacks)
+				by_pc[stack.back()] += samples;
+
+			std::vector<std::pair<uint16_t, uint64_t>> pcs(by_pc.begin(), by_pc.end());
+			std::sort(pcs.begin(), pcs.end(), [](auto const& a, auto const& b) { return a.second > b.second; });
+			pcs.resize(std::min(pcs.size(), count));
+			return pcs;
+		}
+
+		// One line per distinct stack, "rom;sub_0248;sub_02E0;pc_02E6 123", heaviest first.
+		void write_folded(FILE* out) const
+		{
+			std::vector<std::pair<std::vector<uint16_t> const*, uint64_t>> stacks;
+			for (auto const& [stack, samples] : m_stacks)
+				stacks.push_back({ &stack, samples });
+			std::stable_sort(stacks.begin(), stacks.end(), [](auto const& a, auto const& b) { return a.second > b.second; });
+
+			for (auto const& [stack, samples] : stacks)
+			{
+				fprintf(out, "rom");
+				for (size_t i = 0; i + 1 < stack->size(); ++i)
+					fprintf(out, ";sub_%04X", (*stack)[i]);
+				fprintf(out, ";pc_%04X %llu\n", stack->back(), (unsigned long long)samples);
+			}
+		}
+
+	private:
+		std::vector<stack_sample>					m_ring;
+		std::map<std::vector<uint16_t>, uint64_t>	m_stacks;		// Sample counts by calls then program counter.
+		uint64_t									m_collected = 0;
+		uint64_t									m_random = random_state(0);	// Interval jitter, only touched by the sampled thread.
+		uint32_t									m_interval;
+		alignas(64) std::atomic<uint64_t>			m_head = 0;		// Next sample to collect.
+		alignas(64) std::atomic<uint64_t>			m_tail = 0;		// Next sample to write.
+		std::atomic<uint64_t>						m_dropped = 0;
+
+		// Anywhere from half to one and a half times the interval.
+		uint32_t next_interval()
+		{
+			uint32_t const bits = uint32_t(next_random(m_random)) << 16 | uint32_t(next_random(m_random)) << 8 | next_random(m_random);
+			uint32_t const jitter = bits % (m_interval + 1);
+			return m_interval / 2 + jitter;
+		}
+
+		template<class Interpreter>
+		static uint32_t sample(void* user_data, Interpreter& interpreter)
+		{
+			sampling_profiler& self = *static_cast<sampling_profiler*>(user_data);
+			uint64_t const tail = self.m_tail.load(std::memory_order_relaxed);
+			if (tail - self.m_head.load(std::memory_order_acquire) == self.m_ring.size())
+			{
+				self.m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return self.next_interval();
+			}
+
+			registers const& r = *interpreter.get_registers();
+			auto const& memory = *interpreter.get_memory();
+			constexpr uint32_t c_mask = sizeof(memory.m_data) - 1;
+
+			stack_sample& s = self.m_ring[tail % self.m_ring.size()];
+			s.m_pc = r.m_pc;
+			s.m_depth = static_cast<uint8_t>(std::min<size_t>(r.m_sp, c_maxStack));
+			for (uint32_t i = 0; i < s.m_depth; ++i)
+			{
+				// The call that pushed this return address, or the address itself if the code was overwritten since.
+				uint32_t const call = (memory.m_stack[i] - 2u) & c_mask;
+				uint16_t const opcode = static_cast<uint16_t>((memory.m_data[call] << 8) | memory.m_data[(call + 1) & c_mask]);
+				s.m_calls[i] = (opcode & 0xf000) == 0x2000 ? opcode & 0x0fff : static_cast<uint16_t>(call);
+			}
+
+			self.m_tail.store(tail + 1, std::memory_order_release);
+			return self.next_interval();
+		}
+	};
+}
@@ -0,0 +1,449 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <memory>
+#include <utility>
+
+/*
+* Save states for disk: the full machine in a versioned, portable binary format, written straight into a caller-provided buffer.
+*
+* Layout, little endian:
+*   header		"T8ST", format version (u16), compression (u8), behaviour flags (u8), memory size (u32), payload size (u32) and
+*				the XXH64 of the uncompressed payload (u64).
+*   payload		Every field of the machine_state one after the other (registers, timers, input, the pending instruction, the
+*				Fx0A and vblank waits, cycle counts, random state, memory and stack, display including its resolution, audio),
+*				optionally compressed as one LZ4 block.
+* Nothing is padded or copied as a struct, so states move between compilers and hosts. c_stateFormatVersion goes up whenever the
+* payload changes; states from a newer version are refused.
+* A serializer allocates its scratch buffers once, save() and load() never touch the heap.
+*/
+namespace tiny8
+{
+	enum class state_compression : uint8_t
+	{
+		none,
+		lz4		// LZ4 block format: memory and display are mostly zero or repeated, so states shrink several times for a few µs.
+	};
+
+	constexpr uint16_t c_stateFormatVersion = 1;
+
+	namespace savestate_detail
+	{
+		constexpr uint8_t c_magic[4] = { 'T', '8', 'S', 'T' };
+		constexpr size_t c_headerSize = 4 + 2 + 1 + 1 + 4 + 4 + 8;
+
+		constexpr size_t c_hashBits = 12;
+		constexpr size_t c_minMatch = 4;
+		constexpr size_t c_lastLiterals = 5;	// LZ4 blocks end with at least this many literals...
+		constexpr size_t c_matchLimit = 12;		// ...and no match starts closer than this to the end.
+		constexpr size_t c_maxOffset = 0xffff;
+
+		constexpr size_t lz4_bound(size_t size) { return size + size / 255 + 16; }
+
+		// Appends fields to a buffer, little endian.
+		struct writer
+		{
+			uint8_t* m_out;
+
+			template<class T>
+			void value(T const& v)
+			{
+				uint64_t const bits = static_cast<uint64_t>(v);
+				for (size_t i = 0; i < sizeof(T); ++i)
+					*m_out++ = static_cast<uint8_t>(bits >> (8 * i));
+			}
+
+			template<class T>
+			void array(T const* values, size_t count)
+			{
+				if constexpr (std::endian::native == std::endian::little)
+				{
+					memcpy(m_out, values, count * sizeof(T));
+					m_out += count * sizeof(T);
+				}
+				else
+				{
+					for (size_t i = 0; i < count; ++i)
+						value(values[i]);
+				}
+			}
+		};
+
+		// Reads fields back in the same order.
+		struct reader
+		{
+			uint8_t const* m_in;
+			bool m_valid = true;	// Cleared by a bool stored as anything but 0 or 1.
+
+			void value(bool& v)
+			{
+				uint8_t const byte = *m_in++;
+				m_valid &= byte <= 1;
+				v = byte != 0;
+			}
+
+			template<class T>
+			void value(T& v)
+			{
+				uint64_t bits = 0;
+				for (size_t i = 0; i < sizeof(T); ++i)
+					bits |= static_cast<uint64_t>(*m_in++) << (8 * i);
+				v = static_cast<T>(bits);
+			}
+
+			template<class T>
+			void array(T* values, size_t count)
+			{
+				if constexpr (std::endian::native == std::endian::little)
+				{
+					memcpy(values, m_in, count * sizeof(T));
+					m_in += count * sizeof(T);
+				}
+				else
+				{
+					for (size_t i = 0; i < count; ++i)
+						value(values[i]);
+				}
+			}
+		};
+
+		// The payload, field by field. Shared by saving and loading so the two can't disagree on the order.
+		template<class Archive, class State>
+		void transfer(Archive& archive, State& state)
+		{
+			archive.value(state.m_registers.m_index);
+			archive.value(state.m_registers.m_sp);
+			archive.value(state.m_registers.m_pc);
+			archive.array(state.m_registers.m_v, std::size(state.m_registers.m_v));
+			archive.value(state.m_timers.m_delay);
+			archive.value(state.m_timers.m_sound);
+			archive.value(state.m_input.m_keys);
+			archive.value(state.m_input.m_prevKeys);
+			archive.value(state.m_state.m_opcode);
+			archive.value(state.m_state.m_x);
+			archive.value(state.m_state.m_y);
+			archive.value(state.m_state.m_n);
+			archive.value(state.m_state.m_nn);
+			archive.value(state.m_state.m_nnn);
+			archive.value(state.m_isWaitingForInput);
+			archive.value(state.m_isWaitingForVblank);
+			archive.value(state.m_cycles);
+			archive.value(state.m_frameCycles);
+			archive.value(state.m_random);
+			archive.array(state.m_memory.m_data, std::size(state.m_memory.m_data));
+			archive.array(state.m_memory.m_stack, std::size(state.m_memory.m_stack));
+			archive.array(&state.m_display.m_planes[0][0][0], sizeof(state.m_display.m_planes) / sizeof(uint64_t));
+			archive.value(state.m_display.m_version);
+			archive.value(state.m_display.m_dirtyRows);
+			archive.value(state.m_display.m_planeMask);
+			archive.value(state.m_display.m_hires);
+			archive.array(state.m_audio.m_pattern, std::size(state.m_audio.m_pattern));
+			archive.value(state.m_audio.m_pitch);
+		}
+
+		template<size_t MemorySize>
+		constexpr size_t payload_size()
+		{
+			constexpr size_t c_registers = 3 * 2 + 16;
+			constexpr size_t c_machine = 2 + 2 * 2 + 8 + 2 + 8 + 4 + 8;
+			constexpr size_t c_display = c_displayPlanes * c_hiresDisplayHeight * 2 * 8 + 4 + 8 + 1 + 1;
+			return c_registers + c_machine + MemorySize + c_maxStack * 2 + c_display + c_audioPatternSize + 1;
+		}
+
+		inline void put_length(uint8_t*& out, size_t length)
+		{
+			for (; length >= 255; length -= 255)
+				*out++ = 255;
+			*out++ = static_cast<uint8_t>(length);
+		}
+
+		inline uint32_t read32(uint8_t const* p)
+		{
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		// Greedy LZ4 block compressor with a single-entry hash table of the positions of 4-byte sequences. Returns the block size,
+		// at most lz4_bound(size).
+		inline size_t lz4_compress(uint8_t const* in, size_t size, uint8_t* out, uint32_t* table)
+		{
+			memset(table, 0, sizeof(uint32_t) << c_hashBits);
+
+			uint8_t* const start = out;
+			size_t anchor = 0;
+			size_t i = 0;
+			while (size > c_matchLimit && i <= size - c_matchLimit)
+			{
+				uint32_t const sequence = read32(in + i);
+				uint32_t const hash = (sequence * 2654435761u) >> (32 - c_hashBits);
+				size_t const candidate = table[hash];
+				table[hash] = static_cast<uint32_t>(i + 1);		// 0 is an empty slot.
+
+				if (candidate == 0 || i - (candidate - 1) > c_maxOffset || read32(in + candidate - 1) != sequence)
+				{
+					// Step faster through data that doesn't compress, as LZ4 itself does.
+					i += 1 + ((i - anchor) >> 6);
+					continue;
+				}
+
+				size_t const match = candidate - 1;
+				// Extend the match 8 bytes at a time while they're all equal.
+				size_t length = c_minMatch;
+				size_t const limit = size - c_lastLiterals - i;
+				while (length + 8 <= limit)
+				{
+					uint64_t a, b;
+					memcpy(&a, in + match + length, sizeof(a));
+					memcpy(&b, in + i + length, sizeof(b));
+					if (a != b)
+					{
+						if constexpr (std::endian::native == std::endian::little)
+							length += static_cast<size_t>(std::countr_zero(a ^ b)) / 8;
+						break;
+					}
+					length += 8;
+				}
+				while (length < limit && in[match + length] == in[i + length])
+					++length;
+
+				size_t const literals = i - anchor;
+				*out++ = static_cast<uint8_t>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(length - c_minMatch, 15));
+				if (literals >= 15)
+					put_length(out, literals - 15);
+				memcpy(out, in + anchor, literals);
+				out += literals;
+				*out++ = static_cast<uint8_t>(i - match);
+				*out++ = static_cast<uint8_t>((i - match) >> 8);
+				if (length - c_minMatch >= 15)
+					put_length(out, length - c_minMatch - 15);
+
+				i += length;
+				anchor = i;
+			}
+
+			size_t const literals = size - anchor;
+			*out++ = static_cast<uint8_t>(std::min<size_t>(literals, 15) << 4);
+			if (literals >= 15)
+				put_length(out, literals - 15);
+			memcpy(out, in + anchor, literals);
+			out += literals;
+			return static_cast<size_t>(out - start);
+		}
+
+		// Decompress an LZ4 block of exactly size bytes, false if it's malformed or the size doesn't match.
+		inline bool lz4_decompress(uint8_t const* in, size_t in_size, uint8_t* out, size_t size)
+		{
+			uint8_t const* const end = in + in_size;
+			size_t written = 0;
+			auto const get_length = [&](size_t& length)
+			{
+				uint8_t byte;
+				do
+				{
+					if (in == end)
+						return false;
+					byte = *in++;
+					length += byte;
+				} while (byte == 255);
+				return true;
+			};
+
+			while (in < end)
+			{
+				uint8_t const token = *in++;
+				size_t literals = token >> 4;
+				if (literals == 15 && !get_length(literals))
+					return false;
+				if (literals > static_cast<size_t>(end - in) || literals > size - written)
+					return false;
+
+				memcpy(out + written, in, literals);
+				in += literals;
+				written += literals;
+				if (in == end)
+					break;	// The last sequence has no match.
+
+				if (end - in < 2)
+					return false;
+				size_t const offset = in[0] | (in[1] << 8);
+				in += 2;
+				size_t length = token & 15;
+				if (length == 15 && !get_length(length))
+					return false;
+				length += c_minMatch;
+				if (offset == 0 || offset > written || length > size - written)
+					return false;
+
+				// Matches may overlap what they produce, a run of zeros is a match at offset 1.
+				uint8_t const* from = out + written - offset;
+				if (offset >= length)
+					memcpy(out + written, from, length);
+				else
+				{
+					for (size_t j = 0; j < length; ++j)
+						out[written + j] = from[j];
+				}
+				written += length;
+			}
+			return written == size;
+		}
+	}
+
+	// Saves and loads the states of interpreters with MemorySize bytes of memory.
+	template<size_t MemorySize>
+	class basic_state_serializer
+	{
+	public:
+		using machine_state = basic_machine_state<MemorySize>;
+
+		static constexpr size_t c_payloadSize = savestate_detail::payload_size<MemorySize>();
+
+		// Largest state save() writes, compressed or not.
+		static constexpr size_t c_maxStateSize = savestate_detail::c_headerSize + savestate_detail::lz4_bound(c_payloadSize);
+
+		explicit basic_state_serializer(state_compression compression = state_compression::lz4)
+			: m_compression(compression), m_state(std::make_unique<machine_state>()), m_payload(std::make_unique<uint8_t[]>(c_payloadSize)),
+			m_table(std::make_unique<uint32_t[]>(size_t(1) << savestate_detail::c_hashBits))
+		{
+		}
+
+		void set_compression(state_compression compression) { m_compression = compression; }
+		state_compression get_compression() const { return m_compression; }
+
+		// Write the state of an interpreter to out. Returns its size, 0 if out is smaller than c_maxStateSize.
+		template<class Interpreter>
+		size_t save(Interpreter const& interpreter, std::span<uint8_t> out)
+		{
+			static_assert(Interpreter::c_memorySize == MemorySize, "the serializer and the interpreter must have the same memory size");
+
+			if (out.size() < c_maxStateSize)
+				return 0;
+
+			interpreter.save_state(*m_state);
+			return save(*m_state, interpreter.get_flags(), out);
+		}
+
+		// Same as above for a state captured earlier with save_state(), from an interpreter with the given flags.
+		size_t save(machine_state const& state, flags behaviour_flags, std::span<uint8_t> out)
+		{
+			using namespace savestate_detail;
+
+			if (out.size() < c_maxStateSize)
+				return 0;
+
+			// Uncompressed payloads are written in place, compressed ones are staged for the compressor.
+			uint8_t* const payload = m_compression == state_compression::none ? out.data() + c_headerSize : m_payload.get();
+			writer fields{ payload };
+			transfer(fields, state);
+			assert(static_cast<size_t>(fields.m_out - payload) == c_payloadSize);
+
+			size_t stored = c_payloadSize;
+			if (m_compression == state_compression::lz4)
+				stored = lz4_compress(payload, c_payloadSize, out.data() + c_headerSize, m_table.get());
+
+			writer header{ out.data() };
+			header.array(c_magic, std::size(c_magic));
+			header.value(c_stateFormatVersion);
+			header.value(static_cast<uint8_t>(m_compression));
+			header.value(static_cast<uint8_t>(behaviour_flags));
+			header.value(static_cast<uint32_t>(MemorySize));
+			header.value(static_cast<uint32_t>(stored));
+			header.value(xxhash64(payload, c_payloadSize));
+			return c_headerSize + stored;
+		}
+
+		// Restore a state written by save(), switching runtime flags interpreters to the flags it was saved with. Returns false,
+		// leaving the interpreter untouched, if the state is truncated or corrupt, holds values the interpreter can't run from
+		// (including a frame further along than the interpreter's cycles per frame, so set the timer mode first), is from a newer
+		// format version, for another memory size, or (with flags fixed at compile time) for other behaviour flags.
+		template<class Interpreter>
+		bool load(Interpreter& interpreter, std::span<uint8_t const> in)
+		{
+			static_assert(Interpreter::c_memorySize == MemorySize, "the serializer and the interpreter must have the same memory size");
+			using namespace savestate_detail;
+
+			if (in.size() < c_headerSize || memcmp(in.data(), c_magic, sizeof(c_magic)) != 0)
+				return false;
+
+			uint16_t version;
+			uint8_t compression, behaviour_flags;
+			uint32_t memory_size, stored;
+			uint64_t hash;
+			reader header{ in.data() + sizeof(c_magic) };
+			header.value(version);
+			header.value(compression);
+			header.value(behaviour_flags);
+			header.value(memory_size);
+			header.value(stored);
+			header.value(hash);
+
+			if (version == 0 || version > c_stateFormatVersion || memory_size != MemorySize || stored > in.size() - c_headerSize
+				|| (behaviour_flags & ~flags::all_legacy) != 0)
+				return false;
+			if constexpr (Interpreter::c_staticFlags)
+			{
+				if (behaviour_flags != interpreter.get_flags())
+					return false;
+			}
+
+			uint8_t const* payload = in.data() + c_headerSize;
+			if (compression == static_cast<uint8_t>(state_compression::lz4))
+			{
+				if (!lz4_decompress(payload, stored, m_payload.get(), c_payloadSize))
+					return false;
+				payload = m_payload.get();
+			}
+			else if (compression != static_cast<uint8_t>(state_compression::none) || stored != c_payloadSize)
+				return false;
+
+			if (xxhash64(payload, c_payloadSize) != hash)
+				return false;
+
+			// The hash only catches accidents, anyone can recompute it: check what the interpreter indexes or counts with. The
+			// operand fields are rebuilt from the opcode, as a pending Fx0A uses them to index the registers.
+			reader fields{ payload };
+			transfer(fields, *m_state);
+			if (!fields.m_valid || m_state->m_frameCycles >= interpreter.get_cycles_per_frame() || m_state->m_display.m_planeMask > 3)
+				return false;
+			m_state->m_state = Interpreter::decode_opcode(m_state->m_state.m_opcode);
+
+			if constexpr (Interpreter::c_staticFlags)
+				interpreter.load_state(*m_state);
+			else
+				interpreter.load_state(*m_state, static_cast<flags>(behaviour_flags));
+			return true;
+		}
+
+	private:
+		state_compression				m_compression;
+		std::unique_ptr<machine_state>	m_state;		// The interpreter's state between it and the payload.
+		std::unique_ptr<uint8_t[]>		m_payload;		// Uncompressed payload of compressed states.
+		std::unique_ptr<uint32_t[]>		m_table;		// LZ4 match finder.
+	};
+
+	using state_serializer = basic_state_serializer<c_maxMemory>;
+	using extended_state_serializer = basic_state_serializer<c_extendedMemory>;
+}
@@ -0,0 +1,262 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <span>
+
+/*
+* Display delta stream for remote frontends, one message per emulated frame (e.g. one WebSocket binary message each).
+*
+* The encoder keeps the last display it sent and only encodes the rows that differ from it, XORed against it, so a sprite
+* moving by a pixel costs a few bytes instead of a frame. Displays whose m_version didn't change since the last message
+* aren't even compared and encode to nothing. The rows don't depend on m_dirtyRows, which other consumers may be taking.
+*
+* Message layout, all bytes:
+*   flags		bit 0: high resolution, bit 1: keyframe (XORed against a blank screen instead of the previous message).
+*   rows		One bit per row that changed, row y in bit y % 8 of byte y / 8: 4 bytes in low resolution, 8 in high resolution.
+*   deltas		For every changed row top to bottom, plane 0 then plane 1, the XOR of its pixels: 8 bytes in low resolution and 16
+*				in high resolution, leftmost pixel in the most significant bit of the first byte. Run-length coded as a sequence
+*				of tokens: 0x00-0x7f is followed by that many plus one literal bytes, 0x80-0xff stands for (token & 0x7f) + 1
+*				zero bytes.
+* A keyframe is sent first, on resolution changes and after request_keyframe() (a viewer joining the stream).
+*/
+namespace tiny8
+{
+	namespace stream_detail
+	{
+		constexpr size_t c_rowBytes = c_hiresDisplayWidth / 8;
+		constexpr size_t c_maxDeltaBytes = c_hiresDisplayHeight * c_displayPlanes * c_rowBytes;
+
+		constexpr uint8_t c_hires = 1 << 0;
+		constexpr uint8_t c_keyframe = 1 << 1;
+		constexpr uint8_t c_zeroRun = 0x80;
+		constexpr size_t c_maxToken = 128;
+
+		inline size_t row_bytes(bool hires) { return hires ? c_rowBytes : c_displayWidth / 8; }
+		inline size_t mask_bytes(bool hires) { return (hires ? c_hiresDisplayHeight : c_displayHeight) / 8; }
+	}
+
+	// Largest message encode() writes: every row changed and no zero run to shrink it.
+	constexpr size_t c_maxStreamMessageSize = 1 + 8 + stream_detail::c_maxDeltaBytes + stream_detail::c_maxDeltaBytes / stream_detail::c_maxToken + 1;
+
+	class frame_encoder
+	{
+	public:
+		// Encode the display of an interpreter, see below.
+		template<class Interpreter> requires requires (Interpreter& interpreter) { interpreter.get_display(); }
+		size_t encode(Interpreter& interpreter, uint8_t out[c_maxStreamMessageSize]) { return encode(*interpreter.get_display(), out); }
+
+		// Write the message bringing a viewer of the previous messages up to this display. Returns its size, 0 when there is
+		// nothing to send.
+		size_t encode(display const& source, uint8_t out[c_maxStreamMessageSize])
+		{
+			using namespace stream_detail;
+
+			bool const keyframe = m_keyframe || source.m_hires != m_sent.m_hires;
+			if (!keyframe && source.m_version == m_sentVersion)
+				return 0;
+
+			if (keyframe)
+			{
+				memset(m_sent.m_planes, 0, sizeof(m_sent.m_planes));
+				m_sent.m_hires = source.m_hires;
+			}
+
+			size_t const height = source.height();
+			size_t const words = source.m_hires ? 2 : 1;
+
+			// XOR of every changed row, staged so the run-length coder sees them back to back.
+			uint8_t deltas[c_maxDeltaBytes];
+			size_t delta_size = 0;
+			uint64_t rows = 0;
+			for (size_t y = 0; y < height; ++y)
+			{
+				bool changed = false;
+				for (size_t plane = 0; plane < c_displayPlanes; ++plane)
+				{
+					for (size_t w = 0; w < words; ++w)
+						changed |= source.m_planes[plane][y][w] != m_sent.m_planes[plane][y][w];
+				}
+				if (!changed)
+					continue;
+
+				rows |= 1ull << y;
+				for (size_t plane = 0; plane < c_displayPlanes; ++plane)
+				{
+					for (size_t w = 0; w < words; ++w)
+					{
+						uint64_t const delta = source.m_planes[plane][y][w] ^ m_sent.m_planes[plane][y][w];
+						for (size_t b = 0; b < 8; ++b)
+							deltas[delta_size++] = static_cast<uint8_t>(delta >> (56 - 8 * b));
+						m_sent.m_planes[plane][y][w] = source.m_planes[plane][y][w];
+					}
+				}
+			}
+
+			m_sentVersion = source.m_version;
+			m_keyframe = false;
+			if (rows == 0 && !keyframe)
+				return 0;
+
+			size_t size = 0;
+			out[size++] = static_cast<uint8_t>((source.m_hires ? c_hires : 0) | (keyframe ? c_keyframe : 0));
+			for (size_t i = 0; i < mask_bytes(source.m_hires); ++i)
+				out[size++] = static_cast<uint8_t>(rows >> (8 * i));
+
+			return size + run_length(deltas, delta_size, out + size);
+		}
+
+		// Make the next message a keyframe.
+		void request_keyframe() { m_keyframe = true; }
+
+	private:
+		display		m_sent;						// What the viewers have after the last message.
+		uint32_t	m_sentVersion = 0;
+		bool		m_keyframe = true;
+
+		// Literal runs end where two zero bytes follow, a single zero costs less as a literal than as a run of its own.
+		static size_t run_length(uint8_t const* in, size_t size, uint8_t* out)
+		{
+			using namespace stream_detail;
+
+			size_t written = 0;
+			size_t i = 0;
+			while (i < size)
+			{
+				size_t const start = i;
+				if (in[i] == 0)
+				{
+					while (i < size && in[i] == 0 && i - start < c_maxToken)
+						++i;
+					out[written++] = static_cast<uint8_t>(c_zeroRun | (i - start - 1));
+					continue;
+				}
+
+				while (i < size && i - start < c_maxToken && !(in[i] == 0 && i + 1 < size && in[i + 1] == 0))
+					++i;
+				out[written++] = static_cast<uint8_t>(i - start - 1);
+				memcpy(out + written, in + start, i - start);
+				written += i - start;
+			}
+			return written;
+		}
+	};
+
+	// Applies messages from a frame_encoder to a display, as a remote viewer would.
+	class frame_decoder
+	{
+	public:
+		// Returns false, leaving the display untouched, for a malformed message or a delta that doesn't follow a keyframe.
+		bool decode(std::span<uint8_t const> message)
+		{
+			using namespace stream_detail;
+
+			if (message.empty())
+				return false;
+
+			uint8_t const flags = message[0];
+			bool const hires = (flags & c_hires) != 0;
+			bool const keyframe = (flags & c_keyframe) != 0;
+			if (!keyframe && (!m_synced || hires != m_display.m_hires))
+				return false;
+
+			size_t const masks = mask_bytes(hires);
+			if (message.size() < 1 + masks)
+				return false;
+
+			uint64_t rows = 0;
+			for (size_t i = 0; i < masks; ++i)
+				rows |= static_cast<uint64_t>(message[1 + i]) << (8 * i);
+
+			uint8_t deltas[c_maxDeltaBytes];
+			size_t const expected = static_cast<size_t>(std::popcount(rows)) * c_displayPlanes * row_bytes(hires);
+			if (!run_length(message.subspan(1 + masks), deltas, expected))
+				return false;
+
+			if (keyframe)
+			{
+				memset(m_display.m_planes, 0, sizeof(m_display.m_planes));
+				m_display.m_hires = hires;
+				m_display.m_dirtyRows = ~0ull;
+				m_synced = true;
+			}
+
+			size_t const words = hires ? 2 : 1;
+			uint8_t const* delta = deltas;
+			for (uint64_t remaining = rows; remaining != 0; remaining &= remaining - 1)
+			{
+				size_t const y = static_cast<size_t>(std::countr_zero(remaining));
+				for (size_t plane = 0; plane < c_displayPlanes; ++plane)
+				{
+					for (size_t w = 0; w < words; ++w)
+					{
+						uint64_t value = 0;
+						for (size_t b = 0; b < 8; ++b)
+							value = (value << 8) | *delta++;
+						m_display.m_planes[plane][y][w] ^= value;
+					}
+				}
+			}
+
+			m_display.m_dirtyRows |= rows;
+			m_display.m_version++;
+			return true;
+		}
+
+		display const& get_display() const { return m_display; }
+		display& get_display() { return m_display; }
+
+	private:
+		display		m_display;
+		bool		m_synced = false;	// A keyframe was decoded.
+
+		// Expand exactly expected bytes, false if the tokens don't add up to that.
+		static bool run_length(std::span<uint8_t const> in, uint8_t* out, size_t expected)
+		{
+			using namespace stream_detail;
+
+			size_t written = 0;
+			size_t i = 0;
+			while (i < in.size())
+			{
+				uint8_t const token = in[i++];
+				size_t const count = (token & ~c_zeroRun) + 1u;
+				if (written + count > expected)
+					return false;
+
+				if (token & c_zeroRun)
+					memset(out + written, 0, count);
+				else
+				{
+					if (i + count > in.size())
+						return false;
+					memcpy(out + written, &in[i], count);
+					i += count;
+				}
+				written += count;
+			}
+			return written == expected;
+		}
+	};
+}
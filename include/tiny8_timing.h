@@ -0,0 +1,196 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "tiny8.h"
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+
+/*
+* Per-phase frame timing for frontends.
+*
+* A scoped_timer measures how long a phase of a frame takes (emulating it, converting the display, presenting it, polling input,
+* rendering audio) into that phase's log_histogram: 8 linear sub-buckets per power of two nanoseconds, so every percentile is
+* within 12.5% whatever the range, in a fixed array with no allocation. A frontend dumps and clears the histograms every second.
+*
+* Timers are only compiled in when TINY8_TIMING is defined (configure with -DTINY8_TIMING=ON); otherwise scoped_timer is empty
+* and never reads the clock, and the histograms stay empty.
+*/
+namespace tiny8
+{
+	enum class timing_phase : uint8_t
+	{
+		emulation,
+		conversion,		// Display to pixels.
+		present,
+		input,
+		audio,
+		count
+	};
+
+	constexpr char const* c_timingPhaseNames[] = { "emulation", "conversion", "present", "input", "audio" };
+	static_assert(std::size(c_timingPhaseNames) == static_cast<size_t>(timing_phase::count));
+
+	// Durations in nanoseconds, one writer thread at a time; read and clear from any thread (a value recorded during a clear may
+	// be lost).
+	class log_histogram
+	{
+	public:
+		static constexpr uint32_t c_subBuckets = 8;
+		static constexpr uint32_t c_bucketCount = (64 - 2) * c_subBuckets;
+
+		void record(uint64_t ns)
+		{
+			m_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+			if (ns > m_max.load(std::memory_order_relaxed))
+				m_max.store(ns, std::memory_order_relaxed);
+		}
+
+		uint64_t count() const
+		{
+			uint64_t total = 0;
+			for (auto const& b : m_buckets)
+				total += b.load(std::memory_order_relaxed);
+			return total;
+		}
+
+		uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+
+		// The duration fraction (0 to 1) of the values recorded are at or below, as the middle of its bucket. 0 if empty.
+		uint64_t percentile(double fraction) const
+		{
+			uint64_t const total = count();
+			if (total == 0)
+				return 0;
+
+			uint64_t const rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * total + 0.5));
+			uint64_t seen = 0;
+			for (uint32_t i = 0; i < c_bucketCount; ++i)
+			{
+				seen += m_buckets[i].load(std::memory_order_relaxed);
+				if (seen >= rank)
+					return std::min((lower_bound(i) + upper_bound(i)) / 2, max());
+			}
+			return max();
+		}
+
+		void clear()
+		{
+			for (auto& b : m_buckets)
+				b.store(0, std::memory_order_relaxed);
+			m_max.store(0, std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<uint32_t>	m_buckets[c_bucketCount] = {};
+		std::atomic<uint64_t>	m_max = 0;
+
+		// Values below c_subBuckets get a bucket each, then every power of two is split in c_subBuckets.
+		static constexpr uint32_t bucket(uint64_t ns)
+		{
+			if (ns < c_subBuckets)
+				return static_cast<uint32_t>(ns);
+
+			uint32_t const exponent = static_cast<uint32_t>(std::bit_width(ns)) - 1;
+			uint32_t const sub = static_cast<uint32_t>(ns >> (exponent - 3)) & (c_subBuckets - 1);
+			return (exponent - 2) * c_subBuckets + sub;
+		}
+
+		static constexpr uint64_t lower_bound(uint32_t index)
+		{
+			if (index < c_subBuckets)
+				return index;
+
+			uint32_t const exponent = index / c_subBuckets + 2;
+			return static_cast<uint64_t>(c_subBuckets + index % c_subBuckets) << (exponent - 3);
+		}
+
+		static constexpr uint64_t upper_bound(uint32_t index) { return index + 1 < c_bucketCount ? lower_bound(index + 1) - 1 : ~0ull; }
+	};
+
+	// One histogram per phase.
+	class frame_timings
+	{
+	public:
+		void record(timing_phase phase, uint64_t ns) { m_phases[static_cast<size_t>(phase)].record(ns); }
+		log_histogram const& phase(timing_phase phase) const { return m_phases[static_cast<size_t>(phase)]; }
+
+		// One line per phase that recorded anything: count, p50, p99 and max in microseconds. Prints nothing if none did.
+		void dump(FILE* output) const
+		{
+			for (size_t i = 0; i < std::size(m_phases); ++i)
+			{
+				log_histogram const& h = m_phases[i];
+				uint64_t const count = h.count();
+				if (count != 0)
+				{
+					fprintf(output, "  %-10s %8llu samples  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", c_timingPhaseNames[i],
+						(unsigned long long)count, h.percentile(0.5) / 1000.0, h.percentile(0.99) / 1000.0, h.max() / 1000.0);
+				}
+			}
+		}
+
+		void clear()
+		{
+			for (auto& h : m_phases)
+				h.clear();
+		}
+
+	private:
+		log_histogram	m_phases[static_cast<size_t>(timing_phase::count)];
+	};
+
+#if defined(TINY8_TIMING)
+	// Records the time from construction to destruction into a phase.
+	class scoped_timer
+	{
+	public:
+		scoped_timer(frame_timings& timings, timing_phase phase)
+			: m_timings(timings), m_phase(phase), m_start(std::chrono::steady_clock::now())
+		{
+		}
+
+		~scoped_timer()
+		{
+			auto const elapsed = std::chrono::steady_clock::now() - m_start;
+			m_timings.record(m_phase, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+		}
+
+		scoped_timer(scoped_timer const&) = delete;
+		scoped_timer& operator=(scoped_timer const&) = delete;
+
+	private:
+		frame_timings&							m_timings;
+		timing_phase							m_phase;
+		std::chrono::steady_clock::time_point	m_start;
+	};
+#else
+	class scoped_timer
+	{
+	public:
+		scoped_timer(frame_timings&, timing_phase) {}
+	};
+#endif
+}
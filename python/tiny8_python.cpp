@@ -0,0 +1,175 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <tiny8.h>
+#include <tiny8_batch.h>
+#include <tiny8_env.h>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+
+#include <memory>
+#include <span>
+
+/*
+* The tiny8 Python module: interpreters and vectorised environments, with their display, memory and registers exposed as numpy
+* arrays over the interpreter's own buffers. Nothing is copied per step, a view taken once sees every later frame (and writes
+* through it poke the machine), and it keeps its interpreter alive. Stepping releases the GIL.
+*
+*	env = tiny8.VecEnv(256, open("pong.ch8", "rb").read(), seed=1, flags=tiny8.chip8_original)
+*	obs = env.reset()										# (256, 64, 128) uint8, 0 to 3 per pixel
+*	ram = [env.memory(i) for i in range(len(env))]			# (4096,) uint8 each, score and lives live here
+*	obs, rewards, done = env.step(actions, frames=4)		# actions: (256,) uint16 key masks
+*
+* The arrays step() returns are the env's own buffers, overwritten by the next step: copy what has to outlive it. vec_env's
+* reward and termination hooks run on every frame, too often to call back into Python, so they aren't exposed: read the memory
+* views between steps instead.
+*/
+namespace py = pybind11;
+
+namespace
+{
+	std::span<uint8_t const> as_bytes(py::buffer const& buffer)
+	{
+		py::buffer_info const info = buffer.request();
+		return { static_cast<uint8_t const*>(info.ptr), static_cast<size_t>(info.size * info.itemsize) };
+	}
+
+	// Views of an interpreter's buffers, keeping owner (the Python object the interpreter lives in) alive.
+	py::array display_view(tiny8::interpreter& interpreter, py::handle owner)
+	{
+		auto& planes = interpreter.get_display()->m_planes;
+		return py::array_t<uint64_t>({ std::size(planes), std::size(planes[0]), std::size(planes[0][0]) }, &planes[0][0][0], owner);
+	}
+
+	py::array memory_view(tiny8::interpreter& interpreter, py::handle owner)
+	{
+		auto& data = interpreter.get_memory()->m_data;
+		return py::array_t<uint8_t>(static_cast<py::ssize_t>(std::size(data)), data, owner);
+	}
+
+	py::array registers_view(tiny8::interpreter& interpreter, py::handle owner)
+	{
+		auto& v = interpreter.get_registers()->m_v;
+		return py::array_t<uint8_t>(static_cast<py::ssize_t>(std::size(v)), v, owner);
+	}
+
+	void run_frame(tiny8::interpreter& interpreter, uint16_t keys, uint32_t cycles_per_frame)
+	{
+		uint8_t key_buffer[tiny8::c_maxKeys];
+		for (size_t key = 0; key < tiny8::c_maxKeys; ++key)
+			key_buffer[key] = (keys >> key) & 1;
+
+		py::gil_scoped_release release;
+		interpreter.run_frame(key_buffer, cycles_per_frame);
+	}
+
+	// A vec_env with the buffers its steps write into, allocated once and returned by every step.
+	struct python_env
+	{
+		tiny8::vec_env			m_env;
+		py::array				m_observations;
+		py::array_t<float>		m_rewards;
+		py::array_t<uint8_t>	m_done;
+
+		python_env(size_t count, py::buffer rom, bool packed, uint64_t seed, size_t threads, uint8_t behaviour_flags)
+			: m_env(count, as_bytes(rom), packed ? tiny8::observation_format::packed : tiny8::observation_format::bytes, seed, threads, tiny8::flags(behaviour_flags))
+			, m_observations(packed
+				? py::array(py::dtype::of<uint64_t>(), { count, size_t(tiny8::c_displayPlanes), size_t(tiny8::c_hiresDisplayHeight), size_t(2) })
+				: py::array(py::dtype::of<uint8_t>(), { count, size_t(tiny8::c_hiresDisplayHeight), size_t(tiny8::c_hiresDisplayWidth) }))
+			, m_rewards(count), m_done(count)
+		{
+		}
+
+		uint8_t* observations() { return static_cast<uint8_t*>(m_observations.mutable_data()); }
+
+		tiny8::interpreter& instance(size_t index)
+		{
+			if (index >= m_env.size())
+				throw py::index_error("instance index out of range");
+			return m_env[index];
+		}
+	};
+}
+
+PYBIND11_MODULE(tiny8, m)
+{
+	m.doc() = "CHIP-8 interpreters and vectorised environments, with zero-copy numpy views of their buffers";
+
+	m.attr("none") = int(tiny8::none);
+	m.attr("chip8_original") = int(tiny8::chip8_original);
+	m.attr("chip8_schip") = int(tiny8::chip8_schip);
+	m.attr("chip8_xochip") = int(tiny8::chip8_xochip);
+	m.attr("default_cycles_per_frame") = tiny8::c_defaultCyclesPerFrame;
+
+	py::class_<tiny8::interpreter>(m, "Interpreter")
+		.def(py::init([](uint8_t behaviour_flags) { return std::make_unique<tiny8::interpreter>(tiny8::flags(behaviour_flags)); }),
+			py::arg("flags") = uint8_t(tiny8::chip8_original))
+		.def("load_rom", [](tiny8::interpreter& self, py::buffer const& rom) { return self.load_rom(as_bytes(rom)); }, py::arg("rom"))
+		.def("run_frame", &run_frame, py::arg("keys") = 0, py::arg("cycles_per_frame") = tiny8::c_defaultCyclesPerFrame,
+			"Run a frame holding the keys of the mask (bit k for key k), without the GIL")
+		.def("set_seed", &tiny8::interpreter::set_seed, py::arg("seed"))
+		.def("state_hash", &tiny8::interpreter::state_hash)
+		.def_property_readonly("has_fault", &tiny8::interpreter::has_fault)
+		.def_property_readonly("hires", [](tiny8::interpreter& self) { return self.get_display()->m_hires; })
+		.def_property_readonly("pc", [](tiny8::interpreter& self) { return self.get_registers()->m_pc; })
+		.def_property_readonly("index", [](tiny8::interpreter& self) { return self.get_registers()->m_index; })
+		.def_property_readonly("display", [](py::object self) { return display_view(self.cast<tiny8::interpreter&>(), self); },
+			"The display's bit planes, (planes, 64 rows, 2 words) uint64, bit 63 - x % 64 of word x / 64 for pixel x")
+		.def_property_readonly("memory", [](py::object self) { return memory_view(self.cast<tiny8::interpreter&>(), self); })
+		.def_property_readonly("registers", [](py::object self) { return registers_view(self.cast<tiny8::interpreter&>(), self); },
+			"V0 to VF");
+
+	py::class_<python_env>(m, "VecEnv")
+		.def(py::init<size_t, py::buffer, bool, uint64_t, size_t, uint8_t>(), py::arg("count"), py::arg("rom"),
+			py::arg("packed") = false, py::arg("seed") = 0, py::arg("threads") = 0, py::arg("flags") = uint8_t(tiny8::chip8_original))
+		.def("__len__", [](python_env& self) { return self.m_env.size(); })
+		.def("set_cycles_per_frame", [](python_env& self, uint32_t cycles) { self.m_env.set_cycles_per_frame(cycles); }, py::arg("cycles"))
+		.def("set_episode_limit", [](python_env& self, uint32_t frames) { self.m_env.set_episode_limit(frames); }, py::arg("frames"))
+		.def("reset", [](python_env& self)
+		{
+			uint8_t* const observations = self.observations();
+			{
+				py::gil_scoped_release release;
+				self.m_env.reset(observations);
+			}
+			return self.m_observations;
+		})
+		.def("step", [](python_env& self, py::array_t<uint16_t, py::array::c_style | py::array::forcecast> const& actions, uint32_t frames)
+		{
+			if (static_cast<size_t>(actions.size()) < self.m_env.size())
+				throw py::value_error("one action per instance is needed");
+			if (frames == 0)
+				throw py::value_error("frames must be at least 1");
+			uint8_t* const observations = self.observations();
+			float* const rewards = self.m_rewards.mutable_data();
+			uint8_t* const done = self.m_done.mutable_data();
+			{
+				py::gil_scoped_release release;
+				self.m_env.step(std::span(actions.data(), self.m_env.size()), frames, observations, rewards, done);
+			}
+			return py::make_tuple(self.m_observations, self.m_rewards, self.m_done);
+		}, py::arg("actions"), py::arg("frames") = 1,
+			"Hold each instance's key mask for frames frames; returns (observations, rewards, done), the env's own buffers")
+		.def("display", [](py::object self, size_t index) { return display_view(self.cast<python_env&>().instance(index), self); }, py::arg("index"))
+		.def("memory", [](py::object self, size_t index) { return memory_view(self.cast<python_env&>().instance(index), self); }, py::arg("index"))
+		.def("registers", [](py::object self, size_t index) { return registers_view(self.cast<python_env&>().instance(index), self); }, py::arg("index"));
+}
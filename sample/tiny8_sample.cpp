@@ -20,46 +20,211 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 #include <tiny8.h>
+#include <tiny8_rom.h>
+#include <tiny8_audio.h>
+#include <tiny8_frames.h>
+#include <tiny8_blit.h>
+#include <tiny8_atlas.h>
+#include <tiny8_batch.h>
+#include <tiny8_timing.h>
+#include <tiny8_input.h>
 #include <SDL.h>
 
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
 constexpr size_t c_windowScale = 10;
 constexpr size_t c_windowWidth = tiny8::c_displayWidth * c_windowScale;
-constexpr size_t c_windowHeight = tiny8::c_displayHeight * c_windowScale;
 
-// Set an sdl surface's pixel based on a given state (on/off)
-void set_sdl_pixel(SDL_Surface* surface, uint32_t x, uint32_t y, uint8_t pixelState)
+// The emulation thread runs this many instructions per 60Hz frame by default, independently of how fast frames get presented.
+// --cycles-per-frame N overrides it, and - / = halve and double it while running.
+constexpr uint32_t c_cyclesPerFrame = 30;
+constexpr uint32_t c_maxCyclesPerFrame = 1 << 20;
+
+// Holding Tab fast-forwards at --turbo N emulated frames per presented frame (1 to tiny8::turbo::c_maxSpeed), with the audio
+// sped up along or, with --turbo-mute, silent.
+constexpr uint32_t c_turboSpeed = 10;
+
+// --instances N runs N copies of the rom (seeded apart) on a batch and shows them all as the tiles of one atlas texture.
+constexpr size_t c_maxInstances = 256;
+
+// Frame pacing: sleep until this close to the next frame, then spin, as sleeps overshoot by up to a scheduler tick. Falling more
+// than c_maxLateFrames behind (a breakpoint, a suspended laptop) starts over from now instead of running the missed frames.
+constexpr double c_frameRate = 60.0;
+constexpr double c_spinMargin = 0.002;
+constexpr uint64_t c_maxLateFrames = 4;
+
+// The interpreter polls the keys this often while running a frame, in instructions.
+constexpr uint32_t c_inputPollInterval = 4;
+
+// Queued audio the emulation loop keeps ahead of the audio device, in samples (~35ms at 44.1kHz).
+constexpr size_t c_audioLatency = 1536;
+
+// ARGB colours for the pixel values of the two XO-CHIP planes: off, plane 1, plane 2, both.
+constexpr tiny8::blit_palette c_palette = { { 0xff000000, 0xffffffff, 0xffaaaaaa, 0xff555555 } };
+
+// --phosphor N keeps N% of a pixel's brightness from one presented frame to the next, so sprites erased and redrawn every frame
+// glow steadily instead of flickering. The GPU does the blending, the atlas texture is uploaded as without it.
+constexpr uint32_t c_maxPhosphor = 95;
+
+// Paces a loop to a fixed rate off SDL's performance counter.
+class frame_pacer
 {
-	auto* const pixel = (uint32_t*)((uint8_t*)surface->pixels + y * surface->pitch + x * surface->format->BytesPerPixel);
-	*pixel = pixelState ? ~0u : 0;
-}
+public:
+	explicit frame_pacer(double rate)
+		: m_frequency(SDL_GetPerformanceFrequency())
+		, m_period(static_cast<uint64_t>(m_frequency / rate))
+		, m_spin(static_cast<uint64_t>(m_frequency * c_spinMargin))
+		, m_next(SDL_GetPerformanceCounter() + m_period)
+	{
+	}
+
+	// Wait for the next frame. Returns how late it woke up, in seconds.
+	double wait()
+	{
+		uint64_t now = SDL_GetPerformanceCounter();
+		if (now < m_next && m_next - now > m_spin)
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds((m_next - now - m_spin) * 1'000'000 / m_frequency));
+			now = SDL_GetPerformanceCounter();
+		}
+		while (now < m_next)
+			now = SDL_GetPerformanceCounter();
+
+		double const late = seconds(now - m_next);
+		m_next += m_period;
+		if (now > m_next + c_maxLateFrames * m_period)
+			m_next = now + m_period;
+		return late;
+	}
+
+	double seconds(uint64_t ticks) const { return static_cast<double>(ticks) / m_frequency; }
+
+private:
+	uint64_t const	m_frequency;
+	uint64_t const	m_period;
+	uint64_t const	m_spin;
+	uint64_t		m_next;
+};
+
+// Timing of the emulation thread over the last second, shown in the window title.
+struct frame_stats
+{
+	std::atomic<uint32_t>	m_workUs = 0;		// Average time spent emulating a presented frame.
+	std::atomic<uint32_t>	m_maxWorkUs = 0;
+	std::atomic<uint32_t>	m_lateUs = 0;		// Average lateness of the frame start.
+	std::atomic<uint32_t>	m_maxLateUs = 0;
+	std::atomic<bool>		m_updated = false;
+};
+
+// Time spent in each phase of a frame, printed every second when built with TINY8_TIMING. Conversion is timed per instance.
+tiny8::frame_timings g_timings;
 
 int main(int argc, char** argv)
 {
+	char const* rom_path = "roms/chip8-test-suite.ch8";
+	std::atomic<uint32_t> cycles_per_frame = c_cyclesPerFrame;
+	size_t instances = 1;
+	uint32_t turbo_speed = c_turboSpeed;
+	tiny8::turbo_audio turbo_audio = tiny8::turbo_audio::stretch;
+	uint32_t phosphor = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::string(argv[i]) == "--cycles-per-frame" && i + 1 < argc)
+			cycles_per_frame = std::clamp<uint32_t>(static_cast<uint32_t>(std::stoul(argv[++i])), 1, c_maxCyclesPerFrame);
+		else if (std::string(argv[i]) == "--instances" && i + 1 < argc)
+			instances = std::clamp<size_t>(std::stoul(argv[++i]), 1, c_maxInstances);
+		else if (std::string(argv[i]) == "--turbo" && i + 1 < argc)
+			turbo_speed = std::clamp<uint32_t>(static_cast<uint32_t>(std::stoul(argv[++i])), 1, tiny8::turbo::c_maxSpeed);
+		else if (std::string(argv[i]) == "--turbo-mute")
+			turbo_audio = tiny8::turbo_audio::mute;
+		else if (std::string(argv[i]) == "--phosphor" && i + 1 < argc)
+			phosphor = std::min<uint32_t>(static_cast<uint32_t>(std::stoul(argv[++i])), c_maxPhosphor);
+		else
+			rom_path = argv[i];
+	}
+
 	tiny8::interpreter interpreter (tiny8::interpreter::chip8_xochip);
+	interpreter.set_trap_callback(&tiny8::trap_print);
 
-	ifstream rom("roms/chip8-test-suite.ch8", fstream::in | fstream::binary);
-	if (rom.is_open())
-	{		
-		rom.seekg(0, ios::end);
-		size_t const romDataSize = rom.tellg();
-		rom.seekg(0, ios::beg);		
+	if (!tiny8::load_rom_file(interpreter, rom_path))
+		printf("Couldn't load %s (missing or too large).\n", rom_path);
 
-		char* const romData = reinterpret_cast<char* const>(interpreter.get_memory()->m_rom);
-		rom.read(romData, romDataSize);
-		rom.close();
+	// More than one instance: a batch runs them all, seeded apart by index so their random draws differ, and the interpreter above
+	// sits idle.
+	std::unique_ptr<tiny8::batch> wall;
+	if (instances > 1)
+	{
+		wall = std::make_unique<tiny8::batch>(instances, 0, tiny8::interpreter::chip8_xochip);
+		for (size_t i = 0; i < instances; ++i)
+		{
+			(*wall)[i].set_trap_callback(&tiny8::trap_print);
+			tiny8::load_rom_file((*wall)[i], rom_path);
+		}
 	}
 
-	// Initialise SDL and get hold of the window's surface.
+	// Every instance is a tile of one atlas: presenting uploads the rows that changed across all of them and draws a single quad.
+	tiny8::blit_atlas atlas(instances, c_palette);
+	int const window_height = static_cast<int>(c_windowWidth * atlas.height() / atlas.width());
+
+	// Initialise SDL and create a renderer for the window; presenting waits for vsync, which no longer holds emulation back.
 	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_EVENTS);
-	SDL_Window* window = SDL_CreateWindow("Tiny8 Sample", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, c_windowWidth, c_windowHeight, SDL_WINDOW_SHOWN);
-	SDL_Surface* surface = SDL_GetWindowSurface(window);
+	SDL_Window* window = SDL_CreateWindow("Tiny8 Sample", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, c_windowWidth, window_height, SDL_WINDOW_SHOWN);
+	SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+
+	// Streaming texture holding the atlas, updated with its changed rows and scaled to the window by the GPU.
+	SDL_Texture* tiny8_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, static_cast<int>(atlas.width()), static_cast<int>(atlas.height()));
+
+	// Phosphor persistence: a render target holding what's on screen, which every present multiplies by the decay and tops up with
+	// the brighter of it and the atlas. The renderer has no shaders, the blend unit does this with one texture instead of a history.
+	SDL_Texture* phosphor_texture = nullptr;
+	if (phosphor > 0 && SDL_RenderTargetSupported(renderer))
+	{
+		phosphor_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, static_cast<int>(atlas.width()), static_cast<int>(atlas.height()));
+		SDL_SetTextureBlendMode(phosphor_texture, SDL_BLENDMODE_NONE);
+
+		// Not every renderer has a max blend; adding saturates lit pixels just the same, and only makes fading grey ones brighter.
+		SDL_BlendMode const brighter = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_MAXIMUM,
+			SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_MAXIMUM);
+		if (SDL_SetTextureBlendMode(tiny8_texture, brighter) != 0)
+			SDL_SetTextureBlendMode(tiny8_texture, SDL_BLENDMODE_ADD);
+
+		SDL_SetRenderTarget(renderer, phosphor_texture);
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xff);
+		SDL_RenderClear(renderer);
+		SDL_SetRenderTarget(renderer, nullptr);
+
+		uint8_t const decay = static_cast<uint8_t>(phosphor * 0xff / 100);
+		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_MOD);
+		SDL_SetRenderDrawColor(renderer, decay, decay, decay, 0xff);
+	}
 
-	// This will be filled with data from the tiny8 display and will be stretched on the window surface.
-	SDL_Surface* tiny8_surface = SDL_CreateRGBSurface(0, tiny8::c_displayWidth, tiny8::c_displayHeight, 32, 0, 0, 0, 0);
+	// Presents to keep fading after the last new frame, until a lit pixel has decayed below one step.
+	uint32_t const fade_presents = phosphor_texture != nullptr ? static_cast<uint32_t>(std::ceil(std::log(1.0 / 255.0) / std::log(phosphor / 100.0))) : 0;
+	uint32_t fading = 0;
+
+	// The audio callback runs on SDL's audio thread and pulls samples out of the stream's lock-free ring.
+	tiny8::audio_stream audio;
+	SDL_AudioSpec desired = {};
+	desired.freq = static_cast<int>(audio.sample_rate());
+	desired.format = AUDIO_S16SYS;
+	desired.channels = 1;
+	desired.samples = 512;
+	desired.callback = &tiny8::audio_stream::callback;
+	desired.userdata = &audio;
+	SDL_AudioDeviceID const audio_device = SDL_OpenAudioDevice(nullptr, 0, &desired, nullptr, 0);
+	if (audio_device == 0)
+		printf("Couldn't open an audio device: %s\n", SDL_GetError());
+	else
+		SDL_PauseAudioDevice(audio_device, 0);
 	
 	// Setup keys to send to the interpreter. These are arranged in the following way (schematic below based on qwerty layout):
 		/*
@@ -84,59 +249,201 @@ int main(int argc, char** argv)
 		7, 8, 9, 14,
 		10, 0, 11, 15
 	};
-	uint8_t key_states[tiny8::c_maxKeys] = { 0 };
-	
+
+	// Scancode to CHIP-8 key, -1 for the rest of the keyboard.
+	int8_t key_for_scancode[SDL_NUM_SCANCODES];
+	std::fill(std::begin(key_for_scancode), std::end(key_for_scancode), int8_t(-1));
+	for (size_t i = 0; i < std::size(key_scancodes); ++i)
+		key_for_scancode[key_scancodes[i]] = static_cast<int8_t>(key_remap[i]);
+
+	// Written by the event loop, polled by the interpreter every few instructions on the emulation thread.
+	tiny8::input_port events;
+	events.attach(interpreter, c_inputPollInterval);
+	std::atomic<bool> quit = false;
+
+	// Emulation runs on its own thread at a fixed rate and publishes every changed frame; presenting never holds it back.
+	std::vector<tiny8::frame_mailbox> frames(instances);
+	tiny8::turbo turbo(1, turbo_audio);
+	frame_stats stats;
+
+	// Fast-forwarded audio is rendered after every emulated frame, 1/speed of a frame each; at normal speed the loop tops the
+	// queue up once per presented frame instead.
+	struct turbo_sound
+	{
+		tiny8::turbo*			m_turbo;
+		tiny8::audio_stream*	m_audio;
+
+		void operator()(tiny8::interpreter& instance, uint32_t speed) const
+		{
+			if (speed > 1 && m_turbo->audible())
+				m_audio->render_frame(instance, speed);
+		}
+	};
+	turbo_sound sound = { &turbo, &audio };
+	if (wall != nullptr)
+	{
+		wall->set_frame_callback([](void* user_data, tiny8::batch& batch, uint64_t)
+		{
+			turbo_sound const& sound = *static_cast<turbo_sound*>(user_data);
+			sound(batch[0], sound.m_turbo->running_speed());
+		}, &sound);
+	}
+	std::thread emulation([&]()
+	{
+		frame_pacer pacer(c_frameRate);
+		double work = 0.0, max_work = 0.0, late = 0.0, max_late = 0.0;
+		uint32_t count = 0;
+		while (!quit)
+		{
+			uint64_t const start = SDL_GetPerformanceCounter();
+			{
+				tiny8::scoped_timer const timer(g_timings, tiny8::timing_phase::emulation);
+				if (wall != nullptr)
+				{
+					// Batch instances latch their keys once per frame; all of them get the same ones and the first one is heard.
+					uint16_t const keys = events.drain();
+					for (size_t i = 0; i < wall->size(); ++i)
+					{
+						for (size_t key = 0; key < tiny8::c_maxKeys; ++key)
+							wall->keys(i)[key] = (keys >> key) & 1;
+					}
+
+					wall->set_cycles_per_frame(cycles_per_frame.load(std::memory_order_relaxed));
+					turbo.run_batch(*wall, frames);
+				}
+				else
+				{
+					turbo.run(interpreter, frames[0], cycles_per_frame.load(std::memory_order_relaxed), sound);
+				}
+			}
+
+			if (turbo.audible())
+			{
+				tiny8::scoped_timer const timer(g_timings, tiny8::timing_phase::audio);
+				audio.fill(wall != nullptr ? (*wall)[0] : interpreter, c_audioLatency);
+			}
+
+			double const frame_work = pacer.seconds(SDL_GetPerformanceCounter() - start);
+			double const frame_late = pacer.wait();
+			work += frame_work;
+			late += frame_late;
+			max_work = std::max(max_work, frame_work);
+			max_late = std::max(max_late, frame_late);
+			if (++count == static_cast<uint32_t>(c_frameRate))
+			{
+				stats.m_workUs = static_cast<uint32_t>(work / count * 1e6);
+				stats.m_maxWorkUs = static_cast<uint32_t>(max_work * 1e6);
+				stats.m_lateUs = static_cast<uint32_t>(late / count * 1e6);
+				stats.m_maxLateUs = static_cast<uint32_t>(max_late * 1e6);
+				stats.m_updated = true;
+				work = max_work = late = max_late = 0.0;
+				count = 0;
+			}
+		}
+	});
+
 	SDL_Event e; 
-	bool quit = false;
 	while (quit == false) 
 	{ 
-		while (SDL_PollEvent(&e)) 
-		{ 
-			switch (e.type)
-			{
-			case SDL_QUIT:
-				quit = true;
-				break;
-
-			case SDL_KEYDOWN:
-			case SDL_KEYUP:
-				uint8_t index = 0;
-				for (auto& scancode : key_scancodes)
+		{
+			tiny8::scoped_timer const timer(g_timings, tiny8::timing_phase::input);
+			while (SDL_PollEvent(&e)) 
+			{ 
+				switch (e.type)
 				{
-					if (scancode == SDL_GetScancodeFromKey(e.key.keysym.sym))
+				case SDL_QUIT:
+					quit = true;
+					break;
+
+				case SDL_KEYDOWN:
+				case SDL_KEYUP:
+				{
+					if (e.type == SDL_KEYDOWN && (e.key.keysym.sym == SDLK_MINUS || e.key.keysym.sym == SDLK_EQUALS))
 					{
-						key_states[key_remap[index]] = e.key.state == SDL_PRESSED ? 1 : 0;
+						uint32_t const cycles = cycles_per_frame.load(std::memory_order_relaxed);
+						cycles_per_frame = std::clamp<uint32_t>(e.key.keysym.sym == SDLK_MINUS ? cycles / 2 : cycles * 2, 1, c_maxCyclesPerFrame);
 					}
-					++index;
+
+					if (e.key.keysym.sym == SDLK_TAB && e.key.repeat == 0)
+						turbo.set_speed(e.type == SDL_KEYDOWN ? turbo_speed : 1);
+
+					int8_t const key = key_for_scancode[e.key.keysym.scancode];
+					if (key >= 0 && e.key.repeat == 0)
+						events.push(static_cast<uint8_t>(key), e.key.state == SDL_PRESSED);
+					break;
 				}
-				break;
-			}
-		} 
-	
-		interpreter.advance(key_states);
+				}
+			} 
+		}
+
+		if (stats.m_updated.exchange(false))
+		{
+			char title[192];
+			snprintf(title, sizeof(title), "Tiny8 Sample - %u cycles/frame, %ux, emulation %u us (max %u), wake-up %u us late (max %u)",
+				cycles_per_frame.load(), turbo.speed(), stats.m_workUs.load(), stats.m_maxWorkUs.load(), stats.m_lateUs.load(), stats.m_maxLateUs.load());
+			SDL_SetWindowTitle(window, title);
+
+#if defined(TINY8_TIMING)
+			printf("Frame phases over the last second:\n");
+			g_timings.dump(stdout);
+			g_timings.clear();
+#endif
+		}
 	
-		// Update the tiny8 surface data.
-		for (uint32_t x = 0; x < tiny8::c_displayWidth; ++x)
+		// Nothing to present if no instance published a new frame since the last present, unless the phosphor is still fading.
+		bool published = false;
+		for (size_t i = 0; i < instances; ++i)
 		{
-			for (uint32_t y = 0; y < tiny8::c_displayHeight; ++y)
+			if (frames[i].acquire())
 			{
-				uint8_t const value = interpreter.get_display()->m_data[y * tiny8::c_displayWidth + x];
-				set_sdl_pixel(tiny8_surface, x, y, value);
+				tiny8::scoped_timer const timer(g_timings, tiny8::timing_phase::conversion);
+				atlas.update(i, frames[i].front(), frames[i].front().m_dirtyRows);
+				published = true;
 			}
 		}
-		
-		// Stretch to output.
-		SDL_Rect dest;
-		dest.x = 0;
-		dest.y = 0;
-		dest.w = c_windowWidth;
-		dest.h = c_windowHeight;
-		SDL_BlitScaled(tiny8_surface, NULL, surface, &dest);
-
-		SDL_UpdateWindowSurface(window);
+
+		if (!published && fading == 0)
+		{
+			SDL_Delay(1);
+			continue;
+		}
+		fading = published ? fade_presents : fading - 1;
+
+		// Upload the span of atlas rows that changed since the last present, then stretch the whole atlas to the window.
+		tiny8::scoped_timer const present_timer(g_timings, tiny8::timing_phase::present);
+		tiny8::blit_atlas::span const dirty = atlas.take_dirty_span();
+		if (dirty.m_count != 0)
+		{
+			SDL_Rect rows;
+			rows.x = 0;
+			rows.y = static_cast<int>(dirty.m_first);
+			rows.w = static_cast<int>(atlas.width());
+			rows.h = static_cast<int>(dirty.m_count);
+			SDL_UpdateTexture(tiny8_texture, &rows, atlas.pixels() + dirty.m_first * atlas.width(), static_cast<int>(atlas.pitch()));
+		}
+
+		if (phosphor_texture != nullptr)
+		{
+			SDL_SetRenderTarget(renderer, phosphor_texture);
+			SDL_RenderFillRect(renderer, nullptr);
+			SDL_RenderCopy(renderer, tiny8_texture, nullptr, nullptr);
+			SDL_SetRenderTarget(renderer, nullptr);
+			SDL_RenderCopy(renderer, phosphor_texture, nullptr, nullptr);
+		}
+		else
+			SDL_RenderCopy(renderer, tiny8_texture, nullptr, nullptr);
+		SDL_RenderPresent(renderer);
 	}
 
-	SDL_FreeSurface(tiny8_surface);
+	emulation.join();
+
+	if (audio_device != 0)
+		SDL_CloseAudioDevice(audio_device);
+
+	if (phosphor_texture != nullptr)
+		SDL_DestroyTexture(phosphor_texture);
+	SDL_DestroyTexture(tiny8_texture);
+	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 	return 0;
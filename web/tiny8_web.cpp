@@ -0,0 +1,98 @@
+﻿// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <tiny8.h>
+#include <tiny8_blit.h>
+
+#include <emscripten/emscripten.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/*
+* The browser build: one interpreter driven from a Web Worker (tiny8_worker.js), which calls tiny8_web_run_frame() 60 times a
+* second. The module's memory is a SharedArrayBuffer (-pthread), so the page reads frames and writes keys in it directly and
+* nothing crosses postMessage per frame.
+*
+* Frames are double buffered: frame n is blitted into m_pixels[n & 1] with m_writing set to n first and m_sequence to n after.
+* The page copies m_pixels[s & 1] for s = m_sequence and drops the copy if m_writing has reached s + 2 meanwhile, which only
+* happens if it took longer than a frame.
+*/
+namespace
+{
+	constexpr size_t c_framePixels = tiny8::c_hiresDisplayWidth * tiny8::c_hiresDisplayHeight;
+
+	// Read by the page through offsetof, keep tiny8_worker.js in sync.
+	struct web_frame
+	{
+		std::atomic<uint32_t>	m_sequence;		// Last frame published.
+		std::atomic<uint32_t>	m_writing;		// Frame being blitted.
+		uint32_t				m_width[2];
+		uint32_t				m_height[2];
+		uint32_t				m_pixels[2][c_framePixels];	// RGBA, width x height row-major.
+	};
+	static_assert(offsetof(web_frame, m_width) == 8 && offsetof(web_frame, m_height) == 16 && offsetof(web_frame, m_pixels) == 24);
+	static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+	// Canvas pixels are RGBA bytes, so the colours are written ABGR on little endian wasm.
+	constexpr tiny8::blit_palette c_palette = { { 0xff000000, 0xffffffff, 0xff5555ff, 0xffffaa55 } };
+
+	std::unique_ptr<tiny8::interpreter>	g_interpreter;
+	web_frame							g_frame = {};
+	uint8_t								g_keys[tiny8::c_maxKeys] = {};	// Written by the page with Atomics.store.
+}
+
+extern "C"
+{
+	// Where the page finds the frames and the keys, as byte offsets into the module's memory.
+	EMSCRIPTEN_KEEPALIVE uint32_t tiny8_web_frame() { return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&g_frame)); }
+	EMSCRIPTEN_KEEPALIVE uint32_t tiny8_web_keys() { return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(g_keys)); }
+
+	// Start rom (size bytes, allocated by the worker with _malloc) on a new interpreter with the given behaviour flags.
+	EMSCRIPTEN_KEEPALIVE bool tiny8_web_load(uint8_t const* rom, uint32_t size, uint32_t behaviour_flags)
+	{
+		g_interpreter = std::make_unique<tiny8::interpreter>(static_cast<tiny8::flags>(behaviour_flags));
+		return g_interpreter->load_rom(std::span<uint8_t const>(rom, size));
+	}
+
+	// Run a frame with the keys the page holds and publish its display.
+	EMSCRIPTEN_KEEPALIVE void tiny8_web_run_frame(uint32_t cycles_per_frame)
+	{
+		if (!g_interpreter)
+			return;
+
+		uint8_t keys[tiny8::c_maxKeys];
+		for (size_t key = 0; key < tiny8::c_maxKeys; ++key)
+			keys[key] = std::atomic_ref<uint8_t>(g_keys[key]).load(std::memory_order_relaxed);
+		g_interpreter->run_frame(keys, cycles_per_frame);
+
+		uint32_t const sequence = g_frame.m_sequence.load(std::memory_order_relaxed) + 1;
+		uint32_t const buffer = sequence & 1;
+		tiny8::display const& display = *g_interpreter->get_display();
+		g_frame.m_writing.store(sequence, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		g_frame.m_width[buffer] = static_cast<uint32_t>(display.width());
+		g_frame.m_height[buffer] = static_cast<uint32_t>(display.height());
+		tiny8::blit(display, g_frame.m_pixels[buffer], display.width() * sizeof(uint32_t), c_palette);
+		g_frame.m_sequence.store(sequence, std::memory_order_release);
+	}
+}
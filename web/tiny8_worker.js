@@ -0,0 +1,66 @@
+// MIT License
+//
+// Copyright(c) 2023, Pantelis Lekakis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright noticeand this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Emulation thread of the browser build: runs tiny8_web.wasm at 60 frames per second. The page gets the module's memory (a
+// SharedArrayBuffer) once, then reads frames and writes keys in it directly, see tiny8_web.cpp.
+importScripts("tiny8_web.js");
+
+const c_frameInterval = 1000 / 60;
+const c_maxCatchUp = 4;			// Frames run at once after a stall before giving up on catching up.
+
+let tiny8 = null;
+let cyclesPerFrame = 12;
+let nextFrame = 0;
+
+function tick()
+{
+	const now = performance.now();
+	for (let frames = 0; nextFrame <= now && frames < c_maxCatchUp; ++frames, nextFrame += c_frameInterval)
+		tiny8._tiny8_web_run_frame(cyclesPerFrame);
+	if (nextFrame <= now)
+		nextFrame = now + c_frameInterval;
+	setTimeout(tick, Math.max(0, nextFrame - performance.now()));
+}
+
+createTiny8().then((module) =>
+{
+	tiny8 = module;
+	postMessage({ memory: tiny8.HEAPU8.buffer, frame: tiny8._tiny8_web_frame(), keys: tiny8._tiny8_web_keys() });
+});
+
+// { rom: Uint8Array, flags, cyclesPerFrame } from the page, the only message after startup.
+onmessage = (event) =>
+{
+	const rom = event.data.rom;
+	const address = tiny8._malloc(rom.length);
+	tiny8.HEAPU8.set(rom, address);
+	const loaded = tiny8._tiny8_web_load(address, rom.length, event.data.flags);
+	tiny8._free(address);
+	cyclesPerFrame = event.data.cyclesPerFrame;
+
+	if (loaded && nextFrame === 0)
+	{
+		nextFrame = performance.now();
+		tick();
+	}
+	postMessage({ loaded: !!loaded });
+};